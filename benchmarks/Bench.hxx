@@ -0,0 +1,115 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+// author: Max Kellermann <max.kellermann@gmail.com>
+
+/*
+ * A tiny microbenchmark harness.  Each result is printed as one JSON
+ * object per line (JSON Lines) to stdout, so runs can be compared
+ * with a script.
+ */
+
+#pragma once
+
+#include <fmt/core.h>
+
+#include <algorithm> // for std::sort()
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+/**
+ * How often each benchmark is repeated; the minimum and the median
+ * are reported.
+ */
+static constexpr std::size_t BENCH_REPEAT = 7;
+
+struct BenchFilter {
+	std::string_view pattern;
+
+	bool operator()(std::string_view name) const noexcept {
+		return pattern.empty() || name.find(pattern) != name.npos;
+	}
+};
+
+/**
+ * Prevent the compiler from optimizing away a value.
+ */
+template<typename T>
+inline void
+DoNotOptimize(const T &value) noexcept
+{
+	asm volatile("" : : "r,m"(value) : "memory");
+}
+
+/**
+ * A small deterministic pseudo random number generator
+ * (xorshift64), so all runs use the same input.
+ */
+class BenchRandom {
+	uint_least64_t state;
+
+public:
+	explicit constexpr BenchRandom(uint_least64_t seed=0x9e3779b97f4a7c15) noexcept
+		:state(seed) {}
+
+	constexpr uint_least64_t operator()() noexcept {
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+		return state;
+	}
+};
+
+/**
+ * Run the given function #BENCH_REPEAT times and print the result.
+ *
+ * @param name the benchmark name
+ * @param param the size parameter (e.g. number of items; 0 if not
+ * applicable)
+ * @param ops the number of operations performed by one call of #f
+ * @param f the function to be measured
+ */
+template<typename F>
+void
+RunBenchmark(const BenchFilter &filter, std::string_view name,
+	     std::size_t param, std::size_t ops, F &&f)
+{
+	if (!filter(name))
+		return;
+
+	/* warm up (caches, lazy allocations) */
+	f();
+
+	std::array<double, BENCH_REPEAT> ns_per_op;
+	for (auto &i : ns_per_op) {
+		const auto start = std::chrono::steady_clock::now();
+		f();
+		const std::chrono::duration<double, std::nano> duration = std::chrono::steady_clock::now() - start;
+		i = duration.count() / ops;
+	}
+
+	std::sort(ns_per_op.begin(), ns_per_op.end());
+
+	fmt::print("{{\"benchmark\":\"{}\",\"param\":{},\"ops\":{},\"repeat\":{},\"min_ns_per_op\":{:.2f},\"median_ns_per_op\":{:.2f}}}\n",
+		   name, param, ops, BENCH_REPEAT,
+		   ns_per_op.front(), ns_per_op[ns_per_op.size() / 2]);
+}
+
+void
+BenchClientAccounting(const BenchFilter &filter);
+
+void
+BenchCheckPassword(const BenchFilter &filter);
+
+void
+BenchDoorkeeper(const BenchFilter &filter);
+
+void
+BenchSplice(const BenchFilter &filter);
+
+void
+BenchServerList(const BenchFilter &filter);
+
+void
+BenchValidate(const BenchFilter &filter);
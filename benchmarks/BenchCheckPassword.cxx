@@ -0,0 +1,118 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+// author: Max Kellermann <max.kellermann@gmail.com>
+
+#include "Bench.hxx"
+#include "BerkeleyDB.hxx"
+#include "CheckPassword.hxx"
+#include "lib/fmt/RuntimeError.hxx"
+
+#include <sodium/crypto_pwhash.h>
+
+#include <array>
+#include <cstring> // for strlen()
+#include <string>
+
+#include <stdlib.h> // for mkdtemp()
+#include <unistd.h> // for unlink(), rmdir()
+
+static constexpr std::size_t N_USERS = 1000;
+
+static std::string
+MakeUsername(std::size_t i)
+{
+	return fmt::format("USER{}", i);
+}
+
+/**
+ * Create a user database with #N_USERS users, all with the password
+ * "secret", hashed with crypto_pwhash_str() and libsodium's
+ * "interactive" limits.
+ */
+static void
+CreateUserDatabase(const char *path)
+{
+	DB *db;
+	if (int ret = db_create(&db, nullptr, 0))
+		throw FmtRuntimeError("db_create() failed: {}", db_strerror(ret));
+
+	if (int ret = db->open(db, nullptr, path, nullptr, DB_HASH, DB_CREATE, 0600)) {
+		db->close(db, 0);
+		throw FmtRuntimeError("db_open() failed: {}", db_strerror(ret));
+	}
+
+	std::array<char, crypto_pwhash_STRBYTES> hash;
+	static constexpr std::string_view password = "secret";
+	if (crypto_pwhash_str(hash.data(), password.data(), password.size(),
+			      crypto_pwhash_OPSLIMIT_INTERACTIVE,
+			      crypto_pwhash_MEMLIMIT_INTERACTIVE) != 0) {
+		db->close(db, 0);
+		throw std::runtime_error{"crypto_pwhash_str() failed"};
+	}
+
+	for (std::size_t i = 0; i < N_USERS; ++i) {
+		const auto username = MakeUsername(i);
+
+		DBT key{
+			.data = const_cast<char *>(username.data()),
+			.size = static_cast<u_int32_t>(username.size()),
+		};
+
+		DBT value{
+			.data = hash.data(),
+			.size = static_cast<u_int32_t>(strlen(hash.data())),
+		};
+
+		if (int ret = db->put(db, nullptr, &key, &value, 0)) {
+			db->close(db, 0);
+			throw FmtRuntimeError("db_put() failed: {}", db_strerror(ret));
+		}
+	}
+
+	db->close(db, 0);
+}
+
+void
+BenchCheckPassword(const BenchFilter &filter)
+{
+	/* skip the (slow) setup if no benchmark here matches */
+	if (!filter("check_password") && !filter("check_password_wrong") &&
+	    !filter("check_password_unknown_user"))
+		return;
+
+	char directory[] = "/tmp/uologin-bench-XXXXXX";
+	if (mkdtemp(directory) == nullptr)
+		throw std::runtime_error{"mkdtemp() failed"};
+
+	const auto path = fmt::format("{}/users.db", directory);
+	CreateUserDatabase(path.c_str());
+
+	const BerkeleyDB db{path.c_str()};
+
+	unlink(path.c_str());
+	rmdir(directory);
+
+	/* Argon2 is slow by design; few iterations suffice */
+	static constexpr std::size_t ITERATIONS = 16;
+
+	RunBenchmark(filter, "check_password", N_USERS, ITERATIONS, [&db]{
+		BenchRandom random;
+		for (std::size_t i = 0; i < ITERATIONS; ++i)
+			DoNotOptimize(CheckPassword(db, MakeUsername(random() % N_USERS),
+						    "secret"));
+	});
+
+	RunBenchmark(filter, "check_password_wrong", N_USERS, ITERATIONS, [&db]{
+		BenchRandom random;
+		for (std::size_t i = 0; i < ITERATIONS; ++i)
+			DoNotOptimize(CheckPassword(db, MakeUsername(random() % N_USERS),
+						    "wrong"));
+	});
+
+	/* unknown users are rejected without hashing; this measures
+	   just the BerkeleyDB lookup */
+	static constexpr std::size_t LOOKUPS = 100000;
+	RunBenchmark(filter, "check_password_unknown_user", N_USERS, LOOKUPS, [&db]{
+		for (std::size_t i = 0; i < LOOKUPS; ++i)
+			DoNotOptimize(CheckPassword(db, "NOBODY", "secret"));
+	});
+}
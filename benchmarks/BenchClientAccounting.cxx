@@ -0,0 +1,101 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+// author: Max Kellermann <max.kellermann@gmail.com>
+
+#include "Bench.hxx"
+#include "net/ClientAccounting.hxx"
+#include "net/IPv4Address.hxx"
+#include "event/Loop.hxx"
+
+#include <arpa/inet.h> // for htonl()
+
+#include <array>
+#include <chrono>
+#include <vector>
+
+static std::vector<IPv4Address>
+MakeAddresses(std::size_t n) noexcept
+{
+	std::vector<IPv4Address> result;
+	result.reserve(n);
+
+	/* consecutive addresses starting at 10.0.0.1 */
+	for (std::size_t i = 0; i < n; ++i) {
+		const struct in_addr addr{.s_addr = htonl(0x0a000001 + i)};
+		result.emplace_back(addr, 2593);
+	}
+
+	return result;
+}
+
+void
+BenchClientAccounting(const BenchFilter &filter)
+{
+	EventLoop event_loop;
+
+	/* lookups in random order */
+	static constexpr std::size_t LOOKUPS = 1 << 20;
+
+	for (const std::size_t n : {1000U, 10000U, 100000U, 1000000U}) {
+		const auto addresses = MakeAddresses(n);
+
+		/* each run needs a new map, or all but the warm-up
+		   run would measure lookups; this includes
+		   destroying the map */
+		RunBenchmark(filter, "client_accounting_insert", n, n, [&event_loop, &addresses]{
+			ClientAccountingMap map{event_loop, 16, true};
+			for (const auto &i : addresses)
+				DoNotOptimize(map.Get(i));
+		});
+
+		/* knocked clients, the state a snapshot is made
+		   for */
+		ClientAccountingMap map{event_loop, 16, true};
+		for (const auto &i : addresses)
+			map.Get(i)->SetKnocked();
+
+		std::vector<uint32_t> order(LOOKUPS);
+		BenchRandom random;
+		for (auto &i : order)
+			i = random() % n;
+
+		RunBenchmark(filter, "client_accounting_get", n, LOOKUPS, [&map, &addresses, &order]{
+			for (const auto i : order)
+				DoNotOptimize(map.Get(addresses[i]));
+		});
+
+		/* the event loop part of saving a snapshot
+		   (AccountingSnapshot) */
+		RunBenchmark(filter, "client_accounting_snapshot", n, n, [&map]{
+			DoNotOptimize(map.Snapshot());
+		});
+
+		RunBenchmark(filter, "client_accounting_snapshot_cursor", n, n, [&map]{
+			std::array<ClientAccountingSnapshotItem, 4096> buffer;
+			ClientAccountingMap::SnapshotCursor cursor{map};
+			while (!cursor.IsEnd())
+				DoNotOptimize(cursor.Read(buffer));
+		});
+
+		const auto snapshot = map.Snapshot();
+
+		/* loading a snapshot into an empty map; this
+		   includes destroying the map */
+		RunBenchmark(filter, "client_accounting_restore", n, n, [&event_loop, &snapshot]{
+			ClientAccountingMap restored{event_loop, 16, true};
+			restored.Restore(snapshot, std::chrono::seconds{1});
+			DoNotOptimize(restored.Find(snapshot.front().address));
+		});
+	}
+
+	{
+		static constexpr std::size_t ITERATIONS = 1 << 20;
+
+		ClientAccountingMap map{event_loop, 16, true};
+		auto &per_client = *map.Get(IPv4Address{10, 0, 0, 1, 2593});
+
+		RunBenchmark(filter, "update_token_bucket", 0, ITERATIONS, [&per_client]{
+			for (std::size_t i = 0; i < ITERATIONS; ++i)
+				per_client.UpdateTokenBucket(1);
+		});
+	}
+}
@@ -0,0 +1,38 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+// author: Max Kellermann <max.kellermann@gmail.com>
+
+#include "Bench.hxx"
+#include "Doorkeeper.hxx"
+
+#include <stdexcept>
+
+void
+BenchDoorkeeper(const BenchFilter &filter)
+{
+	if (!filter("doorkeeper_flood"))
+		return;
+
+	/* a flood of spoofed one-shot sources: each key is new */
+	static constexpr std::size_t N = 1 << 20;
+
+	Doorkeeper doorkeeper;
+	BenchRandom random;
+
+	RunBenchmark(filter, "doorkeeper_flood", N, N, [&doorkeeper, &random]{
+		for (std::size_t i = 0; i < N; ++i)
+			DoNotOptimize(doorkeeper.Check(random()));
+	});
+
+	/* after all those runs, the filters are as full as they get;
+	   almost none of the new keys may pass */
+	const auto before = doorkeeper.stats.promotions;
+	for (std::size_t i = 0; i < N; ++i)
+		doorkeeper.Check(random());
+
+	const double rate = double(doorkeeper.stats.promotions - before) / N;
+	fmt::print("{{\"benchmark\":\"doorkeeper_flood_promotion_rate\",\"param\":{},\"rate\":{:.4f}}}\n",
+		   N, rate);
+
+	if (rate > 0.01)
+		throw std::runtime_error{"Doorkeeper promotes too many one-shot sources"};
+}
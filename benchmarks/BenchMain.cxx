@@ -0,0 +1,42 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+// author: Max Kellermann <max.kellermann@gmail.com>
+
+#include "Bench.hxx"
+#include "util/PrintException.hxx"
+
+#include <sodium/core.h>
+
+#include <cstdlib>
+
+/*
+ * Usage: uologin-bench [PATTERN]
+ *
+ * Runs all benchmarks whose name contains PATTERN.
+ */
+int
+main(int argc, char **argv) noexcept
+try {
+	if (argc > 2) {
+		fmt::print(stderr, "Usage: {} [PATTERN]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if (sodium_init() < 0) {
+		fmt::print(stderr, "sodium_init() failed\n");
+		return EXIT_FAILURE;
+	}
+
+	const BenchFilter filter{argc > 1 ? argv[1] : std::string_view{}};
+
+	BenchValidate(filter);
+	BenchServerList(filter);
+	BenchClientAccounting(filter);
+	BenchDoorkeeper(filter);
+	BenchSplice(filter);
+	BenchCheckPassword(filter);
+
+	return EXIT_SUCCESS;
+} catch (...) {
+	PrintException(std::current_exception());
+	return EXIT_FAILURE;
+}
@@ -0,0 +1,34 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+// author: Max Kellermann <max.kellermann@gmail.com>
+
+#include "Bench.hxx"
+#include "Config.hxx"
+#include "ServerList.hxx"
+#include "net/IPv4Address.hxx"
+
+#include <fmt/format.h>
+
+#include <vector>
+
+void
+BenchServerList(const BenchFilter &filter)
+{
+	static constexpr std::size_t ITERATIONS = 100000;
+
+	for (const std::size_t n : {1U, 4U, 16U}) {
+		std::vector<GameServerConfig> servers;
+		for (std::size_t i = 0; i < n; ++i) {
+			std::vector<AllocatedSocketAddress> addresses;
+			addresses.emplace_back(IPv4Address{127, 0, 0, 1, 2593});
+			servers.emplace_back(fmt::format("Game Server {}", i).c_str(),
+					     "127.0.0.1", std::move(addresses));
+		}
+
+		std::vector<std::byte> buffer(GetServerListPacketSize(n));
+
+		RunBenchmark(filter, "format_server_list", n, ITERATIONS, [&servers, &buffer]{
+			for (std::size_t i = 0; i < ITERATIONS; ++i)
+				DoNotOptimize(FormatServerList(buffer, servers));
+		});
+	}
+}
@@ -0,0 +1,138 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+// author: Max Kellermann <max.kellermann@gmail.com>
+
+#include "Bench.hxx"
+#include "Splice.hxx"
+#include "PipeStock.hxx"
+#include "event/Loop.hxx"
+#include "net/IPv4Address.hxx"
+#include "net/SocketError.hxx"
+#include "net/UniqueSocketDescriptor.hxx"
+#include "system/Error.hxx"
+
+#include <array>
+#include <span>
+#include <stdexcept>
+#include <utility> // for std::pair
+
+#include <sys/socket.h>
+
+static std::pair<UniqueSocketDescriptor, UniqueSocketDescriptor>
+CreateSocketPair()
+{
+	int sv[2];
+	if (socketpair(AF_LOCAL, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0, sv) < 0)
+		throw MakeErrno("socketpair() failed");
+
+	return {
+		UniqueSocketDescriptor{AdoptTag{}, SocketDescriptor{sv[0]}},
+		UniqueSocketDescriptor{AdoptTag{}, SocketDescriptor{sv[1]}},
+	};
+}
+
+/**
+ * Create a connected pair of TCP sockets over the loopback device
+ * (like a connection to a game server on the same host).
+ */
+static std::pair<UniqueSocketDescriptor, UniqueSocketDescriptor>
+CreateLoopbackTcpPair()
+{
+	UniqueSocketDescriptor listener;
+	if (!listener.Create(AF_INET, SOCK_STREAM, 0))
+		throw MakeSocketError("Failed to create socket");
+
+	if (!listener.Bind(IPv4Address{127, 0, 0, 1, 0}) ||
+	    !listener.Listen(1))
+		throw MakeSocketError("Failed to listen");
+
+	UniqueSocketDescriptor a;
+	if (!a.Create(AF_INET, SOCK_STREAM, 0))
+		throw MakeSocketError("Failed to create socket");
+
+	if (!a.Connect(listener.GetLocalAddress()))
+		throw MakeSocketError("Failed to connect");
+
+	auto b = listener.AcceptNonBlock();
+	if (!b.IsDefined())
+		throw MakeSocketError("Failed to accept");
+
+	a.SetNonBlocking();
+	a.SetNoDelay();
+	b.SetNoDelay();
+
+	return {std::move(a), std::move(b)};
+}
+
+/**
+ * Forward one chunk from "client" to "server" the way #Connection
+ * does: client_out → client_in → pipe → server_in → server_out.
+ */
+static void
+ForwardChunk(PipeStock &pipe_stock, Splice &splice,
+	     SocketDescriptor client_out, SocketDescriptor client_in,
+	     SocketDescriptor server_in, SocketDescriptor server_out,
+	     std::span<std::byte> buffer)
+{
+	if (client_out.Send(buffer, MSG_DONTWAIT) != static_cast<ssize_t>(buffer.size()))
+		throw std::runtime_error{"send() failed"};
+
+	if (splice.ReceiveFrom(pipe_stock, client_in) != Splice::ReceiveResult::OK)
+		throw std::runtime_error{"Splice::ReceiveFrom() failed"};
+
+	if (splice.SendTo(server_in) != Splice::SendResult::OK)
+		throw std::runtime_error{"Splice::SendTo() failed"};
+
+	/* drain the receiving end */
+	std::size_t remaining = buffer.size();
+	while (remaining > 0) {
+		const auto nbytes = server_out.ReadNoWait(buffer);
+		if (nbytes <= 0)
+			throw std::runtime_error{"recv() failed"};
+		remaining -= nbytes;
+	}
+}
+
+void
+BenchSplice(const BenchFilter &filter)
+{
+	EventLoop event_loop;
+	PipeStock pipe_stock{event_loop};
+
+	const auto [client_out, client_in] = CreateSocketPair();
+	const auto [server_in, server_out] = CreateSocketPair();
+
+	static constexpr std::size_t ITERATIONS = 4096;
+
+	/* game packets are small; 16 kB covers bulk transfers
+	   (e.g. the map at login) */
+	for (const std::size_t size : {64U, 1024U, 16384U}) {
+		std::array<std::byte, 16384> buffer{};
+
+		RunBenchmark(filter, "splice_forward", size, ITERATIONS, [&]{
+			Splice splice;
+			for (std::size_t i = 0; i < ITERATIONS; ++i)
+				ForwardChunk(pipe_stock, splice,
+					     client_out, client_in,
+					     server_in, server_out,
+					     std::span{buffer}.first(size));
+		});
+	}
+
+	/* the same with a game server on this host over loopback
+	   TCP; compare with "splice_forward" above, whose upstream
+	   is already a local socket ("game_server" with a path) */
+	const auto [tcp_server_in, tcp_server_out] = CreateLoopbackTcpPair();
+
+	for (const std::size_t size : {64U, 1024U, 16384U}) {
+		std::array<std::byte, 16384> buffer{};
+
+		RunBenchmark(filter, "splice_upstream_tcp", size, ITERATIONS, [&]{
+			Splice splice;
+			for (std::size_t i = 0; i < ITERATIONS; ++i)
+				ForwardChunk(pipe_stock, splice,
+					     client_out, client_in,
+					     tcp_server_in, tcp_server_out,
+					     std::span{buffer}.first(size));
+		});
+	}
+}
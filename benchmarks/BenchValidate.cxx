@@ -0,0 +1,60 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+// author: Max Kellermann <max.kellermann@gmail.com>
+
+#include "Bench.hxx"
+#include "Validate.hxx"
+#include "uo/Packets.hxx"
+#include "uo/String.hxx"
+
+#include <vector>
+
+/**
+ * Generate credentials with usernames and passwords of random
+ * length; every 8th username contains a control character.
+ */
+static std::vector<UO::CredentialsFragment>
+MakeCredentials(std::size_t n) noexcept
+{
+	BenchRandom random;
+
+	std::vector<UO::CredentialsFragment> result(n);
+	for (std::size_t i = 0; i < n; ++i) {
+		auto &c = result[i];
+
+		const std::size_t username_length = 1 + random() % sizeof(c.username);
+		for (std::size_t j = 0; j < username_length; ++j)
+			c.username[j] = 'a' + random() % 26;
+
+		if (i % 8 == 0)
+			c.username[random() % username_length] = '\x01';
+
+		const std::size_t password_length = random() % sizeof(c.password);
+		for (std::size_t j = 0; j < password_length; ++j)
+			c.password[j] = '!' + random() % 94;
+	}
+
+	return result;
+}
+
+void
+BenchValidate(const BenchFilter &filter)
+{
+	static constexpr std::size_t N = 65536;
+	const auto credentials = MakeCredentials(N);
+
+	RunBenchmark(filter, "extract_string", N, N, [&credentials]{
+		for (const auto &c : credentials)
+			DoNotOptimize(UO::ExtractString(c.username));
+	});
+
+	RunBenchmark(filter, "is_valid_username", N, N, [&credentials]{
+		for (const auto &c : credentials)
+			DoNotOptimize(IsValidUsername(UO::ExtractString(c.username)));
+	});
+
+	RunBenchmark(filter, "is_valid_string_field", N, N, [&credentials]{
+		for (const auto &c : credentials)
+			DoNotOptimize(IsValidStringField(c.username, false) &
+				      IsValidStringField(c.password, true));
+	});
+}
@@ -0,0 +1,329 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+// author: Max Kellermann <max.kellermann@gmail.com>
+
+#include "AccountingSnapshot.hxx"
+#include "net/ClientAccounting.hxx"
+#include "lib/fmt/ExceptionFormatter.hxx"
+#include "lib/fmt/RuntimeError.hxx"
+#include "lib/fmt/SystemError.hxx"
+#include "thread/Job.hxx"
+#include "thread/Queue.hxx"
+#include "thread/Pool.hxx"
+#include "io/UniqueFileDescriptor.hxx"
+#include "system/Error.hxx"
+#include "time/Cast.hxx"
+#include "util/ScopeExit.hxx"
+#include "util/SpanCast.hxx"
+
+#include <fmt/core.h>
+
+#include <algorithm> // for std::copy_n(), std::max()
+#include <cassert>
+#include <chrono>
+#include <cstring> // for memcmp()
+#include <utility> // for std::exchange()
+
+#include <errno.h>
+#include <fcntl.h> // for O_CREAT
+#include <stdio.h> // for rename()
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using std::string_view_literals::operator""sv;
+
+/**
+ * The maximum number of items collected in one event loop
+ * iteration (see AccountingSnapshot::OnCollect()).
+ */
+static constexpr std::size_t COLLECT_CHUNK = 4096;
+
+struct AccountingSnapshotHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t item_size;
+	uint64_t n_items;
+
+	/**
+	 * The wall clock time (milliseconds since the epoch) when
+	 * this snapshot was made; used to rebase all durations when
+	 * loading the snapshot.
+	 */
+	int64_t realtime_ms;
+};
+
+static_assert(sizeof(AccountingSnapshotHeader) == 32);
+
+static constexpr char SNAPSHOT_MAGIC[8] = {'u', 'o', 'l', 'o', 'g', 'a', 'c', 'c'};
+static constexpr uint32_t SNAPSHOT_VERSION = 1;
+
+static int_least64_t
+RealtimeMilliseconds() noexcept
+{
+	return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+static constexpr AccountingSnapshotHeader
+MakeHeader(std::size_t n_items, int_least64_t realtime_ms) noexcept
+{
+	AccountingSnapshotHeader header{
+		.version = SNAPSHOT_VERSION,
+		.item_size = sizeof(ClientAccountingSnapshotItem),
+		.n_items = n_items,
+		.realtime_ms = realtime_ms,
+	};
+
+	std::copy_n(SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC), header.magic);
+	return header;
+}
+
+static void
+FullWrite(FileDescriptor fd, std::span<const std::byte> src)
+{
+	while (!src.empty()) {
+		const auto nbytes = write(fd.Get(), src.data(), src.size());
+		if (nbytes < 0)
+			throw MakeErrno("Failed to write snapshot");
+
+		src = src.subspan(nbytes);
+	}
+}
+
+static void
+WriteSnapshotFile(const char *path, const AccountingSnapshotHeader &header,
+		  std::span<const ClientAccountingSnapshotItem> items)
+{
+	const auto tmp_path = fmt::format("{}.tmp"sv, path);
+
+	UniqueFileDescriptor fd;
+	if (!fd.Open(tmp_path.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0600))
+		throw FmtErrno("Failed to create {:?}", tmp_path);
+
+	FullWrite(fd, ReferenceAsBytes(header));
+	FullWrite(fd, std::as_bytes(items));
+
+	if (rename(tmp_path.c_str(), path) < 0)
+		throw FmtErrno("Failed to rename {:?}", tmp_path);
+}
+
+class SaveAccountingSnapshotJob final : public ThreadJob, Cancellable {
+	ThreadQueue &queue;
+
+	const char *const path;
+
+	const AccountingSnapshotHeader header;
+	const std::vector<ClientAccountingSnapshotItem> items;
+
+	using Callback = BoundMethod<void(double duration, std::exception_ptr error) noexcept>;
+	const Callback callback;
+
+	double duration;
+	std::exception_ptr error;
+
+	bool canceled = false;
+
+public:
+	SaveAccountingSnapshotJob(ThreadQueue &_queue, const char *_path,
+				  std::vector<ClientAccountingSnapshotItem> &&_items,
+				  Callback _callback,
+				  CancellablePointer &cancel_ptr) noexcept
+		:queue(_queue), path(_path),
+		 header(MakeHeader(_items.size(), RealtimeMilliseconds())),
+		 items(std::move(_items)),
+		 callback(_callback) {
+		cancel_ptr = *this;
+	}
+
+private:
+	// virtual methods from ThreadJob
+
+	void Run() noexcept override {
+		const auto start_time = std::chrono::steady_clock::now();
+
+		try {
+			WriteSnapshotFile(path, header, items);
+		} catch (...) {
+			error = std::current_exception();
+		}
+
+		duration = ToFloatSeconds(std::chrono::steady_clock::now() - start_time);
+	}
+
+	void Done() noexcept override {
+		if (!canceled)
+			callback(duration, std::move(error));
+		delete this;
+	}
+
+	void Cancel() noexcept override {
+		canceled = true;
+
+		if (queue.Cancel(*this))
+			delete this;
+	}
+};
+
+AccountingSnapshot::AccountingSnapshot(ClientAccountingMap &_map,
+				       std::string &&_path,
+				       Event::Duration _interval) noexcept
+	:map(_map), path(std::move(_path)), interval(_interval),
+	 timer(map.GetEventLoop(), BIND_THIS_METHOD(OnTimer)),
+	 collect_event(map.GetEventLoop(), BIND_THIS_METHOD(OnCollect))
+{
+}
+
+AccountingSnapshot::~AccountingSnapshot() noexcept
+{
+	if (cancel_ptr)
+		cancel_ptr.Cancel();
+}
+
+inline void
+AccountingSnapshot::Load()
+{
+	const auto start_time = std::chrono::steady_clock::now();
+
+	UniqueFileDescriptor fd;
+	if (!fd.OpenReadOnly(path.c_str())) {
+		if (errno == ENOENT)
+			return;
+
+		throw FmtErrno("Failed to open {:?}", path);
+	}
+
+	struct stat st;
+	if (fstat(fd.Get(), &st) < 0)
+		throw FmtErrno("Failed to stat {:?}", path);
+
+	const std::size_t size = st.st_size;
+	if (size < sizeof(AccountingSnapshotHeader))
+		throw FmtRuntimeError("Malformed snapshot file {:?}", path);
+
+	void *p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd.Get(), 0);
+	if (p == MAP_FAILED)
+		throw FmtErrno("Failed to map {:?}", path);
+
+	AtScopeExit(p, size) { munmap(p, size); };
+
+	const auto &header = *reinterpret_cast<const AccountingSnapshotHeader *>(p);
+	if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0 ||
+	    header.version != SNAPSHOT_VERSION ||
+	    header.item_size != sizeof(ClientAccountingSnapshotItem) ||
+	    header.n_items > (size - sizeof(header)) / sizeof(ClientAccountingSnapshotItem))
+		throw FmtRuntimeError("Malformed snapshot file {:?}", path);
+
+	const std::span items{
+		reinterpret_cast<const ClientAccountingSnapshotItem *>(&header + 1),
+		static_cast<std::size_t>(header.n_items),
+	};
+
+	const auto age_ms = std::max<int_least64_t>(RealtimeMilliseconds() - header.realtime_ms, 0);
+	map.Restore(items, std::chrono::milliseconds{age_ms});
+
+	stats.loaded_items = items.size();
+	stats.load_duration = ToFloatSeconds(std::chrono::steady_clock::now() - start_time);
+
+	fmt::print(stderr, "Loaded {} client accounting items in {:.3f}s\n",
+		   stats.loaded_items, stats.load_duration);
+}
+
+void
+AccountingSnapshot::Start() noexcept
+{
+	try {
+		Load();
+	} catch (...) {
+		fmt::print(stderr, "Failed to load client accounting snapshot: {}\n",
+			   std::current_exception());
+	}
+
+	timer.Schedule(interval);
+}
+
+void
+AccountingSnapshot::Shutdown() noexcept
+{
+	timer.Cancel();
+	collect_event.Cancel();
+	cursor.reset();
+	collected = {};
+
+	if (cancel_ptr)
+		cancel_ptr.Cancel();
+
+	const auto start_time = std::chrono::steady_clock::now();
+
+	try {
+		const auto items = map.Snapshot();
+		WriteSnapshotFile(path.c_str(),
+				  MakeHeader(items.size(), RealtimeMilliseconds()),
+				  items);
+		stats.saved_items = items.size();
+	} catch (...) {
+		fmt::print(stderr, "Failed to save client accounting snapshot: {}\n",
+			   std::current_exception());
+		return;
+	}
+
+	fmt::print(stderr, "Saved {} client accounting items in {:.3f}s\n",
+		   stats.saved_items,
+		   ToFloatSeconds(std::chrono::steady_clock::now() - start_time));
+}
+
+void
+AccountingSnapshot::OnTimer() noexcept
+{
+	timer.Schedule(interval);
+
+	if (cancel_ptr || cursor)
+		/* the previous save is still running */
+		return;
+
+	cursor.emplace(map);
+	OnCollect();
+}
+
+void
+AccountingSnapshot::OnCollect() noexcept
+{
+	assert(cursor);
+
+	const std::size_t old_size = collected.size();
+	collected.resize(old_size + COLLECT_CHUNK);
+	const std::size_t n = cursor->Read(std::span{collected}.subspan(old_size));
+	collected.resize(old_size + n);
+
+	if (!cursor->IsEnd()) {
+		/* let other handlers run before the next chunk */
+		collect_event.Schedule();
+		return;
+	}
+
+	cursor.reset();
+	stats.saved_items = collected.size();
+
+	/* the durations in the items are relative to the time
+	   their chunk was collected; all chunks are collected within
+	   a few event loop iterations, so the difference is
+	   negligible */
+	auto &queue = thread_pool_get_queue(map.GetEventLoop());
+	auto *job = new SaveAccountingSnapshotJob(queue, path.c_str(),
+						  std::exchange(collected, {}),
+						  BIND_THIS_METHOD(OnSaveDone),
+						  cancel_ptr);
+	queue.Add(*job);
+}
+
+void
+AccountingSnapshot::OnSaveDone(double duration, std::exception_ptr error) noexcept
+{
+	cancel_ptr = {};
+
+	stats.save_duration = duration;
+
+	if (error) {
+		++stats.save_errors;
+		fmt::print(stderr, "Failed to save client accounting snapshot: {}\n",
+			   error);
+	}
+}
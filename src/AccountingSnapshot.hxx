@@ -0,0 +1,88 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+// author: Max Kellermann <max.kellermann@gmail.com>
+
+#pragma once
+
+#include "event/DeferEvent.hxx"
+#include "event/FarTimerEvent.hxx"
+#include "net/ClientAccounting.hxx"
+#include "util/Cancellable.hxx"
+
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <optional>
+#include <string>
+#include <vector>
+
+/**
+ * Periodically saves a snapshot of the #ClientAccountingMap to a
+ * file (in a worker thread) and restores it at startup, so the
+ * "knocked" flags and tarpit state survive a restart.
+ *
+ * The file consists of a #AccountingSnapshotHeader followed by an
+ * array of #ClientAccountingSnapshotItem, and is loaded with
+ * mmap().
+ *
+ * The items are collected in chunks (one per event loop iteration)
+ * with a #ClientAccountingMap::SnapshotCursor, so even a large map
+ * does not block the event loop.
+ */
+class AccountingSnapshot final {
+	ClientAccountingMap &map;
+
+	const std::string path;
+
+	const Event::Duration interval;
+
+	FarTimerEvent timer;
+
+	/**
+	 * Collects the next chunk of items.
+	 */
+	DeferEvent collect_event;
+
+	/**
+	 * Walks the map while items are being collected.
+	 */
+	std::optional<ClientAccountingMap::SnapshotCursor> cursor;
+
+	/**
+	 * The items collected so far.
+	 */
+	std::vector<ClientAccountingSnapshotItem> collected;
+
+	CancellablePointer cancel_ptr;
+
+public:
+	struct {
+		std::size_t saved_items, loaded_items;
+		double save_duration, load_duration;
+		uint_least64_t save_errors;
+	} stats{};
+
+	AccountingSnapshot(ClientAccountingMap &_map,
+			   std::string &&_path,
+			   Event::Duration _interval) noexcept;
+	~AccountingSnapshot() noexcept;
+
+	/**
+	 * Load the snapshot file (if it exists) and start the
+	 * periodic timer.
+	 */
+	void Start() noexcept;
+
+	/**
+	 * Cancel all pending operations and save the final snapshot
+	 * synchronously.  Must be called after all worker threads
+	 * have been joined.
+	 */
+	void Shutdown() noexcept;
+
+private:
+	void Load();
+
+	void OnTimer() noexcept;
+	void OnCollect() noexcept;
+	void OnSaveDone(double duration, std::exception_ptr error) noexcept;
+};
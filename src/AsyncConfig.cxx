@@ -0,0 +1,64 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+// author: Max Kellermann <max.kellermann@gmail.com>
+
+#include "AsyncConfig.hxx"
+#include "Config.hxx"
+#include "thread/Job.hxx"
+#include "thread/Queue.hxx"
+#include "thread/Pool.hxx"
+#include "util/Cancellable.hxx"
+
+class LoadConfigJob final : public ThreadJob, Cancellable {
+	ThreadQueue &queue;
+
+	const char *const path;
+
+	const LoadConfigCallback callback;
+
+	std::shared_ptr<const Config> config;
+	std::exception_ptr error;
+
+	bool canceled = false;
+
+public:
+	LoadConfigJob(ThreadQueue &_queue, const char *_path,
+		      LoadConfigCallback _callback,
+		      CancellablePointer &cancel_ptr) noexcept
+		:queue(_queue), path(_path), callback(_callback) {
+		cancel_ptr = *this;
+	}
+
+private:
+	// virtual methods from ThreadJob
+
+	void Run() noexcept override {
+		try {
+			config = std::make_shared<const Config>(LoadConfigFile(path));
+		} catch (...) {
+			error = std::current_exception();
+		}
+	}
+
+	void Done() noexcept override {
+		if (!canceled)
+			callback(std::move(config), std::move(error));
+		delete this;
+	}
+
+	void Cancel() noexcept override {
+		canceled = true;
+
+		if (queue.Cancel(*this))
+			delete this;
+	}
+};
+
+void
+LoadConfigFileAsync(EventLoop &event_loop, const char *path,
+		    LoadConfigCallback callback,
+		    CancellablePointer &cancel_ptr) noexcept
+{
+	auto &queue = thread_pool_get_queue(event_loop);
+	auto *job = new LoadConfigJob(queue, path, callback, cancel_ptr);
+	queue.Add(*job);
+}
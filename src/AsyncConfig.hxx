@@ -0,0 +1,26 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+// author: Max Kellermann <max.kellermann@gmail.com>
+
+#pragma once
+
+#include "util/BindMethod.hxx"
+
+#include <exception>
+#include <memory>
+
+struct Config;
+class EventLoop;
+class CancellablePointer;
+
+using LoadConfigCallback = BoundMethod<void(std::shared_ptr<const Config> config,
+					    std::exception_ptr error) noexcept>;
+
+/**
+ * Load the configuration file in a worker thread, so the event loop
+ * is not blocked while parsing the file and resolving host names.
+ * The callback is invoked in the #EventLoop thread.
+ */
+void
+LoadConfigFileAsync(EventLoop &event_loop, const char *path,
+		    LoadConfigCallback callback,
+		    CancellablePointer &cancel_ptr) noexcept;
@@ -0,0 +1,64 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+// author: Max Kellermann <max.kellermann@gmail.com>
+
+#include "AuthTicket.hxx"
+#include "ClientAddress.hxx"
+
+#include <sodium/crypto_shorthash.h>
+
+#include <algorithm> // for std::copy()
+
+static_assert(sizeof(AuthTicketKey) == crypto_shorthash_KEYBYTES);
+
+static uint32_t
+MakeAuthTicket(const AuthTicketKey &key, SocketAddress client,
+	       std::string_view upper_username, uint_least64_t period) noexcept
+{
+	std::array<std::byte, 8 + 16 + 30> message;
+	std::size_t length = 0;
+
+	for (unsigned i = 0; i < 8; ++i)
+		message[length++] = static_cast<std::byte>(period >> (56 - 8 * i));
+
+	ExportClientAddress(message.data() + length, client);
+	length += 16;
+
+	if (upper_username.size() > message.size() - length)
+		upper_username = upper_username.substr(0, message.size() - length);
+
+	length = std::copy(upper_username.begin(), upper_username.end(),
+			   reinterpret_cast<char *>(message.data() + length))
+		- reinterpret_cast<char *>(message.data());
+
+	std::array<unsigned char, crypto_shorthash_BYTES> hash;
+	crypto_shorthash(hash.data(),
+			 reinterpret_cast<const unsigned char *>(message.data()), length,
+			 reinterpret_cast<const unsigned char *>(key.data()));
+
+	return uint32_t(hash[0]) | (uint32_t(hash[1]) << 8) |
+		(uint32_t(hash[2]) << 16) | (uint32_t(hash[3]) << 24);
+}
+
+static uint_least64_t
+GetPeriod(std::chrono::system_clock::time_point now) noexcept
+{
+	return std::chrono::duration_cast<std::chrono::seconds>(now.time_since_epoch()) / AUTH_TICKET_PERIOD;
+}
+
+uint32_t
+MakeAuthTicket(const AuthTicketKey &key, SocketAddress client,
+	       std::string_view upper_username,
+	       std::chrono::system_clock::time_point now) noexcept
+{
+	return MakeAuthTicket(key, client, upper_username, GetPeriod(now));
+}
+
+bool
+VerifyAuthTicket(const AuthTicketKey &key, uint32_t auth_id,
+		 SocketAddress client, std::string_view upper_username,
+		 std::chrono::system_clock::time_point now) noexcept
+{
+	const auto period = GetPeriod(now);
+	return MakeAuthTicket(key, client, upper_username, period) == auth_id ||
+		MakeAuthTicket(key, client, upper_username, period - 1) == auth_id;
+}
@@ -0,0 +1,60 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+// author: Max Kellermann <max.kellermann@gmail.com>
+
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+class SocketAddress;
+
+/**
+ * The key shared between uologin and the game server (SipHash-2-4,
+ * see crypto_shorthash()).
+ */
+using AuthTicketKey = std::array<std::byte, 16>;
+
+/**
+ * The lifetime of a ticket is between one and two of these periods.
+ */
+static constexpr std::chrono::seconds AUTH_TICKET_PERIOD{30};
+
+/*
+ * An auth ticket is the "auth_id" in the 0x8c Relay packet (see
+ * #uo_packet_relay) which uologin sends after a successful login in
+ * "login_server_mode".  The client connects to the game server and
+ * sends it back in its 0x91 GameLogin packet; the game server uses
+ * VerifyAuthTicket() (or an equivalent implementation) to check that
+ * the login was authorized by uologin.
+ *
+ * The ticket is the little-endian lower half of the SipHash-2-4 of
+ * this message:
+ *
+ * - the period number (seconds since the epoch divided by
+ *   #AUTH_TICKET_PERIOD) as 64 bit big-endian integer
+ * - the client's IP address as 16 bytes (IPv4 as IPv4-mapped IPv6
+ *   address)
+ * - the upper case username (see ToUpperUsername())
+ */
+
+/**
+ * Generate a ticket for the given client.
+ */
+[[gnu::pure]]
+uint32_t
+MakeAuthTicket(const AuthTicketKey &key, SocketAddress client,
+	       std::string_view upper_username,
+	       std::chrono::system_clock::time_point now) noexcept;
+
+/**
+ * Check a ticket received from a client; tickets from the current
+ * and from the previous period are accepted.
+ */
+[[gnu::pure]]
+bool
+VerifyAuthTicket(const AuthTicketKey &key, uint32_t auth_id,
+		 SocketAddress client, std::string_view upper_username,
+		 std::chrono::system_clock::time_point now) noexcept;
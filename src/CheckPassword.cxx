@@ -0,0 +1,83 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+// author: Max Kellermann <max.kellermann@gmail.com>
+
+#include "CheckPassword.hxx"
+#include "BerkeleyDB.hxx"
+#include "util/SpanCast.hxx"
+
+#include <charconv>
+#include <cstdint>
+
+using std::string_view_literals::operator""sv;
+
+const char *
+LookupPasswordHash(const BerkeleyDB &db, std::string_view upper_username,
+		   PasswordHashBuffer &buffer)
+{
+	const std::size_t size = db.Get(AsBytes(upper_username), std::as_writable_bytes(std::span{buffer}));
+
+	if (size == 0 || size >= buffer.size())
+		return nullptr;
+
+	buffer[size] = '\0';
+	return buffer.data();
+}
+
+template<typename T>
+static bool
+ParseUnsigned(std::string_view s, T &value) noexcept
+{
+	const auto [ptr, ec] = std::from_chars(s.data(), s.data() + s.size(), value);
+	return ec == std::errc{} && ptr == s.data() + s.size();
+}
+
+PasswordHashCost
+ParsePasswordHashCost(std::string_view hash) noexcept
+{
+	PasswordHashCost cost;
+
+	if (!hash.starts_with("$argon2"sv))
+		return cost;
+
+	/* the parameters are separated by '$' and ','; the salt
+	   and the hash are Base64 without padding, so they never
+	   contain '=' */
+	uint_least64_t memory_kib = 0;
+	for (std::size_t pos = 1; pos < hash.size();) {
+		std::size_t end = hash.find_first_of("$,"sv, pos);
+		if (end == hash.npos)
+			end = hash.size();
+
+		const auto param = hash.substr(pos, end - pos);
+		pos = end + 1;
+
+		if (param.starts_with("m="sv)) {
+			if (!ParseUnsigned(param.substr(2), memory_kib))
+				return {};
+		} else if (param.starts_with("t="sv)) {
+			if (!ParseUnsigned(param.substr(2), cost.opslimit))
+				return {};
+		}
+	}
+
+	if (memory_kib > SIZE_MAX / 1024)
+		return {};
+
+	cost.memory = memory_kib * 1024;
+	return cost;
+}
+
+bool
+VerifyPasswordHash(const char *hash, std::string_view password) noexcept
+{
+	return crypto_pwhash_str_verify(hash, password.data(), password.size()) == 0;
+}
+
+bool
+CheckPassword(const BerkeleyDB &db, std::string_view upper_username,
+	      std::string_view password)
+{
+	PasswordHashBuffer buffer;
+	const char *hash = LookupPasswordHash(db, upper_username, buffer);
+	return hash != nullptr && VerifyPasswordHash(hash, password);
+}
@@ -0,0 +1,75 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+// author: Max Kellermann <max.kellermann@gmail.com>
+
+#pragma once
+
+#include <sodium/crypto_pwhash.h>
+
+#include <array>
+#include <cstddef>
+#include <string_view>
+
+class BerkeleyDB;
+
+using PasswordHashBuffer = std::array<char, crypto_pwhash_STRBYTES>;
+
+/**
+ * Look up the password hash of the given user.  This is cheap and
+ * may run in the #EventLoop thread.
+ *
+ * Throws on database error.
+ *
+ * @param upper_username the key in the user database (see
+ * ToUpperUsername())
+ * @return the null-terminated hash (pointing into the given
+ * buffer) or nullptr if there is no such user
+ */
+[[nodiscard]]
+const char *
+LookupPasswordHash(const BerkeleyDB &db, std::string_view upper_username,
+		   PasswordHashBuffer &buffer);
+
+/**
+ * The resources needed to verify a password hash.
+ */
+struct PasswordHashCost {
+	/**
+	 * The memory allocated by one verification [bytes].
+	 */
+	std::size_t memory = 0;
+
+	/**
+	 * The number of passes.
+	 */
+	unsigned long opslimit = 0;
+};
+
+/**
+ * Parse the Argon2 parameters from a hash string (e.g.
+ * "$argon2id$v=19$m=65536,t=2,p=1$...").  Returns zero values if the
+ * string is malformed (its verification will fail quickly).
+ */
+[[gnu::pure]]
+PasswordHashCost
+ParsePasswordHashCost(std::string_view hash) noexcept;
+
+/**
+ * Verify the password against a hash returned by
+ * LookupPasswordHash().  This is the expensive part of a login and
+ * usually runs in a worker thread.
+ */
+[[nodiscard]]
+bool
+VerifyPasswordHash(const char *hash, std::string_view password) noexcept;
+
+/**
+ * Look up the password hash of the given user and verify the
+ * password against it (i.e. LookupPasswordHash() plus
+ * VerifyPasswordHash()).
+ *
+ * Throws on database error.
+ */
+[[nodiscard]]
+bool
+CheckPassword(const BerkeleyDB &db, std::string_view upper_username,
+	      std::string_view password);
@@ -0,0 +1,22 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+// author: Max Kellermann <max.kellermann@gmail.com>
+
+#include "ClientAddress.hxx"
+
+#include <fmt/format.h>
+
+#include <iterator> // for std::back_inserter()
+
+#include <arpa/inet.h> // for ntohl()
+
+void
+FormatClientKey(std::string &out, uint_least64_t key) noexcept
+{
+	if (IsIPv4ClientKey(key)) {
+		const uint32_t address = ntohl(static_cast<uint32_t>(key));
+		fmt::format_to(std::back_inserter(out), "{}.{}.{}.{}",
+			       (address >> 24) & 0xff, (address >> 16) & 0xff,
+			       (address >> 8) & 0xff, address & 0xff);
+	} else
+		fmt::format_to(std::back_inserter(out), "#{:016x}", key);
+}
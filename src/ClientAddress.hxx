@@ -0,0 +1,60 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+// author: Max Kellermann <max.kellermann@gmail.com>
+
+#pragma once
+
+#include "net/IPv4Address.hxx"
+#include "net/IPv6Address.hxx"
+#include "net/SocketAddress.hxx"
+
+#include <algorithm> // for std::fill_n()
+#include <cstddef>
+#include <cstdint>
+#include <cstring> // for memcpy()
+#include <string>
+
+#include <sys/socket.h>
+
+/**
+ * Write the client's IP address (without the port) as 16 bytes
+ * (IPv4 as IPv4-mapped IPv6 address).  This is used to bind signed
+ * tokens to a client.
+ */
+inline void
+ExportClientAddress(std::byte *dest, SocketAddress address) noexcept
+{
+	std::fill_n(dest, 16, std::byte{});
+
+	if (address.IsNull())
+		return;
+
+	switch (address.GetFamily()) {
+	case AF_INET:
+		dest[10] = dest[11] = std::byte{0xff};
+		memcpy(dest + 12, &IPv4Address::Cast(address).GetAddress(), 4);
+		break;
+
+	case AF_INET6:
+		memcpy(dest, &IPv6Address::Cast(address).GetAddress(), 16);
+		break;
+	}
+}
+
+/**
+ * Is this client accounting key (see
+ * PerClientAccounting::GetAddressKey()) an IPv4 address?  IPv6 keys
+ * are folded and cannot be converted back.
+ */
+constexpr bool
+IsIPv4ClientKey(uint_least64_t key) noexcept
+{
+	return key != 0 && key <= 0xffffffff;
+}
+
+/**
+ * Append a client accounting key to the string: IPv4 keys (which
+ * contain the address in network byte order) in dotted notation,
+ * IPv6 keys as '#' followed by 16 hex digits.
+ */
+void
+FormatClientKey(std::string &out, uint_least64_t key) noexcept;
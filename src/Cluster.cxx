@@ -0,0 +1,335 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+// author: Max Kellermann <max.kellermann@gmail.com>
+
+#include "Cluster.hxx"
+#include "net/ClientAccounting.hxx"
+#include "net/MultiReceiveMessage.hxx"
+#include "net/UniqueSocketDescriptor.hxx"
+#include "util/PackedBigEndian.hxx"
+#include "util/PrintException.hxx"
+
+#include <sodium/crypto_auth.h>
+#include <sodium/randombytes.h>
+
+#include <fmt/format.h>
+
+#include <algorithm> // for std::copy(), std::min()
+#include <chrono>
+
+#include <sys/socket.h>
+
+static_assert(CLUSTER_KEY_SIZE == crypto_auth_KEYBYTES);
+
+/**
+ * How often are pending changes sent?
+ */
+static constexpr Event::Duration FLUSH_INTERVAL = std::chrono::milliseconds{100};
+
+/**
+ * Datagrams with a timestamp which differs more than this from our
+ * clock are rejected; this limits replay attacks.
+ */
+static constexpr std::chrono::milliseconds MAX_CLOCK_SKEW = std::chrono::seconds{30};
+
+/**
+ * The maximum number of changes which are queued; more are
+ * discarded.
+ */
+static constexpr std::size_t MAX_PENDING_CHANGES = 65536;
+
+static constexpr uint32_t CLUSTER_MAGIC = 0x756f6c63; // "uolc"
+static constexpr uint8_t CLUSTER_VERSION = 1;
+
+/**
+ * The header of a cluster datagram.  It is followed by
+ * #ClusterDatagramHeader::n_items #ClusterChangeItem and the MAC
+ * (crypto_auth()) over everything before it.  All integers are big
+ * endian.
+ */
+struct ClusterDatagramHeader {
+	PackedBE32 magic;
+	uint8_t version;
+	uint8_t reserved;
+	PackedBE16 n_items;
+
+	PackedBE64 node_id;
+
+	/**
+	 * CLOCK_REALTIME in milliseconds.
+	 */
+	PackedBE64 timestamp_ms;
+};
+
+static_assert(sizeof(ClusterDatagramHeader) == 24);
+static_assert(alignof(ClusterDatagramHeader) == 1);
+
+/**
+ * One change of a #PerClientAccounting.
+ */
+struct ClusterChangeItem {
+	/**
+	 * The key returned by PerClientAccounting::GetAddressKey().
+	 */
+	PackedBE64 address;
+
+	/**
+	 * The remaining tarpit duration in milliseconds.
+	 */
+	PackedBE32 tarpit_ms;
+
+	/**
+	 * The current delay in centiseconds.
+	 */
+	PackedBE16 delay_cs;
+
+	/**
+	 * #ClientAccountingChange flags.
+	 */
+	uint8_t flags;
+
+	uint8_t reserved;
+};
+
+static_assert(sizeof(ClusterChangeItem) == 16);
+static_assert(alignof(ClusterChangeItem) == 1);
+
+/**
+ * The number of items per datagram; this keeps datagrams well below
+ * the usual MTU.
+ */
+static constexpr std::size_t MAX_ITEMS_PER_DATAGRAM = 64;
+
+static constexpr std::size_t MAX_DATAGRAM_SIZE = sizeof(ClusterDatagramHeader) +
+	MAX_ITEMS_PER_DATAGRAM * sizeof(ClusterChangeItem) + crypto_auth_BYTES;
+
+static uint_least64_t
+GenerateNodeId() noexcept
+{
+	uint_least64_t id;
+	randombytes_buf(&id, sizeof(id));
+	return id;
+}
+
+static uint_least64_t
+RealtimeMilliseconds() noexcept
+{
+	return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+template<typename T>
+static constexpr uint_least64_t
+ClampMilliseconds(T d, uint_least64_t max) noexcept
+{
+	if (d <= T::zero())
+		return 0;
+
+	return std::min<uint_least64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(d).count(), max);
+}
+
+Cluster::Cluster(EventLoop &event_loop, ClientAccountingMap &_accounting,
+		 UniqueSocketDescriptor &&socket,
+		 std::vector<AllocatedSocketAddress> &&_peers,
+		 std::span<const std::byte, CLUSTER_KEY_SIZE> _key,
+		 std::size_t bandwidth,
+		 KnockHandler _knock_handler) noexcept
+	:accounting(_accounting),
+	 knock_handler(_knock_handler),
+	 udp_listener(event_loop, std::move(socket),
+		      MultiReceiveMessage{64, MAX_DATAGRAM_SIZE},
+		      *this),
+	 flush_timer(event_loop, BIND_THIS_METHOD(OnFlushTimer)),
+	 peers(std::move(_peers)),
+	 node_id(GenerateNodeId()),
+	 bytes_per_flush(bandwidth * FLUSH_INTERVAL / std::chrono::seconds{1})
+{
+	std::copy(_key.begin(), _key.end(), key.begin());
+
+	accounting.EnableChangeTracking(MAX_PENDING_CHANGES);
+	flush_timer.Schedule(FLUSH_INTERVAL);
+}
+
+Cluster::~Cluster() noexcept
+{
+	accounting.EnableChangeTracking(0);
+}
+
+void
+Cluster::SendToPeers(std::span<const std::byte> datagram) noexcept
+{
+	for (const auto &peer : peers) {
+		if (sendto(udp_listener.GetSocket().Get(),
+			   datagram.data(), datagram.size(),
+			   MSG_DONTWAIT|MSG_NOSIGNAL,
+			   peer.GetAddress(), peer.GetSize()) < 0) {
+			/* no retransmit; the next change of the same
+			   client will fix it */
+			++stats.send_errors;
+			continue;
+		}
+
+		++stats.sent_datagrams;
+		stats.sent_bytes += datagram.size();
+	}
+}
+
+void
+Cluster::OnFlushTimer() noexcept
+{
+	flush_timer.Schedule(FLUSH_INTERVAL);
+
+	if (peers.empty())
+		return;
+
+	/* how many datagrams fit into the bandwidth limit? (but at
+	   least one, or we would never send anything) */
+	std::size_t n_datagrams = bytes_per_flush / (MAX_DATAGRAM_SIZE * peers.size());
+	if (n_datagrams == 0)
+		n_datagrams = 1;
+
+	const auto now = accounting.GetEventLoop().SteadyNow();
+
+	for (std::size_t d = 0; d < n_datagrams; ++d) {
+		alignas(uint64_t) std::array<std::byte, MAX_DATAGRAM_SIZE> buffer;
+		auto &header = *reinterpret_cast<ClusterDatagramHeader *>(buffer.data());
+		auto *items = reinterpret_cast<ClusterChangeItem *>(buffer.data() + sizeof(header));
+
+		const std::size_t n_items = accounting.ConsumeChanges(MAX_ITEMS_PER_DATAGRAM, [&items, now](const PerClientAccounting &per_client, uint_least8_t flags){
+			if ((flags & CLIENT_ACCOUNTING_TARPIT) && !per_client.HasKnocked())
+				/* the tarpit came after the knock and
+				   has reset it */
+				flags &= ~CLIENT_ACCOUNTING_KNOCKED;
+
+			*items++ = {
+				.address = per_client.GetAddressKey(),
+				.tarpit_ms = static_cast<uint32_t>(ClampMilliseconds(per_client.GetTarpitUntil() - now, UINT32_MAX)),
+				.delay_cs = static_cast<uint16_t>(ClampMilliseconds(per_client.GetDelay(), UINT16_MAX * 10) / 10),
+				.flags = flags,
+			};
+		});
+
+		if (n_items == 0)
+			break;
+
+		header = {
+			.magic = CLUSTER_MAGIC,
+			.version = CLUSTER_VERSION,
+			.n_items = static_cast<uint16_t>(n_items),
+			.node_id = node_id,
+			.timestamp_ms = RealtimeMilliseconds(),
+		};
+
+		const std::size_t signed_size = sizeof(header) + n_items * sizeof(ClusterChangeItem);
+		auto *mac = reinterpret_cast<unsigned char *>(buffer.data() + signed_size);
+		crypto_auth(mac,
+			    reinterpret_cast<const unsigned char *>(buffer.data()), signed_size,
+			    reinterpret_cast<const unsigned char *>(key.data()));
+
+		stats.sent_items += n_items;
+		SendToPeers(std::span{buffer}.first(signed_size + crypto_auth_BYTES));
+
+		if (n_items < MAX_ITEMS_PER_DATAGRAM)
+			/* no more pending changes */
+			break;
+	}
+}
+
+bool
+Cluster::OnUdpDatagram(std::span<const std::byte> payload,
+		       std::span<UniqueFileDescriptor>,
+		       SocketAddress, int)
+{
+	if (payload.size() < sizeof(ClusterDatagramHeader) + crypto_auth_BYTES) {
+		++stats.rejected_datagrams;
+		return true;
+	}
+
+	const auto &header = *reinterpret_cast<const ClusterDatagramHeader *>(payload.data());
+	const std::size_t n_items = header.n_items;
+	const std::size_t signed_size = sizeof(header) + n_items * sizeof(ClusterChangeItem);
+
+	if (header.magic != CLUSTER_MAGIC || header.version != CLUSTER_VERSION ||
+	    payload.size() != signed_size + crypto_auth_BYTES ||
+	    crypto_auth_verify(reinterpret_cast<const unsigned char *>(payload.data() + signed_size),
+			       reinterpret_cast<const unsigned char *>(payload.data()), signed_size,
+			       reinterpret_cast<const unsigned char *>(key.data())) != 0) {
+		++stats.rejected_datagrams;
+		return true;
+	}
+
+	if (header.node_id == node_id)
+		/* our own datagram */
+		return true;
+
+	const int_least64_t skew = static_cast<int_least64_t>(RealtimeMilliseconds() - header.timestamp_ms);
+	if (skew > MAX_CLOCK_SKEW.count() || skew < -MAX_CLOCK_SKEW.count()) {
+		++stats.rejected_datagrams;
+		return true;
+	}
+
+	++stats.received_datagrams;
+	stats.received_items += n_items;
+
+	const std::span items{reinterpret_cast<const ClusterChangeItem *>(payload.data() + sizeof(header)), n_items};
+	for (const auto &i : items)
+		if (accounting.ApplyRemoteChange(i.address, i.flags,
+						 std::chrono::milliseconds{i.tarpit_ms},
+						 std::chrono::milliseconds{uint_least32_t{i.delay_cs} * 10}))
+			knock_handler(i.address);
+
+	return true;
+}
+
+void
+Cluster::OnUdpError(std::exception_ptr error) noexcept
+{
+	PrintException(std::move(error));
+}
+
+void
+Cluster::ExportMetrics(std::string &out) const noexcept
+{
+	fmt::format_to(std::back_inserter(out), R"(
+# HELP uologin_cluster_sent_datagrams Counter for datagrams sent to cluster peers
+# TYPE uologin_cluster_sent_datagrams counter
+
+# HELP uologin_cluster_sent_items Counter for client accounting changes sent to cluster peers
+# TYPE uologin_cluster_sent_items counter
+
+# HELP uologin_cluster_sent_bytes Counter for bytes sent to cluster peers
+# TYPE uologin_cluster_sent_bytes counter
+
+# HELP uologin_cluster_send_errors Counter for datagrams which could not be sent to cluster peers
+# TYPE uologin_cluster_send_errors counter
+
+# HELP uologin_cluster_received_datagrams Counter for valid datagrams received from cluster peers
+# TYPE uologin_cluster_received_datagrams counter
+
+# HELP uologin_cluster_received_items Counter for client accounting changes received from cluster peers
+# TYPE uologin_cluster_received_items counter
+
+# HELP uologin_cluster_rejected_datagrams Counter for malformed, unauthenticated or stale cluster datagrams
+# TYPE uologin_cluster_rejected_datagrams counter
+
+# HELP uologin_cluster_pending_changes Current number of client accounting changes waiting to be sent
+# TYPE uologin_cluster_pending_changes gauge
+
+# HELP uologin_cluster_dropped_changes Counter for client accounting changes discarded because the queue was full
+# TYPE uologin_cluster_dropped_changes counter
+
+uologin_cluster_sent_datagrams {}
+uologin_cluster_sent_items {}
+uologin_cluster_sent_bytes {}
+uologin_cluster_send_errors {}
+uologin_cluster_received_datagrams {}
+uologin_cluster_received_items {}
+uologin_cluster_rejected_datagrams {}
+uologin_cluster_pending_changes {}
+uologin_cluster_dropped_changes {}
+)",
+		       stats.sent_datagrams, stats.sent_items,
+		       stats.sent_bytes, stats.send_errors,
+		       stats.received_datagrams, stats.received_items,
+		       stats.rejected_datagrams,
+		       accounting.GetPendingChanges(),
+		       accounting.GetDroppedChanges());
+}
@@ -0,0 +1,118 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+// author: Max Kellermann <max.kellermann@gmail.com>
+
+#pragma once
+
+#include "event/CoarseTimerEvent.hxx"
+#include "event/net/MultiUdpListener.hxx"
+#include "event/net/UdpHandler.hxx"
+#include "net/AllocatedSocketAddress.hxx"
+#include "util/BindMethod.hxx"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <string>
+#include <vector>
+
+class ClientAccountingMap;
+class UniqueSocketDescriptor;
+
+/**
+ * The size of the key which authenticates all cluster datagrams
+ * (HMAC-SHA512-256, see crypto_auth()).
+ */
+static constexpr std::size_t CLUSTER_KEY_SIZE = 32;
+
+/**
+ * Replicates local #ClientAccountingMap changes (knocks and tarpit
+ * events) to other uologin nodes and applies their changes to the
+ * local map.
+ *
+ * Changes are collected by the map and sent periodically in batches
+ * of compact records via UDP to all peers, limited to a configured
+ * bandwidth.  Changes which cannot be sent (because the bandwidth is
+ * exceeded for too long or a datagram is lost) are not
+ * retransmitted; the state converges with the next change of the
+ * same client.  All datagrams are authenticated with a shared key.
+ *
+ * Remote knocks are reported to a #KnockHandler, which adds the
+ * client to the local nftables set.
+ */
+class Cluster final : UdpHandler {
+public:
+	/**
+	 * Invoked with the client accounting key of a client which
+	 * has knocked on another node (and was not yet known to have
+	 * knocked here).
+	 */
+	using KnockHandler = BoundMethod<void(uint_least64_t address) noexcept>;
+
+private:
+	ClientAccountingMap &accounting;
+
+	const KnockHandler knock_handler;
+
+	MultiUdpListener udp_listener;
+
+	/**
+	 * Sends pending changes periodically.
+	 */
+	CoarseTimerEvent flush_timer;
+
+	const std::vector<AllocatedSocketAddress> peers;
+
+	std::array<std::byte, CLUSTER_KEY_SIZE> key;
+
+	/**
+	 * A random identifier of this node which is used to ignore
+	 * our own datagrams (if the peer list contains this node).
+	 */
+	const uint_least64_t node_id;
+
+	/**
+	 * The maximum number of bytes sent (to all peers together)
+	 * per #flush_timer interval.
+	 */
+	const std::size_t bytes_per_flush;
+
+public:
+	struct {
+		uint_least64_t sent_datagrams, sent_items, sent_bytes, send_errors;
+		uint_least64_t received_datagrams, received_items;
+		uint_least64_t rejected_datagrams;
+	} stats{};
+
+	/**
+	 * @param bandwidth the maximum number of bytes per second
+	 * sent to all peers together
+	 */
+	Cluster(EventLoop &event_loop, ClientAccountingMap &_accounting,
+		UniqueSocketDescriptor &&socket,
+		std::vector<AllocatedSocketAddress> &&_peers,
+		std::span<const std::byte, CLUSTER_KEY_SIZE> _key,
+		std::size_t bandwidth,
+		KnockHandler _knock_handler) noexcept;
+
+	~Cluster() noexcept;
+
+	Cluster(const Cluster &) = delete;
+	Cluster &operator=(const Cluster &) = delete;
+
+	void ExportMetrics(std::string &out) const noexcept;
+
+private:
+	/**
+	 * Send one datagram to all peers.
+	 */
+	void SendToPeers(std::span<const std::byte> datagram) noexcept;
+
+	void OnFlushTimer() noexcept;
+
+	// virtual methods from UdpHandler
+	bool OnUdpDatagram(std::span<const std::byte> payload,
+			   std::span<UniqueFileDescriptor> fds,
+			   SocketAddress address, int uid) override;
+	void OnUdpError(std::exception_ptr error) noexcept override;
+};
@@ -2,29 +2,130 @@
 // author: Max Kellermann <max.kellermann@gmail.com>
 
 #include "Config.hxx"
+#include "GameServerAddress.hxx"
+#include "lib/fmt/RuntimeError.hxx"
+#include "lib/fmt/SystemError.hxx"
 #include "io/config/ConfigParser.hxx"
 #include "io/config/FileLineParser.hxx"
+#include "io/Open.hxx"
+#include "io/UniqueFileDescriptor.hxx"
 #include "net/AddressInfo.hxx"
 #include "net/IPv4Address.hxx"
 #include "net/Parser.hxx"
 #include "net/Resolver.hxx"
+#include "util/CharUtil.hxx"
 #include "util/StringAPI.hxx"
 
 #include <fmt/core.h>
 
-#include <stdlib.h> // for getenv()
+#include <algorithm> // for std::max(), std::copy_n()
+#include <array>
+#include <thread> // for std::thread::hardware_concurrency()
+
+#include <sched.h> // for CPU_SETSIZE
+#include <stdlib.h> // for getenv(), strtoul()
 
 using std::string_view_literals::operator""sv;
 
 inline
 Config::Config() noexcept
+	:verify_threads_max(std::max(std::thread::hardware_concurrency(), 1U))
 {
 	if (const char *runtime_directory = getenv("RUNTIME_DIRECTORY")) {
 		prometheus_exporter.bind_address.SetLocal(fmt::format("{}/prometheus-exporter.socket"sv,
 								      runtime_directory));
+		control_socket = fmt::format("{}/control.socket"sv, runtime_directory);
+	}
+}
+
+static unsigned
+ParseCpuNumber(const char *&p)
+{
+	if (!IsDigitASCII(*p))
+		throw LineParser::Error{"CPU number expected"};
+
+	char *endptr;
+	const unsigned long value = strtoul(p, &endptr, 10);
+	if (value >= CPU_SETSIZE)
+		throw LineParser::Error{"CPU number too large"};
+
+	p = endptr;
+	return value;
+}
+
+/**
+ * Parse a high watermark and an optional low watermark (default 90%
+ * of the high watermark).
+ */
+static OverloadWatermark
+ParseWatermark(LineParser &line, std::size_t max=0)
+{
+	OverloadWatermark w;
+	w.high = line.NextPositiveInteger();
+	w.low = line.IsEnd()
+		? w.high * 9 / 10
+		: line.NextPositiveInteger();
+	line.ExpectEnd();
+
+	if (max > 0 && w.high > max)
+		throw LineParser::Error{"Value too large"};
+
+	if (w.low > w.high)
+		throw LineParser::Error{"Low watermark is larger than high watermark"};
+
+	return w;
+}
+
+/**
+ * Parse a CPU list like "2-5,7".
+ */
+static std::vector<unsigned>
+ParseCpuList(const char *p)
+{
+	std::vector<unsigned> result;
+
+	while (true) {
+		const unsigned first = ParseCpuNumber(p);
+		unsigned last = first;
+
+		if (*p == '-') {
+			++p;
+			last = ParseCpuNumber(p);
+			if (last < first)
+				throw LineParser::Error{"Invalid CPU range"};
+		}
+
+		for (unsigned i = first; i <= last; ++i)
+			result.push_back(i);
+
+		if (*p == 0)
+			return result;
+
+		if (*p != ',')
+			throw LineParser::Error{"Malformed CPU list"};
+
+		++p;
 	}
 }
 
+static void
+LoadKeyFile(std::span<std::byte> dest, const char *path)
+{
+	const auto fd = OpenReadOnly(path);
+
+	/* use a larger buffer to detect files which are too large */
+	std::array<std::byte, 256> buffer;
+	const auto nbytes = fd.Read(buffer);
+	if (nbytes < 0)
+		throw FmtErrno("Failed to read {:?}", path);
+
+	if (static_cast<std::size_t>(nbytes) != dest.size())
+		throw FmtRuntimeError("Key file {:?} must contain exactly {} bytes",
+				      path, dest.size());
+
+	std::copy_n(buffer.begin(), dest.size(), dest.begin());
+}
+
 class MyConfigParser final : public ConfigParser {
 	Config &config;
 
@@ -52,6 +153,12 @@ MyConfigParser::ParseLine(FileLineParser &line)
 		line.ExpectEnd();
 
 		config.knock_listener.bind_address = IPv4Address{port};
+	} else if (StringIsEqual(word, "knock_cookie_lifetime")) {
+		config.knock_cookie_lifetime = std::chrono::seconds{line.NextPositiveInteger()};
+		line.ExpectEnd();
+	} else if (StringIsEqual(word, "knock_cookie_key_file")) {
+		LoadKeyFile(config.knock_cookie_key, line.ExpectValueAndEnd());
+		config.have_knock_cookie_key = true;
 	} else if (StringIsEqual(word, "knock_nft_set")) {
 		config.knock_nft_set = line.ExpectValueAndEnd();
 	} else if (StringIsEqual(word, "user_database")) {
@@ -62,22 +169,126 @@ MyConfigParser::ParseLine(FileLineParser &line)
 	} else if (StringIsEqual(word, "game_server")) {
 		const char *value = line.ExpectValue();
 
-		static constexpr struct addrinfo hints = {
-			.ai_flags = AI_ADDRCONFIG,
-			.ai_family = AF_UNSPEC,
-			.ai_socktype = SOCK_STREAM,
-		};
-
-		config.game_server = Resolve(value, 2593, &hints).GetBest();
+		config.game_server_host = value;
+		config.game_server = ResolveGameServer(value);
 
 		if (!line.IsEnd()) {
 			value = line.ExpectValueAndEnd();
 
-			config.server_list.emplace_back(value, std::move(config.game_server));
+			config.server_list.emplace_back(value,
+							config.game_server_host,
+							config.game_server);
 		}
+	} else if (StringIsEqual(word, "game_server_handoff")) {
+		const char *value = line.ExpectValueAndEnd();
+
+		/* abstract sockets have no permissions, and any
+		   local process could bind the name and receive
+		   the clients' passwords */
+		if (*value != '/')
+			throw LineParser::Error{"Absolute socket path expected"};
+
+		config.game_server_handoff.SetLocal(value);
 	} else if (StringIsEqual(word, "send_remote_ip")) {
 		config.send_remote_ip = line.NextBool();
 		line.ExpectEnd();
+	} else if (StringIsEqual(word, "proxy_protocol")) {
+		config.proxy_protocol = line.NextBool();
+		line.ExpectEnd();
+	} else if (StringIsEqual(word, "send_proxy_protocol")) {
+		config.send_proxy_protocol = line.NextBool();
+		line.ExpectEnd();
+	} else if (StringIsEqual(word, "relay_edge_triggered")) {
+		config.relay_edge_triggered = line.NextBool();
+		line.ExpectEnd();
+	} else if (StringIsEqual(word, "max_tracked_users")) {
+		config.max_tracked_users = line.NextPositiveInteger();
+		line.ExpectEnd();
+	} else if (StringIsEqual(word, "tcp_info_samples")) {
+		config.tcp_info_samples = line.NextPositiveInteger();
+		line.ExpectEnd();
+	} else if (StringIsEqual(word, "verify_threads")) {
+		config.verify_threads_min = line.NextPositiveInteger();
+		config.verify_threads_max = line.IsEnd()
+			? config.verify_threads_min
+			: line.NextPositiveInteger();
+		line.ExpectEnd();
+
+		if (config.verify_threads_max < config.verify_threads_min)
+			throw LineParser::Error{"Maximum is smaller than minimum"};
+	} else if (StringIsEqual(word, "overload_connections")) {
+		config.overload.connections = ParseWatermark(line);
+	} else if (StringIsEqual(word, "overload_verify_jobs")) {
+		config.overload.verify_jobs = ParseWatermark(line);
+	} else if (StringIsEqual(word, "overload_fd_percent")) {
+		config.overload.fd_percent = ParseWatermark(line, 100);
+	} else if (StringIsEqual(word, "verify_memory")) {
+		config.verify_memory = std::size_t{line.NextPositiveInteger()} << 20;
+		line.ExpectEnd();
+	} else if (StringIsEqual(word, "verify_inline_memory")) {
+		config.verify_inline_memory = std::size_t{line.NextPositiveInteger()} << 10;
+		line.ExpectEnd();
+	} else if (StringIsEqual(word, "verify_cpus")) {
+		config.verify_cpus = ParseCpuList(line.ExpectValueAndEnd());
+	} else if (StringIsEqual(word, "handover_socket")) {
+		config.handover_socket = line.ExpectValueAndEnd();
+	} else if (StringIsEqual(word, "persist_client_accounting")) {
+		const bool value = line.NextBool();
+		line.ExpectEnd();
+
+		config.client_accounting_snapshot.clear();
+
+		if (value) {
+			const char *runtime_directory = getenv("RUNTIME_DIRECTORY");
+			if (runtime_directory == nullptr)
+				throw LineParser::Error{"No RUNTIME_DIRECTORY"};
+
+			config.client_accounting_snapshot = fmt::format("{}/client-accounting.snapshot"sv,
+									 runtime_directory);
+		}
+	} else if (StringIsEqual(word, "client_accounting_snapshot_interval")) {
+		config.client_accounting_snapshot_interval = std::chrono::seconds{line.NextPositiveInteger()};
+		line.ExpectEnd();
+	} else if (StringIsEqual(word, "resolve_interval")) {
+		const char *value = line.ExpectValueAndEnd();
+		char *endptr;
+		const unsigned long seconds = strtoul(value, &endptr, 10);
+		if (endptr == value || *endptr != 0)
+			throw LineParser::Error{"Number of seconds expected"};
+
+		config.resolve_interval = std::chrono::seconds{seconds};
+	} else if (StringIsEqual(word, "login_server_mode")) {
+		config.login_server_mode = line.NextBool();
+		line.ExpectEnd();
+	} else if (StringIsEqual(word, "auth_ticket_key_file")) {
+		LoadKeyFile(config.auth_ticket_key, line.ExpectValueAndEnd());
+		config.have_auth_ticket_key = true;
+	} else if (StringIsEqual(word, "cluster_listen")) {
+		const char *value = line.ExpectValueAndEnd();
+
+		static constexpr struct addrinfo hints = {
+			.ai_flags = AI_ADDRCONFIG|AI_PASSIVE,
+			.ai_family = AF_UNSPEC,
+			.ai_socktype = SOCK_DGRAM,
+		};
+
+		config.cluster_listener.bind_address = ParseSocketAddress(value, 2594, hints);
+	} else if (StringIsEqual(word, "cluster_peer")) {
+		const char *value = line.ExpectValueAndEnd();
+
+		static constexpr struct addrinfo hints = {
+			.ai_flags = AI_ADDRCONFIG,
+			.ai_family = AF_UNSPEC,
+			.ai_socktype = SOCK_DGRAM,
+		};
+
+		config.cluster_peers.emplace_back(Resolve(value, 2594, &hints).GetBest());
+	} else if (StringIsEqual(word, "cluster_key_file")) {
+		LoadKeyFile(config.cluster_key, line.ExpectValueAndEnd());
+		config.have_cluster_key = true;
+	} else if (StringIsEqual(word, "cluster_bandwidth")) {
+		config.cluster_bandwidth = line.NextPositiveInteger();
+		line.ExpectEnd();
 	} else if (StringIsEqual(word, "prometheus_exporter")) {
 		const char *value = line.ExpectValueAndEnd();
 
@@ -100,9 +311,46 @@ MyConfigParser::Finish()
 
 	config.listener.Fixup();
 	config.knock_listener.Fixup();
+	config.cluster_listener.Fixup();
+
+	if (!config.cluster_listener.bind_address.IsNull() &&
+	    !config.have_cluster_key)
+		throw "No cluster_key_file setting";
 
-	if (config.game_server.IsNull())
+	if (config.knock_cookie_lifetime.count() > 0 &&
+	    !config.have_knock_cookie_key)
+		throw "No knock_cookie_key_file setting";
+
+	if (config.game_server.empty())
 		throw "No game_server setting";
+
+	/* with a server list, the client reconnects to the selected
+	   game server, and there is nothing to hand off */
+	if (!config.game_server_handoff.IsNull() &&
+	    (!config.server_list.empty() || config.login_server_mode))
+		throw "game_server_handoff not possible with a server list or login_server_mode";
+
+	if (config.login_server_mode) {
+		if (!config.have_auth_ticket_key)
+			throw "No auth_ticket_key_file setting";
+
+		/* the client connects to the game server itself, and
+		   the Relay packet has room only for an IPv4
+		   address */
+		if (IsLocalGameServer(config.game_server_host.c_str()))
+			throw "Local game_server not possible with login_server_mode";
+
+		for (const auto &i : config.server_list)
+			if (IsLocalGameServer(i.host.c_str()))
+				throw "Local game_server not possible with login_server_mode";
+
+		/* the client needs a server list to select the
+		   game server */
+		if (config.server_list.empty())
+			config.server_list.emplace_back("Game Server",
+							config.game_server_host,
+							config.game_server);
+	}
 }
 
 Config
@@ -3,19 +3,37 @@
 
 #pragma once
 
+#include "AuthTicket.hxx"
+#include "OverloadConfig.hxx"
 #include "net/AllocatedSocketAddress.hxx"
 #include "net/SocketConfig.hxx"
 
+#include <array>
+#include <chrono>
+#include <cstddef>
 #include <string>
 #include <vector>
 
 struct GameServerConfig {
 	const std::string name;
-	AllocatedSocketAddress address;
+
+	/**
+	 * The host name as specified in the configuration file; it is
+	 * resolved again periodically (see #Reresolver).
+	 */
+	std::string host;
+
+	/**
+	 * All addresses #host resolved to, in Happy Eyeballs order
+	 * (see InterleaveAddressFamilies()).  Never empty.
+	 */
+	std::vector<AllocatedSocketAddress> addresses;
 
 	[[nodiscard]]
-	GameServerConfig(const char *_name, SocketAddress _address) noexcept
-		:name(_name), address(_address) {}
+	GameServerConfig(const char *_name, std::string _host,
+			 std::vector<AllocatedSocketAddress> _addresses) noexcept
+		:name(_name), host(std::move(_host)),
+		 addresses(std::move(_addresses)) {}
 };
 
 struct Config {
@@ -39,14 +57,168 @@ struct Config {
 
 	std::string user_database;
 
-	AllocatedSocketAddress game_server;
+	/**
+	 * The "game_server" host name and all of its addresses (see
+	 * #GameServerConfig).
+	 */
+	std::string game_server_host;
+	std::vector<AllocatedSocketAddress> game_server;
 
 	std::vector<GameServerConfig> server_list;
 
+	/**
+	 * If set, then authenticated clients are passed to the game
+	 * server on this host over this local socket instead of
+	 * being relayed (see GameServerHandoff.hxx).  This cannot be
+	 * combined with a server list.  This is always a path (never
+	 * an abstract socket), so filesystem permissions control who
+	 * may receive the clients.
+	 */
+	AllocatedSocketAddress game_server_handoff;
+
+	/**
+	 * The maximum number of usernames tracked by
+	 * #UserAccounting.
+	 */
+	std::size_t max_tracked_users = 65536;
+
+	/**
+	 * The maximum number of relays whose TCP_INFO is sampled per
+	 * second (see #TcpInfoSampler).
+	 */
+	std::size_t tcp_info_samples = 64;
+
+	/**
+	 * When to stop accepting new connections (see
+	 * #OverloadController).
+	 */
+	OverloadConfig overload;
+
+	/**
+	 * The number of password verification threads (see
+	 * #VerifyPool).
+	 */
+	unsigned verify_threads_min = 1, verify_threads_max;
+
+	/**
+	 * The CPUs the password verification threads are pinned to.
+	 * If not empty, the main thread is pinned to all other CPUs.
+	 */
+	std::vector<unsigned> verify_cpus;
+
+	/**
+	 * The maximum memory used by concurrent password
+	 * verifications [bytes] (see #VerifyPool); 0 means unlimited.
+	 */
+	std::size_t verify_memory = 0;
+
+	/**
+	 * Password hashes which need no more than this amount of
+	 * memory [bytes] (and only few passes) are verified in the
+	 * #EventLoop thread; 0 disables this.
+	 */
+	std::size_t verify_inline_memory = 0;
+
+	/**
+	 * The path of the socket used to hand over all sockets to a
+	 * new process during a binary upgrade (see Handover.hxx).
+	 * Empty means disabled.
+	 */
+	std::string handover_socket;
+
+	/**
+	 * The path of the control socket which dumps the connection
+	 * and accounting tables (see #ControlListener).  It is
+	 * created in RUNTIME_DIRECTORY; empty means disabled.
+	 */
+	std::string control_socket;
+
+	/**
+	 * The path of the #ClientAccountingMap snapshot file.  Empty
+	 * means the map is not persisted.
+	 */
+	std::string client_accounting_snapshot;
+
+	std::chrono::seconds client_accounting_snapshot_interval{60};
+
+	/**
+	 * The lifetime of knock cookies (see KnockCookies.hxx).  Zero
+	 * disables knock cookies.
+	 */
+	std::chrono::seconds knock_cookie_lifetime{};
+
+	/**
+	 * The master key for knock cookies (loaded from
+	 * "knock_cookie_key_file").
+	 */
+	std::array<std::byte, 32> knock_cookie_key;
+	bool have_knock_cookie_key = false;
+
+	/**
+	 * How often are "game_server" host names resolved again?
+	 * Zero disables re-resolution.
+	 */
+	std::chrono::seconds resolve_interval{60};
+
+	/**
+	 * The UDP socket which exchanges client accounting changes
+	 * with other nodes (see #Cluster).  If no address is
+	 * configured, then the cluster is disabled.
+	 */
+	SocketConfig cluster_listener{
+		.reuse_port = true,
+	};
+
+	std::vector<AllocatedSocketAddress> cluster_peers;
+
+	/**
+	 * The shared key which authenticates cluster datagrams
+	 * (loaded from "cluster_key_file").
+	 */
+	std::array<std::byte, 32> cluster_key;
+	bool have_cluster_key = false;
+
+	/**
+	 * The maximum number of bytes per second sent to all cluster
+	 * peers together.
+	 */
+	std::size_t cluster_bandwidth = 256 * 1024;
+
 	bool auto_reload_user_database = false;
 
 	bool send_remote_ip = false;
 
+	/**
+	 * Expect a PROXY protocol v2 header from a load balancer on
+	 * each new connection?
+	 */
+	bool proxy_protocol = false;
+
+	/**
+	 * Send a PROXY protocol v2 header to the game server (instead
+	 * of the "REMOTE_IP" extended packet)?
+	 */
+	bool send_proxy_protocol = false;
+
+	/**
+	 * Register relayed sessions edge-triggered (see
+	 * #RelayConnection)?
+	 */
+	bool relay_edge_triggered = false;
+
+	/**
+	 * Complete the login server protocol and send a 0x8c Relay
+	 * packet with an auth ticket instead of forwarding the game
+	 * session (see AuthTicket.hxx).
+	 */
+	bool login_server_mode = false;
+
+	/**
+	 * Loaded from "auth_ticket_key_file".
+	 */
+	AuthTicketKey auth_ticket_key;
+	bool have_auth_ticket_key = false;
+
 	Config() noexcept;
 };
 
@@ -2,38 +2,60 @@
 // author: Max Kellermann <max.kellermann@gmail.com>
 
 #include "Connection.hxx"
+#include "AuthTicket.hxx"
 #include "Config.hxx"
+#include "GameServerHandoff.hxx"
 #include "Instance.hxx"
+#include "JsonString.hxx"
+#include "Listener.hxx"
+#include "LoopStats.hxx"
+#include "Probes.hxx"
+#include "ProxyProtocol.hxx"
+#include "ServerList.hxx"
+#include "Username.hxx"
 #include "Validate.hxx"
 #include "uo/Command.hxx"
 #include "uo/Packets.hxx"
 #include "uo/String.hxx"
 #include "lib/fmt/ExceptionFormatter.hxx"
 #include "lib/fmt/SocketAddressFormatter.hxx"
+#include "net/IPv4Address.hxx"
+#include "net/IPv6Address.hxx"
 #include "net/ToString.hxx"
 #include "net/UniqueSocketDescriptor.hxx"
 #include "io/Iovec.hxx"
+#include "time/Cast.hxx"
 #include "util/PrintException.hxx"
 #include "util/ScopeExit.hxx"
 #include "util/SpanCast.hxx"
 
-#include <fmt/core.h>
+#include <fmt/format.h>
 
+#include <algorithm> // for std::copy()
+#include <iterator> // for std::back_inserter()
 #include <span>
 #include <string_view>
 
-Connection::Connection(Instance &_instance,
+Connection::Connection(Instance &_instance, Listener &_listener,
 		       PerClientAccounting *per_client,
 		       UniqueSocketDescriptor &&_fd,
-		       SocketAddress address) noexcept
-	:instance(_instance),
+		       SocketAddress address,
+		       std::span<const std::byte> initial_data) noexcept
+	:instance(_instance), listener(_listener),
+	 config(instance.GetConfigPtr()),
 	 remote_address(address),
+	 start_time(instance.GetEventLoop().SteadyNow()),
 	 incoming(instance.GetEventLoop(), BIND_THIS_METHOD(OnIncomingReady),
 		  _fd.Release()),
 	 outgoing(instance.GetEventLoop(), BIND_THIS_METHOD(OnOutgoingReady)),
 	 connect(instance.GetEventLoop(), *this),
 	 timeout(instance.GetEventLoop(), BIND_THIS_METHOD(OnTimeout))
 {
+	assert(initial_data.size() <= initial_packets.size());
+	std::copy(initial_data.begin(), initial_data.end(),
+		  initial_packets.begin());
+	initial_packets_fill = initial_data.size();
+
 	++instance.metrics.client_connections;
 	++instance.metrics.client_connections_accepted;
 
@@ -50,6 +72,8 @@ Connection::Connection(Instance &_instance,
 
 Connection::~Connection() noexcept
 {
+	instance.OnConnectionDestroyed(*this);
+
 	if (cancel_ptr)
 		cancel_ptr.Cancel();
 
@@ -58,37 +82,48 @@ Connection::~Connection() noexcept
 		--instance.metrics.server_connections;
 	}
 
-	incoming.Close();
+	/* the socket is undefined after StartRelay() */
+	if (incoming.IsDefined())
+		incoming.Close();
+
 	--instance.metrics.client_connections;
 }
 
-struct ExpectedPackets {
-	struct uo_packet_seed seed;
-	struct uo_packet_account_login login;
-};
-
-static bool
-DoSpliceSend(SocketEvent &from, SocketEvent &to, Splice &s)
+void
+Connection::DumpJson(std::string &out, Event::TimePoint now) const noexcept
 {
-	switch (s.SendTo(to.GetSocket())) {
-	case Splice::SendResult::OK:
-		to.CancelOnlyWrite();
-		break;
+	static constexpr const char *state_names[] = {
+		"initial",
+		"check_credentials",
+		"server_list",
+		"connecting",
+		"send_play_server",
+	};
 
-	case Splice::SendResult::PARTIAL:
-	case Splice::SendResult::SOCKET_BLOCKING:
-		from.CancelOnlyRead();
-		to.ScheduleWrite();
-		break;
+	fmt::format_to(std::back_inserter(out),
+		       R"({{"type":"connection","state":"{}","age":{:.3f},"client":)",
+		       state_names[static_cast<std::size_t>(state)],
+		       ToFloatSeconds(now - start_time));
 
-	case Splice::SendResult::ERROR:
-		// TODO errno
-		return false;
-	}
+	/* the address of a local socket may contain anything */
+	AppendJsonString(out, ToString(remote_address));
+	out.append("}\n");
+}
 
-	return true;
+inline void
+Connection::SetState(State new_state) noexcept
+{
+	UOLOGIN_PROBE(connection_state, this,
+		      static_cast<unsigned>(state),
+		      static_cast<unsigned>(new_state));
+	state = new_state;
 }
 
+struct ExpectedPackets {
+	struct uo_packet_seed seed;
+	struct uo_packet_account_login login;
+};
+
 inline bool
 Connection::SendAccountLoginReject() noexcept
 {
@@ -105,36 +140,24 @@ Connection::SendServerList() noexcept
 {
 	assert(initial_packets_fill == initial_packets.size());
 
-	const auto &server_list = instance.GetConfig().server_list;
+	const auto &server_list = config->server_list;
 	assert(!server_list.empty());
 
-	const std::size_t size = sizeof(struct uo_packet_server_list) +
-		(server_list.size() - 1) * sizeof(struct uo_fragment_server_info);
-	auto &packet = *reinterpret_cast<struct uo_packet_server_list *>(malloc(size));
-	AtScopeExit(&packet) { free(&packet); };
-
-	memset(&packet, 0, size);
+	const LoopStats::Scope loop_scope{instance.GetLoopStats(),
+					  LoopCategory::SERVER_LIST};
 
-	packet.cmd = UO::Command::ServerList;
-	packet.length = size;
-	packet.unknown_0x5d = 0x5d;
-	packet.num_game_servers = server_list.size();
+	const std::size_t size = GetServerListPacketSize(server_list.size());
+	auto *buffer = static_cast<std::byte *>(malloc(size));
+	AtScopeExit(buffer) { free(buffer); };
 
-	for (unsigned i = 0; i < server_list.size(); ++i) {
-		const auto &src = server_list[i];
-		auto &dst = packet.game_servers[i];
+	const auto packet = FormatServerList({buffer, size}, server_list);
 
-		dst.index = i;
-		snprintf(dst.name, sizeof(dst.name), "%s", src.name.c_str());
-		dst.address = 0xdeadbeef;
-	}
-
-	if (incoming.GetSocket().Send(std::span{reinterpret_cast<std::byte *>(&packet), size}, MSG_DONTWAIT) < 0) {
+	if (incoming.GetSocket().Send(packet, MSG_DONTWAIT) < 0) {
 		Destroy();
 		return;
 	}
 
-	state = State::SERVER_LIST;
+	SetState(State::SERVER_LIST);
 	incoming.ScheduleRead();
 	timeout.Schedule(std::chrono::minutes{1});
 }
@@ -143,7 +166,7 @@ inline void
 Connection::ReceivePlayServer() noexcept
 {
 	assert(state == State::SERVER_LIST);
-	assert(!instance.GetConfig().server_list.empty());
+	assert(!config->server_list.empty());
 	assert(initial_packets_fill == initial_packets.size());
 
 	struct uo_packet_play_server packet;
@@ -151,20 +174,107 @@ Connection::ReceivePlayServer() noexcept
 	const auto nbytes = incoming.GetSocket().ReadNoWait(ReferenceAsWritableBytes(packet));
 	if (nbytes <= 0 || static_cast<std::size_t>(nbytes) != sizeof(packet) ||
 	    packet.cmd != UO::Command::PlayServer ||
-	    packet.index >= instance.GetConfig().server_list.size()) [[unlikely]] {
+	    packet.index >= config->server_list.size()) [[unlikely]] {
 		Destroy();
 		return;
 	}
 
-	outgoing_address = instance.GetConfig().server_list[packet.index].address;
+	outgoing_addresses = config->server_list[packet.index].addresses;
 
 	incoming.CancelOnlyRead();
 	timeout.Cancel();
 
+	if (config->login_server_mode) {
+		/* let the client connect to the game server
+		   directly */
+		SendRelay();
+		return;
+	}
+
 	/* connect to the actual game server */
-	state = State::CONNECTING;
+	SetState(State::CONNECTING);
 	send_play_server = true;
-	connect.Connect(outgoing_address, std::chrono::seconds{10});
+	connect.Connect(outgoing_addresses, std::chrono::seconds{10});
+}
+
+/**
+ * Convert the address to IPv4 (the 0x8c Relay packet supports
+ * nothing else).
+ *
+ * @return a null address on error
+ */
+static IPv4Address
+ToRelayAddress(SocketAddress address) noexcept
+{
+	switch (address.GetFamily()) {
+	case AF_INET:
+		return IPv4Address::Cast(address);
+
+	case AF_INET6:
+		if (const auto &v6 = IPv6Address::Cast(address); v6.IsV4Mapped())
+			return v6.UnmapV4();
+
+		break;
+	}
+
+	return IPv4Address{0, 0, 0, 0, 0};
+}
+
+/**
+ * Find the first address in the list which can be sent in a 0x8c
+ * Relay packet.
+ *
+ * @return a null address if there is none
+ */
+static IPv4Address
+ToRelayAddress(std::span<const AllocatedSocketAddress> addresses) noexcept
+{
+	for (const SocketAddress i : addresses)
+		if (const auto v4 = ToRelayAddress(i); v4.GetPort() != 0)
+			return v4;
+
+	return IPv4Address{0, 0, 0, 0, 0};
+}
+
+inline void
+Connection::SendRelay() noexcept
+{
+	assert(state == State::SERVER_LIST);
+	assert(config->login_server_mode);
+
+	const auto game_server = ToRelayAddress(outgoing_addresses);
+	if (game_server.GetPort() == 0) [[unlikely]] {
+		fmt::print(stderr, "Cannot relay to non-IPv4 game server {}\n",
+			   SocketAddress{outgoing_addresses.front()});
+		Destroy();
+		return;
+	}
+
+	const auto &packets = *reinterpret_cast<const ExpectedPackets *>(initial_packets.data());
+	UpperUsernameBuffer upper_username_buffer;
+	const auto upper_username = ToUpperUsername(upper_username_buffer,
+						    UO::ExtractString(packets.login.credentials.username));
+
+	const struct uo_packet_relay relay{
+		.cmd = UO::Command::Relay,
+		.ip = game_server.GetNumericAddress(),
+		.port = game_server.GetPort(),
+		.auth_id = MakeAuthTicket(config->auth_ticket_key,
+					  remote_address, upper_username,
+					  std::chrono::system_clock::now()),
+	};
+
+	if (incoming.GetSocket().Send(ReferenceAsBytes(relay), MSG_DONTWAIT) < 0) {
+		Destroy();
+		return;
+	}
+
+	++instance.metrics.relayed_logins;
+
+	/* the client will close this connection and connect to the
+	   game server */
+	incoming.GetSocket().ShutdownWrite();
+	Destroy();
 }
 
 inline void
@@ -188,6 +298,24 @@ Connection::ReceiveLoginPackets() noexcept
 	if (initial_packets_fill < initial_packets.size())
 		return;
 
+	OnLoginPackets();
+}
+
+void
+Connection::OnInitialData() noexcept
+{
+	assert(state == State::INITIAL);
+
+	if (initial_packets_fill == initial_packets.size())
+		OnLoginPackets();
+}
+
+inline void
+Connection::OnLoginPackets() noexcept
+{
+	assert(state == State::INITIAL);
+	assert(initial_packets_fill == initial_packets.size());
+
 	incoming.CancelOnlyRead();
 	timeout.Cancel();
 
@@ -214,7 +342,7 @@ Connection::ReceiveLoginPackets() noexcept
 		return;
 	}
 
-	state = State::CHECK_CREDENTIALS;
+	SetState(State::CHECK_CREDENTIALS);
 
 	try {
 		instance.GetDatabase().CheckCredentials(username, password,
@@ -233,6 +361,9 @@ Connection::ReceiveLoginPackets() noexcept
 inline void
 Connection::OnCheckCredentials(std::string_view username, bool result) noexcept
 {
+	const LoopStats::Scope loop_scope{instance.GetLoopStats(),
+					  LoopCategory::LOGIN};
+
 	assert(state == State::CHECK_CREDENTIALS);
 
 	cancel_ptr = {};
@@ -241,6 +372,7 @@ Connection::OnCheckCredentials(std::string_view username, bool result) noexcept
 		fmt::print(stderr, "Bad password for user {:?} from {}\n",
 			   username, remote_address);
 		++instance.metrics.rejected_logins;
+		instance.GetHeavyHitters().AddRejectedUsername(username);
 
 		accounting.UpdateTokenBucket(5);
 
@@ -255,21 +387,26 @@ Connection::OnCheckCredentials(std::string_view username, bool result) noexcept
 		   username, remote_address);
 	++instance.metrics.accepted_logins;
 
-	if (!instance.GetConfig().server_list.empty()) {
+	if (!config->server_list.empty()) {
 		SendServerList();
 		return;
 	}
 
+	if (!config->game_server_handoff.IsNull() && HandOff())
+		return;
+
 	/* connect to the actual game server */
-	state = State::CONNECTING;
-	incoming.ScheduleRead();
-	outgoing_address = instance.GetConfig().game_server;
-	connect.Connect(outgoing_address, std::chrono::seconds{10});
+	SetState(State::CONNECTING);
+	outgoing_addresses = config->game_server;
+	connect.Connect(outgoing_addresses, std::chrono::seconds{10});
 }
 
 void
 Connection::OnIncomingReady(unsigned events) noexcept
 {
+	const LoopStats::Scope loop_scope{instance.GetLoopStats(),
+					  LoopCategory::LOGIN};
+
 	if (events & incoming.DEAD_MASK) {
 		if (state == State::INITIAL)
 			accounting.UpdateTokenBucket(4);
@@ -278,60 +415,26 @@ Connection::OnIncomingReady(unsigned events) noexcept
 		return;
 	}
 
-	assert(!connect.IsPending());
-
-	if (state == State::INITIAL) {
+	switch (state) {
+	case State::INITIAL:
 		/* read the initial packets (SEED and ACCOUNT_LOGIN)
 		   from the socket */
 		assert(events & incoming.READ);
 		ReceiveLoginPackets();
 		return;
-	} else if (state == State::SERVER_LIST) {
+
+	case State::SERVER_LIST:
 		assert(events & incoming.READ);
 		ReceivePlayServer();
 		return;
-	}
-
-	if (events & incoming.WRITE) {
-		if (!DoSpliceSend(outgoing, incoming, splice_out_in)) {
-			Destroy();
-			return;
-		}
-	}
-
-	if (events & incoming.READ) {
-		splice_in_out.received_bytes = 0;
-		switch (splice_in_out.ReceiveFrom(instance.GetPipeStock(), incoming.GetSocket())) {
-		case Splice::ReceiveResult::OK:
-			instance.metrics.client_bytes += splice_in_out.received_bytes;
-
-			if (!DoSpliceSend(incoming, outgoing, splice_in_out)) {
-				Destroy();
-				return;
-			}
-
-			break;
-
-		case Splice::ReceiveResult::SOCKET_BLOCKING:
-			break;
-
-		case Splice::ReceiveResult::SOCKET_CLOSED:
-			/* close connection with FIN, not RST */
-			outgoing.GetSocket().ShutdownWrite();
-
-			Destroy();
-			return;
-
-		case Splice::ReceiveResult::PIPE_FULL:
-			assert(outgoing.IsWritePending());
-			incoming.CancelOnlyRead();
-			return;
 
-		case Splice::ReceiveResult::ERROR:
-			// TODO errno
-			Destroy();
-			return;
-		}
+	case State::CHECK_CREDENTIALS:
+	case State::CONNECTING:
+	case State::SEND_PLAY_SERVER:
+		/* the client has sent more data early; leave it in
+		   the socket for the #RelayConnection */
+		incoming.CancelOnlyRead();
+		return;
 	}
 }
 
@@ -351,6 +454,19 @@ Discard(SocketDescriptor socket, std::size_t n) noexcept
 	return true;
 }
 
+inline void
+Connection::StartRelay(UniqueSocketDescriptor &&outgoing_fd) noexcept
+{
+	timeout.Cancel();
+
+	UOLOGIN_PROBE(connection_handoff, this, "relay");
+
+	listener.AddRelay(accounting.GetPerClient(),
+			  UniqueSocketDescriptor{AdoptTag{}, incoming.ReleaseSocket()},
+			  std::move(outgoing_fd));
+	Destroy();
+}
+
 inline void
 Connection::ReceiveServerList() noexcept
 {
@@ -385,15 +501,20 @@ Connection::ReceiveServerList() noexcept
 		return;
 	}
 
-	incoming.ScheduleRead();
-	state = State::READY;
+	/* the #RelayConnection accounts this socket from now on */
+	--instance.metrics.server_connections;
+	StartRelay(UniqueSocketDescriptor{AdoptTag{}, outgoing.ReleaseSocket()});
 }
 
 void
 Connection::OnOutgoingReady(unsigned events) noexcept
 {
+	const LoopStats::Scope loop_scope{instance.GetLoopStats(),
+					  LoopCategory::LOGIN};
+
 	assert(incoming.IsDefined());
 	assert(!connect.IsPending());
+	assert(state == State::SEND_PLAY_SERVER);
 
 	if (events & outgoing.DEAD_MASK) {
 		accounting.UpdateTokenBucket(5);
@@ -401,54 +522,7 @@ Connection::OnOutgoingReady(unsigned events) noexcept
 		return;
 	}
 
-	if (state == State::SEND_PLAY_SERVER) {
-		ReceiveServerList();
-		return;
-	}
-
-	assert(state == State::READY);
-
-	if (events & outgoing.WRITE) {
-		if (!DoSpliceSend(incoming, outgoing, splice_in_out)) {
-			Destroy();
-			return;
-		}
-	}
-
-	if (events & outgoing.READ) {
-		splice_out_in.received_bytes = 0;
-		switch (splice_out_in.ReceiveFrom(instance.GetPipeStock(), outgoing.GetSocket())) {
-		case Splice::ReceiveResult::OK:
-			instance.metrics.server_bytes += splice_out_in.received_bytes;
-
-			if (!DoSpliceSend(outgoing, incoming, splice_out_in)) {
-				Destroy();
-				return;
-			}
-
-			break;
-
-		case Splice::ReceiveResult::SOCKET_BLOCKING:
-			break;
-
-		case Splice::ReceiveResult::SOCKET_CLOSED:
-			/* close connection with FIN, not RST */
-			incoming.GetSocket().ShutdownWrite();
-
-			Destroy();
-			return;
-
-		case Splice::ReceiveResult::PIPE_FULL:
-			assert(incoming.IsWritePending());
-			outgoing.CancelOnlyRead();
-			return;
-
-		case Splice::ReceiveResult::ERROR:
-			// TODO errno
-			Destroy();
-			return;
-		}
-	}
+	ReceiveServerList();
 }
 
 void
@@ -469,11 +543,21 @@ Connection::SendInitialPackets(SocketDescriptor socket) noexcept
 	std::array<struct iovec, 5> v;
 	std::size_t n = 0;
 
+	std::array<std::byte, MAX_FORMATTED_PROXY_HEADER_SIZE> proxy_header;
+	if (config->send_proxy_protocol) {
+		/* the PROXY header must be the very first thing on
+		   the connection */
+		const auto local_address = incoming.GetSocket().GetLocalAddress();
+		const std::size_t proxy_header_size =
+			FormatProxyHeader(proxy_header, remote_address, local_address);
+		v[n++] = MakeIovec(std::span{proxy_header}.first(proxy_header_size));
+	}
+
 	v[n++] = MakeIovec(ReferenceAsBytes(packets.seed));
 
 	struct uo_packet_extended remote_ip_header;
 	std::string remote_ip_buffer;
-	if (instance.GetConfig().send_remote_ip) {
+	if (config->send_remote_ip && !config->send_proxy_protocol) {
 		if (const auto remote_ip = HostToString(remote_address); !remote_ip.empty()) {
 			remote_ip_buffer = fmt::format("REMOTE_IP={}", remote_ip);
 			remote_ip_header = {
@@ -492,6 +576,33 @@ Connection::SendInitialPackets(SocketDescriptor socket) noexcept
 	return socket.Send(std::span{v}.first(n), MSG_DONTWAIT) > 0;
 }
 
+inline bool
+Connection::HandOff() noexcept
+{
+	assert(initial_packets_fill == initial_packets.size());
+
+	try {
+		SendGameServerHandoff(instance.GetHandoffSocket(),
+				      config->game_server_handoff,
+				      remote_address, initial_packets,
+				      incoming.GetSocket());
+	} catch (...) {
+		/* fall back to relaying */
+		++instance.metrics.handoff_errors;
+		fmt::print(stderr, "Failed to hand off connection from {}: {}\n",
+			   remote_address, std::current_exception());
+		return false;
+	}
+
+	++instance.metrics.handed_off_logins;
+	UOLOGIN_PROBE(connection_handoff, this, "game_server");
+
+	/* the game server owns the client socket now; closing our
+	   copy does not affect it */
+	Destroy();
+	return true;
+}
+
 void
 Connection::OnSocketConnectSuccess(UniqueSocketDescriptor fd) noexcept
 {
@@ -503,18 +614,23 @@ Connection::OnSocketConnectSuccess(UniqueSocketDescriptor fd) noexcept
 		return;
 	}
 
-	++instance.metrics.server_connections;
 	++instance.metrics.server_connections_established;
 
-	outgoing.Open(fd.Release());
-	outgoing.ScheduleRead();
+	if (connect.WasRaced())
+		++instance.metrics.happy_eyeballs_races;
+	if (connect.IsFallback())
+		++instance.metrics.happy_eyeballs_fallbacks;
 
-	if (send_play_server) {
-		state = State::SEND_PLAY_SERVER;
-	} else {
-		incoming.ScheduleRead();
-		state = State::READY;
+	if (!send_play_server) {
+		StartRelay(std::move(fd));
+		return;
 	}
+
+	++instance.metrics.server_connections;
+
+	outgoing.Open(fd.Release());
+	outgoing.ScheduleRead();
+	SetState(State::SEND_PLAY_SERVER);
 }
 
 void
@@ -525,7 +641,7 @@ Connection::OnSocketConnectError(std::exception_ptr e) noexcept
 	++instance.metrics.server_connections_failed;
 
 	fmt::print(stderr, "Failed to connect to {}: {}\n",
-		   outgoing_address, std::move(e));
+		   connect.GetAddress(), std::move(e));
 
 	Destroy();
 }
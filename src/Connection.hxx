@@ -3,7 +3,7 @@
 
 #pragma once
 
-#include "Splice.hxx"
+#include "HappyEyeballs.hxx"
 #include "event/CoarseTimerEvent.hxx"
 #include "event/SocketEvent.hxx"
 #include "event/net/ConnectSocket.hxx"
@@ -12,69 +12,137 @@
 #include "util/IntrusiveList.hxx"
 
 #include <array>
+#include <cstddef>
+#include <memory>
+#include <span>
+#include <string>
 
+struct Config;
 class Instance;
+class Listener;
 class UniqueSocketDescriptor;
 class SocketAddress;
 
+/**
+ * A connection from a client during the login handshake.  After the
+ * connection to the game server has been established, both sockets
+ * are moved to a #RelayConnection.
+ */
 class Connection final
 	: public IntrusiveListHook<IntrusiveHookMode::AUTO_UNLINK>,
 	  ConnectSocketHandler
 {
+public:
+	/**
+	 * The size of the packets expected from the client after
+	 * connecting (SEED and ACCOUNT_LOGIN).
+	 */
+	static constexpr std::size_t INITIAL_PACKETS_SIZE = 83;
+
+private:
 	Instance &instance;
 
+	Listener &listener;
+
+	/**
+	 * The configuration snapshot which was current when this
+	 * connection was accepted.  A reload does not affect
+	 * existing connections.
+	 */
+	const std::shared_ptr<const Config> config;
+
 	const StaticSocketAddress remote_address;
 
+	/**
+	 * When this connection was accepted.
+	 */
+	const Event::TimePoint start_time;
+
 	AccountedClientConnection accounting;
 
 	SocketEvent incoming, outgoing;
 
-	Splice splice_in_out, splice_out_in;
-
-	SocketAddress outgoing_address;
-	ConnectSocket connect;
+	/**
+	 * The addresses of the selected game server (owned by
+	 * #config).
+	 */
+	std::span<const AllocatedSocketAddress> outgoing_addresses;
+	HappyEyeballs connect;
 
 	CoarseTimerEvent timeout;
 
 	CancellablePointer cancel_ptr;
 
-	std::array<std::byte, 83> initial_packets;
+	std::array<std::byte, INITIAL_PACKETS_SIZE> initial_packets;
 	uint_least8_t initial_packets_fill = 0;
 
+	/**
+	 * The numeric values are passed to the "connection_state"
+	 * probe; do not reorder.
+	 */
 	enum class State : uint_least8_t {
 		INITIAL,
 		CHECK_CREDENTIALS,
 		SERVER_LIST,
 		CONNECTING,
 		SEND_PLAY_SERVER,
-		READY,
 	} state = State::INITIAL;
 
 	bool send_play_server = false;
 
 public:
-	Connection(Instance &_instance,
+	/**
+	 * @param initial_data data which has already been received
+	 * from the client (the beginning of the initial packets); if
+	 * not empty, the caller must invoke OnInitialData()
+	 */
+	Connection(Instance &_instance, Listener &_listener,
 		   PerClientAccounting *per_client,
-		   UniqueSocketDescriptor &&_fd, SocketAddress address) noexcept;
+		   UniqueSocketDescriptor &&_fd, SocketAddress address,
+		   std::span<const std::byte> initial_data = {}) noexcept;
+
 	~Connection() noexcept;
 
 	auto &GetEventLoop() const noexcept {
 		return connect.GetEventLoop();
 	}
 
+	/**
+	 * Process the initial data passed to the constructor if it
+	 * contains the complete initial packets.  This may destroy
+	 * the object.
+	 */
+	void OnInitialData() noexcept;
+
+	/**
+	 * Append a JSON line describing this connection (for the
+	 * control socket).
+	 */
+	void DumpJson(std::string &out, Event::TimePoint now) const noexcept;
+
 private:
 	void Destroy() noexcept {
 		delete this;
 	}
 
+	void SetState(State new_state) noexcept;
+
 	bool SendAccountLoginReject() noexcept;
 
 	void SendServerList() noexcept;
 	void ReceivePlayServer() noexcept;
+	void SendRelay() noexcept;
 	void ReceiveLoginPackets() noexcept;
+	void OnLoginPackets() noexcept;
 
 	void ReceiveServerList() noexcept;
 
+	/**
+	 * The handshake is complete: move both sockets to a new
+	 * #RelayConnection and destroy this object.
+	 */
+	void StartRelay(UniqueSocketDescriptor &&outgoing_fd) noexcept;
+
 	void OnIncomingReady(unsigned events) noexcept;
 	void OnOutgoingReady(unsigned events) noexcept;
 	void OnTimeout() noexcept;
@@ -83,6 +151,14 @@ private:
 
 	bool SendInitialPackets(SocketDescriptor socket) noexcept;
 
+	/**
+	 * Pass the client socket to the game server (option
+	 * "game_server_handoff") and destroy this object.
+	 *
+	 * @return false on error (this object is not destroyed)
+	 */
+	bool HandOff() noexcept;
+
 	/* virtual methods from ConnectSocketHandler */
 	void OnSocketConnectSuccess(UniqueSocketDescriptor fd) noexcept override;
 	void OnSocketConnectError(std::exception_ptr e) noexcept override;
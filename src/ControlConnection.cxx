@@ -0,0 +1,313 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+// author: Max Kellermann <max.kellermann@gmail.com>
+
+#include "ControlConnection.hxx"
+#include "ClientAddress.hxx"
+#include "Connection.hxx"
+#include "Instance.hxx"
+#include "Listener.hxx"
+#include "RelayConnection.hxx"
+#include "net/UniqueSocketDescriptor.hxx"
+#include "util/SpanCast.hxx"
+#include "util/StringStrip.hxx"
+
+#include <fmt/format.h>
+
+#include <algorithm> // for std::min()
+#include <array>
+#include <cassert>
+#include <iterator> // for std::back_inserter()
+#include <string_view>
+
+#include <errno.h>
+
+using std::string_view_literals::operator""sv;
+
+/**
+ * The maximum number of items generated in one event loop
+ * iteration.
+ */
+static constexpr std::size_t CHUNK_SIZE = 256;
+
+ControlConnection::ControlConnection(Instance &_instance,
+				     UniqueSocketDescriptor &&fd) noexcept
+	:instance(_instance),
+	 socket(instance.GetEventLoop(), BIND_THIS_METHOD(OnSocketReady), fd.Release())
+{
+	socket.Schedule(socket.READ | socket.READ_HANGUP);
+}
+
+ControlConnection::~ControlConnection() noexcept
+{
+	socket.Close();
+}
+
+void
+ControlConnection::OnConnectionDestroyed(const Connection &c) noexcept
+{
+	if (phase != Phase::CONNECTIONS || next_connection != &c)
+		return;
+
+	if (!c.is_linked()) {
+		/* the whole list is being cleared */
+		next_connection = nullptr;
+		return;
+	}
+
+	const auto &list = listener->GetConnections();
+	auto i = list.iterator_to(c);
+	++i;
+	next_connection = i != list.end() ? &*i : nullptr;
+}
+
+void
+ControlConnection::OnRelayDestroyed(const RelayConnection &r) noexcept
+{
+	if (phase != Phase::RELAYS || next_relay != &r)
+		return;
+
+	if (!r.is_linked()) {
+		next_relay = nullptr;
+		return;
+	}
+
+	const auto &list = listener->GetRelays();
+	auto i = list.iterator_to(r);
+	++i;
+	next_relay = i != list.end() ? &*i : nullptr;
+}
+
+void
+ControlConnection::ReceiveCommand() noexcept
+{
+	const auto nbytes = socket.GetSocket().ReadNoWait(std::as_writable_bytes(std::span{command_buffer}.subspan(command_length)));
+	if (nbytes < 0) {
+		if (errno == EAGAIN)
+			return;
+
+		Destroy();
+		return;
+	}
+
+	if (nbytes == 0) {
+		/* the client has shut down its sending side; execute
+		   what we have got (if anything) */
+		if (command_length == 0) {
+			Destroy();
+			return;
+		}
+
+		ExecuteCommand(Strip(std::string_view{command_buffer.data(), command_length}));
+		return;
+	}
+
+	const std::string_view received{command_buffer.data() + command_length,
+					static_cast<std::size_t>(nbytes)};
+	command_length += nbytes;
+
+	if (const auto newline = received.find('\n');
+	    newline != received.npos) {
+		const std::size_t end = received.data() + newline - command_buffer.data();
+		ExecuteCommand(Strip(std::string_view{command_buffer.data(), end}));
+		return;
+	}
+
+	if (command_length == command_buffer.size()) {
+		output = "{\"error\":\"command too long\"}\n"sv;
+		phase = Phase::END;
+		socket.Schedule(socket.WRITE);
+	}
+}
+
+void
+ControlConnection::ExecuteCommand(std::string_view command) noexcept
+{
+	if (command == "connections"sv) {
+		dump_connections = true;
+		dump_accounting = false;
+	} else if (command == "accounting"sv) {
+		dump_connections = false;
+		dump_accounting = true;
+	} else if (command == "dump"sv) {
+		dump_connections = dump_accounting = true;
+	} else if (command == "reload"sv) {
+		/* the same as SIGHUP; the result is logged and
+		   counted in uologin_config_reloads */
+		instance.ReloadConfig();
+		output = "{\"reload\":\"started\"}\n"sv;
+		phase = Phase::END;
+		socket.Schedule(socket.WRITE);
+		return;
+	} else if (command == "top"sv) {
+		/* this is small enough to be generated at once */
+		instance.GetHeavyHitters().DumpJson(output);
+		phase = Phase::END;
+		socket.Schedule(socket.WRITE);
+		return;
+	} else {
+		output = "{\"error\":\"unknown command\"}\n"sv;
+		phase = Phase::END;
+		socket.Schedule(socket.WRITE);
+		return;
+	}
+
+	if (dump_connections) {
+		listener = instance.GetListeners().begin();
+		end_listener = instance.GetListeners().end();
+		StartListener();
+	} else
+		StartAccounting();
+
+	socket.Schedule(socket.WRITE);
+}
+
+void
+ControlConnection::StartListener() noexcept
+{
+	if (listener == end_listener) {
+		if (dump_accounting)
+			StartAccounting();
+		else
+			phase = Phase::END;
+		return;
+	}
+
+	phase = Phase::CONNECTIONS;
+
+	const auto &connections = listener->GetConnections();
+	next_connection = connections.empty() ? nullptr : &connections.front();
+}
+
+void
+ControlConnection::StartAccounting() noexcept
+{
+	phase = Phase::ACCOUNTING;
+	accounting.emplace(instance.GetClientAccountingMap());
+}
+
+static void
+DumpAccounting(std::string &out,
+	       const ClientAccountingSnapshotItem &item) noexcept
+{
+	auto o = std::back_inserter(out);
+
+	fmt::format_to(o, R"({{"type":"accounting","key":{})", item.address);
+
+	if (IsIPv4ClientKey(item.address)) {
+		out.append(R"(,"address":")"sv);
+		FormatClientKey(out, item.address);
+		out.push_back('"');
+	}
+
+	fmt::format_to(o, R"(,"expires":{:.3f},"tarpit":{:.3f},"delay":{:.3f},"tokens":{:.1f},"knocked":{}}})" "\n",
+		       item.expires_ms / 1000.,
+		       item.tarpit_ms / 1000.,
+		       item.delay_ms / 1000.,
+		       item.tokens,
+		       item.knocked != 0);
+}
+
+bool
+ControlConnection::Generate() noexcept
+{
+	assert(phase != Phase::COMMAND);
+
+	const auto now = instance.GetEventLoop().SteadyNow();
+
+	for (std::size_t budget = CHUNK_SIZE; budget > 0;) {
+		switch (phase) {
+		case Phase::CONNECTIONS:
+			if (next_connection == nullptr) {
+				phase = Phase::RELAYS;
+
+				const auto &relays = listener->GetRelays();
+				next_relay = relays.empty() ? nullptr : &relays.front();
+			} else {
+				const auto &list = listener->GetConnections();
+				auto i = list.iterator_to(*next_connection);
+				for (; budget > 0 && i != list.end(); ++i, --budget)
+					i->DumpJson(output, now);
+
+				next_connection = i != list.end() ? &*i : nullptr;
+			}
+
+			break;
+
+		case Phase::RELAYS:
+			if (next_relay == nullptr) {
+				++listener;
+				StartListener();
+			} else {
+				const auto &list = listener->GetRelays();
+				auto i = list.iterator_to(*next_relay);
+				for (; budget > 0 && i != list.end(); ++i, --budget)
+					i->DumpJson(output, now);
+
+				next_relay = i != list.end() ? &*i : nullptr;
+			}
+
+			break;
+
+		case Phase::ACCOUNTING: {
+			std::array<ClientAccountingSnapshotItem, 64> buffer;
+			const std::size_t n = accounting->Read(std::span{buffer}.first(std::min(budget, buffer.size())));
+			for (std::size_t i = 0; i < n; ++i)
+				DumpAccounting(output, buffer[i]);
+
+			budget -= n;
+
+			if (accounting->IsEnd()) {
+				accounting.reset();
+				phase = Phase::END;
+			}
+
+			break;
+		}
+
+		case Phase::COMMAND:
+		case Phase::END:
+			return !output.empty();
+		}
+	}
+
+	return true;
+}
+
+void
+ControlConnection::OnSocketReady(unsigned events) noexcept
+{
+	if (events & socket.DEAD_MASK) {
+		Destroy();
+		return;
+	}
+
+	if (phase == Phase::COMMAND) {
+		ReceiveCommand();
+		return;
+	}
+
+	if (output_position == output.size()) {
+		/* generate only one chunk per call and let the event
+		   loop run other handlers before the next one */
+		output.clear();
+		output_position = 0;
+
+		if (!Generate()) {
+			/* done; closing the socket signals the end of
+			   the dump */
+			Destroy();
+			return;
+		}
+	}
+
+	const auto nbytes = socket.GetSocket().WriteNoWait(AsBytes(std::string_view{output}.substr(output_position)));
+	if (nbytes < 0) {
+		if (errno == EAGAIN)
+			return;
+
+		Destroy();
+		return;
+	}
+
+	output_position += nbytes;
+}
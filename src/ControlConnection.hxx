@@ -0,0 +1,129 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+// author: Max Kellermann <max.kellermann@gmail.com>
+
+#pragma once
+
+#include "event/SocketEvent.hxx"
+#include "net/ClientAccounting.hxx"
+#include "util/IntrusiveList.hxx"
+
+#include <array>
+#include <cstddef>
+#include <forward_list>
+#include <optional>
+#include <string>
+#include <string_view>
+
+class Instance;
+class Listener;
+class Connection;
+class RelayConnection;
+class UniqueSocketDescriptor;
+
+/**
+ * A client of the control socket (see #ControlListener).  It reads
+ * one command line (terminated by a newline or by shutting down the
+ * sending side) and then executes it, usually by writing the
+ * requested tables as JSON lines:
+ *
+ * - "connections": all #Connection and #RelayConnection objects
+ * - "accounting": all #ClientAccountingMap items
+ * - "dump": both
+ * - "top": the #HeavyHitters top lists
+ * - "reload": reload the configuration file like SIGHUP (see
+ *   Instance::ReloadConfig())
+ *
+ * The output is generated in small chunks whenever the socket is
+ * writable, so the event loop is never blocked for long, no matter
+ * how large the tables are.  Objects which are created during the
+ * dump may or may not be included.
+ */
+class ControlConnection final
+	: public AutoUnlinkIntrusiveListHook
+{
+	Instance &instance;
+
+	SocketEvent socket;
+
+	enum class Phase : uint_least8_t {
+		COMMAND,
+		CONNECTIONS,
+		RELAYS,
+		ACCOUNTING,
+		END,
+	} phase = Phase::COMMAND;
+
+	/**
+	 * The command line received so far (#Phase::COMMAND).
+	 */
+	std::array<char, 64> command_buffer;
+	std::size_t command_length = 0;
+
+	bool dump_connections, dump_accounting;
+
+	/**
+	 * The #Listener whose lists are currently being dumped.
+	 */
+	std::forward_list<Listener>::const_iterator listener, end_listener;
+
+	/**
+	 * The next item to be dumped (depending on #phase).  If the
+	 * item gets destroyed, OnConnectionDestroyed() or
+	 * OnRelayDestroyed() advances this pointer.
+	 */
+	const Connection *next_connection;
+	const RelayConnection *next_relay;
+
+	/**
+	 * Walks the #ClientAccountingMap during #Phase::ACCOUNTING.
+	 */
+	std::optional<ClientAccountingMap::SnapshotCursor> accounting;
+
+	std::string output;
+	std::size_t output_position = 0;
+
+public:
+	ControlConnection(Instance &_instance,
+			  UniqueSocketDescriptor &&fd) noexcept;
+	~ControlConnection() noexcept;
+
+	/**
+	 * Called by the #Connection destructor.
+	 */
+	void OnConnectionDestroyed(const Connection &c) noexcept;
+
+	/**
+	 * Called by the #RelayConnection destructor.
+	 */
+	void OnRelayDestroyed(const RelayConnection &r) noexcept;
+
+private:
+	void Destroy() noexcept {
+		delete this;
+	}
+
+	/**
+	 * Receive more of the command line and execute it once it
+	 * is complete.
+	 */
+	void ReceiveCommand() noexcept;
+
+	void ExecuteCommand(std::string_view command) noexcept;
+
+	/**
+	 * Start dumping the lists of #listener (or advance to the
+	 * next phase if there is no listener left).
+	 */
+	void StartListener() noexcept;
+
+	void StartAccounting() noexcept;
+
+	/**
+	 * Generate the next chunk of output.
+	 *
+	 * @return false if the dump is complete
+	 */
+	bool Generate() noexcept;
+
+	void OnSocketReady(unsigned events) noexcept;
+};
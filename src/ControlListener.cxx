@@ -0,0 +1,48 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+// author: Max Kellermann <max.kellermann@gmail.com>
+
+#include "ControlListener.hxx"
+#include "ControlConnection.hxx"
+#include "Instance.hxx"
+#include "net/UniqueSocketDescriptor.hxx"
+#include "util/DeleteDisposer.hxx"
+#include "util/PrintException.hxx"
+
+ControlListener::ControlListener(Instance &_instance,
+				 UniqueSocketDescriptor &&socket)
+	:ServerSocket(_instance.GetEventLoop(), std::move(socket)),
+	 instance(_instance)
+{
+}
+
+ControlListener::~ControlListener() noexcept
+{
+	connections.clear_and_dispose(DeleteDisposer{});
+}
+
+void
+ControlListener::OnConnectionDestroyed(const Connection &c) noexcept
+{
+	for (auto &i : connections)
+		i.OnConnectionDestroyed(c);
+}
+
+void
+ControlListener::OnRelayDestroyed(const RelayConnection &r) noexcept
+{
+	for (auto &i : connections)
+		i.OnRelayDestroyed(r);
+}
+
+void
+ControlListener::OnAccept(UniqueSocketDescriptor fd, SocketAddress) noexcept
+{
+	auto *c = new ControlConnection(instance, std::move(fd));
+	connections.push_back(*c);
+}
+
+void
+ControlListener::OnAcceptError(std::exception_ptr error) noexcept
+{
+	PrintException(std::move(error));
+}
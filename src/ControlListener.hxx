@@ -0,0 +1,37 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+// author: Max Kellermann <max.kellermann@gmail.com>
+
+#pragma once
+
+#include "event/net/ServerSocket.hxx"
+#include "util/IntrusiveList.hxx"
+
+class Instance;
+class Connection;
+class RelayConnection;
+class ControlConnection;
+
+/**
+ * Listens on the control socket (in RUNTIME_DIRECTORY) which
+ * allows inspecting the connection and accounting tables (see
+ * #ControlConnection).
+ */
+class ControlListener final : ServerSocket {
+	Instance &instance;
+
+	IntrusiveList<ControlConnection> connections;
+
+public:
+	[[nodiscard]]
+	ControlListener(Instance &_instance, UniqueSocketDescriptor &&socket);
+	~ControlListener() noexcept;
+
+	void OnConnectionDestroyed(const Connection &c) noexcept;
+	void OnRelayDestroyed(const RelayConnection &r) noexcept;
+
+private:
+	/* virtual methods from class ServerSocket */
+	void OnAccept(UniqueSocketDescriptor fd,
+		      SocketAddress address) noexcept override;
+	void OnAcceptError(std::exception_ptr ep) noexcept override;
+};
@@ -2,35 +2,53 @@
 // author: Max Kellermann <max.kellermann@gmail.com>
 
 #include "Database.hxx"
+#include "CheckPassword.hxx"
+#include "LoopStats.hxx"
+#include "Probes.hxx"
+#include "UserAccounting.hxx"
+#include "Username.hxx"
+#include "VerifyPool.hxx"
+#include "lib/fmt/ExceptionFormatter.hxx"
 #include "lib/fmt/RuntimeError.hxx"
 #include "lib/fmt/SystemError.hxx"
-#include "thread/Job.hxx"
-#include "thread/Queue.hxx"
-#include "thread/Pool.hxx"
 #include "io/CopyRegularFile.hxx"
 #include "io/Open.hxx"
 #include "io/UniqueFileDescriptor.hxx"
+#include "thread/Job.hxx"
+#include "thread/Pool.hxx"
+#include "thread/Queue.hxx"
 #include "util/Cancellable.hxx"
-#include "util/CharUtil.hxx"
-#include "util/SpanCast.hxx"
+#include "util/PrintException.hxx"
 
-#include <sodium/crypto_pwhash.h>
+#include <fmt/format.h>
 
-#include <algorithm> // for std::transform()
+#include <algorithm> // for std::copy(), std::min(), std::max()
 #include <array>
 #include <cassert>
+#include <iterator> // for std::back_inserter()
 
 #include <fcntl.h> // for O_CREAT
+#include <stdio.h> // for rename()
 #include <stdlib.h> // for getenv()
 #include <sys/stat.h>
+#include <unistd.h> // for unlink()
 
 using std::string_view_literals::operator""sv;
 
-Database::Database(EventLoop &_event_loop, const char *_path, bool _auto_reload)
-	:event_loop(_event_loop), path(_path), auto_reload(_auto_reload)
+Database::Database(EventLoop &_event_loop,
+		   VerifyPool &_verify_pool, UserAccounting &_user_accounting,
+		   LoopStats &_loop_stats,
+		   const char *_path, bool _auto_reload,
+		   std::size_t _inline_memory)
+	:event_loop(_event_loop),
+	 verify_pool(_verify_pool), user_accounting(_user_accounting),
+	 loop_stats(_loop_stats),
+	 path(_path),
+	 inline_memory(_inline_memory),
+	 auto_reload(_auto_reload)
 {
 	if (path != nullptr && !auto_reload)
-		db = BerkeleyDB{path};
+		db = std::make_unique<const BerkeleyDB>(path);
 }
 
 static void
@@ -41,19 +59,102 @@ CopyRegularFile(const char *src, const char *dst, off_t size)
 	CopyRegularFile(src_fd, dst_fd, size);
 }
 
-inline void
-Database::DoAutoReload(off_t size)
+/**
+ * Copy the database to RUNTIME_DIRECTORY (so the original can be
+ * replaced at any time) and open the copy.  Each copy is a new file
+ * which is renamed over the previous one, so the previous snapshot
+ * keeps reading its own (unlinked) file until it is replaced.
+ *
+ * This function is thread-safe.
+ */
+static std::unique_ptr<const BerkeleyDB>
+LoadCopy(const char *path, off_t size, unsigned generation)
 {
-	assert(auto_reload);
-
 	const char *runtime_directory = getenv("RUNTIME_DIRECTORY");
 	if (runtime_directory == nullptr)
 		throw std::runtime_error{"No RUNTIME_DIRECTORY"};
 
+	const auto tmp_path = fmt::format("{}/user.db.{}"sv,
+					  runtime_directory, generation);
 	const auto copy_path = fmt::format("{}/user.db"sv, runtime_directory);
-	CopyRegularFile(path, copy_path.c_str(), size);
 
-	db = BerkeleyDB{copy_path.c_str()};
+	std::unique_ptr<const BerkeleyDB> db;
+
+	try {
+		CopyRegularFile(path, tmp_path.c_str(), size);
+		db = std::make_unique<const BerkeleyDB>(tmp_path.c_str());
+	} catch (...) {
+		unlink(tmp_path.c_str());
+		throw;
+	}
+
+	if (rename(tmp_path.c_str(), copy_path.c_str()) < 0) {
+		const int e = errno;
+		unlink(tmp_path.c_str());
+		throw FmtErrno(e, "Failed to rename {:?}", tmp_path);
+	}
+
+	return db;
+}
+
+/**
+ * Loads a new database snapshot in a worker thread.
+ */
+class Database::ReloadJob final : public ThreadJob, Cancellable {
+	ThreadQueue &queue;
+
+	Database &parent;
+
+	const char *const path;
+	const off_t size;
+	const unsigned generation;
+
+	std::unique_ptr<const BerkeleyDB> db;
+	std::exception_ptr error;
+
+	bool canceled = false;
+
+public:
+	ReloadJob(ThreadQueue &_queue, Database &_parent,
+		  const char *_path, off_t _size, unsigned _generation,
+		  CancellablePointer &cancel_ptr) noexcept
+		:queue(_queue), parent(_parent),
+		 path(_path), size(_size), generation(_generation) {
+		cancel_ptr = *this;
+	}
+
+private:
+	// virtual methods from ThreadJob
+
+	void Run() noexcept override {
+		try {
+			db = LoadCopy(path, size, generation);
+		} catch (...) {
+			error = std::current_exception();
+		}
+	}
+
+	void Done() noexcept override {
+		if (!canceled)
+			parent.OnReloadDone(std::move(db), std::move(error));
+		delete this;
+	}
+
+	void Cancel() noexcept override {
+		canceled = true;
+
+		if (queue.Cancel(*this))
+			delete this;
+	}
+};
+
+void
+Database::Shutdown() noexcept
+{
+	if (reload_cancel_ptr) {
+		reload_cancel_ptr.Cancel();
+		reload_cancel_ptr = {};
+	}
 }
 
 inline void
@@ -61,38 +162,91 @@ Database::MaybeAutoReload()
 {
 	assert(auto_reload);
 
+	if (reload_cancel_ptr)
+		/* a reload is already running; keep using the
+		   current snapshot meanwhile */
+		return;
+
 	struct stat st;
-	if (stat(path, &st) < 0)
+	if (stat(path, &st) < 0) {
+		if (db)
+			/* keep using the current snapshot until the
+			   file reappears */
+			return;
+
 		throw FmtErrno("Failed to check {:?}", path);
+	}
+
+	if (!S_ISREG(st.st_mode)) {
+		if (db)
+			return;
 
-	if (!S_ISREG(st.st_mode))
 		throw FmtRuntimeError("Not a regular file: {:?}", path);
+	}
 
 	if (st.st_mtime == last_mtime) {
-		/* not modified, but the last attempt may have failed,
-		   so rethrow any previous error */
-		if (last_reload_error)
+		/* not modified, but if there is no snapshot, the
+		   last attempt has failed, so rethrow its error */
+		if (!db && last_reload_error)
 			std::rethrow_exception(last_reload_error);
 		return;
 	}
 
 	last_mtime = st.st_mtime;
-	db = {};
-	last_reload_error = {};
 
-	try {
-		DoAutoReload(st.st_size);
-	} catch (...) {
-		last_reload_error = std::current_exception();
-		throw;
+	if (!db) {
+		/* there is nothing to verify with meanwhile, so load
+		   the first snapshot synchronously */
+		const LoopStats::Scope loop_scope{loop_stats, LoopCategory::USER_DATABASE};
+
+		try {
+			db = LoadCopy(path, st.st_size, ++reload_generation);
+			last_reload_error = {};
+		} catch (...) {
+			last_reload_error = std::current_exception();
+			throw;
+		}
+
+		return;
 	}
+
+	auto &queue = thread_pool_get_queue(event_loop);
+	auto *job = new ReloadJob(queue, *this, path, st.st_size,
+				  ++reload_generation, reload_cancel_ptr);
+	queue.Add(*job);
 }
 
-class Database::CheckCredentialsJob final : public ThreadJob, Cancellable {
-	ThreadQueue &queue;
-	BerkeleyDB &db;
+void
+Database::OnReloadDone(std::unique_ptr<const BerkeleyDB> new_db,
+		       std::exception_ptr error) noexcept
+{
+	reload_cancel_ptr = {};
+
+	if (error) {
+		/* keep the old snapshot */
+		fmt::print(stderr, "Failed to reload user database: {}\n", error);
+		last_reload_error = std::move(error);
+		return;
+	}
+
+	/* password hashes are looked up before jobs are submitted,
+	   so nothing refers to the old snapshot; it is closed right
+	   away */
+	db = std::move(new_db);
+	last_reload_error = {};
+}
+
+class Database::CheckCredentialsJob final : public VerifyJob, Cancellable {
+	VerifyPool &pool;
+	UserAccounting &user_accounting;
 
-	const std::string username, password;
+	const std::string username, upper_username, password;
+
+	/**
+	 * The password hash from the database; empty if there is no
+	 * such user.
+	 */
+	const std::string hash;
 
 	const CheckCredentialsCallback callback;
 
@@ -101,28 +255,43 @@ class Database::CheckCredentialsJob final : public ThreadJob, Cancellable {
 	bool result;
 
 public:
-	explicit CheckCredentialsJob(ThreadQueue &_queue, BerkeleyDB &_db,
+	explicit CheckCredentialsJob(VerifyPool &_pool,
+				     UserAccounting &_user_accounting,
 				     std::string_view _username,
+				     std::string_view _upper_username,
 				     std::string_view _password,
+				     const char *_hash,
 				     CheckCredentialsCallback _callback,
 				     CancellablePointer &cancel_ptr)
-		:queue(_queue), db(_db),
-		 username(_username), password(_password),
+		:pool(_pool),
+		 user_accounting(_user_accounting),
+		 username(_username), upper_username(_upper_username),
+		 password(_password),
+		 hash(_hash != nullptr ? _hash : ""),
 		 callback(_callback) {
 		cancel_ptr = *this;
+
+		/* the caller submits this job right away */
+		UOLOGIN_PROBE(check_credentials_enqueue, this, username.c_str());
 	}
 
 private:
-	[[nodiscard]]
-	bool CheckPassword() noexcept;
-
-	// virtual methods from ThreadJob
+	// virtual methods from VerifyJob
 
 	void Run() noexcept override {
-		result = CheckPassword();
+		UOLOGIN_PROBE(check_credentials_start, this);
+
+		result = !hash.empty() && VerifyPasswordHash(hash.c_str(), password);
 	}
 
 	void Done() noexcept override {
+		/* account the result even if the client has given up
+		   waiting for it */
+		user_accounting.Update(upper_username, result);
+
+		UOLOGIN_PROBE(check_credentials_done, this, username.c_str(),
+			      result, canceled);
+
 		if (!canceled)
 			callback(username, result);
 		delete this;
@@ -131,31 +300,120 @@ private:
 	void Cancel() noexcept override {
 		canceled = true;
 
-		if (queue.Cancel(*this))
+		const bool dequeued = pool.Cancel(*this);
+		UOLOGIN_PROBE(check_credentials_cancel, this, dequeued);
+
+		if (dequeued)
 			delete this;
 	}
 };
 
-inline bool
-Database::CheckCredentialsJob::CheckPassword() noexcept
-{
-	std::array<char, 30> upper_username_buffer;
-	if (username.size() > upper_username_buffer.size())
-		return false;
+/**
+ * Collects the results of all #CheckCredentialsBatchJob instances
+ * of one Database::CheckCredentialsBatch() call and invokes the
+ * callback after the last one has finished.
+ */
+class Database::CheckCredentialsBatchOperation final {
+	const std::span<CredentialsBatchItem> items;
+
+	const CheckCredentialsBatchCallback callback;
+
+	std::size_t n_remaining;
+
+public:
+	CheckCredentialsBatchOperation(std::span<CredentialsBatchItem> _items,
+				       CheckCredentialsBatchCallback _callback,
+				       std::size_t n_jobs) noexcept
+		:items(_items), callback(_callback), n_remaining(n_jobs) {}
+
+	void OnJobDone() noexcept {
+		assert(n_remaining > 0);
+
+		if (--n_remaining == 0) {
+			callback(items);
+			delete this;
+		}
+	}
+};
+
+/**
+ * Verifies one chunk of a batch.
+ */
+class Database::CheckCredentialsBatchJob final : public VerifyJob {
+	UserAccounting &user_accounting;
+
+	CheckCredentialsBatchOperation &operation;
 
-	std::transform(username.begin(), username.end(),
-		       upper_username_buffer.begin(), ToUpperASCII);
-	const std::string_view key = {upper_username_buffer.data(), username.size()};
+	const std::span<CredentialsBatchItem> items;
 
-	std::array<char, crypto_pwhash_STRBYTES> value;
-	const std::size_t value_size = db.Get(AsBytes(key), std::as_writable_bytes(std::span{value}));
+public:
+	CheckCredentialsBatchJob(UserAccounting &_user_accounting,
+				 CheckCredentialsBatchOperation &_operation,
+				 std::span<CredentialsBatchItem> _items) noexcept
+		:user_accounting(_user_accounting),
+		 operation(_operation), items(_items) {}
+
+private:
+	// virtual methods from VerifyJob
+
+	void Run() noexcept override {
+		for (auto &i : items) {
+			if (i.skip)
+				continue;
+
+			const char *hash = i.GetHash();
+			i.result = hash != nullptr &&
+				VerifyPasswordHash(hash, i.GetPassword());
+		}
+	}
+
+	void Done() noexcept override {
+		for (const auto &i : items)
+			if (!i.skip)
+				user_accounting.Update(i.GetUpperUsername(), i.result);
+
+		auto &_operation = operation;
+		delete this;
+		_operation.OnJobDone();
+	}
+};
+
+void
+CredentialsBatchItem::Set(std::string_view username, std::string_view password) noexcept
+{
+	assert(username.size() <= username_buffer.size());
+	assert(password.size() <= password_buffer.size());
 
-	if (value_size == 0 || value_size >= value.size())
-		return false;
+	username_length = username.size();
+	std::copy(username.begin(), username.end(), username_buffer.begin());
+	ToUpperUsername(upper_username_buffer, username);
 
-	value[value_size] = '\0';
+	password_length = password.size();
+	std::copy(password.begin(), password.end(), password_buffer.begin());
+}
+
+/**
+ * Look up the password hash, logging database errors (which are
+ * treated like a nonexistent user).
+ */
+static const char *
+LookupPasswordHashNoExcept(const BerkeleyDB &db,
+			   std::string_view upper_username,
+			   PasswordHashBuffer &buffer) noexcept
+{
+	try {
+		return LookupPasswordHash(db, upper_username, buffer);
+	} catch (...) {
+		PrintException(std::current_exception());
+		return nullptr;
+	}
+}
 
-	return crypto_pwhash_str_verify(value.data(), password.data(), password.size()) == 0;
+inline bool
+Database::IsCheapEnough(const PasswordHashCost &cost) const noexcept
+{
+	return inline_memory > 0 && cost.memory <= inline_memory &&
+		cost.opslimit <= INLINE_MAX_OPSLIMIT;
 }
 
 void
@@ -172,10 +430,123 @@ Database::CheckCredentials(std::string_view username,
 		return;
 	}
 
-	auto &queue = thread_pool_get_queue(event_loop);
+	UpperUsernameBuffer upper_username_buffer;
+	const auto upper_username = ToUpperUsername(upper_username_buffer, username);
+	if (upper_username.data() == nullptr ||
+	    !user_accounting.Check(upper_username)) {
+		callback(username, false);
+		return;
+	}
 
-	auto *job = new CheckCredentialsJob(queue, db,
-					    username, password,
-					    callback, cancel_ptr);
-	queue.Add(*job);
+	/* the lookup is cheap; knowing the hash in advance allows
+	   scheduling by its memory cost */
+	PasswordHashBuffer hash_buffer;
+	const char *hash = LookupPasswordHashNoExcept(*db, upper_username, hash_buffer);
+
+	const auto cost = hash != nullptr
+		? ParsePasswordHashCost(hash)
+		: PasswordHashCost{};
+
+	/* only cheap hashes are verified right away; everything
+	   else, including unknown users (whose job does nothing),
+	   goes through the thread pool */
+	if (hash != nullptr && IsCheapEnough(cost)) {
+		const bool result = VerifyPasswordHash(hash, password);
+		++n_inline;
+
+		user_accounting.Update(upper_username, result);
+		callback(username, result);
+		return;
+	}
+
+	auto *job = new CheckCredentialsJob(verify_pool, user_accounting,
+					    username, upper_username, password,
+					    hash, callback, cancel_ptr);
+	verify_pool.Add(*job, cost.memory);
+}
+
+void
+Database::CheckCredentialsBatch(std::span<CredentialsBatchItem> items,
+				CheckCredentialsBatchCallback callback)
+{
+	if (auto_reload)
+		MaybeAutoReload();
+
+	if (!db) {
+		for (auto &i : items)
+			i.result = true;
+
+		callback(items);
+		return;
+	}
+
+	/* up to one lookup per knock datagram; this runs in the
+	   #EventLoop thread, so account for it */
+	const LoopStats::Scope loop_scope{loop_stats, LoopCategory::USER_DATABASE};
+
+	std::size_t n_verify = 0;
+	for (auto &i : items) {
+		if (!user_accounting.Check(i.GetUpperUsername())) {
+			i.skip = true;
+			i.result = false;
+			continue;
+		}
+
+		++n_verify;
+
+		const char *hash = LookupPasswordHashNoExcept(*db, i.GetUpperUsername(),
+							      i.hash_buffer);
+		if (hash == nullptr)
+			i.hash_buffer.front() = '\0';
+	}
+
+	if (n_verify == 0) {
+		callback(items);
+		return;
+	}
+
+	/* one chunk per worker thread; each job verifies its chunk
+	   serially, so it needs only as much memory as its most
+	   expensive item */
+	const std::size_t max_jobs = std::min<std::size_t>(verify_pool.GetMaxThreads(),
+							   n_verify);
+	const std::size_t chunk_size = (items.size() + max_jobs - 1) / max_jobs;
+	const std::size_t n_jobs = (items.size() + chunk_size - 1) / chunk_size;
+
+	auto *operation = new CheckCredentialsBatchOperation(items, callback,
+							     n_jobs);
+
+	for (std::size_t start = 0; start < items.size(); start += chunk_size) {
+		const auto chunk = items.subspan(start,
+						 std::min(chunk_size,
+							  items.size() - start));
+
+		std::size_t memory_cost = 0;
+		for (const auto &i : chunk) {
+			if (i.skip)
+				continue;
+
+			if (const char *hash = i.GetHash())
+				memory_cost = std::max(memory_cost,
+						       ParsePasswordHashCost(hash).memory);
+		}
+
+		auto *job = new CheckCredentialsBatchJob(user_accounting,
+							 *operation, chunk);
+		UOLOGIN_PROBE(check_credentials_batch_enqueue, job,
+			      operation, chunk.size(), memory_cost);
+		verify_pool.Add(*job, memory_cost);
+	}
+}
+
+void
+Database::ExportMetrics(std::string &out) const noexcept
+{
+	fmt::format_to(std::back_inserter(out), R"(
+# HELP uologin_verify_inline Counter for password verifications in the main thread
+# TYPE uologin_verify_inline counter
+
+uologin_verify_inline {}
+)",
+		       n_inline);
 }
@@ -4,46 +4,181 @@
 #pragma once
 
 #include "BerkeleyDB.hxx"
+#include "CheckPassword.hxx"
+#include "Username.hxx"
 #include "util/BindMethod.hxx"
+#include "util/Cancellable.hxx"
 
+#include <cstdint>
 #include <exception>
+#include <memory>
+#include <span>
+#include <string>
 #include <string_view>
 
 #include <sys/types.h>
 #include <time.h>
 
 class EventLoop;
-class CancellablePointer;
+class LoopStats;
+class UserAccounting;
+class VerifyPool;
+
+/**
+ * One item for Database::CheckCredentialsBatch().  It has a fixed
+ * size and does not allocate memory.
+ */
+struct CredentialsBatchItem {
+	UpperUsernameBuffer username_buffer, upper_username_buffer;
+	std::array<char, 30> password_buffer;
+
+	/**
+	 * The password hash, looked up by
+	 * Database::CheckCredentialsBatch(); an empty string means
+	 * there is no such user.  This is the largest field
+	 * (crypto_pwhash_STRBYTES = 128 bytes).
+	 */
+	PasswordHashBuffer hash_buffer;
+
+	uint_least8_t username_length = 0, password_length = 0;
+
+	/**
+	 * If true, then the password is not verified (e.g. because
+	 * the username is locked out) and #result is false.
+	 */
+	bool skip = false;
+
+	bool result = false;
+
+	void Set(std::string_view username, std::string_view password) noexcept;
+
+	std::string_view GetUsername() const noexcept {
+		return {username_buffer.data(), username_length};
+	}
+
+	std::string_view GetUpperUsername() const noexcept {
+		return {upper_username_buffer.data(), username_length};
+	}
+
+	std::string_view GetPassword() const noexcept {
+		return {password_buffer.data(), password_length};
+	}
+
+	const char *GetHash() const noexcept {
+		return hash_buffer.front() != '\0' ? hash_buffer.data() : nullptr;
+	}
+};
 
 class Database {
 	EventLoop &event_loop;
 
-	BerkeleyDB db;
+	VerifyPool &verify_pool;
+
+	UserAccounting &user_accounting;
+
+	LoopStats &loop_stats;
+
+	/**
+	 * The current snapshot of the database.  Password hashes are
+	 * looked up before a job is submitted, so a reload never
+	 * affects running jobs.  This pointer is only accessed by the
+	 * #EventLoop thread.
+	 */
+	std::unique_ptr<const BerkeleyDB> db;
 
 	const char *const path;
 
 	time_t last_mtime{};
 
+	/**
+	 * The error of the last reload attempt.  It is only rethrown
+	 * if there is no snapshot to fall back to.
+	 */
 	std::exception_ptr last_reload_error;
 
+	/**
+	 * The reload job running in a worker thread.
+	 */
+	CancellablePointer reload_cancel_ptr;
+
+	/**
+	 * Used to give each copy in RUNTIME_DIRECTORY a new inode.
+	 */
+	unsigned reload_generation = 0;
+
+	/**
+	 * Hashes which need no more memory than this are verified in
+	 * the #EventLoop thread; 0 disables this.
+	 */
+	const std::size_t inline_memory;
+
+	/**
+	 * Hashes with more passes are never verified in the
+	 * #EventLoop thread.
+	 */
+	static constexpr unsigned long INLINE_MAX_OPSLIMIT = 4;
+
+	uint_least64_t n_inline = 0;
+
 	const bool auto_reload;
 
 	class CheckCredentialsJob;
+	class CheckCredentialsBatchOperation;
+	class CheckCredentialsBatchJob;
+	class ReloadJob;
 
 public:
 	[[nodiscard]]
-	Database(EventLoop &_event_loop, const char *_path, bool _auto_reload);
+	Database(EventLoop &_event_loop,
+		 VerifyPool &_verify_pool, UserAccounting &_user_accounting,
+		 LoopStats &_loop_stats,
+		 const char *_path, bool _auto_reload,
+		 std::size_t _inline_memory);
 
-	~Database() noexcept = default;
+	~Database() noexcept {
+		Shutdown();
+	}
+
+	/**
+	 * Cancel a pending reload (on shutdown).
+	 */
+	void Shutdown() noexcept;
 
 	using CheckCredentialsCallback = BoundMethod<void(std::string_view username, bool result) noexcept>;
 
+	/**
+	 * Verify the password in a worker thread.  If the username
+	 * is currently locked out (see #UserAccounting) or if the
+	 * hash is cheap enough to be verified right away, the
+	 * callback is invoked synchronously.
+	 */
 	void CheckCredentials(std::string_view username,
 			      std::string_view password,
 			      CheckCredentialsCallback callback,
 			      CancellablePointer &cancel_ptr);
 
+	using CheckCredentialsBatchCallback = BoundMethod<void(std::span<CredentialsBatchItem> items) noexcept>;
+
+	/**
+	 * Verify many passwords with one callback.  The items are
+	 * split into at most one job per worker thread, and each job
+	 * verifies its share serially.  The items must remain valid
+	 * until the callback is invoked, which may happen
+	 * synchronously.  This operation cannot be canceled.
+	 */
+	void CheckCredentialsBatch(std::span<CredentialsBatchItem> items,
+				   CheckCredentialsBatchCallback callback);
+
+	/**
+	 * Append Prometheus metrics to the given string.
+	 */
+	void ExportMetrics(std::string &out) const noexcept;
+
 private:
+	[[gnu::pure]]
+	bool IsCheapEnough(const PasswordHashCost &cost) const noexcept;
+
 	void MaybeAutoReload();
-	void DoAutoReload(off_t size);
+	void OnReloadDone(std::unique_ptr<const BerkeleyDB> new_db,
+			  std::exception_ptr error) noexcept;
 };
@@ -5,6 +5,12 @@
 #include "Connection.hxx"
 #include "Instance.hxx"
 #include "Listener.hxx"
+#include "Probes.hxx"
+#include "net/ClientAccounting.hxx"
+
+#include <algorithm> // for std::copy()
+#include <cassert>
+#include <chrono>
 
 using std::string_view_literals::operator""sv;
 
@@ -12,14 +18,24 @@ DelayedConnection::DelayedConnection(Instance &_instance, Listener &_listener,
 				     PerClientAccounting &per_client,
 				     Event::Duration delay,
 				     UniqueSocketDescriptor fd,
-				     SocketAddress _peer_address) noexcept
-	:listener(_listener),
+				     SocketAddress _peer_address,
+				     std::span<const std::byte> _initial_data) noexcept
+	:instance(_instance), listener(_listener),
 	 peer_address(_peer_address),
-	 timer(_instance.GetEventLoop(), BIND_THIS_METHOD(OnTimer)),
-	 socket(_instance.GetEventLoop(), BIND_THIS_METHOD(OnSocketReady), fd.Release())
+	 timer(instance.GetEventLoop(), BIND_THIS_METHOD(OnTimer)),
+	 socket(instance.GetEventLoop(), BIND_THIS_METHOD(OnSocketReady), fd.Release()),
+	 initial_data_size(_initial_data.size())
 {
+	assert(_initial_data.size() <= initial_data.size());
+	std::copy(_initial_data.begin(), _initial_data.end(), initial_data.begin());
+
+	++instance.metrics.tarpit_connections;
+
 	per_client.AddConnection(accounting);
 
+	UOLOGIN_PROBE(tarpit_start, this, per_client.GetAddressKey(),
+		      static_cast<uint_least64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(delay).count()));
+
 	timer.Schedule(delay);
 
 	/* schedule just EPOLLRDHUP because it can reliably detect
@@ -30,15 +46,21 @@ DelayedConnection::DelayedConnection(Instance &_instance, Listener &_listener,
 DelayedConnection::~DelayedConnection() noexcept
 {
 	socket.Close();
+
+	--instance.metrics.tarpit_connections;
 }
 
 void
 DelayedConnection::OnTimer() noexcept
 {
+	UOLOGIN_PROBE(tarpit_release, this,
+		      accounting.GetPerClient()->GetAddressKey(), false);
+
 	UniqueSocketDescriptor fd{AdoptTag{}, socket.ReleaseSocket()};
 
 	listener.AddConnection(accounting.GetPerClient(),
-			       std::move(fd), peer_address);
+			       std::move(fd), peer_address,
+			       std::span{initial_data}.first(initial_data_size));
 	Destroy();
 }
 
@@ -47,6 +69,9 @@ DelayedConnection::OnSocketReady([[maybe_unused]] unsigned events) noexcept
 {
 	/* client has disconnected */
 
+	UOLOGIN_PROBE(tarpit_release, this,
+		      accounting.GetPerClient()->GetAddressKey(), true);
+
 	accounting.UpdateTokenBucket(4);
 	Destroy();
 }
@@ -3,6 +3,7 @@
 
 #pragma once
 
+#include "Connection.hxx"
 #include "event/CoarseTimerEvent.hxx"
 #include "event/SocketEvent.hxx"
 #include "net/AllocatedSocketAddress.hxx"
@@ -10,6 +11,10 @@
 #include "io/Logger.hxx"
 #include "util/IntrusiveList.hxx"
 
+#include <array>
+#include <cstdint>
+#include <span>
+
 class Instance;
 class Listener;
 class UniqueSocketDescriptor;
@@ -21,6 +26,7 @@ class UniqueSocketDescriptor;
 class DelayedConnection final
 	: public AutoUnlinkIntrusiveListHook
 {
+	Instance &instance;
 	Listener &listener;
 
 	const AllocatedSocketAddress peer_address;
@@ -32,11 +38,19 @@ class DelayedConnection final
 	CoarseTimerEvent timer;
 	SocketEvent socket;
 
+	/**
+	 * Data which was already received from the client (see
+	 * Listener::Admit()).
+	 */
+	std::array<std::byte, Connection::INITIAL_PACKETS_SIZE> initial_data;
+	uint_least8_t initial_data_size;
+
 public:
 	DelayedConnection(Instance &_instance, Listener &_listener,
 			  PerClientAccounting &per_client,
 			  Event::Duration delay,
-			  UniqueSocketDescriptor fd, SocketAddress _peer_address) noexcept;
+			  UniqueSocketDescriptor fd, SocketAddress _peer_address,
+			  std::span<const std::byte> _initial_data) noexcept;
 	~DelayedConnection() noexcept;
 
 protected:
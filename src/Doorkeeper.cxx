@@ -0,0 +1,94 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+// author: Max Kellermann <max.kellermann@gmail.com>
+
+#include "Doorkeeper.hxx"
+
+#include <fmt/format.h>
+
+#include <iterator> // for std::back_inserter()
+
+#include <sodium/randombytes.h>
+
+/**
+ * The "splitmix64" finalizer.
+ */
+static constexpr uint_least64_t
+Mix(uint_least64_t x) noexcept
+{
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebULL;
+	x ^= x >> 31;
+	return x;
+}
+
+Doorkeeper::Doorkeeper() noexcept
+{
+	randombytes_buf(seeds.data(), sizeof(seeds));
+}
+
+bool
+Doorkeeper::Check(uint_least64_t key) noexcept
+{
+	std::array<std::size_t, HASHES> bits;
+	for (std::size_t i = 0; i < HASHES; ++i)
+		bits[i] = Mix(key ^ seeds[i]) % BITS;
+
+	const auto Contains = [&bits](const Filter &f){
+		for (const std::size_t bit : bits)
+			if (!(f[bit / WORD_BITS] & (Word{1} << (bit % WORD_BITS))))
+				return false;
+		return true;
+	};
+
+	if (Contains(filters[current]) || Contains(filters[current ^ 1])) {
+		++stats.promotions;
+		return true;
+	}
+
+	if (n_inserted >= CAPACITY)
+		Rotate();
+
+	auto &f = filters[current];
+	for (const std::size_t bit : bits)
+		f[bit / WORD_BITS] |= Word{1} << (bit % WORD_BITS);
+	++n_inserted;
+
+	++stats.deferred;
+	return false;
+}
+
+void
+Doorkeeper::Rotate() noexcept
+{
+	current ^= 1;
+	filters[current].fill(0);
+	n_inserted = 0;
+	++stats.resets;
+}
+
+void
+Doorkeeper::ExportMetrics(std::string &out) const noexcept
+{
+	fmt::format_to(std::back_inserter(out), R"(
+# HELP uologin_doorkeeper_bytes Memory used by the client accounting doorkeeper filters
+# TYPE uologin_doorkeeper_bytes gauge
+
+# HELP uologin_doorkeeper_deferred Counter for first-seen clients which were only recorded in the doorkeeper filter
+# TYPE uologin_doorkeeper_deferred counter
+
+# HELP uologin_doorkeeper_promotions Counter for clients which passed the doorkeeper
+# TYPE uologin_doorkeeper_promotions counter
+
+# HELP uologin_doorkeeper_resets Counter for doorkeeper filter rotations
+# TYPE uologin_doorkeeper_resets counter
+
+uologin_doorkeeper_bytes {}
+uologin_doorkeeper_deferred {}
+uologin_doorkeeper_promotions {}
+uologin_doorkeeper_resets {}
+)",
+		       GetMemoryUsage(),
+		       stats.deferred, stats.promotions, stats.resets);
+}
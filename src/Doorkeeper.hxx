@@ -0,0 +1,103 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+// author: Max Kellermann <max.kellermann@gmail.com>
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/**
+ * A pair of rotating Bloom filters which decides whether a client
+ * has been seen often enough to deserve a #PerClientAccounting item.
+ * Sources which send just one datagram (e.g. spoofed knock floods)
+ * never get past it, so their memory usage stays flat no matter how
+ * many addresses they use.
+ *
+ * New sources are added to the "current" filter; a source which is
+ * found in the current or in the previous filter is promoted.  After
+ * #CAPACITY insertions, the previous filter is cleared and the two
+ * filters swap roles.  This keeps the occupancy of both filters (and
+ * therefore the false positive rate under a flood of random source
+ * addresses) low, at the cost of forgetting sources after
+ * #CAPACITY to twice as many other new sources.
+ */
+class Doorkeeper {
+	/**
+	 * The number of bits per filter.
+	 */
+	static constexpr std::size_t BITS = 1 << 19;
+
+	/**
+	 * The number of bits set per key.
+	 */
+	static constexpr std::size_t HASHES = 3;
+
+	/**
+	 * Rotate after this many insertions.  At one sixteenth of
+	 * the bits, a full filter has about 17% of its bits set and a
+	 * false positive rate of about 0.5%; under a flood of random
+	 * keys, about 0.6% of them are promoted (see the
+	 * "doorkeeper_flood" benchmark).
+	 */
+	static constexpr std::size_t CAPACITY = BITS / 16;
+
+	using Word = uint_least64_t;
+	static constexpr std::size_t WORD_BITS = 64;
+
+	using Filter = std::array<Word, BITS / WORD_BITS>;
+
+	/**
+	 * Random per-process seeds for the hashes, so an attacker
+	 * cannot choose colliding addresses.
+	 */
+	std::array<uint_least64_t, HASHES> seeds;
+
+	std::array<Filter, 2> filters{};
+
+	/**
+	 * The index of the "current" filter in #filters.
+	 */
+	std::size_t current = 0;
+
+	/**
+	 * The number of insertions into the current filter.
+	 */
+	std::size_t n_inserted = 0;
+
+public:
+	struct {
+		/**
+		 * Sources which were seen for the first time and
+		 * were only recorded in the filter.
+		 */
+		uint_least64_t deferred;
+
+		uint_least64_t promotions, resets;
+	} stats{};
+
+	Doorkeeper() noexcept;
+
+	/**
+	 * Record an event from the given client (see
+	 * ClientAccountingMap::GetKey()).
+	 *
+	 * @return true if this is not the first event from this
+	 * client, i.e. it shall be promoted to a real
+	 * #PerClientAccounting item
+	 */
+	bool Check(uint_least64_t key) noexcept;
+
+	static constexpr std::size_t GetMemoryUsage() noexcept {
+		return sizeof(filters);
+	}
+
+	/**
+	 * Append Prometheus metrics to the given string.
+	 */
+	void ExportMetrics(std::string &out) const noexcept;
+
+private:
+	void Rotate() noexcept;
+};
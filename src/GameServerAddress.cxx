@@ -0,0 +1,75 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+// author: Max Kellermann <max.kellermann@gmail.com>
+
+#include "GameServerAddress.hxx"
+#include "net/AddressInfo.hxx"
+#include "net/Resolver.hxx"
+#include "net/SocketAddress.hxx"
+
+#include <algorithm> // for std::equal()
+
+#include <netdb.h>
+
+std::vector<AllocatedSocketAddress>
+ResolveGameServer(const char *host)
+{
+	if (IsLocalGameServer(host)) {
+		/* a local socket path; '@' means abstract */
+		std::vector<AllocatedSocketAddress> result(1);
+		result.front().SetLocal(host);
+		return result;
+	}
+
+	static constexpr struct addrinfo hints = {
+		.ai_flags = AI_ADDRCONFIG,
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM,
+	};
+
+	std::vector<AllocatedSocketAddress> result;
+	for (const auto &i : Resolve(host, 2593, &hints))
+		result.emplace_back(SocketAddress{i});
+
+	InterleaveAddressFamilies(result);
+	return result;
+}
+
+void
+InterleaveAddressFamilies(std::vector<AllocatedSocketAddress> &addresses) noexcept
+{
+	if (addresses.size() < 3)
+		/* nothing to reorder (with two addresses, either
+		   they already alternate or they have the same
+		   family) */
+		return;
+
+	const auto first_family = addresses.front().GetFamily();
+
+	std::vector<AllocatedSocketAddress> first, other;
+	for (auto &i : addresses) {
+		if (i.GetFamily() == first_family)
+			first.emplace_back(std::move(i));
+		else
+			other.emplace_back(std::move(i));
+	}
+
+	addresses.clear();
+
+	auto a = first.begin(), b = other.begin();
+	while (a != first.end() || b != other.end()) {
+		if (a != first.end())
+			addresses.emplace_back(std::move(*a++));
+		if (b != other.end())
+			addresses.emplace_back(std::move(*b++));
+	}
+}
+
+bool
+IsSameAddressList(const std::vector<AllocatedSocketAddress> &a,
+		  const std::vector<AllocatedSocketAddress> &b) noexcept
+{
+	return std::equal(a.begin(), a.end(), b.begin(), b.end(),
+			  [](const auto &x, const auto &y){
+				  return SocketAddress{x} == SocketAddress{y};
+			  });
+}
@@ -0,0 +1,48 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+// author: Max Kellermann <max.kellermann@gmail.com>
+
+#pragma once
+
+#include "net/AllocatedSocketAddress.hxx"
+
+#include <vector>
+
+/**
+ * Does this "game_server" value specify a local (AF_UNIX) socket,
+ * i.e. a path or an abstract name (see ResolveGameServer())?
+ */
+constexpr bool
+IsLocalGameServer(const char *host) noexcept
+{
+	return host[0] == '/' || host[0] == '@';
+}
+
+/**
+ * Resolve a "game_server" host name (with optional port, default
+ * 2593) to all of its addresses, ordered for Happy Eyeballs (see
+ * InterleaveAddressFamilies()).  This may block.
+ *
+ * A value starting with '/' (a path) or '@' (an abstract name) is a
+ * local (AF_UNIX) stream socket for a game server on this host;
+ * there is nothing to resolve then.
+ *
+ * Throws on error.
+ */
+std::vector<AllocatedSocketAddress>
+ResolveGameServer(const char *host);
+
+/**
+ * Reorder the addresses so the address families alternate, starting
+ * with the family of the first address and preserving the order
+ * within each family (RFC 8305 section 4).
+ */
+void
+InterleaveAddressFamilies(std::vector<AllocatedSocketAddress> &addresses) noexcept;
+
+/**
+ * Do both lists contain the same addresses in the same order?
+ */
+[[gnu::pure]]
+bool
+IsSameAddressList(const std::vector<AllocatedSocketAddress> &a,
+		  const std::vector<AllocatedSocketAddress> &b) noexcept;
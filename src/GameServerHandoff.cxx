@@ -0,0 +1,135 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+// author: Max Kellermann <max.kellermann@gmail.com>
+
+#include "GameServerHandoff.hxx"
+#include "net/SocketAddress.hxx"
+#include "net/UniqueSocketDescriptor.hxx"
+#include "system/Error.hxx"
+
+#include <algorithm> // for std::copy_n()
+#include <array>
+#include <cassert>
+#include <stdexcept>
+
+#include <sys/socket.h>
+
+SocketAddress
+GameServerHandoffHeader::GetAddress() const noexcept
+{
+	return {reinterpret_cast<const struct sockaddr *>(address), address_size};
+}
+
+void
+GameServerHandoffHeader::SetAddress(SocketAddress src) noexcept
+{
+	if (src.IsNull() || src.GetSize() > sizeof(address)) {
+		address_size = 0;
+		return;
+	}
+
+	address_size = src.GetSize();
+	std::copy_n(reinterpret_cast<const std::byte *>(src.GetAddress()),
+		    address_size, address);
+}
+
+void
+SendGameServerHandoff(SocketDescriptor s, SocketAddress destination,
+		      SocketAddress client_address,
+		      std::span<const std::byte> data,
+		      SocketDescriptor client)
+{
+	assert(data.size() <= MAX_GAME_SERVER_HANDOFF_DATA);
+
+	GameServerHandoffHeader header;
+	header.SetAddress(client_address);
+	header.data_size = data.size();
+
+	std::array<struct iovec, 2> iov{{
+		{
+			.iov_base = &header,
+			.iov_len = sizeof(header),
+		},
+		{
+			.iov_base = const_cast<std::byte *>(data.data()),
+			.iov_len = data.size(),
+		},
+	}};
+
+	alignas(struct cmsghdr) std::array<std::byte, CMSG_SPACE(sizeof(int))> control;
+
+	struct msghdr msg{
+		.msg_name = const_cast<struct sockaddr *>(destination.GetAddress()),
+		.msg_namelen = destination.GetSize(),
+		.msg_iov = iov.data(),
+		.msg_iovlen = iov.size(),
+		.msg_control = control.data(),
+		.msg_controllen = control.size(),
+	};
+
+	auto *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	*reinterpret_cast<int *>(CMSG_DATA(cmsg)) = client.Get();
+
+	if (sendmsg(s.Get(), &msg, MSG_DONTWAIT|MSG_NOSIGNAL) < 0)
+		throw MakeErrno("Failed to send handoff datagram");
+}
+
+std::size_t
+ReceiveGameServerHandoff(SocketDescriptor s,
+			 GameServerHandoffHeader &header,
+			 std::span<std::byte> data,
+			 UniqueSocketDescriptor &client)
+{
+	std::array<struct iovec, 2> iov{{
+		{
+			.iov_base = &header,
+			.iov_len = sizeof(header),
+		},
+		{
+			.iov_base = data.data(),
+			.iov_len = data.size(),
+		},
+	}};
+
+	alignas(struct cmsghdr) std::array<std::byte, CMSG_SPACE(sizeof(int))> control;
+
+	struct msghdr msg{
+		.msg_iov = iov.data(),
+		.msg_iovlen = iov.size(),
+		.msg_control = control.data(),
+		.msg_controllen = control.size(),
+	};
+
+	const auto nbytes = recvmsg(s.Get(), &msg, MSG_CMSG_CLOEXEC);
+	if (nbytes < 0)
+		throw MakeErrno("Failed to receive handoff datagram");
+
+	for (auto *cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr;
+	     cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET ||
+		    cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+
+		const std::size_t n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		const auto *src = reinterpret_cast<const int *>(CMSG_DATA(cmsg));
+		for (std::size_t i = 0; i < n; ++i) {
+			UniqueSocketDescriptor fd{AdoptTag{}, SocketDescriptor{src[i]}};
+			if (!client.IsDefined())
+				client = std::move(fd);
+		}
+	}
+
+	if (static_cast<std::size_t>(nbytes) < sizeof(header) ||
+	    (msg.msg_flags & (MSG_TRUNC|MSG_CTRUNC)) != 0 ||
+	    header.magic != GameServerHandoffHeader::MAGIC ||
+	    header.version != GameServerHandoffHeader::VERSION ||
+	    static_cast<std::size_t>(nbytes) != sizeof(header) + header.data_size)
+		throw std::runtime_error{"Malformed handoff datagram"};
+
+	if (!client.IsDefined())
+		throw std::runtime_error{"No socket in handoff datagram"};
+
+	return header.data_size;
+}
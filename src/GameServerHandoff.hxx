@@ -0,0 +1,99 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+// author: Max Kellermann <max.kellermann@gmail.com>
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+
+class SocketDescriptor;
+class UniqueSocketDescriptor;
+class SocketAddress;
+
+/**
+ * The protocol used to pass an authenticated client connection to a
+ * game server on the same host (option "game_server_handoff")
+ * instead of relaying it.
+ *
+ * The game server binds a local SOCK_DGRAM socket to a path in a
+ * directory which only it may write to; abstract sockets are not
+ * supported, because the datagrams contain the client's password.
+ * For each connection, uologin sends one datagram to it, consisting
+ * of one #GameServerHandoffHeader followed by #data_size bytes of
+ * data which uologin has already read from the client (the 0xef
+ * Seed and the 0x80 AccountLogin packets).  The client socket is attached as
+ * SCM_RIGHTS; it is the only file descriptor.  All integers are in
+ * host byte order.
+ *
+ * There is no reply: after the datagram has been sent, uologin
+ * closes its copy of the socket and forgets the connection.  The
+ * game server continues by reading from the socket as if it had
+ * received the data itself.
+ */
+struct GameServerHandoffHeader {
+	static constexpr uint32_t MAGIC = 0x554f484f; // "UOHO"
+	static constexpr uint8_t VERSION = 1;
+
+	uint32_t magic = MAGIC;
+
+	uint8_t version = VERSION;
+
+	/**
+	 * The number of bytes used in #address.
+	 */
+	uint8_t address_size = 0;
+
+	/**
+	 * The number of data bytes following this header.
+	 */
+	uint16_t data_size = 0;
+
+	/**
+	 * The client's address (a struct sockaddr); with
+	 * "proxy_protocol", this is the address from the PROXY
+	 * header.
+	 */
+	std::byte address[128];
+
+	SocketAddress GetAddress() const noexcept;
+	void SetAddress(SocketAddress src) noexcept;
+};
+
+static_assert(sizeof(GameServerHandoffHeader) == 136);
+
+/**
+ * The maximum size of the data following the header.
+ */
+static constexpr std::size_t MAX_GAME_SERVER_HANDOFF_DATA = 1024;
+
+/**
+ * Send one datagram with the client socket attached (non-blocking).
+ *
+ * Throws on error (e.g. if the game server is not running or its
+ * queue is full).
+ *
+ * @param s an unbound SOCK_DGRAM socket
+ * @param destination the game server's handoff socket
+ */
+void
+SendGameServerHandoff(SocketDescriptor s, SocketAddress destination,
+		      SocketAddress client_address,
+		      std::span<const std::byte> data,
+		      SocketDescriptor client);
+
+/**
+ * Receive one datagram (blocking); this is used by the game server
+ * (see tools/HandoffReceiver.cxx).
+ *
+ * Throws on error.
+ *
+ * @param data a buffer for the data (at least
+ * #MAX_GAME_SERVER_HANDOFF_DATA bytes)
+ * @return the number of data bytes
+ */
+std::size_t
+ReceiveGameServerHandoff(SocketDescriptor s,
+			 GameServerHandoffHeader &header,
+			 std::span<std::byte> data,
+			 UniqueSocketDescriptor &client);
@@ -0,0 +1,123 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+// author: Max Kellermann <max.kellermann@gmail.com>
+
+#include "Handover.hxx"
+#include "net/SocketAddress.hxx"
+#include "net/UniqueSocketDescriptor.hxx"
+#include "system/Error.hxx"
+
+#include <algorithm> // for std::copy_n()
+#include <array>
+#include <cassert>
+#include <stdexcept>
+
+#include <sys/socket.h>
+
+/**
+ * The maximum number of sockets attached to one record.
+ */
+static constexpr std::size_t MAX_FDS = 2;
+
+SocketAddress
+HandoverRecord::GetAddress() const noexcept
+{
+	return {reinterpret_cast<const struct sockaddr *>(address), address_size};
+}
+
+void
+HandoverRecord::SetAddress(SocketAddress src) noexcept
+{
+	if (src.IsNull() || src.GetSize() > sizeof(address)) {
+		address_size = 0;
+		return;
+	}
+
+	address_size = src.GetSize();
+	std::copy_n(reinterpret_cast<const std::byte *>(src.GetAddress()),
+		    address_size, address);
+}
+
+void
+SendHandoverRecord(SocketDescriptor s, const HandoverRecord &record,
+		   std::span<const SocketDescriptor> fds)
+{
+	assert(fds.size() <= MAX_FDS);
+
+	struct iovec iov{
+		.iov_base = const_cast<HandoverRecord *>(&record),
+		.iov_len = sizeof(record),
+	};
+
+	alignas(struct cmsghdr) std::array<std::byte, CMSG_SPACE(sizeof(int) * MAX_FDS)> control;
+
+	struct msghdr msg{
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+	};
+
+	if (!fds.empty()) {
+		msg.msg_control = control.data();
+		msg.msg_controllen = CMSG_SPACE(sizeof(int) * fds.size());
+
+		auto *cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+
+		auto *dest = reinterpret_cast<int *>(CMSG_DATA(cmsg));
+		for (const auto fd : fds)
+			*dest++ = fd.Get();
+	}
+
+	if (sendmsg(s.Get(), &msg, MSG_NOSIGNAL) < 0)
+		throw MakeErrno("Failed to send handover record");
+}
+
+std::size_t
+ReceiveHandoverRecord(SocketDescriptor s, HandoverRecord &record,
+		      std::span<UniqueSocketDescriptor> fds)
+{
+	struct iovec iov{
+		.iov_base = &record,
+		.iov_len = sizeof(record),
+	};
+
+	alignas(struct cmsghdr) std::array<std::byte, CMSG_SPACE(sizeof(int) * MAX_FDS)> control;
+
+	struct msghdr msg{
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.data(),
+		.msg_controllen = control.size(),
+	};
+
+	const auto nbytes = recvmsg(s.Get(), &msg, MSG_CMSG_CLOEXEC);
+	if (nbytes < 0)
+		throw MakeErrno("Failed to receive handover record");
+
+	std::size_t n_fds = 0;
+
+	for (auto *cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr;
+	     cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET ||
+		    cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+
+		const std::size_t n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		const auto *src = reinterpret_cast<const int *>(CMSG_DATA(cmsg));
+		for (std::size_t i = 0; i < n; ++i) {
+			UniqueSocketDescriptor fd{AdoptTag{}, SocketDescriptor{src[i]}};
+			if (n_fds < fds.size())
+				fds[n_fds++] = std::move(fd);
+		}
+	}
+
+	if (nbytes == 0)
+		throw std::runtime_error{"Handover peer closed the connection"};
+
+	if (static_cast<std::size_t>(nbytes) != sizeof(record) ||
+	    (msg.msg_flags & (MSG_TRUNC|MSG_CTRUNC)) != 0)
+		throw std::runtime_error{"Malformed handover record"};
+
+	return n_fds;
+}
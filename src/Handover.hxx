@@ -0,0 +1,87 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+// author: Max Kellermann <max.kellermann@gmail.com>
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+
+class SocketDescriptor;
+class UniqueSocketDescriptor;
+class SocketAddress;
+
+/**
+ * The protocol used to pass listener and connection sockets from an
+ * old uologin process to a new one during a binary upgrade.  The new
+ * process connects to the "handover_socket" (SOCK_SEQPACKET) of the
+ * old process and receives one #HandoverRecord per datagram, with
+ * the sockets attached as SCM_RIGHTS, until it receives
+ * #HandoverRecordType::END.
+ */
+enum class HandoverRecordType : uint8_t {
+	END,
+
+	/**
+	 * One listener socket (TCP) is attached.
+	 */
+	LISTENER,
+
+	/**
+	 * One knock listener socket (UDP) is attached.
+	 */
+	KNOCK_LISTENER,
+
+	/**
+	 * Two sockets are attached: the connection from the client
+	 * and the connection to the game server.
+	 */
+	CONNECTION,
+};
+
+struct HandoverRecord {
+	HandoverRecordType type;
+
+	/**
+	 * Unused (formerly the connection state); always zero.
+	 */
+	uint8_t state;
+
+	/**
+	 * The number of bytes used in #address.
+	 */
+	uint8_t address_size;
+
+	/**
+	 * The #ClientAccountingMap key of the client.
+	 */
+	uint_least64_t accounting_key;
+
+	/**
+	 * The client's address (a struct sockaddr).
+	 */
+	std::byte address[128];
+
+	SocketAddress GetAddress() const noexcept;
+	void SetAddress(SocketAddress src) noexcept;
+};
+
+/**
+ * Send one record with the given sockets attached (blocking).
+ *
+ * Throws on error.
+ */
+void
+SendHandoverRecord(SocketDescriptor s, const HandoverRecord &record,
+		   std::span<const SocketDescriptor> fds);
+
+/**
+ * Receive one record (blocking).
+ *
+ * Throws on error.
+ *
+ * @return the number of sockets which were stored in #fds
+ */
+std::size_t
+ReceiveHandoverRecord(SocketDescriptor s, HandoverRecord &record,
+		      std::span<UniqueSocketDescriptor> fds);
@@ -0,0 +1,30 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+// author: Max Kellermann <max.kellermann@gmail.com>
+
+#include "HandoverListener.hxx"
+#include "Instance.hxx"
+#include "net/UniqueSocketDescriptor.hxx"
+#include "util/PrintException.hxx"
+
+HandoverListener::HandoverListener(Instance &_instance,
+				   UniqueSocketDescriptor &&socket)
+	:ServerSocket(_instance.GetEventLoop(), std::move(socket)),
+	 instance(_instance)
+{
+}
+
+void
+HandoverListener::OnAccept(UniqueSocketDescriptor fd, SocketAddress) noexcept
+{
+	/* the handover is synchronous; the new process is blocked
+	   in ReceiveHandoverRecord() */
+	fd.SetBlocking();
+
+	instance.HandoverTo(fd);
+}
+
+void
+HandoverListener::OnAcceptError(std::exception_ptr error) noexcept
+{
+	PrintException(std::move(error));
+}
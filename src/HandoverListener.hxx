@@ -0,0 +1,26 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+// author: Max Kellermann <max.kellermann@gmail.com>
+
+#pragma once
+
+#include "event/net/ServerSocket.hxx"
+
+class Instance;
+
+/**
+ * Listens on the "handover_socket" for a new uologin process which
+ * wants to take over all sockets of this process.
+ */
+class HandoverListener final : ServerSocket {
+	Instance &instance;
+
+public:
+	[[nodiscard]]
+	HandoverListener(Instance &_instance, UniqueSocketDescriptor &&socket);
+
+private:
+	/* virtual methods from class ServerSocket */
+	void OnAccept(UniqueSocketDescriptor fd,
+		      SocketAddress address) noexcept override;
+	void OnAcceptError(std::exception_ptr ep) noexcept override;
+};
@@ -0,0 +1,129 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+// author: Max Kellermann <max.kellermann@gmail.com>
+
+#include "HappyEyeballs.hxx"
+#include "net/UniqueSocketDescriptor.hxx"
+
+#include <cassert>
+
+/**
+ * The "Connection Attempt Delay" recommended by RFC 8305.
+ */
+static constexpr Event::Duration CONNECTION_ATTEMPT_DELAY = std::chrono::milliseconds{250};
+
+void
+HappyEyeballs::Attempt::OnSocketConnectSuccess(UniqueSocketDescriptor fd) noexcept
+{
+	parent.OnAttemptSuccess(*this, std::move(fd));
+}
+
+void
+HappyEyeballs::Attempt::OnSocketConnectError(std::exception_ptr e) noexcept
+{
+	parent.OnAttemptError(*this, std::move(e));
+}
+
+HappyEyeballs::HappyEyeballs(EventLoop &event_loop,
+			     ConnectSocketHandler &_handler) noexcept
+	:handler(_handler),
+	 attempts{{{event_loop, *this}, {event_loop, *this}}},
+	 delay_timer(event_loop, BIND_THIS_METHOD(OnDelayTimer))
+{
+}
+
+bool
+HappyEyeballs::IsPending() const noexcept
+{
+	for (const auto &i : attempts)
+		if (i.socket.IsPending())
+			return true;
+
+	return false;
+}
+
+inline void
+HappyEyeballs::StartNext(Attempt &attempt) noexcept
+{
+	assert(next < addresses.size());
+	assert(!attempt.socket.IsPending());
+
+	current = attempt.index = next++;
+	attempt.socket.Connect(addresses[current], timeout);
+}
+
+void
+HappyEyeballs::Connect(std::span<const AllocatedSocketAddress> _addresses,
+		       Event::Duration _timeout) noexcept
+{
+	assert(!_addresses.empty());
+	assert(!IsPending());
+
+	addresses = _addresses;
+	timeout = _timeout;
+	next = current = 0;
+	last_error = {};
+	raced = false;
+
+	if (addresses.size() > 1)
+		delay_timer.Schedule(CONNECTION_ATTEMPT_DELAY);
+
+	StartNext(attempts.front());
+}
+
+void
+HappyEyeballs::Cancel() noexcept
+{
+	delay_timer.Cancel();
+
+	for (auto &i : attempts)
+		if (i.socket.IsPending())
+			i.socket.Cancel();
+}
+
+void
+HappyEyeballs::OnDelayTimer() noexcept
+{
+	for (auto &i : attempts) {
+		if (!i.socket.IsPending()) {
+			raced = true;
+			StartNext(i);
+			return;
+		}
+	}
+}
+
+void
+HappyEyeballs::OnAttemptSuccess(Attempt &attempt,
+				UniqueSocketDescriptor fd) noexcept
+{
+	Cancel();
+
+	current = attempt.index;
+	handler.OnSocketConnectSuccess(std::move(fd));
+}
+
+void
+HappyEyeballs::OnAttemptError(Attempt &attempt, std::exception_ptr e) noexcept
+{
+	current = attempt.index;
+	last_error = std::move(e);
+
+	if (next < addresses.size()) {
+		/* don't wait for the delay timer; try the next
+		   address right now */
+		if (next + 1 < addresses.size())
+			delay_timer.Schedule(CONNECTION_ATTEMPT_DELAY);
+		else
+			delay_timer.Cancel();
+
+		StartNext(attempt);
+		return;
+	}
+
+	if (IsPending())
+		/* the other attempt may still succeed */
+		return;
+
+	delay_timer.Cancel();
+	handler.OnSocketConnectError(std::move(last_error));
+}
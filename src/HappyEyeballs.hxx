@@ -0,0 +1,128 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+// author: Max Kellermann <max.kellermann@gmail.com>
+
+#pragma once
+
+#include "event/FineTimerEvent.hxx"
+#include "event/net/ConnectSocket.hxx"
+#include "net/AllocatedSocketAddress.hxx"
+
+#include <array>
+#include <cstddef>
+#include <exception>
+#include <span>
+
+/**
+ * Connect to the first responding address of a list (RFC 8305
+ * "Happy Eyeballs"): the next address is tried if the current attempt
+ * fails or has not succeeded after a short delay; at most two
+ * attempts are in flight.  The address list should already be in
+ * the desired order (see InterleaveAddressFamilies()).
+ *
+ * The result is reported to a #ConnectSocketHandler; the error is
+ * the one of the last failed attempt.
+ */
+class HappyEyeballs final {
+	ConnectSocketHandler &handler;
+
+	class Attempt final : ConnectSocketHandler {
+		HappyEyeballs &parent;
+
+	public:
+		ConnectSocket socket;
+
+		std::size_t index;
+
+		Attempt(EventLoop &event_loop, HappyEyeballs &_parent) noexcept
+			:parent(_parent), socket(event_loop, *this) {}
+
+	private:
+		/* virtual methods from ConnectSocketHandler */
+		void OnSocketConnectSuccess(UniqueSocketDescriptor fd) noexcept override;
+		void OnSocketConnectError(std::exception_ptr e) noexcept override;
+	};
+
+	std::array<Attempt, 2> attempts;
+
+	/**
+	 * Starts the next attempt if the current one takes too long.
+	 */
+	FineTimerEvent delay_timer;
+
+	std::span<const AllocatedSocketAddress> addresses;
+
+	Event::Duration timeout;
+
+	/**
+	 * The index of the next address to be tried.
+	 */
+	std::size_t next;
+
+	/**
+	 * The index of the address which was connected (or attempted
+	 * last).
+	 */
+	std::size_t current;
+
+	std::exception_ptr last_error;
+
+	/**
+	 * Was a second attempt started while the first one was
+	 * still pending?
+	 */
+	bool raced;
+
+public:
+	HappyEyeballs(EventLoop &event_loop,
+		      ConnectSocketHandler &_handler) noexcept;
+
+	auto &GetEventLoop() const noexcept {
+		return delay_timer.GetEventLoop();
+	}
+
+	[[gnu::pure]]
+	bool IsPending() const noexcept;
+
+	/**
+	 * @param _addresses a non-empty list of addresses which must
+	 * remain valid until the handler is invoked or Cancel() is
+	 * called
+	 * @param _timeout the timeout of each attempt
+	 */
+	void Connect(std::span<const AllocatedSocketAddress> _addresses,
+		     Event::Duration _timeout) noexcept;
+
+	void Cancel() noexcept;
+
+	/**
+	 * Returns the address which was connected (or the last one
+	 * which was attempted, after a failure).
+	 */
+	SocketAddress GetAddress() const noexcept {
+		return addresses[current];
+	}
+
+	/**
+	 * Was the connection established to an address other than
+	 * the first one?
+	 */
+	bool IsFallback() const noexcept {
+		return current > 0;
+	}
+
+	bool WasRaced() const noexcept {
+		return raced;
+	}
+
+private:
+	/**
+	 * Start an attempt to connect to the next address.  This
+	 * may invoke the handler (and thus destroy this object)
+	 * synchronously, so the caller must return immediately.
+	 */
+	void StartNext(Attempt &attempt) noexcept;
+
+	void OnDelayTimer() noexcept;
+	void OnAttemptSuccess(Attempt &attempt, UniqueSocketDescriptor fd) noexcept;
+	void OnAttemptError(Attempt &attempt, std::exception_ptr e) noexcept;
+};
@@ -0,0 +1,159 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+// author: Max Kellermann <max.kellermann@gmail.com>
+
+#include "HeavyHitters.hxx"
+#include "ClientAddress.hxx"
+#include "event/Loop.hxx"
+
+#include <fmt/format.h>
+
+#include <array>
+#include <iterator> // for std::back_inserter()
+
+static constexpr Event::Duration DECAY_INTERVAL = std::chrono::minutes{1};
+
+HeavyHitters::HeavyHitters(EventLoop &_event_loop) noexcept
+	:event_loop(_event_loop),
+	 next_decay(event_loop.SteadyNow() + DECAY_INTERVAL)
+{
+}
+
+void
+HeavyHitters::AddRejectedUsername(std::string_view username) noexcept
+{
+	UsernameKey key;
+	const auto upper = ToUpperUsername(key.data, username);
+	if (upper.data() == nullptr)
+		return;
+
+	key.size = upper.size();
+
+	MaybeDecay();
+	rejected_usernames.Add(key, 1);
+}
+
+void
+HeavyHitters::MaybeDecay() noexcept
+{
+	const auto now = event_loop.SteadyNow();
+	if (now < next_decay) [[likely]]
+		return;
+
+	/* after a long idle period, a few halvings clear
+	   everything anyway */
+	for (unsigned i = 0; i < 64 && now >= next_decay; ++i) {
+		penalties.Decay();
+		bytes.Decay();
+		rejected_usernames.Decay();
+		next_decay += DECAY_INTERVAL;
+	}
+
+	if (now >= next_decay)
+		next_decay = now + DECAY_INTERVAL;
+}
+
+/**
+ * Append a string with backslashes and double quotes escaped (for
+ * Prometheus label values and JSON strings); usernames are
+ * printable ASCII (see IsValidUsername()).
+ */
+static void
+AppendEscaped(std::string &out, std::string_view s) noexcept
+{
+	for (const char ch : s) {
+		if (ch == '\\' || ch == '"')
+			out.push_back('\\');
+		out.push_back(ch);
+	}
+}
+
+template<typename C>
+static void
+ExportAddressTop(std::string &out, const char *name, const char *help,
+		 const C &sketch) noexcept
+{
+	std::array<typename C::Counter, HeavyHitters::TOP_N> top;
+	const std::size_t n = sketch.Top(top);
+
+	fmt::format_to(std::back_inserter(out), R"(
+# HELP {0} {1}
+# TYPE {0} gauge
+)", name, help);
+
+	for (std::size_t i = 0; i < n; ++i) {
+		fmt::format_to(std::back_inserter(out), R"({}{{rank="{}",client=")",
+			       name, i + 1);
+		FormatClientKey(out, top[i].key);
+		fmt::format_to(std::back_inserter(out), "\"}} {}\n", top[i].count);
+	}
+}
+
+void
+HeavyHitters::ExportMetrics(std::string &out) noexcept
+{
+	MaybeDecay();
+
+	ExportAddressTop(out, "uologin_top_client_penalty",
+			 "Estimated token bucket cost of the clients with the highest cost (halved every minute)",
+			 penalties);
+
+	ExportAddressTop(out, "uologin_top_client_bytes",
+			 "Estimated relayed bytes of the clients with the most traffic (halved every minute)",
+			 bytes);
+
+	std::array<decltype(rejected_usernames)::Counter, TOP_N> top;
+	const std::size_t n = rejected_usernames.Top(top);
+
+	out += R"(
+# HELP uologin_top_rejected_username Estimated rejected logins and knocks of the most rejected usernames (halved every minute)
+# TYPE uologin_top_rejected_username gauge
+)";
+
+	for (std::size_t i = 0; i < n; ++i) {
+		fmt::format_to(std::back_inserter(out),
+			       R"(uologin_top_rejected_username{{rank="{}",username=")",
+			       i + 1);
+		AppendEscaped(out, top[i].key.ToStringView());
+		fmt::format_to(std::back_inserter(out), "\"}} {}\n", top[i].count);
+	}
+}
+
+template<typename C>
+static void
+DumpAddressTop(std::string &out, const char *type, const C &sketch) noexcept
+{
+	std::array<typename C::Counter, HeavyHitters::TOP_N> top;
+	const std::size_t n = sketch.Top(top);
+
+	for (std::size_t i = 0; i < n; ++i) {
+		fmt::format_to(std::back_inserter(out),
+			       R"({{"type":"{}","rank":{},"client":")",
+			       type, i + 1);
+		FormatClientKey(out, top[i].key);
+		fmt::format_to(std::back_inserter(out),
+			       R"(","count":{},"error":{}}})" "\n",
+			       top[i].count, top[i].error);
+	}
+}
+
+void
+HeavyHitters::DumpJson(std::string &out) noexcept
+{
+	MaybeDecay();
+
+	DumpAddressTop(out, "top_client_penalty", penalties);
+	DumpAddressTop(out, "top_client_bytes", bytes);
+
+	std::array<decltype(rejected_usernames)::Counter, TOP_N> top;
+	const std::size_t n = rejected_usernames.Top(top);
+
+	for (std::size_t i = 0; i < n; ++i) {
+		fmt::format_to(std::back_inserter(out),
+			       R"({{"type":"top_rejected_username","rank":{},"username":")",
+			       i + 1);
+		AppendEscaped(out, top[i].key.ToStringView());
+		fmt::format_to(std::back_inserter(out),
+			       R"(","count":{},"error":{}}})" "\n",
+			       top[i].count, top[i].error);
+	}
+}
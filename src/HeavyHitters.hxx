@@ -0,0 +1,113 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+// author: Max Kellermann <max.kellermann@gmail.com>
+
+#pragma once
+
+#include "SpaceSaving.hxx"
+#include "Username.hxx"
+#include "event/Chrono.hxx"
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+class EventLoop;
+
+/**
+ * Tracks the clients and usernames which cause the most trouble
+ * with fixed-size #SpaceSaving sketches, so they can be identified
+ * without exporting one metric per address.  All counts are halved
+ * every minute, so the top lists reflect recent activity.
+ */
+class HeavyHitters {
+	/**
+	 * An upper case username.
+	 */
+	struct UsernameKey {
+		UpperUsernameBuffer data;
+		uint_least8_t size;
+
+		std::string_view ToStringView() const noexcept {
+			return {data.data(), size};
+		}
+
+		bool operator==(const UsernameKey &other) const noexcept {
+			return ToStringView() == other.ToStringView();
+		}
+	};
+
+	struct UsernameHash {
+		std::size_t operator()(const UsernameKey &key) const noexcept {
+			return std::hash<std::string_view>{}(key.ToStringView());
+		}
+	};
+
+	/**
+	 * Client keys are already well distributed (see
+	 * PerClientAccounting::GetAddressKey()), but IPv4 keys only
+	 * use the low 32 bits; mix them anyway.
+	 */
+	struct AddressHash {
+		std::size_t operator()(uint_least64_t key) const noexcept {
+			return (key * 0x9e3779b97f4a7c15ULL) >> 32;
+		}
+	};
+
+	static constexpr std::size_t K = 64;
+
+	EventLoop &event_loop;
+
+	Event::TimePoint next_decay;
+
+	/**
+	 * Token bucket costs (see
+	 * PerClientAccounting::UpdateTokenBucket()) by client.
+	 */
+	SpaceSaving<uint_least64_t, K, AddressHash> penalties;
+
+	/**
+	 * Relayed bytes (both directions) by client.
+	 */
+	SpaceSaving<uint_least64_t, K, AddressHash> bytes;
+
+	/**
+	 * Rejected logins and knocks by username.
+	 */
+	SpaceSaving<UsernameKey, K, UsernameHash> rejected_usernames;
+
+public:
+	/**
+	 * The number of entries in each exported top list.
+	 */
+	static constexpr std::size_t TOP_N = 10;
+
+	explicit HeavyHitters(EventLoop &_event_loop) noexcept;
+
+	/**
+	 * A handler for ClientAccountingMap::SetPenaltyHandler().
+	 */
+	void OnPenalty(uint_least64_t address, double size) noexcept {
+		MaybeDecay();
+		penalties.Add(address, static_cast<uint_least64_t>(size));
+	}
+
+	void AddBytes(uint_least64_t address, uint_least64_t n) noexcept {
+		MaybeDecay();
+		bytes.Add(address, n);
+	}
+
+	void AddRejectedUsername(std::string_view username) noexcept;
+
+	/**
+	 * Append Prometheus metrics to the given string.
+	 */
+	void ExportMetrics(std::string &out) noexcept;
+
+	/**
+	 * Append JSON lines (for the control socket).
+	 */
+	void DumpJson(std::string &out) noexcept;
+
+private:
+	void MaybeDecay() noexcept;
+};
@@ -0,0 +1,74 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+// author: Max Kellermann <max.kellermann@gmail.com>
+
+#pragma once
+
+#include <fmt/format.h>
+
+#include <array>
+#include <bit> // for std::bit_width()
+#include <cstddef>
+#include <cstdint>
+#include <iterator> // for std::back_inserter()
+#include <string>
+#include <string_view>
+
+/**
+ * A histogram with power-of-two buckets: bucket i counts the values
+ * below 2^i (and not below 2^(i-1)); the last bucket counts all
+ * larger values.  Adding a value costs a few instructions and no
+ * allocation.
+ *
+ * @param N the number of buckets (excluding the overflow bucket)
+ */
+template<std::size_t N>
+class Log2Histogram {
+	std::array<uint_least64_t, N + 1> buckets{};
+
+	uint_least64_t count = 0, sum = 0;
+
+public:
+	constexpr void Add(uint_least64_t value) noexcept {
+		const std::size_t i = std::bit_width(value);
+		++buckets[i < N ? i : N];
+		++count;
+		sum += value;
+	}
+
+	constexpr uint_least64_t GetCount() const noexcept {
+		return count;
+	}
+
+	/**
+	 * Write this histogram in the Prometheus text format (just
+	 * the samples, without HELP/TYPE).
+	 *
+	 * @param labels additional labels (e.g. `category="foo"`) or
+	 * empty
+	 * @param scale the factor which converts values to the
+	 * exported unit (e.g. 1e-6 for microseconds to seconds)
+	 */
+	void Export(std::string &out, std::string_view name,
+		    std::string_view labels, double scale) const noexcept {
+		auto o = std::back_inserter(out);
+		const std::string_view comma = labels.empty()
+			? std::string_view{}
+			: std::string_view{","};
+
+		uint_least64_t cumulative = 0;
+		for (std::size_t i = 0; i < N; ++i) {
+			cumulative += buckets[i];
+			fmt::format_to(o, "{}_bucket{{{}{}le=\"{}\"}} {}\n",
+				       name, labels, comma,
+				       static_cast<double>(uint_least64_t{1} << i) * scale,
+				       cumulative);
+		}
+
+		fmt::format_to(o, "{}_bucket{{{}{}le=\"+Inf\"}} {}\n"
+			       "{}_sum{{{}}} {}\n"
+			       "{}_count{{{}}} {}\n",
+			       name, labels, comma, count,
+			       name, labels, static_cast<double>(sum) * scale,
+			       name, labels, count);
+	}
+};
@@ -2,22 +2,75 @@
 // author: Max Kellermann <max.kellermann@gmail.com>
 
 #include "Instance.hxx"
+#include "AccountingSnapshot.hxx"
+#include "AsyncConfig.hxx"
+#include "ClientAddress.hxx"
+#include "Cluster.hxx"
 #include "Config.hxx"
+#include "ControlListener.hxx"
+#include "Handover.hxx"
+#include "HandoverListener.hxx"
 #include "Listener.hxx"
+#include "KnockCookies.hxx"
 #include "KnockListener.hxx"
+#include "Nftables.hxx"
 #include "thread/Pool.hxx"
 #include "event/net/PrometheusExporterListener.hxx"
+#include "lib/fmt/ExceptionFormatter.hxx"
+#include "net/SocketError.hxx"
+#include "net/UniqueSocketDescriptor.hxx"
+#include "time/Cast.hxx"
 #include "util/PrintException.hxx"
 
 #include <fmt/core.h>
 
-Instance::Instance(const Config &_config)
-	:config(_config),
-	 database(event_loop,
-		  config.user_database.empty() ? nullptr : config.user_database.c_str(),
-		  config.auto_reload_user_database)
+#include <array>
+#include <chrono>
+#include <stdexcept>
+
+#include <signal.h>
+#include <sys/socket.h>
+
+Instance::Instance(std::shared_ptr<const Config> _config,
+		   const char *_config_path)
+	:config_path(_config_path),
+	 initial_config(std::move(_config)),
+	 config(initial_config),
+	 user_accounting(event_loop, initial_config->max_tracked_users),
+	 verify_pool(event_loop,
+		     initial_config->verify_threads_min,
+		     initial_config->verify_threads_max,
+		     initial_config->verify_cpus,
+		     initial_config->verify_memory),
+	 overload_controller(event_loop, initial_config->overload,
+			     BIND_THIS_METHOD(GetOverloadSignals),
+			     BIND_THIS_METHOD(OnOverload)),
+	 database(event_loop, verify_pool, user_accounting, loop_stats,
+		  initial_config->user_database.empty() ? nullptr : initial_config->user_database.c_str(),
+		  initial_config->auto_reload_user_database,
+		  initial_config->verify_inline_memory)
 {
 	shutdown_listener.Enable();
+
+	client_accounting.SetPenaltyHandler(BIND_METHOD(heavy_hitters, &HeavyHitters::OnPenalty));
+
+	loop_stats.Start();
+	reresolver.Start();
+	tcp_info_sampler.Start();
+
+	reload_signal.Add(SIGHUP);
+	reload_signal.Enable();
+
+	if (initial_config->knock_cookie_lifetime.count() > 0)
+		knock_cookies = std::make_unique<KnockCookies>(initial_config->knock_cookie_key,
+							       initial_config->knock_cookie_lifetime);
+
+	if (!initial_config->client_accounting_snapshot.empty()) {
+		accounting_snapshot = std::make_unique<AccountingSnapshot>(client_accounting,
+									   std::string{initial_config->client_accounting_snapshot},
+									   initial_config->client_accounting_snapshot_interval);
+		accounting_snapshot->Start();
+	}
 }
 
 Instance::~Instance() noexcept
@@ -38,12 +91,18 @@ Instance::AddPrometheusExporter(UniqueSocketDescriptor &&socket) noexcept
 	prometheus_exporter = std::make_unique<PrometheusExporterListener>(event_loop,
 									   std::move(socket),
 									   handler);
+	++n_listener_fds;
 }
 
 void
 Instance::AddListener(UniqueSocketDescriptor &&fd) noexcept
 {
-	listeners.emplace_front(*this, std::move(fd));
+	listeners.emplace_front(*this, std::move(fd),
+				initial_config->proxy_protocol);
+	++n_listener_fds;
+
+	if (overload_controller.IsOverloaded())
+		listeners.front().Pause();
 }
 
 void
@@ -51,38 +110,361 @@ Instance::AddKnockListener(UniqueSocketDescriptor &&fd,
 			   const char *nft_set) noexcept
 {
 	knock_listeners.emplace_front(*this, std::move(fd), nft_set);
+	++n_listener_fds;
+}
+
+void
+Instance::AddHandoverListener(UniqueSocketDescriptor &&fd) noexcept
+{
+	assert(!handover_listener);
+
+	handover_listener = std::make_unique<HandoverListener>(*this, std::move(fd));
+	++n_listener_fds;
+}
+
+SocketDescriptor
+Instance::GetHandoffSocket()
+{
+	if (!handoff_socket.IsDefined() &&
+	    !handoff_socket.Create(AF_LOCAL, SOCK_DGRAM, 0))
+		throw MakeSocketError("Failed to create handoff socket");
+
+	return handoff_socket;
+}
+
+void
+Instance::AddControlListener(UniqueSocketDescriptor &&fd) noexcept
+{
+	assert(!control_listener);
+
+	control_listener = std::make_unique<ControlListener>(*this, std::move(fd));
+	++n_listener_fds;
+}
+
+void
+Instance::OnConnectionDestroyed(const Connection &c) noexcept
+{
+	if (control_listener)
+		control_listener->OnConnectionDestroyed(c);
+}
+
+void
+Instance::OnRelayDestroyed(const RelayConnection &r) noexcept
+{
+	tcp_info_sampler.OnRelayDestroyed(r);
+
+	if (control_listener)
+		control_listener->OnRelayDestroyed(r);
+}
+
+PerClientAccounting *
+Instance::GetKnockClientAccounting(SocketAddress address) noexcept
+{
+	const auto key = ClientAccountingMap::GetKey(address);
+	if (auto *per_client = client_accounting.Find(key))
+		return per_client;
+
+	if (key == 0 || !knock_doorkeeper.Check(key))
+		return nullptr;
+
+	return client_accounting.Get(key);
+}
+
+void
+Instance::AddCluster(UniqueSocketDescriptor &&fd) noexcept
+{
+	assert(!cluster);
+
+	auto peers = initial_config->cluster_peers;
+	cluster = std::make_unique<Cluster>(event_loop, client_accounting,
+					    std::move(fd), std::move(peers),
+					    initial_config->cluster_key,
+					    initial_config->cluster_bandwidth,
+					    BIND_THIS_METHOD(OnRemoteKnock));
+	++n_listener_fds;
+}
+
+void
+Instance::OnRemoteKnock(uint_least64_t address) noexcept
+{
+	/* IPv6 keys are folded and cannot be converted back to an
+	   address, so IPv6 knocks only reach the accounting map */
+	if (initial_config->knock_nft_set.empty() || !IsIPv4ClientKey(address))
+		return;
+
+	std::string ip;
+	FormatClientKey(ip, address);
+
+	const LoopStats::Scope loop_scope{loop_stats, LoopCategory::NFTABLES};
+
+	try {
+		NftAddElement("inet", "filter", initial_config->knock_nft_set.c_str(),
+			      ip.c_str());
+	} catch (...) {
+		fmt::print(stderr, "Failed to add nft element: {}\n", std::current_exception());
+	}
+}
+
+void
+Instance::HandoverTo(SocketDescriptor s) noexcept
+{
+	const auto start_time = std::chrono::steady_clock::now();
+	unsigned n_sent = 0, n_dropped = 0;
+
+	try {
+		for (auto &i : listeners) {
+			const SocketDescriptor fd = i.GetSocket();
+			SendHandoverRecord(s, {.type = HandoverRecordType::LISTENER},
+					   {&fd, 1});
+		}
+
+		for (auto &i : knock_listeners) {
+			const SocketDescriptor fd = i.GetSocket();
+			SendHandoverRecord(s, {.type = HandoverRecordType::KNOCK_LISTENER},
+					   {&fd, 1});
+		}
+
+		for (auto &i : listeners)
+			i.HandoverConnections(s, n_sent, n_dropped);
+
+		SendHandoverRecord(s, {.type = HandoverRecordType::END}, {});
+	} catch (...) {
+		/* the new process will discard everything it has
+		   received so far; keep running */
+		fmt::print(stderr, "Handover failed: {}\n", std::current_exception());
+		return;
+	}
+
+	fmt::print(stderr, "Handed over {} connections ({} dropped) in {:.3f}s\n",
+		   n_sent, n_dropped,
+		   ToFloatSeconds(std::chrono::steady_clock::now() - start_time));
+
+	/* stop all I/O right now; the new process owns these sockets
+	   already */
+	control_listener.reset();
+	knock_listeners.clear();
+	listeners.clear();
+
+	handover_shutdown.Schedule();
+}
+
+bool
+Instance::ReceiveHandover(SocketDescriptor s)
+{
+	const auto start_time = std::chrono::steady_clock::now();
+	const char *const nft_set = initial_config->knock_nft_set.empty()
+		? nullptr
+		: initial_config->knock_nft_set.c_str();
+
+	bool have_listener = false;
+
+	for (bool done = false; !done;) {
+		HandoverRecord record;
+		std::array<UniqueSocketDescriptor, 2> fds;
+		const std::size_t n_fds = ReceiveHandoverRecord(s, record, fds);
+
+		switch (record.type) {
+		case HandoverRecordType::END:
+			done = true;
+			break;
+
+		case HandoverRecordType::LISTENER:
+			if (n_fds != 1)
+				throw std::runtime_error{"Malformed handover listener record"};
+
+			AddListener(std::move(fds[0]));
+			have_listener = true;
+			break;
+
+		case HandoverRecordType::KNOCK_LISTENER:
+			if (n_fds != 1)
+				throw std::runtime_error{"Malformed handover knock listener record"};
+
+			AddKnockListener(std::move(fds[0]), nft_set);
+			break;
+
+		case HandoverRecordType::CONNECTION:
+			if (n_fds != 2 || listeners.empty()) {
+				++metrics.handover_failed_connections;
+				break;
+			}
+
+			listeners.front().AddRelay(client_accounting.Get(record.accounting_key),
+						   std::move(fds[0]), std::move(fds[1]));
+			++metrics.handover_adopted_connections;
+			break;
+
+		default:
+			throw std::runtime_error{"Unknown handover record"};
+		}
+	}
+
+	fmt::print(stderr, "Adopted {} connections ({} failed) in {:.3f}s\n",
+		   metrics.handover_adopted_connections,
+		   metrics.handover_failed_connections,
+		   ToFloatSeconds(std::chrono::steady_clock::now() - start_time));
+
+	return have_listener;
+}
+
+void
+Instance::ReloadConfig() noexcept
+{
+	if (reload_cancel_ptr)
+		/* already reloading */
+		return;
+
+	LoadConfigFileAsync(event_loop, config_path,
+			    BIND_THIS_METHOD(OnConfigLoaded),
+			    reload_cancel_ptr);
+}
+
+void
+Instance::OnReloadSignal(int) noexcept
+{
+	ReloadConfig();
+}
+
+void
+Instance::OnConfigLoaded(std::shared_ptr<const Config> new_config,
+			 std::exception_ptr error) noexcept
+{
+	reload_cancel_ptr = {};
+
+	if (error) {
+		++metrics.config_reload_errors;
+		fmt::print(stderr, "Failed to reload configuration: {}\n", error);
+		return;
+	}
+
+	++metrics.config_reloads;
+	fmt::print(stderr, "Reloaded configuration\n");
+
+	/* new connections will use the new snapshot; existing ones
+	   keep the old one until they are closed */
+	config = std::move(new_config);
+
+	/* the new "resolve_interval" may have enabled
+	   re-resolution */
+	reresolver.Start();
+}
+
+void
+Instance::OnResolved(const std::shared_ptr<const Config> &old_config,
+		     std::shared_ptr<const Config> new_config) noexcept
+{
+	if (old_config != config)
+		/* the configuration was reloaded meanwhile, which
+		   has resolved all host names already */
+		return;
+
+	fmt::print(stderr, "Game server addresses have changed\n");
+
+	config = std::move(new_config);
+}
+
+OverloadController::Signals
+Instance::GetOverloadSignals() noexcept
+{
+	/* tarpitted clients and those whose PROXY header is still
+	   missing hold a socket, too; a flood of these is exactly
+	   what this shall detect */
+	const std::size_t waiting_connections =
+		metrics.tarpit_connections + metrics.proxy_connections;
+
+	return {
+		.connections = metrics.client_connections + waiting_connections,
+		.verify_jobs = verify_pool.GetPendingJobs(),
+
+		/* an estimate: one socket per client and per
+		   server connection, two per pipe and the
+		   listeners; ignoring a few internal ones
+		   (eventfd, signalfd, epoll, log) */
+		.fds = metrics.client_connections + metrics.server_connections +
+			waiting_connections +
+			pipe_stock.GetFdCount() + n_listener_fds,
+	};
+}
+
+void
+Instance::OnOverload(bool overloaded) noexcept
+{
+	if (overloaded)
+		fmt::print(stderr, "Overloaded, pausing accepting new connections\n");
+	else
+		fmt::print(stderr, "Overload is over, resuming accepting new connections\n");
+
+	for (auto &i : listeners) {
+		if (overloaded)
+			i.Pause();
+		else
+			i.Resume();
+	}
 }
 
 void
 Instance::OnShutdown() noexcept
 {
 	shutdown_listener.Disable();
+	reload_signal.Disable();
+	handover_shutdown.Cancel();
+	loop_stats.Stop();
+	reresolver.Stop();
+	database.Shutdown();
+	overload_controller.Stop();
+	tcp_info_sampler.Stop();
+
+	if (reload_cancel_ptr)
+		reload_cancel_ptr.Cancel();
 
 	thread_pool_stop();
+	verify_pool.Stop();
 
 #ifdef HAVE_LIBSYSTEMD
 	systemd_watchdog.Disable();
 #endif
 
+	control_listener.reset();
 	knock_listeners.clear();
 	listeners.clear();
+	handover_listener.reset();
 	prometheus_exporter.reset();
+	cluster.reset();
+	knock_cookies.reset();
 
 	client_accounting.Shutdown();
 
 	thread_pool_join();
+
+	if (accounting_snapshot)
+		accounting_snapshot->Shutdown();
 }
 
 std::string
 Instance::OnPrometheusExporterRequest()
 {
-	return fmt::format(R"(
+	const auto snapshot_stats = accounting_snapshot
+		? accounting_snapshot->stats
+		: decltype(accounting_snapshot->stats){};
+
+	const LoopStats::Scope loop_scope{loop_stats, LoopCategory::PROMETHEUS};
+
+	auto result = fmt::format(R"(
 # HELP uologin_client_connections Current number of connections from clients
 # TYPE uologin_client_connections gauge
 
 # HELP uologin_server_connections Current number of connections to servers
 # TYPE uologin_server_connections gauge
 
+# HELP uologin_relay_connections Current number of sessions which have completed the handshake
+# TYPE uologin_relay_connections gauge
+
+# HELP uologin_tarpit_connections Current number of connections held in the tarpit
+# TYPE uologin_tarpit_connections gauge
+
+# HELP uologin_proxy_connections Current number of connections waiting for the PROXY protocol header
+# TYPE uologin_proxy_connections gauge
+
 # HELP uologin_client_connections_accepted Counter for connections accepted from clients
 # TYPE uologin_client_connections_accepted counter
 
@@ -92,9 +474,18 @@ Instance::OnPrometheusExporterRequest()
 # HELP uologin_server_connections_failed Counter for failures to connect to servers
 # TYPE uologin_server_connections_failed counter
 
-# HELP uologin_accepted_knocks Counter for accepted UDP knocks
+# HELP uologin_happy_eyeballs_races Counter for server connections where a second address was tried in parallel
+# TYPE uologin_happy_eyeballs_races counter
+
+# HELP uologin_happy_eyeballs_fallbacks Counter for server connections established to an address other than the first one
+# TYPE uologin_happy_eyeballs_fallbacks counter
+
+# HELP uologin_accepted_knocks Counter for UDP knocks accepted after password verification
 # TYPE uologin_accepted_knocks counter
 
+# HELP uologin_accepted_cookie_knocks Counter for UDP knocks accepted with a knock cookie
+# TYPE uologin_accepted_cookie_knocks counter
+
 # HELP uologin_rejected_knocks Counter for rejected UDP knocks
 # TYPE uologin_rejected_knocks counter
 
@@ -113,48 +504,176 @@ Instance::OnPrometheusExporterRequest()
 # HELP uologin_malformed_logins Counter for malformed logins
 # TYPE uologin_malformed_logins counter
 
+# HELP uologin_relayed_logins Counter for clients relayed to the game server with an auth ticket
+# TYPE uologin_relayed_logins counter
+
+# HELP uologin_handed_off_logins Counter for clients whose socket was passed to the game server
+# TYPE uologin_handed_off_logins counter
+
+# HELP uologin_handoff_errors Counter for clients which could not be passed to the game server (and were relayed instead)
+# TYPE uologin_handoff_errors counter
+
 # HELP uologin_delayed_connections Counter for delayed connections
 # TYPE uologin_delayed_connections counter
 
+# HELP uologin_malformed_proxy_headers Counter for connections with a malformed PROXY protocol header
+# TYPE uologin_malformed_proxy_headers counter
+
 # HELP uologin_client_bytes Counter for bytes forwarded from clients to servers
 # TYPE uologin_client_bytes counter
 
 # HELP uologin_server_bytes Counter for bytes forwarded from servers to clients
 # TYPE uologin_server_bytes counter
 
+# HELP uologin_relay_epoll_ctl Counter for changes of relay socket registrations (divide by forwarded bytes to compare relay modes)
+# TYPE uologin_relay_epoll_ctl counter
+
+# HELP uologin_handover_adopted_connections Counter for connections adopted from the old process
+# TYPE uologin_handover_adopted_connections counter
+
+# HELP uologin_handover_failed_connections Counter for connections which could not be adopted from the old process
+# TYPE uologin_handover_failed_connections counter
+
+# HELP uologin_config_reloads Counter for successful configuration reloads
+# TYPE uologin_config_reloads counter
+
+# HELP uologin_config_reload_errors Counter for failed configuration reloads
+# TYPE uologin_config_reload_errors counter
+
+# HELP uologin_tracked_users Number of usernames with failed logins being tracked
+# TYPE uologin_tracked_users gauge
+
+# HELP uologin_locked_out_users Number of usernames which are currently locked out
+# TYPE uologin_locked_out_users gauge
+
+# HELP uologin_user_lockouts Counter for usernames being locked out after too many failed logins
+# TYPE uologin_user_lockouts counter
+
+# HELP uologin_locked_out_verifications Counter for password verifications rejected because the username was locked out
+# TYPE uologin_locked_out_verifications counter
+
+# HELP uologin_tracked_user_evictions Counter for tracked usernames evicted because the table was full
+# TYPE uologin_tracked_user_evictions counter
+
+# HELP uologin_accounting_snapshot_items Number of items in the last client accounting snapshot
+# TYPE uologin_accounting_snapshot_items gauge
+
+# HELP uologin_accounting_snapshot_save_seconds Duration of the last client accounting snapshot save
+# TYPE uologin_accounting_snapshot_save_seconds gauge
+
+# HELP uologin_accounting_snapshot_load_seconds Duration of loading the client accounting snapshot at startup
+# TYPE uologin_accounting_snapshot_load_seconds gauge
+
+# HELP uologin_accounting_snapshot_errors Counter for failures to save the client accounting snapshot
+# TYPE uologin_accounting_snapshot_errors counter
+
 uologin_client_connections {}
 uologin_server_connections {}
+uologin_relay_connections {}
+uologin_tarpit_connections {}
+uologin_proxy_connections {}
 
 uologin_client_connections_accepted {}
 uologin_server_connections_established {}
 uologin_server_connections_failed {}
+uologin_happy_eyeballs_races {}
+uologin_happy_eyeballs_fallbacks {}
 
 uologin_accepted_knocks {}
+uologin_accepted_cookie_knocks {}
 uologin_rejected_knocks {}
 uologin_missing_knocks {}
 uologin_malformed_knocks {}
 uologin_accepted_logins {}
 uologin_rejected_logins {}
 uologin_malformed_logins {}
+uologin_relayed_logins {}
+uologin_handed_off_logins {}
+uologin_handoff_errors {}
 uologin_delayed_connections {}
+uologin_malformed_proxy_headers {}
 
 uologin_client_bytes {}
 uologin_server_bytes {}
+uologin_relay_epoll_ctl {}
+
+uologin_handover_adopted_connections {}
+uologin_handover_failed_connections {}
+
+uologin_config_reloads {}
+uologin_config_reload_errors {}
+
+uologin_tracked_users {}
+uologin_locked_out_users {}
+uologin_user_lockouts {}
+uologin_locked_out_verifications {}
+uologin_tracked_user_evictions {}
+
+uologin_accounting_snapshot_items {}
+uologin_accounting_snapshot_save_seconds {}
+uologin_accounting_snapshot_load_seconds {}
+uologin_accounting_snapshot_errors {}
 )",
 			   metrics.client_connections, metrics.server_connections,
+			   metrics.relay_connections,
+			   metrics.tarpit_connections, metrics.proxy_connections,
 			   metrics.client_connections_accepted,
 			   metrics.server_connections_established,
 			   metrics.server_connections_failed,
+			   metrics.happy_eyeballs_races,
+			   metrics.happy_eyeballs_fallbacks,
 
 			   metrics.accepted_knocks,
+			   metrics.accepted_cookie_knocks,
 			   metrics.rejected_knocks,
 			   metrics.missing_knocks,
 			   metrics.malformed_knocks,
 			   metrics.accepted_logins,
 			   metrics.rejected_logins,
 			   metrics.malformed_logins,
+			   metrics.relayed_logins,
+			   metrics.handed_off_logins,
+			   metrics.handoff_errors,
 			   metrics.delayed_connections,
-			   metrics.client_bytes, metrics.server_bytes);
+			   metrics.malformed_proxy_headers,
+			   metrics.client_bytes, metrics.server_bytes,
+			   metrics.relay_epoll_ctl,
+			   metrics.handover_adopted_connections,
+			   metrics.handover_failed_connections,
+			   metrics.config_reloads,
+			   metrics.config_reload_errors,
+			   user_accounting.size(),
+			   user_accounting.CountLockedOut(),
+			   user_accounting.stats.lockouts,
+			   user_accounting.stats.rejected_verifications,
+			   user_accounting.stats.evictions,
+			   snapshot_stats.saved_items,
+			   snapshot_stats.save_duration,
+			   snapshot_stats.load_duration,
+			   snapshot_stats.save_errors);
+
+	verify_pool.ExportMetrics(result);
+	database.ExportMetrics(result);
+
+	if (cluster)
+		cluster->ExportMetrics(result);
+
+	reresolver.ExportMetrics(result);
+
+	if (knock_cookies)
+		knock_cookies->ExportMetrics(result);
+
+	overload_controller.ExportMetrics(result);
+
+	heavy_hitters.ExportMetrics(result);
+	tcp_info_sampler.ExportMetrics(result);
+
+	if (RequireKnock())
+		knock_doorkeeper.ExportMetrics(result);
+
+	loop_stats.ExportMetrics(result);
+
+	return result;
 }
 
 void
@@ -4,12 +4,24 @@
 #pragma once
 
 #include "Database.hxx"
+#include "Doorkeeper.hxx"
+#include "HeavyHitters.hxx"
+#include "LoopStats.hxx"
+#include "OverloadController.hxx"
 #include "PipeStock.hxx"
+#include "Reresolver.hxx"
+#include "TcpInfoSampler.hxx"
+#include "UserAccounting.hxx"
+#include "VerifyPool.hxx"
+#include "event/DeferEvent.hxx"
 #include "event/Loop.hxx"
 #include "event/ShutdownListener.hxx"
+#include "event/SignalEvent.hxx"
 #include "event/net/PrometheusExporterHandler.hxx"
 #include "net/ClientAccounting.hxx"
 #include "net/SocketAddress.hxx"
+#include "net/UniqueSocketDescriptor.hxx"
+#include "util/Cancellable.hxx"
 #include "config.h"
 
 #ifdef HAVE_LIBSYSTEMD
@@ -22,60 +34,212 @@
 struct Config;
 class Listener;
 class KnockListener;
+class HandoverListener;
+class ControlListener;
+class Connection;
+class RelayConnection;
+class AccountingSnapshot;
+class Cluster;
+class KnockCookies;
 class PrometheusExporterListener;
+class SocketDescriptor;
 
 class Instance final
 	: PrometheusExporterHandler
 {
-	const Config &config;
+	const char *const config_path;
+
+	/**
+	 * The configuration this process was started with.  Settings
+	 * which cannot be reloaded (listeners, user database) are
+	 * read from here and may be referenced by pointer.
+	 */
+	const std::shared_ptr<const Config> initial_config;
+
+	/**
+	 * The current configuration snapshot.  It is replaced by
+	 * OnConfigLoaded(); existing connections keep a reference to
+	 * the snapshot they were created with.
+	 */
+	std::shared_ptr<const Config> config;
 
 	EventLoop event_loop;
+
+	LoopStats loop_stats{event_loop};
 	ShutdownListener shutdown_listener{event_loop, BIND_THIS_METHOD(OnShutdown)};
 
+	/**
+	 * SIGHUP reloads the configuration file.
+	 */
+	SignalEvent reload_signal{event_loop, BIND_THIS_METHOD(OnReloadSignal)};
+
+	CancellablePointer reload_cancel_ptr;
+
+	/**
+	 * Shuts down this process after all sockets have been handed
+	 * over to the new process.
+	 */
+	DeferEvent handover_shutdown{event_loop, BIND_THIS_METHOD(OnShutdown)};
+
+	/**
+	 * Periodically resolves the game server host names and
+	 * publishes a new snapshot if an address has changed.
+	 */
+	Reresolver reresolver{event_loop, config, BIND_THIS_METHOD(OnResolved)};
+
 #ifdef HAVE_LIBSYSTEMD
 	Systemd::Watchdog systemd_watchdog{event_loop};
 #endif
 
 	std::unique_ptr<PrometheusExporterListener> prometheus_exporter;
 
+	std::unique_ptr<HandoverListener> handover_listener;
+
 	PipeStock pipe_stock{event_loop};
 
+	/**
+	 * The number of listener sockets (for the overload "fds"
+	 * estimate).
+	 */
+	std::size_t n_listener_fds = 0;
+
+	/**
+	 * An unbound SOCK_DGRAM socket for sending handoff datagrams
+	 * (see GameServerHandoff.hxx); created on demand.
+	 */
+	UniqueSocketDescriptor handoff_socket;
+
+	UserAccounting user_accounting;
+
+	VerifyPool verify_pool;
+
+	OverloadController overload_controller;
+
 	Database database;
 
+	HeavyHitters heavy_hitters{event_loop};
+
+	/**
+	 * Guards #client_accounting against one-shot knock sources.
+	 */
+	Doorkeeper knock_doorkeeper;
+
 	ClientAccountingMap client_accounting{event_loop, 16, true};
 
+	std::unique_ptr<AccountingSnapshot> accounting_snapshot;
+
+	std::unique_ptr<Cluster> cluster;
+
+	/**
+	 * Only set if "knock_cookie_lifetime" is configured.
+	 */
+	std::unique_ptr<KnockCookies> knock_cookies;
+
+	/**
+	 * Declared before #listeners because it gets notified when
+	 * their relays are destroyed.
+	 */
+	TcpInfoSampler tcp_info_sampler{*this, initial_config->tcp_info_samples};
+
 	std::forward_list<Listener> listeners;
 	std::forward_list<KnockListener> knock_listeners;
 
+	/**
+	 * Declared after #listeners because its dumps point into
+	 * the #Listener objects.
+	 */
+	std::unique_ptr<ControlListener> control_listener;
+
 public:
 	struct {
 		std::size_t client_connections, server_connections;
 
+		/**
+		 * The number of #RelayConnection objects (included in
+		 * #client_connections and #server_connections).
+		 */
+		std::size_t relay_connections;
+
+		/**
+		 * The number of #DelayedConnection and
+		 * #ProxyConnection objects (not included in
+		 * #client_connections).
+		 */
+		std::size_t tarpit_connections, proxy_connections;
+
 		uint_least64_t client_connections_accepted, server_connections_established, server_connections_failed;
+		uint_least64_t happy_eyeballs_races, happy_eyeballs_fallbacks;
 
-		uint_least64_t accepted_knocks, rejected_knocks, malformed_knocks, missing_knocks;
+		uint_least64_t accepted_knocks, accepted_cookie_knocks;
+		uint_least64_t rejected_knocks, malformed_knocks, missing_knocks;
 		uint_least64_t accepted_logins, rejected_logins, malformed_logins;
+		uint_least64_t relayed_logins;
+		uint_least64_t handed_off_logins, handoff_errors;
 		uint_least64_t delayed_connections;
+		uint_least64_t malformed_proxy_headers;
 
 		uint_least64_t client_bytes, server_bytes;
+
+		/**
+		 * The number of (potential) epoll_ctl() calls by
+		 * #RelayConnection objects.
+		 */
+		uint_least64_t relay_epoll_ctl;
+
+		uint_least64_t handover_adopted_connections, handover_failed_connections;
+
+		uint_least64_t config_reloads, config_reload_errors;
 	} metrics{};
 
+	/**
+	 * @param _config the initial configuration; only
+	 * "game_server", "game_server_handoff", "send_remote_ip",
+	 * "send_proxy_protocol", "login_server_mode",
+	 * "auth_ticket_key_file", "resolve_interval" and
+	 * "relay_edge_triggered" can be reloaded later
+	 */
 	[[nodiscard]]
-	explicit Instance(const Config &_config);
+	Instance(std::shared_ptr<const Config> _config, const char *_config_path);
 	~Instance() noexcept;
 
 	const Config &GetConfig() const noexcept {
+		return *config;
+	}
+
+	const std::shared_ptr<const Config> &GetConfigPtr() const noexcept {
 		return config;
 	}
 
+	/**
+	 * Reload the configuration file in a worker thread and
+	 * publish the new snapshot when done.
+	 */
+	void ReloadConfig() noexcept;
+
 	EventLoop &GetEventLoop() noexcept {
 		return event_loop;
 	}
 
+	LoopStats &GetLoopStats() noexcept {
+		return loop_stats;
+	}
+
+	OverloadController &GetOverloadController() noexcept {
+		return overload_controller;
+	}
+
 	PipeStock &GetPipeStock() noexcept {
 		return pipe_stock;
 	}
 
+	/**
+	 * Returns the socket for sending handoff datagrams, creating
+	 * it if necessary.
+	 *
+	 * Throws on error.
+	 */
+	SocketDescriptor GetHandoffSocket();
+
 	bool RequireKnock() const noexcept {
 		return !knock_listeners.empty();
 	}
@@ -84,19 +248,105 @@ public:
 		return database;
 	}
 
+	const std::forward_list<Listener> &GetListeners() const noexcept {
+		return listeners;
+	}
+
+	HeavyHitters &GetHeavyHitters() noexcept {
+		return heavy_hitters;
+	}
+
+	ClientAccountingMap &GetClientAccountingMap() noexcept {
+		return client_accounting;
+	}
+
+	KnockCookies *GetKnockCookies() noexcept {
+		return knock_cookies.get();
+	}
+
 	[[gnu::pure]]
 	PerClientAccounting *GetClientAccounting(SocketAddress address) noexcept {
 		return client_accounting.Get(address);
 	}
 
+	/**
+	 * Like GetClientAccounting(), but for knock datagrams: a
+	 * client which is not yet known gets an item only on its
+	 * second knock (see #Doorkeeper).
+	 *
+	 * @return the item or nullptr if the client was not
+	 * admitted (yet)
+	 */
+	PerClientAccounting *GetKnockClientAccounting(SocketAddress address) noexcept;
+
+	/**
+	 * Look up an existing accounting item without creating one
+	 * and without consulting the #Doorkeeper.
+	 */
+	[[gnu::pure]]
+	PerClientAccounting *FindClientAccounting(SocketAddress address) noexcept {
+		const auto key = ClientAccountingMap::GetKey(address);
+		return key != 0 ? client_accounting.Find(key) : nullptr;
+	}
+
 	void AddPrometheusExporter(UniqueSocketDescriptor &&socket) noexcept;
 	void AddListener(UniqueSocketDescriptor &&fd) noexcept;
 	void AddKnockListener(UniqueSocketDescriptor &&fd,
 			      const char *nft_set) noexcept;
+	void AddHandoverListener(UniqueSocketDescriptor &&fd) noexcept;
+	void AddControlListener(UniqueSocketDescriptor &&fd) noexcept;
+
+	/**
+	 * Called by the #Connection destructor (for the control
+	 * socket's dump cursors).
+	 */
+	void OnConnectionDestroyed(const Connection &c) noexcept;
+
+	/**
+	 * Called by the #RelayConnection destructor.
+	 */
+	void OnRelayDestroyed(const RelayConnection &r) noexcept;
+
+	/**
+	 * Start exchanging client accounting changes with the
+	 * configured cluster peers.
+	 */
+	void AddCluster(UniqueSocketDescriptor &&fd) noexcept;
+
+	/**
+	 * Pass all listeners and connections to a new process over
+	 * the given (blocking) socket and then shut down.
+	 */
+	void HandoverTo(SocketDescriptor s) noexcept;
+
+	/**
+	 * Receive listeners and connections from the old process
+	 * (the counterpart of HandoverTo()).
+	 *
+	 * Throws on error.
+	 *
+	 * @return true if at least one listener was received
+	 */
+	bool ReceiveHandover(SocketDescriptor s);
 
 private:
 	void OnShutdown() noexcept;
 
+	void OnReloadSignal(int signo) noexcept;
+	void OnConfigLoaded(std::shared_ptr<const Config> new_config,
+			    std::exception_ptr error) noexcept;
+	void OnResolved(const std::shared_ptr<const Config> &old_config,
+			std::shared_ptr<const Config> new_config) noexcept;
+
+	OverloadController::Signals GetOverloadSignals() noexcept;
+	void OnOverload(bool overloaded) noexcept;
+
+	/**
+	 * Called by #Cluster when a client has knocked on another
+	 * node.
+	 */
+	void OnRemoteKnock(uint_least64_t address) noexcept;
+
 	/* virtual methods from class PrometheusExporterHandler */
 	std::string OnPrometheusExporterRequest() override;
 	void OnPrometheusExporterError(std::exception_ptr error) noexcept override;
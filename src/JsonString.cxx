@@ -0,0 +1,28 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+// author: Max Kellermann <max.kellermann@gmail.com>
+
+#include "JsonString.hxx"
+
+#include <fmt/format.h>
+
+#include <iterator> // for std::back_inserter()
+
+void
+AppendJsonString(std::string &out, std::string_view value) noexcept
+{
+	out.push_back('"');
+
+	for (const char ch : value) {
+		const auto b = static_cast<unsigned char>(ch);
+
+		if (ch == '"' || ch == '\\') {
+			out.push_back('\\');
+			out.push_back(ch);
+		} else if (b < 0x20 || b >= 0x7f)
+			fmt::format_to(std::back_inserter(out), "\\u{:04x}", b);
+		else
+			out.push_back(ch);
+	}
+
+	out.push_back('"');
+}
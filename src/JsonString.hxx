@@ -0,0 +1,16 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+// author: Max Kellermann <max.kellermann@gmail.com>
+
+#pragma once
+
+#include <string>
+#include <string_view>
+
+/**
+ * Append a JSON string literal (including the double quotes).
+ * Control characters and all bytes outside of the ASCII range are
+ * escaped as "\u00XX", so the output is valid JSON even if the
+ * input is arbitrary binary data (e.g. the path of a local socket).
+ */
+void
+AppendJsonString(std::string &out, std::string_view value) noexcept;
@@ -0,0 +1,200 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+// author: Max Kellermann <max.kellermann@gmail.com>
+
+#include "KnockCookies.hxx"
+#include "ClientAddress.hxx"
+
+#include <sodium/crypto_generichash.h>
+#include <sodium/utils.h>
+
+#include <fmt/format.h>
+
+#include <algorithm> // for std::copy()
+#include <iterator> // for std::back_inserter()
+
+static_assert(crypto_generichash_KEYBYTES == KnockCookies::KEY_SIZE);
+
+/**
+ * The size of the binary cookie (see KnockCookies.hxx).
+ */
+static constexpr std::size_t HEADER_SIZE = 1 + 4, MAC_SIZE = 16;
+static constexpr std::size_t BINARY_SIZE = HEADER_SIZE + MAC_SIZE;
+
+static_assert(1 + (BINARY_SIZE * 4 + 2) / 3 == KNOCK_COOKIE_LENGTH);
+
+static void
+CalculateMac(std::span<std::byte, MAC_SIZE> dest,
+	     std::span<const std::byte, KnockCookies::KEY_SIZE> key,
+	     std::span<const std::byte, HEADER_SIZE> header,
+	     SocketAddress client, std::string_view upper_username) noexcept
+{
+	std::array<std::byte, HEADER_SIZE + 16 + 30> message;
+	std::size_t length = std::copy(header.begin(), header.end(),
+				       message.begin()) - message.begin();
+
+	ExportClientAddress(message.data() + length, client);
+	length += 16;
+
+	if (upper_username.size() > message.size() - length)
+		upper_username = upper_username.substr(0, message.size() - length);
+
+	length = std::copy(upper_username.begin(), upper_username.end(),
+			   reinterpret_cast<char *>(message.data() + length))
+		- reinterpret_cast<char *>(message.data());
+
+	crypto_generichash(reinterpret_cast<unsigned char *>(dest.data()), dest.size(),
+			   reinterpret_cast<const unsigned char *>(message.data()), length,
+			   reinterpret_cast<const unsigned char *>(key.data()), key.size());
+}
+
+static uint_least32_t
+ToEpochSeconds(std::chrono::system_clock::time_point t) noexcept
+{
+	return std::chrono::duration_cast<std::chrono::seconds>(t.time_since_epoch()).count();
+}
+
+void
+KnockCookies::DeriveKey(Key &key, uint_least64_t period) const noexcept
+{
+	std::array<std::byte, 8> message;
+	for (unsigned i = 0; i < message.size(); ++i)
+		message[i] = static_cast<std::byte>(period >> (56 - 8 * i));
+
+	crypto_generichash(reinterpret_cast<unsigned char *>(key.data.data()), key.data.size(),
+			   reinterpret_cast<const unsigned char *>(message.data()), message.size(),
+			   reinterpret_cast<const unsigned char *>(master_key.data()), master_key.size());
+
+	key.period = period;
+	key.id = static_cast<uint_least8_t>(period);
+}
+
+KnockCookies::KnockCookies(std::span<const std::byte, KEY_SIZE> _master_key,
+			   std::chrono::seconds _lifetime) noexcept
+	:lifetime(_lifetime)
+{
+	std::copy(_master_key.begin(), _master_key.end(), master_key.begin());
+
+	const uint_least64_t period = ToEpochSeconds(std::chrono::system_clock::now()) / lifetime.count();
+	DeriveKey(current, period);
+	DeriveKey(previous, period - 1);
+}
+
+void
+KnockCookies::UpdateKeys(std::chrono::system_clock::time_point now) noexcept
+{
+	const uint_least64_t period = ToEpochSeconds(now) / lifetime.count();
+	if (period == current.period)
+		return;
+
+	if (period == current.period + 1)
+		previous = current;
+	else
+		DeriveKey(previous, period - 1);
+
+	DeriveKey(current, period);
+	++stats.rotations;
+}
+
+KnockCookie
+KnockCookies::Make(SocketAddress client,
+		   std::string_view upper_username) noexcept
+{
+	const auto now = std::chrono::system_clock::now();
+	UpdateKeys(now);
+
+	const uint_least32_t expires = ToEpochSeconds(now + lifetime);
+
+	std::array<std::byte, BINARY_SIZE> binary;
+	binary[0] = static_cast<std::byte>(current.id);
+	for (unsigned i = 0; i < 4; ++i)
+		binary[1 + i] = static_cast<std::byte>(expires >> (24 - 8 * i));
+
+	CalculateMac(std::span{binary}.subspan<HEADER_SIZE>(), current.data,
+		     std::span{binary}.first<HEADER_SIZE>(),
+		     client, upper_username);
+
+	/* sodium_bin2base64() writes a null terminator */
+	std::array<char, KNOCK_COOKIE_LENGTH + 1> buffer;
+	buffer[0] = '~';
+	sodium_bin2base64(buffer.data() + 1, buffer.size() - 1,
+			  reinterpret_cast<const unsigned char *>(binary.data()), binary.size(),
+			  sodium_base64_VARIANT_URLSAFE_NO_PADDING);
+
+	KnockCookie cookie;
+	std::copy_n(buffer.begin(), cookie.size(), cookie.begin());
+
+	++stats.issued;
+	return cookie;
+}
+
+bool
+KnockCookies::Verify(std::string_view cookie, SocketAddress client,
+		     std::string_view upper_username) noexcept
+{
+	if (!IsCookie(cookie)) {
+		++stats.rejected;
+		return false;
+	}
+
+	cookie.remove_prefix(1);
+
+	std::array<std::byte, BINARY_SIZE> binary;
+	std::size_t binary_size;
+	if (sodium_base642bin(reinterpret_cast<unsigned char *>(binary.data()), binary.size(),
+			      cookie.data(), cookie.size(),
+			      nullptr, &binary_size, nullptr,
+			      sodium_base64_VARIANT_URLSAFE_NO_PADDING) != 0 ||
+	    binary_size != binary.size()) {
+		++stats.rejected;
+		return false;
+	}
+
+	const auto now = std::chrono::system_clock::now();
+	UpdateKeys(now);
+
+	const uint_least8_t id = static_cast<uint_least8_t>(binary[0]);
+	const Key *key = id == current.id
+		? &current
+		: (id == previous.id ? &previous : nullptr);
+
+	uint_least32_t expires = 0;
+	for (unsigned i = 0; i < 4; ++i)
+		expires = (expires << 8) | static_cast<uint_least32_t>(binary[1 + i]);
+
+	if (key == nullptr ||
+	    expires < ToEpochSeconds(now)) {
+		++stats.rejected;
+		return false;
+	}
+
+	std::array<std::byte, MAC_SIZE> mac;
+	CalculateMac(mac, key->data, std::span{binary}.first<HEADER_SIZE>(),
+		     client, upper_username);
+
+	if (sodium_memcmp(mac.data(), binary.data() + HEADER_SIZE, mac.size()) != 0) {
+		++stats.rejected;
+		return false;
+	}
+
+	return true;
+}
+
+void
+KnockCookies::ExportMetrics(std::string &out) const noexcept
+{
+	fmt::format_to(std::back_inserter(out), R"(
+# HELP uologin_knock_cookies_issued Counter for knock cookies sent to clients
+# TYPE uologin_knock_cookies_issued counter
+
+# HELP uologin_knock_cookies_rejected Counter for invalid or expired knock cookies
+# TYPE uologin_knock_cookies_rejected counter
+
+# HELP uologin_knock_cookie_key_rotations Counter for knock cookie key rotations
+# TYPE uologin_knock_cookie_key_rotations counter
+
+uologin_knock_cookies_issued {}
+uologin_knock_cookies_rejected {}
+uologin_knock_cookie_key_rotations {}
+)",
+		       stats.issued, stats.rejected, stats.rotations);
+}
@@ -0,0 +1,114 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+// author: Max Kellermann <max.kellermann@gmail.com>
+
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <string>
+#include <string_view>
+
+class SocketAddress;
+
+/*
+ * A knock cookie lets a client which has recently knocked with a
+ * valid password knock again without another (expensive) password
+ * verification.
+ *
+ * After a successful password knock, uologin replies with one UDP
+ * datagram containing the cookie as #KNOCK_COOKIE_LENGTH ASCII
+ * characters (no null terminator).  The client sends this string
+ * instead of the password in the password field of its next knocks
+ * until it expires.  A rejected cookie is verified as a password
+ * (any printable string may be a password), so it counts as a failed
+ * login; the client should switch back to its password before the
+ * cookie expires.
+ *
+ * The string is '~' followed by 21 bytes in URL-safe base64 without
+ * padding:
+ *
+ * - key id (1 byte)
+ * - expiry time in seconds since the epoch (32 bit big-endian)
+ * - the first 16 bytes of the keyed BLAKE2b hash
+ *   (crypto_generichash()) of the 5 bytes above, the client's IP
+ *   address (16 bytes, IPv4 as IPv4-mapped IPv6 address) and the
+ *   upper case username
+ *
+ * The key is derived from the configured master key
+ * ("knock_cookie_key_file") and the current period (seconds since
+ * the epoch divided by the lifetime); the key id is the lowest byte
+ * of the period number.  Therefore cookies survive a restart and
+ * are accepted by all nodes which share the key file.  The key of
+ * the previous period remains valid, so a cookie never outlives its
+ * key.
+ */
+
+static constexpr std::size_t KNOCK_COOKIE_LENGTH = 29;
+
+using KnockCookie = std::array<char, KNOCK_COOKIE_LENGTH>;
+
+class KnockCookies {
+public:
+	static constexpr std::size_t KEY_SIZE = 32;
+
+private:
+	struct Key {
+		std::array<std::byte, KEY_SIZE> data;
+		uint_least64_t period;
+		uint_least8_t id;
+	};
+
+	std::array<std::byte, KEY_SIZE> master_key;
+
+	const std::chrono::seconds lifetime;
+
+	Key current, previous;
+
+public:
+	struct {
+		uint_least64_t issued, rejected, rotations;
+	} stats{};
+
+	KnockCookies(std::span<const std::byte, KEY_SIZE> _master_key,
+		     std::chrono::seconds _lifetime) noexcept;
+
+	/**
+	 * May this password field contain a cookie?  This is only a
+	 * hint: a password may look like a cookie, therefore a
+	 * rejected cookie must still be verified as a password.
+	 */
+	static constexpr bool IsCookie(std::string_view password) noexcept {
+		return password.size() == KNOCK_COOKIE_LENGTH &&
+			password.front() == '~';
+	}
+
+	/**
+	 * Generate a cookie for the given client.
+	 */
+	KnockCookie Make(SocketAddress client,
+			 std::string_view upper_username) noexcept;
+
+	/**
+	 * Check a cookie received in the password field of a knock.
+	 * This is cheap enough to be done in the event loop.
+	 */
+	bool Verify(std::string_view cookie, SocketAddress client,
+		    std::string_view upper_username) noexcept;
+
+	/**
+	 * Append Prometheus metrics to the given string.
+	 */
+	void ExportMetrics(std::string &out) const noexcept;
+
+private:
+	void DeriveKey(Key &key, uint_least64_t period) const noexcept;
+
+	/**
+	 * Switch to the keys of the current period if it has
+	 * changed.
+	 */
+	void UpdateKeys(std::chrono::system_clock::time_point now) noexcept;
+};
@@ -4,108 +4,144 @@
 #include "KnockListener.hxx"
 #include "Instance.hxx"
 #include "Validate.hxx"
+#include "KnockCookies.hxx"
+#include "LoopStats.hxx"
 #include "Nftables.hxx"
+#include "Probes.hxx"
+#include "Username.hxx"
 #include "uo/Command.hxx"
-#include "uo/Packets.hxx"
 #include "uo/String.hxx"
 #include "lib/fmt/ExceptionFormatter.hxx"
 #include "lib/fmt/SocketAddressFormatter.hxx"
-#include "net/AllocatedSocketAddress.hxx"
 #include "net/MultiReceiveMessage.hxx"
 #include "net/ToString.hxx"
 #include "net/UniqueSocketDescriptor.hxx"
-#include "util/Cancellable.hxx"
 #include "util/PrintException.hxx"
 
+#include <algorithm> // for std::copy_n()
+#include <cassert>
+
+#include <sys/socket.h> // for sendto()
+
+/**
+ * The number of datagrams received with one recvmmsg() call; this is
+ * also the maximum size of one #Batch.
+ */
+static constexpr std::size_t MAX_BATCH = 1024;
+
 KnockListener::KnockListener(Instance &_instance, UniqueSocketDescriptor &&socket,
 			     const char *_nft_set)
 	:instance(_instance),
 	 udp_listener(instance.GetEventLoop(), std::move(socket),
-		      MultiReceiveMessage{1024, sizeof(struct uo_packet_account_login)},
+		      MultiReceiveMessage{MAX_BATCH, sizeof(struct uo_packet_account_login)},
 		      *this),
-	 nft_set(_nft_set)
+	 nft_set(_nft_set),
+	 flush_event(instance.GetEventLoop(), BIND_THIS_METHOD(Flush))
 {
+	pending.reserve(MAX_BATCH);
 }
 
-class KnockListener::Request final {
+/**
+ * A batch of knocks which is being verified by the #VerifyPool
+ * (see Database::CheckCredentialsBatch()).
+ */
+class KnockListener::Batch final : public AutoUnlinkIntrusiveListHook {
 	Instance &instance;
 	const char *const nft_set;
 
-	const AllocatedSocketAddress address;
+	/**
+	 * The listener which received the knocks (for sending
+	 * cookies); nullptr if it has been destroyed meanwhile.
+	 */
+	KnockListener *listener;
 
-	/* this field is never used because UDP requests cannot be
-	   canceled */
-	CancellablePointer cancel_ptr;
+	std::vector<CredentialsBatchItem> items;
+
+	/**
+	 * The client addresses, parallel to #items.
+	 */
+	std::vector<StaticSocketAddress> addresses;
 
 public:
-	Request(Instance &_instance, const char *_nft_set,
-		std::string_view username, std::string_view password,
-		SocketAddress _address) noexcept
-		:instance(_instance), nft_set(_nft_set),
-		 address(_address) {
-		instance.GetDatabase().CheckCredentials(username, password,
-							BIND_THIS_METHOD(OnCheckCredentials), cancel_ptr);
+	Batch(Instance &_instance, KnockListener &_listener) noexcept
+		:instance(_instance), nft_set(_listener.nft_set),
+		 listener(&_listener) {}
+
+	void DetachListener() noexcept {
+		listener = nullptr;
 	}
 
-private:
-	void OnCheckCredentials(std::string_view username, bool result) noexcept;
-};
+	void Reserve(std::size_t n) noexcept {
+		items.reserve(n);
+		addresses.reserve(n);
+	}
 
-bool
-KnockListener::OnUdpDatagram(std::span<const std::byte> payload,
-			     std::span<UniqueFileDescriptor>,
-			     SocketAddress address, int)
-{
-	auto *accounting = instance.GetClientAccounting(address);
-	if (accounting == nullptr)
-		return true;
-
-	const auto &packet = *reinterpret_cast<const struct uo_packet_account_login *>(payload.data());
-	if (payload.size() != sizeof(packet) ||
-	    packet.cmd != UO::Command::AccountLogin) {
-		if (accounting != nullptr)
-			accounting->UpdateTokenBucket(10);
-		++instance.metrics.malformed_knocks;
-		return true;
+	bool empty() const noexcept {
+		return items.empty();
 	}
 
-	const auto username = UO::ExtractString(packet.credentials.username);
-	const auto password = UO::ExtractString(packet.credentials.password);
-	if (!IsValidUsername(username)) {
-		if (accounting != nullptr)
-			accounting->UpdateTokenBucket(8);
-		++instance.metrics.malformed_knocks;
-		return true;
+	void Add(const UO::CredentialsFragment &credentials,
+		 SocketAddress address) noexcept {
+		auto &item = items.emplace_back();
+		item.Set(UO::ExtractString(credentials.username),
+			 UO::ExtractString(credentials.password));
+		addresses.emplace_back(address);
 	}
 
-	new Request(instance, nft_set, username, password, address);
+	/**
+	 * Submit this batch to the #Database.  If that fails (e.g.
+	 * because the database could not be loaded), all knocks are
+	 * rejected and this object is deleted.
+	 */
+	void Submit() noexcept {
+		try {
+			instance.GetDatabase().CheckCredentialsBatch(items,
+								     BIND_THIS_METHOD(OnCheckCredentials));
+		} catch (...) {
+			PrintException(std::current_exception());
+			instance.metrics.rejected_knocks += items.size();
+			delete this;
+		}
+	}
 
-	return true;
+private:
+	void OnCheckCredentials(std::span<CredentialsBatchItem> items) noexcept;
+};
+
+KnockListener::~KnockListener() noexcept
+{
+	batches.clear_and_dispose([](Batch *batch){
+		batch->DetachListener();
+	});
 }
 
-void
-KnockListener::Request::OnCheckCredentials(std::string_view username, bool result) noexcept
+/**
+ * Mark the client as knocked (after its password or cookie has been
+ * verified).
+ *
+ * @param how a word for the log message
+ */
+static void
+AcceptKnock(Instance &instance, const char *nft_set,
+	    std::string_view username, SocketAddress address,
+	    const char *how) noexcept
 {
 	auto *accounting = instance.GetClientAccounting(address);
 	if (accounting == nullptr)
 		return;
 
-	if (!result) {
-		if (accounting != nullptr)
-			accounting->UpdateTokenBucket(5);
-		++instance.metrics.rejected_knocks;
-		delete this;
-		return;
-	}
+	UOLOGIN_PROBE(knock_accept, accounting->GetAddressKey(), how);
 
-	fmt::print(stderr, "Accepted knock for user {:?} from {}\n",
-		   username, address);
-	++instance.metrics.accepted_knocks;
+	fmt::print(stderr, "Accepted knock ({}) for user {:?} from {}\n",
+		   how, username, address);
 
 	accounting->SetKnocked();
 
 	if (nft_set != nullptr) {
 		if (const auto ip = HostToString(address); !ip.empty()) {
+			const LoopStats::Scope loop_scope{instance.GetLoopStats(),
+							  LoopCategory::NFTABLES};
+
 			try {
 				NftAddElement("inet", "filter", nft_set, ip.c_str());
 			} catch (...) {
@@ -113,6 +149,186 @@ KnockListener::Request::OnCheckCredentials(std::string_view username, bool resul
 			}
 		}
 	}
+}
+
+/**
+ * Check the cookie in the password field of a knock.
+ *
+ * @return true if the knock was accepted
+ */
+static bool
+CheckKnockCookie(KnockCookies &cookies,
+		 const UO::CredentialsFragment &credentials,
+		 SocketAddress address) noexcept
+{
+	const auto password = UO::ExtractString(credentials.password);
+	assert(KnockCookies::IsCookie(password));
+
+	UpperUsernameBuffer upper_username_buffer;
+	const auto upper_username = ToUpperUsername(upper_username_buffer,
+						    UO::ExtractString(credentials.username));
+	return upper_username.data() != nullptr &&
+		cookies.Verify(password, address, upper_username);
+}
+
+void
+KnockListener::SendCookie(SocketAddress address,
+			  std::string_view upper_username) noexcept
+{
+	auto *cookies = instance.GetKnockCookies();
+	if (cookies == nullptr)
+		return;
+
+	const auto cookie = cookies->Make(address, upper_username);
+
+	/* errors are ignored; the client will knock with its
+	   password again */
+	sendto(GetSocket().Get(), cookie.data(), cookie.size(),
+	       MSG_DONTWAIT|MSG_NOSIGNAL,
+	       address.GetAddress(), address.GetSize());
+}
+
+bool
+KnockListener::OnUdpDatagram(std::span<const std::byte> payload,
+			     std::span<UniqueFileDescriptor>,
+			     SocketAddress address, int)
+{
+	/* only copy the datagram; validation is done for the whole
+	   batch by Flush() */
+
+	auto &knock = pending.emplace_back();
+	knock.address = address;
+	knock.size_ok = payload.size() == sizeof(knock.packet);
+	std::copy_n(payload.begin(),
+		    std::min(payload.size(), sizeof(knock.packet)),
+		    reinterpret_cast<std::byte *>(&knock.packet));
+
+	if (pending.size() >= MAX_BATCH)
+		Flush();
+	else
+		flush_event.Schedule();
+
+	return true;
+}
+
+void
+KnockListener::Flush() noexcept
+{
+	flush_event.Cancel();
+
+	if (pending.empty())
+		return;
+
+	const LoopStats::Scope loop_scope{instance.GetLoopStats(),
+					  LoopCategory::KNOCK_BATCH};
+
+	/* first pass: validate all datagrams; this loop has no
+	   data-dependent branches */
+
+	bool valid[MAX_BATCH];
+	assert(pending.size() <= MAX_BATCH);
+
+	for (std::size_t i = 0; i < pending.size(); ++i) {
+		const auto &knock = pending[i];
+		const auto &credentials = knock.packet.credentials;
+		valid[i] = knock.size_ok &
+			(knock.packet.cmd == UO::Command::AccountLogin) &
+			IsValidStringField(credentials.username, false) &
+			IsValidStringField(credentials.password, true);
+	}
+
+	/* second pass: accounting and collecting the survivors */
+
+	auto *const cookies = instance.GetKnockCookies();
+
+	auto *batch = new Batch(instance, *this);
+	batch->Reserve(pending.size());
+
+	for (std::size_t i = 0; i < pending.size(); ++i) {
+		const auto &knock = pending[i];
+
+		/* a client which knocks for the first time gets no
+		   accounting item yet; a second knock or a
+		   successful verification creates one */
+		auto *accounting = instance.GetKnockClientAccounting(knock.address);
+
+		if (!valid[i]) {
+			/* a well-formed packet with a bad username
+			   is penalized a bit less */
+			if (accounting != nullptr)
+				accounting->UpdateTokenBucket(knock.size_ok &&
+							      knock.packet.cmd == UO::Command::AccountLogin
+							      ? 8 : 10);
+			++instance.metrics.malformed_knocks;
+			UOLOGIN_PROBE(knock_reject,
+				      ClientAccountingMap::GetKey(knock.address),
+				      "malformed");
+			continue;
+		}
+
+		if (cookies != nullptr &&
+		    KnockCookies::IsCookie(UO::ExtractString(knock.packet.credentials.password)) &&
+		    CheckKnockCookie(*cookies, knock.packet.credentials, knock.address)) {
+			/* no password verification needed */
+			AcceptKnock(instance, nft_set,
+				    UO::ExtractString(knock.packet.credentials.username),
+				    knock.address, "cookie");
+			++instance.metrics.accepted_cookie_knocks;
+			continue;
+		}
+
+		/* a rejected cookie may as well be a password which
+		   happens to look like one; verify it like any other
+		   password, which also penalizes and counts it if it
+		   is wrong */
+		batch->Add(knock.packet.credentials, knock.address);
+	}
+
+	pending.clear();
+
+	if (batch->empty()) {
+		delete batch;
+		return;
+	}
+
+	batches.push_back(*batch);
+	batch->Submit();
+}
+
+void
+KnockListener::Batch::OnCheckCredentials(std::span<CredentialsBatchItem> _items) noexcept
+{
+	assert(_items.size() == addresses.size());
+
+	const LoopStats::Scope loop_scope{instance.GetLoopStats(),
+					  LoopCategory::KNOCK_RESULT};
+
+	for (std::size_t i = 0; i < _items.size(); ++i) {
+		const auto &item = _items[i];
+		const SocketAddress address = addresses[i];
+
+		if (item.result) {
+			AcceptKnock(instance, nft_set, item.GetUsername(), address,
+				    "password");
+			++instance.metrics.accepted_knocks;
+
+			if (listener != nullptr)
+				listener->SendCookie(address, item.GetUpperUsername());
+			continue;
+		}
+
+		UOLOGIN_PROBE(knock_reject, ClientAccountingMap::GetKey(address),
+			      "password");
+
+		/* Flush() has already counted this datagram in the
+		   doorkeeper; don't count it twice (and don't
+		   allocate an item just for the penalty) */
+		if (auto *accounting = instance.FindClientAccounting(address))
+			accounting->UpdateTokenBucket(5);
+
+		++instance.metrics.rejected_knocks;
+		instance.GetHeavyHitters().AddRejectedUsername(item.GetUsername());
+	}
 
 	delete this;
 }
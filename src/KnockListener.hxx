@@ -3,8 +3,16 @@
 
 #pragma once
 
+#include "uo/Packets.hxx"
+#include "event/DeferEvent.hxx"
 #include "event/net/MultiUdpListener.hxx"
 #include "event/net/UdpHandler.hxx"
+#include "net/StaticSocketAddress.hxx"
+#include "util/IntrusiveList.hxx"
+
+#include <string_view>
+
+#include <vector>
 
 struct Config;
 class Instance;
@@ -15,14 +23,54 @@ class KnockListener final : UdpHandler {
 	MultiUdpListener udp_listener;
 	const char *const nft_set;
 
-	class Request;
+	/**
+	 * A datagram which was received but not yet validated.
+	 */
+	struct PendingKnock {
+		StaticSocketAddress address;
+		struct uo_packet_account_login packet;
+		bool size_ok;
+	};
+
+	/**
+	 * Datagrams received by #udp_listener during this event loop
+	 * iteration.  They are validated and submitted all at once by
+	 * Flush().
+	 */
+	std::vector<PendingKnock> pending;
+
+	/**
+	 * Calls Flush() after #udp_listener has delivered its batch.
+	 */
+	DeferEvent flush_event;
+
+	class Batch;
+
+	/**
+	 * Batches which are currently being verified.
+	 */
+	IntrusiveList<Batch> batches;
 
 public:
 	[[nodiscard]]
 	KnockListener(Instance &_instance, UniqueSocketDescriptor &&socket,
 		      const char *_nft_set);
+	~KnockListener() noexcept;
+
+	SocketDescriptor GetSocket() const noexcept {
+		return udp_listener.GetSocket();
+	}
 
 private:
+	void Flush() noexcept;
+
+	/**
+	 * Send a knock cookie (see KnockCookies.hxx) to the client if
+	 * cookies are enabled.
+	 */
+	void SendCookie(SocketAddress address,
+			std::string_view upper_username) noexcept;
+
 	// virtual methods from UdpHandler
 	bool OnUdpDatagram(std::span<const std::byte> payload,
 			   std::span<UniqueFileDescriptor> fds,
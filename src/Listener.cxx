@@ -4,38 +4,83 @@
 #include "Listener.hxx"
 #include "Instance.hxx"
 #include "Connection.hxx"
+#include "RelayConnection.hxx"
 #include "DelayedConnection.hxx"
+#include "LoopStats.hxx"
+#include "Probes.hxx"
+#include "ProxyConnection.hxx"
 #include "lib/fmt/SocketAddressFormatter.hxx"
 #include "time/Cast.hxx"
 #include "util/PrintException.hxx"
 
-Listener::Listener(Instance &_instance, UniqueSocketDescriptor &&socket)
+Listener::Listener(Instance &_instance, UniqueSocketDescriptor &&socket,
+		   bool _proxy_protocol)
 	:ServerSocket(_instance.GetEventLoop(), std::move(socket)),
-	 instance(_instance)
+	 instance(_instance),
+	 proxy_protocol(_proxy_protocol)
 {
 }
 
 Listener::~Listener() noexcept
 {
+	proxy_connections.clear_and_dispose(DeleteDisposer{});
 	delayed_connections.clear_and_dispose(DeleteDisposer{});
 	connections.clear_and_dispose(DeleteDisposer{});
+	relays.clear_and_dispose(DeleteDisposer{});
 }
 
 void
 Listener::AddConnection(PerClientAccounting *per_client,
 			UniqueSocketDescriptor &&connection_fd,
-			SocketAddress peer_address) noexcept
+			SocketAddress peer_address,
+			std::span<const std::byte> initial_data) noexcept
 {
-	auto *c = new Connection(instance, per_client,
-				 std::move(connection_fd), peer_address);
+	auto *c = new Connection(instance, *this, per_client,
+				 std::move(connection_fd), peer_address,
+				 initial_data);
 	connections.push_front(*c);
+
+	if (!initial_data.empty())
+		c->OnInitialData();
 }
 
 void
-Listener::OnAccept(UniqueSocketDescriptor connection_fd,
-		   SocketAddress peer_address) noexcept
+Listener::AddRelay(PerClientAccounting *per_client,
+		   UniqueSocketDescriptor &&incoming_fd,
+		   UniqueSocketDescriptor &&outgoing_fd) noexcept
+{
+	auto *r = new RelayConnection(instance, per_client,
+				      std::move(incoming_fd),
+				      std::move(outgoing_fd));
+	relays.push_front(*r);
+}
+
+void
+Listener::HandoverConnections(SocketDescriptor s,
+			      unsigned &n_sent, unsigned &n_dropped)
+{
+	for (auto &r : relays) {
+		if (r.Handover(s))
+			++n_sent;
+		else
+			++n_dropped;
+	}
+
+	n_dropped += connections.size();
+	n_dropped += delayed_connections.size();
+	n_dropped += proxy_connections.size();
+}
+
+void
+Listener::Admit(UniqueSocketDescriptor &&connection_fd,
+		SocketAddress peer_address,
+		std::span<const std::byte> initial_data) noexcept
 {
 	PerClientAccounting *const per_client = instance.GetClientAccounting(peer_address);
+	const uint_least64_t client_key = per_client != nullptr
+		? per_client->GetAddressKey()
+		: 0;
+
 	if (per_client != nullptr) {
 		per_client->UpdateTokenBucket(1);
 
@@ -43,6 +88,8 @@ Listener::OnAccept(UniqueSocketDescriptor connection_fd,
 			// TODO remove this log message (no spam)
 			fmt::print(stderr, "Client {} has not knocked\n", peer_address);
 			++instance.metrics.missing_knocks;
+			UOLOGIN_PROBE(reject, connection_fd.Get(), client_key,
+				      "missing_knock");
 			return;
 		}
 
@@ -50,6 +97,8 @@ Listener::OnAccept(UniqueSocketDescriptor connection_fd,
 			/* too many connections from this IP address -
 			   reject the new connection */
 			fmt::print(stderr, "Too many connections from {}\n", peer_address);
+			UOLOGIN_PROBE(reject, connection_fd.Get(), client_key,
+				      "too_many_connections");
 
 			// TODO send AccountLoginReject?
 			return;
@@ -60,13 +109,37 @@ Listener::OnAccept(UniqueSocketDescriptor connection_fd,
 			++instance.metrics.delayed_connections;
 			auto *c = new DelayedConnection(instance, *this,
 							*per_client, delay,
-							std::move(connection_fd), peer_address);
+							std::move(connection_fd), peer_address,
+							initial_data);
 			delayed_connections.push_back(*c);
 			return;
 		}
 	}
 
-	AddConnection(per_client, std::move(connection_fd), peer_address);
+	UOLOGIN_PROBE(accept, connection_fd.Get(), client_key);
+
+	AddConnection(per_client, std::move(connection_fd), peer_address,
+		      initial_data);
+}
+
+void
+Listener::OnAccept(UniqueSocketDescriptor connection_fd,
+		   SocketAddress peer_address) noexcept
+{
+	const LoopStats::Scope loop_scope{instance.GetLoopStats(),
+					  LoopCategory::ACCEPT};
+
+	if (proxy_protocol) {
+		/* the peer is the load balancer; the client's
+		   address will be in the PROXY header */
+		auto *c = new ProxyConnection(instance, *this,
+					      std::move(connection_fd),
+					      peer_address);
+		proxy_connections.push_back(*c);
+	} else
+		Admit(std::move(connection_fd), peer_address, {});
+
+	instance.GetOverloadController().Check();
 }
 
 void
@@ -6,25 +6,101 @@
 #include "event/net/ServerSocket.hxx"
 #include "util/IntrusiveList.hxx"
 
+#include <cstddef>
+#include <span>
+
 class Instance;
 class Connection;
+class RelayConnection;
 class DelayedConnection;
+class ProxyConnection;
 class PerClientAccounting;
+class SocketDescriptor;
 
 class Listener final : ServerSocket {
 	Instance &instance;
 
 	IntrusiveList<Connection> connections;
+	IntrusiveList<RelayConnection> relays;
 	IntrusiveList<DelayedConnection> delayed_connections;
+	IntrusiveList<ProxyConnection> proxy_connections;
+
+	/**
+	 * Expect a PROXY protocol v2 header on each new connection
+	 * (the "proxy_protocol" option)?
+	 */
+	const bool proxy_protocol;
 
 public:
 	[[nodiscard]]
-	Listener(Instance &_instance, UniqueSocketDescriptor &&socket);
+	Listener(Instance &_instance, UniqueSocketDescriptor &&socket,
+		 bool _proxy_protocol);
 	~Listener() noexcept;
 
+	using ServerSocket::GetSocket;
+
+	const auto &GetConnections() const noexcept {
+		return connections;
+	}
+
+	const auto &GetRelays() const noexcept {
+		return relays;
+	}
+
+	/**
+	 * Stop accepting new connections (see #OverloadController);
+	 * they will queue up in the kernel's listen backlog.
+	 */
+	void Pause() noexcept {
+		RemoveEvent();
+	}
+
+	void Resume() noexcept {
+		AddEvent();
+	}
+
+	/**
+	 * Apply the per-client checks (knock, connection limit,
+	 * tarpit) to a new connection and create a #Connection (or
+	 * a #DelayedConnection).
+	 *
+	 * @param peer_address the address of the client (with
+	 * "proxy_protocol", the one from the PROXY header)
+	 * @param initial_data data which has already been received
+	 * from the client
+	 */
+	void Admit(UniqueSocketDescriptor &&connection_fd,
+		   SocketAddress peer_address,
+		   std::span<const std::byte> initial_data) noexcept;
+
 	void AddConnection(PerClientAccounting *per_client,
 			   UniqueSocketDescriptor &&connection_fd,
-			   SocketAddress peer_address) noexcept;
+			   SocketAddress peer_address,
+			   std::span<const std::byte> initial_data = {}) noexcept;
+
+	/**
+	 * Create a #RelayConnection for a session whose handshake is
+	 * complete, or which was handed over by the old process (see
+	 * #HandoverRecordType::CONNECTION).
+	 */
+	void AddRelay(PerClientAccounting *per_client,
+		      UniqueSocketDescriptor &&incoming_fd,
+		      UniqueSocketDescriptor &&outgoing_fd) noexcept;
+
+	/**
+	 * Pass all relays which can be handed over to the new
+	 * process; connections which are still in the handshake are
+	 * dropped.
+	 *
+	 * Throws on error.
+	 *
+	 * @param n_sent incremented for each connection that was
+	 * handed over
+	 * @param n_dropped incremented for each connection that
+	 * cannot be handed over
+	 */
+	void HandoverConnections(SocketDescriptor s,
+				 unsigned &n_sent, unsigned &n_dropped);
 
 private:
 	/* virtual methods from class ServerSocket */
@@ -0,0 +1,158 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+// author: Max Kellermann <max.kellermann@gmail.com>
+
+#include "LoopStats.hxx"
+#include "event/Loop.hxx"
+
+#include <fmt/format.h>
+
+#include <algorithm> // for std::min_element()
+#include <iterator> // for std::back_inserter()
+
+using std::string_view_literals::operator""sv;
+
+static constexpr Event::Duration LAG_TIMER_INTERVAL = std::chrono::milliseconds{100};
+
+static constexpr std::array<std::string_view, N_LOOP_CATEGORIES> loop_category_names{
+	"accept"sv,
+	"login"sv,
+	"server_list"sv,
+	"relay"sv,
+	"knock_batch"sv,
+	"knock_result"sv,
+	"nftables"sv,
+	"user_database"sv,
+	"prometheus"sv,
+};
+
+static constexpr uint_least64_t
+ToMicroseconds(Event::Duration d) noexcept
+{
+	return d > Event::Duration::zero()
+		? std::chrono::duration_cast<std::chrono::microseconds>(d).count()
+		: 0;
+}
+
+static constexpr double
+ToSeconds(Event::Duration d) noexcept
+{
+	return std::chrono::duration_cast<std::chrono::duration<double>>(d).count();
+}
+
+LoopStats::LoopStats(EventLoop &_event_loop) noexcept
+	:event_loop(_event_loop),
+	 lag_timer(event_loop, BIND_THIS_METHOD(OnLagTimer))
+{
+}
+
+void
+LoopStats::Start() noexcept
+{
+	lag_timer_due = Event::Clock::now() + LAG_TIMER_INTERVAL;
+	lag_timer.Schedule(LAG_TIMER_INTERVAL);
+}
+
+inline void
+LoopStats::UpdateIteration(Event::TimePoint now) noexcept
+{
+	/* the EventLoop caches the time of its wakeup; a different
+	   value means a new iteration has begun, and the previous
+	   one is complete */
+	const auto wakeup = event_loop.SteadyNow();
+	if (wakeup != iteration_start) {
+		if (iteration_start != Event::TimePoint{})
+			iteration_latency.Add(ToMicroseconds(iteration_busy));
+
+		iteration_start = wakeup;
+		iteration_busy = {};
+	}
+
+	iteration_busy = std::max(iteration_busy, now - wakeup);
+}
+
+void
+LoopStats::Add(LoopCategory category,
+	       Event::TimePoint start, Event::TimePoint end) noexcept
+{
+	const auto duration = end - start;
+
+	auto &c = categories[static_cast<std::size_t>(category)];
+	c.histogram.Add(ToMicroseconds(duration));
+	c.max = std::max(c.max, duration);
+
+	auto &least = *std::min_element(top.begin(), top.end(),
+					[](const auto &a, const auto &b){
+						return a.duration < b.duration;
+					});
+	if (duration > least.duration)
+		least = {duration, category};
+
+	UpdateIteration(end);
+}
+
+void
+LoopStats::OnLagTimer() noexcept
+{
+	const auto now = Event::Clock::now();
+	timer_lag.Add(ToMicroseconds(now - lag_timer_due));
+	UpdateIteration(now);
+
+	/* schedule relative to the actual time, or else one long
+	   stall would be followed by a burst of zero-lag samples */
+	lag_timer_due = now + LAG_TIMER_INTERVAL;
+	lag_timer.Schedule(LAG_TIMER_INTERVAL);
+}
+
+void
+LoopStats::ExportMetrics(std::string &out) noexcept
+{
+	out.append(R"(
+# HELP uologin_loop_timer_lag_seconds How late a periodic timer fired compared to its scheduled time
+# TYPE uologin_loop_timer_lag_seconds histogram
+)");
+	timer_lag.Export(out, "uologin_loop_timer_lag_seconds", {}, 1e-6);
+
+	out.append(R"(
+# HELP uologin_loop_iteration_seconds Time from an event loop wakeup until its last instrumented callback finished
+# TYPE uologin_loop_iteration_seconds histogram
+)");
+	iteration_latency.Export(out, "uologin_loop_iteration_seconds", {}, 1e-6);
+
+	out.append(R"(
+# HELP uologin_loop_callback_seconds Duration of event loop callbacks
+# TYPE uologin_loop_callback_seconds histogram
+)");
+
+	auto o = std::back_inserter(out);
+
+	for (std::size_t i = 0; i < categories.size(); ++i)
+		categories[i].histogram.Export(out, "uologin_loop_callback_seconds",
+					       fmt::format("category=\"{}\"", loop_category_names[i]),
+					       1e-6);
+
+	out.append(R"(
+# HELP uologin_loop_callback_max_seconds Duration of the slowest event loop callback
+# TYPE uologin_loop_callback_max_seconds gauge
+)");
+
+	for (std::size_t i = 0; i < categories.size(); ++i)
+		fmt::format_to(o, "uologin_loop_callback_max_seconds{{category=\"{}\"}} {}\n",
+			       loop_category_names[i], ToSeconds(categories[i].max));
+
+	out.append(R"(
+# HELP uologin_loop_top_callback_seconds The slowest event loop callbacks since the last scrape
+# TYPE uologin_loop_top_callback_seconds gauge
+)");
+
+	std::sort(top.begin(), top.end(), [](const auto &a, const auto &b){
+		return a.duration > b.duration;
+	});
+
+	for (std::size_t i = 0; i < top.size() && top[i].duration > Event::Duration::zero(); ++i)
+		fmt::format_to(o, "uologin_loop_top_callback_seconds{{rank=\"{}\",category=\"{}\"}} {}\n",
+			       i + 1,
+			       loop_category_names[static_cast<std::size_t>(top[i].category)],
+			       ToSeconds(top[i].duration));
+
+	top = {};
+}
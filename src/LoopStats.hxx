@@ -0,0 +1,142 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+// author: Max Kellermann <max.kellermann@gmail.com>
+
+#pragma once
+
+#include "Histogram.hxx"
+#include "event/FineTimerEvent.hxx"
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+/**
+ * Named categories of event loop callbacks whose cost is measured by
+ * #LoopStats.  Nested scopes are counted inclusively (e.g. the time
+ * spent in #NFTABLES is also part of #KNOCK_RESULT).
+ */
+enum class LoopCategory : uint_least8_t {
+	ACCEPT,
+	LOGIN,
+	SERVER_LIST,
+	RELAY,
+	KNOCK_BATCH,
+	KNOCK_RESULT,
+	NFTABLES,
+	USER_DATABASE,
+	PROMETHEUS,
+};
+
+static constexpr std::size_t N_LOOP_CATEGORIES = 9;
+
+/**
+ * Measures how responsive the event loop is:
+ *
+ * - the lag of a periodic timer (how late it fires compared to its
+ *   scheduled time)
+ * - the latency of each loop iteration, i.e. how long after the
+ *   wakeup the last instrumented callback of that iteration
+ *   finished
+ * - the cost of instrumented callbacks by #LoopCategory, plus the
+ *   slowest individual callbacks ("top offenders")
+ *
+ * The overhead is two clock_gettime() calls (vDSO) per instrumented
+ * callback.
+ */
+class LoopStats {
+	/**
+	 * Histograms count microseconds; 24 buckets cover up to 8.4
+	 * seconds.
+	 */
+	using Histogram = Log2Histogram<24>;
+
+	static constexpr std::size_t N_TOP = 8;
+
+	EventLoop &event_loop;
+
+	/**
+	 * This timer fires periodically to measure how late timers
+	 * are being dispatched.
+	 */
+	FineTimerEvent lag_timer;
+
+	Event::TimePoint lag_timer_due;
+
+	Histogram timer_lag, iteration_latency;
+
+	/**
+	 * The wakeup time of the iteration whose latency is currently
+	 * being collected.
+	 */
+	Event::TimePoint iteration_start{};
+
+	Event::Duration iteration_busy{};
+
+	struct Category {
+		Histogram histogram;
+		Event::Duration max{};
+	};
+
+	std::array<Category, N_LOOP_CATEGORIES> categories;
+
+	struct Offender {
+		Event::Duration duration{};
+		LoopCategory category{};
+	};
+
+	/**
+	 * The slowest callbacks since the last ExportMetrics() call
+	 * (unsorted).
+	 */
+	std::array<Offender, N_TOP> top;
+
+public:
+	explicit LoopStats(EventLoop &_event_loop) noexcept;
+
+	/**
+	 * Start measuring the timer lag.
+	 */
+	void Start() noexcept;
+
+	void Stop() noexcept {
+		lag_timer.Cancel();
+	}
+
+	/**
+	 * Measures the duration of its own lifetime and accounts it
+	 * to the given category.
+	 */
+	class Scope {
+		LoopStats &stats;
+		const Event::TimePoint start;
+		const LoopCategory category;
+
+	public:
+		Scope(LoopStats &_stats, LoopCategory _category) noexcept
+			:stats(_stats),
+			 start(Event::Clock::now()),
+			 category(_category) {}
+
+		~Scope() noexcept {
+			stats.Add(category, start, Event::Clock::now());
+		}
+
+		Scope(const Scope &) = delete;
+		Scope &operator=(const Scope &) = delete;
+	};
+
+	/**
+	 * Append Prometheus metrics to the given string.  This resets
+	 * the top offender list.
+	 */
+	void ExportMetrics(std::string &out) noexcept;
+
+private:
+	void Add(LoopCategory category,
+		 Event::TimePoint start, Event::TimePoint end) noexcept;
+
+	void UpdateIteration(Event::TimePoint now) noexcept;
+
+	void OnLagTimer() noexcept;
+};
@@ -6,7 +6,10 @@
 #include "Instance.hxx"
 #include "lib/fmt/RuntimeError.hxx"
 #include "lib/fmt/SystemError.hxx"
+#include "net/AllocatedSocketAddress.hxx"
+#include "net/SocketConfig.hxx"
 #include "net/UniqueSocketDescriptor.hxx"
+#include "system/Error.hxx"
 #include "util/PrintException.hxx"
 #include "config.h"
 
@@ -14,23 +17,126 @@
 #include <systemd/sd-daemon.h>
 #endif
 
+#include <memory>
+#include <span>
+
+#include <errno.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdlib.h>
 #include <sys/signal.h>
+#include <unistd.h> // for unlink()
+
+/**
+ * Connect to the handover socket of an old process (if one is
+ * running) and adopt all of its sockets.
+ *
+ * @return true if listeners were adopted
+ */
+static bool
+ReceiveHandover(Instance &instance, SocketAddress address)
+{
+	UniqueSocketDescriptor s;
+	if (!s.Create(AF_LOCAL, SOCK_SEQPACKET, 0))
+		throw MakeErrno("Failed to create handover socket");
+
+	if (!s.Connect(address)) {
+		const int e = errno;
+		if (e == ENOENT || e == ECONNREFUSED)
+			/* no old process */
+			return false;
+
+		throw MakeErrno(e, "Failed to connect to handover socket");
+	}
+
+	return instance.ReceiveHandover(s);
+}
+
+static void
+SetupHandover(Instance &instance, SocketAddress address, const char *path)
+{
+	/* the old process is gone (or about to exit), so we can take
+	   over its socket path */
+	unlink(path);
+
+	SocketConfig c{
+		.listen = 4,
+		.mode = 0600,
+	};
+	c.bind_address = address;
+	instance.AddHandoverListener(c.Create(SOCK_SEQPACKET));
+}
+
+static void
+SetupControl(Instance &instance, const char *path)
+{
+	/* remove the socket of an old process */
+	unlink(path);
+
+	SocketConfig c{
+		.listen = 4,
+		.mode = 0600,
+	};
+	c.bind_address.SetLocal(path);
+	instance.AddControlListener(c.Create(SOCK_STREAM));
+}
+
+/**
+ * Keep the main thread (which runs the #EventLoop) off the CPUs
+ * reserved for password verification.
+ */
+static void
+PinMainThread(std::span<const unsigned> verify_cpus)
+{
+	if (verify_cpus.empty())
+		return;
+
+	cpu_set_t set;
+	if (sched_getaffinity(0, sizeof(set), &set) < 0)
+		throw MakeErrno("sched_getaffinity() failed");
+
+	for (const unsigned cpu : verify_cpus)
+		CPU_CLR(cpu, &set);
+
+	if (CPU_COUNT(&set) == 0)
+		/* no CPU left; don't pin */
+		return;
+
+	if (sched_setaffinity(0, sizeof(set), &set) < 0)
+		throw MakeErrno("sched_setaffinity() failed");
+}
 
 static int
-Run(const Config &config)
+Run(std::shared_ptr<const Config> _config, const char *config_path)
 {
-	Instance instance{config};
+	Instance instance{std::move(_config), config_path};
+	const Config &config = instance.GetConfig();
 
 	if (!config.prometheus_exporter.bind_address.IsNull())
 		instance.AddPrometheusExporter(config.prometheus_exporter.Create(SOCK_STREAM));
 
-	instance.AddListener(config.listener.Create(SOCK_STREAM));
+	AllocatedSocketAddress handover_address;
+	if (!config.handover_socket.empty())
+		handover_address.SetLocal(config.handover_socket.c_str());
+
+	if (handover_address.IsNull() ||
+	    !ReceiveHandover(instance, handover_address)) {
+		instance.AddListener(config.listener.Create(SOCK_STREAM));
+
+		if (!config.knock_listener.bind_address.IsNull())
+			instance.AddKnockListener(config.knock_listener.Create(SOCK_DGRAM),
+						  config.knock_nft_set.empty() ? nullptr : config.knock_nft_set.c_str());
+	}
 
-	if (!config.knock_listener.bind_address.IsNull())
-		instance.AddKnockListener(config.knock_listener.Create(SOCK_DGRAM),
-					  config.knock_nft_set.empty() ? nullptr : config.knock_nft_set.c_str());
+	if (!config.cluster_listener.bind_address.IsNull())
+		instance.AddCluster(config.cluster_listener.Create(SOCK_DGRAM));
+
+	if (!handover_address.IsNull())
+		SetupHandover(instance, handover_address,
+			      config.handover_socket.c_str());
+
+	if (!config.control_socket.empty())
+		SetupControl(instance, config.control_socket.c_str());
 
 #ifdef HAVE_LIBSYSTEMD
 	/* tell systemd we're ready */
@@ -45,14 +151,18 @@ int
 main(int argc, char **argv) noexcept
 try {
 	const auto cmdline = ParseCommandLine(argc, argv);
-	const auto config = LoadConfigFile(cmdline.config_path);
+	auto config = std::make_shared<const Config>(LoadConfigFile(cmdline.config_path));
+
+	/* this must be done before any other thread is created,
+	   because new threads inherit the affinity */
+	PinMainThread(config->verify_cpus);
 
 	signal(SIGPIPE, SIG_IGN);
 
 	/* reduce glibc's thread cancellation overhead */
 	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, nullptr);
 
-	return Run(config);
+	return Run(std::move(config), cmdline.config_path);
 } catch (...) {
 	PrintException(std::current_exception());
 	return EXIT_FAILURE;
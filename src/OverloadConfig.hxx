@@ -0,0 +1,35 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+// author: Max Kellermann <max.kellermann@gmail.com>
+
+#pragma once
+
+#include <cstddef>
+
+/**
+ * A high and a low watermark.  Zero disables the signal.
+ */
+struct OverloadWatermark {
+	std::size_t high = 0, low = 0;
+};
+
+/**
+ * The configuration of #OverloadController.
+ */
+struct OverloadConfig {
+	/**
+	 * The number of client connections, including those in the
+	 * tarpit and those waiting for a PROXY protocol header.
+	 */
+	OverloadWatermark connections;
+
+	/**
+	 * The number of pending password verification jobs.
+	 */
+	OverloadWatermark verify_jobs;
+
+	/**
+	 * The (estimated) number of file descriptors in percent of
+	 * RLIMIT_NOFILE.
+	 */
+	OverloadWatermark fd_percent{90, 80};
+};
@@ -0,0 +1,139 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+// author: Max Kellermann <max.kellermann@gmail.com>
+
+#include "OverloadController.hxx"
+#include "event/Loop.hxx"
+#include "time/Cast.hxx"
+
+#include <fmt/format.h>
+
+#include <cassert>
+#include <iterator> // for std::back_inserter()
+
+#include <sys/resource.h>
+
+static constexpr Event::Duration RESUME_CHECK_INTERVAL = std::chrono::milliseconds{100};
+
+static std::size_t
+GetMaxFds() noexcept
+{
+	struct rlimit rl;
+	if (getrlimit(RLIMIT_NOFILE, &rl) < 0 || rl.rlim_cur == RLIM_INFINITY)
+		return 0;
+
+	return rl.rlim_cur;
+}
+
+static constexpr bool
+IsAbove(const OverloadWatermark &w, std::size_t value) noexcept
+{
+	return w.high > 0 && value >= w.high;
+}
+
+static constexpr bool
+IsBelow(const OverloadWatermark &w, std::size_t value) noexcept
+{
+	return w.high == 0 || value <= w.low;
+}
+
+OverloadController::OverloadController(EventLoop &event_loop,
+				       const OverloadConfig &_config,
+				       SignalsCallback _get_signals,
+				       StateCallback _state_callback) noexcept
+	:config(_config),
+	 max_fds(GetMaxFds()),
+	 get_signals(_get_signals), state_callback(_state_callback),
+	 resume_timer(event_loop, BIND_THIS_METHOD(OnResumeTimer))
+{
+}
+
+void
+OverloadController::Check() noexcept
+{
+	if (overloaded)
+		return;
+
+	const auto s = get_signals();
+
+	bool trigger = false;
+
+	if (IsAbove(config.connections, s.connections)) {
+		++stats.triggers[CONNECTIONS];
+		trigger = true;
+	}
+
+	if (IsAbove(config.verify_jobs, s.verify_jobs)) {
+		++stats.triggers[VERIFY_JOBS];
+		trigger = true;
+	}
+
+	if (IsAbove(config.fd_percent, FdPercent(s.fds))) {
+		++stats.triggers[FDS];
+		trigger = true;
+	}
+
+	if (!trigger)
+		return;
+
+	overloaded = true;
+	++stats.pauses;
+	pause_time = resume_timer.GetEventLoop().SteadyNow();
+
+	resume_timer.Schedule(RESUME_CHECK_INTERVAL);
+	state_callback(true);
+}
+
+void
+OverloadController::OnResumeTimer() noexcept
+{
+	assert(overloaded);
+
+	const auto s = get_signals();
+
+	if (!IsBelow(config.connections, s.connections) ||
+	    !IsBelow(config.verify_jobs, s.verify_jobs) ||
+	    !IsBelow(config.fd_percent, FdPercent(s.fds))) {
+		/* hysteresis: still above a low watermark */
+		resume_timer.Schedule(RESUME_CHECK_INTERVAL);
+		return;
+	}
+
+	overloaded = false;
+	stats.paused_duration += resume_timer.GetEventLoop().SteadyNow() - pause_time;
+	state_callback(false);
+}
+
+void
+OverloadController::ExportMetrics(std::string &out) const noexcept
+{
+	auto paused_duration = stats.paused_duration;
+	if (overloaded)
+		paused_duration += resume_timer.GetEventLoop().SteadyNow() - pause_time;
+
+	fmt::format_to(std::back_inserter(out), R"(
+# HELP uologin_overloaded Is accepting new connections currently paused due to overload?
+# TYPE uologin_overloaded gauge
+
+# HELP uologin_overload_pauses Counter for pauses of accepting new connections due to overload
+# TYPE uologin_overload_pauses counter
+
+# HELP uologin_overload_paused_seconds Total time accepting new connections was paused due to overload
+# TYPE uologin_overload_paused_seconds counter
+
+# HELP uologin_overload_triggers Counter for high watermarks being reached
+# TYPE uologin_overload_triggers counter
+
+uologin_overloaded {}
+uologin_overload_pauses {}
+uologin_overload_paused_seconds {}
+uologin_overload_triggers{{signal="connections"}} {}
+uologin_overload_triggers{{signal="verify_jobs"}} {}
+uologin_overload_triggers{{signal="fds"}} {}
+)",
+		       overloaded ? 1 : 0,
+		       stats.pauses,
+		       ToFloatSeconds(paused_duration),
+		       stats.triggers[CONNECTIONS],
+		       stats.triggers[VERIFY_JOBS],
+		       stats.triggers[FDS]);
+}
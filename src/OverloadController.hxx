@@ -0,0 +1,105 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+// author: Max Kellermann <max.kellermann@gmail.com>
+
+#pragma once
+
+#include "OverloadConfig.hxx"
+#include "event/CoarseTimerEvent.hxx"
+#include "util/BindMethod.hxx"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/**
+ * Pauses accepting new connections while the process is overloaded,
+ * i.e. while any signal is above its high watermark, and resumes
+ * after all signals have dropped below their low watermarks.  While
+ * paused, the kernel's listen backlog (and SYN cookies) absorb new
+ * connections.
+ */
+class OverloadController {
+public:
+	/**
+	 * The current values of all signals.
+	 */
+	struct Signals {
+		std::size_t connections, verify_jobs, fds;
+	};
+
+	using SignalsCallback = BoundMethod<Signals() noexcept>;
+
+	/**
+	 * Invoked when the overload state changes; the handler pauses
+	 * or resumes all listeners.
+	 */
+	using StateCallback = BoundMethod<void(bool overloaded) noexcept>;
+
+private:
+	const OverloadConfig config;
+
+	/**
+	 * The RLIMIT_NOFILE soft limit.
+	 */
+	const std::size_t max_fds;
+
+	const SignalsCallback get_signals;
+	const StateCallback state_callback;
+
+	/**
+	 * Checks periodically whether the overload is over.
+	 */
+	CoarseTimerEvent resume_timer;
+
+	Event::TimePoint pause_time;
+
+	bool overloaded = false;
+
+	enum Signal : unsigned {
+		CONNECTIONS,
+		VERIFY_JOBS,
+		FDS,
+		N_SIGNALS,
+	};
+
+	struct {
+		uint_least64_t pauses;
+		Event::Duration paused_duration;
+		std::array<uint_least64_t, N_SIGNALS> triggers;
+	} stats{};
+
+public:
+	OverloadController(EventLoop &event_loop, const OverloadConfig &_config,
+			   SignalsCallback _get_signals,
+			   StateCallback _state_callback) noexcept;
+
+	bool IsOverloaded() const noexcept {
+		return overloaded;
+	}
+
+	/**
+	 * Check whether the high watermarks have been reached; call
+	 * this after accepting a connection.
+	 */
+	void Check() noexcept;
+
+	/**
+	 * Stop checking whether the overload is over (on shutdown).
+	 */
+	void Stop() noexcept {
+		resume_timer.Cancel();
+	}
+
+	/**
+	 * Append Prometheus metrics to the given string.
+	 */
+	void ExportMetrics(std::string &out) const noexcept;
+
+private:
+	std::size_t FdPercent(std::size_t fds) const noexcept {
+		return max_fds > 0 ? fds * 100 / max_fds : 0;
+	}
+
+	void OnResumeTimer() noexcept;
+};
@@ -8,10 +8,17 @@
 #include "io/UniqueFileDescriptor.hxx"
 
 struct PipeStockItem final : StockItem {
+	PipeStock &pipe_stock;
+
 	UniqueFileDescriptor fds[2];
 
-	explicit PipeStockItem(CreateStockItem c)
-		:StockItem(c) {
+	PipeStockItem(CreateStockItem c, PipeStock &_pipe_stock) noexcept
+		:StockItem(c), pipe_stock(_pipe_stock) {
+		++pipe_stock.n_pipes;
+	}
+
+	~PipeStockItem() noexcept {
+		--pipe_stock.n_pipes;
 	}
 
 	/* virtual methods from class StockItem */
@@ -29,7 +36,7 @@ PipeStock::Create(CreateStockItem c, StockRequest,
 		  StockGetHandler &get_handler,
 		  CancellablePointer &)
 {
-	auto *item = new PipeStockItem(c);
+	auto *item = new PipeStockItem(c, *this);
 
 	if (!UniqueFileDescriptor::CreatePipeNonBlock(item->fds[0],
 						      item->fds[1])) {
@@ -7,6 +7,7 @@
 #include "stock/Stock.hxx"
 #include "stock/Class.hxx"
 
+#include <cstddef>
 #include <utility> // for std::pair
 
 class FileDescriptor;
@@ -15,11 +16,26 @@ class FileDescriptor;
  * Anonymous pipe pooling, to speed to istream_pipe.
  */
 class PipeStock final : public Stock, StockClass {
+	friend struct PipeStockItem;
+
+	/**
+	 * The number of pipes which currently exist (idle or busy).
+	 */
+	std::size_t n_pipes = 0;
+
 public:
 	explicit PipeStock(EventLoop &event_loop)
 		:Stock(event_loop, *this, "pipe", 0, 64,
 		       Event::Duration::zero()) {}
 
+	/**
+	 * Returns the number of file descriptors owned by this
+	 * stock (two per pipe).
+	 */
+	std::size_t GetFdCount() const noexcept {
+		return n_pipes * 2;
+	}
+
 private:
 	/* virtual methods from class StockClass */
 	void Create(CreateStockItem c, StockRequest request,
@@ -0,0 +1,53 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+// author: Max Kellermann <max.kellermann@gmail.com>
+
+#pragma once
+
+#include "config.h"
+
+/*
+ * USDT probes (provider "uologin") for bpftrace/SystemTap.  Each
+ * probe compiles to a single "nop" plus a note describing where its
+ * arguments are, so arguments should be cheap to compute.  The
+ * arguments of existing probes must not be changed because scripts
+ * depend on them:
+ *
+ * - accept(int fd, u64 client_key)
+ * - reject(int fd, u64 client_key, const char *reason)
+ * - connection_state(void *connection, u8 old_state, u8 new_state)
+ * - connection_handoff(void *connection, const char *target)
+ * - check_credentials_enqueue(void *job, const char *username)
+ * - check_credentials_start(void *job)
+ * - check_credentials_done(void *job, const char *username, bool result, bool canceled)
+ * - check_credentials_cancel(void *job, bool dequeued)
+ * - check_credentials_batch_enqueue(void *job, void *operation, size_t n_items, size_t memory_cost)
+ * - splice_receive(int fd, ssize_t nbytes, int error)
+ * - splice_send(int fd, ssize_t nbytes, int error)
+ * - knock_accept(u64 client_key, const char *how)
+ * - knock_reject(u64 client_key, const char *reason)
+ * - tarpit_start(void *connection, u64 client_key, u64 delay_ms)
+ * - tarpit_release(void *connection, u64 client_key, bool hangup)
+ *
+ * A client key of 0 means the client is not tracked.  The
+ * connection_handoff target is "relay" or "game_server" (see
+ * "game_server_handoff").
+ *
+ * Example: bpftrace -e 'usdt:/usr/sbin/uologin:uologin:reject { printf("%s\n", str(arg2)); }'
+ */
+
+#ifdef HAVE_SYS_SDT_H
+
+#include <sys/sdt.h>
+
+#define UOLOGIN_PROBE(name, ...) STAP_PROBEV(uologin, name __VA_OPT__(,) __VA_ARGS__)
+
+#else
+
+#include <tuple> // for std::make_tuple()
+
+/* the arguments are referenced in an unevaluated context, so
+   variables which are only used by probes don't trigger
+   -Wunused warnings, and no code is generated */
+#define UOLOGIN_PROBE(name, ...) do { (void)sizeof(std::make_tuple(__VA_ARGS__)); } while (false)
+
+#endif
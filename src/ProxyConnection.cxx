@@ -0,0 +1,89 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+// author: Max Kellermann <max.kellermann@gmail.com>
+
+#include "ProxyConnection.hxx"
+#include "Instance.hxx"
+#include "Listener.hxx"
+#include "net/UniqueSocketDescriptor.hxx"
+
+#include <span>
+#include <stdexcept>
+
+ProxyConnection::ProxyConnection(Instance &_instance, Listener &_listener,
+				 UniqueSocketDescriptor fd,
+				 SocketAddress _peer_address) noexcept
+	:instance(_instance), listener(_listener),
+	 peer_address(_peer_address),
+	 socket(instance.GetEventLoop(), BIND_THIS_METHOD(OnSocketReady), fd.Release()),
+	 timeout(instance.GetEventLoop(), BIND_THIS_METHOD(OnTimeout))
+{
+	++instance.metrics.proxy_connections;
+
+	socket.Schedule(socket.READ | socket.READ_HANGUP);
+
+	/* the same timeout as for the login packets */
+	timeout.Schedule(std::chrono::seconds{5});
+}
+
+ProxyConnection::~ProxyConnection() noexcept
+{
+	socket.Close();
+
+	--instance.metrics.proxy_connections;
+}
+
+void
+ProxyConnection::OnSocketReady(unsigned events) noexcept
+{
+	if (events & socket.DEAD_MASK) {
+		Destroy();
+		return;
+	}
+
+	const auto nbytes = socket.GetSocket().ReadNoWait(std::span{buffer}.subspan(fill));
+	if (nbytes <= 0) [[unlikely]] {
+		Destroy();
+		return;
+	}
+
+	fill += nbytes;
+
+	StaticSocketAddress source;
+	std::size_t header_size;
+
+	try {
+		header_size = ParseProxyHeader(std::span{buffer}.first(fill), source);
+	} catch (const std::runtime_error &) {
+		++instance.metrics.malformed_proxy_headers;
+		Destroy();
+		return;
+	}
+
+	if (header_size == 0) {
+		/* incomplete header; wait for more data (the buffer
+		   cannot be full here because ParseProxyHeader()
+		   rejects headers which would not fit) */
+		return;
+	}
+
+	/* the client sends no more than the initial packets before
+	   it receives a response */
+	const auto initial_data = std::span{buffer}.first(fill).subspan(header_size);
+	if (initial_data.size() > Connection::INITIAL_PACKETS_SIZE) {
+		++instance.metrics.malformed_logins;
+		Destroy();
+		return;
+	}
+
+	UniqueSocketDescriptor fd{AdoptTag{}, socket.ReleaseSocket()};
+	listener.Admit(std::move(fd),
+		       source.IsDefined() ? SocketAddress{source} : SocketAddress{peer_address},
+		       initial_data);
+	Destroy();
+}
+
+void
+ProxyConnection::OnTimeout() noexcept
+{
+	Destroy();
+}
@@ -0,0 +1,55 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+// author: Max Kellermann <max.kellermann@gmail.com>
+
+#pragma once
+
+#include "Connection.hxx"
+#include "ProxyProtocol.hxx"
+#include "event/CoarseTimerEvent.hxx"
+#include "event/SocketEvent.hxx"
+#include "net/StaticSocketAddress.hxx"
+#include "util/IntrusiveList.hxx"
+
+#include <array>
+
+class Instance;
+class Listener;
+class UniqueSocketDescriptor;
+
+/**
+ * Holds a connection accepted from a load balancer (with the
+ * "proxy_protocol" option) until the PROXY protocol header has been
+ * received.  The header is usually received in the same read as the
+ * client's first packets; those are passed to the #Connection.
+ */
+class ProxyConnection final
+	: public AutoUnlinkIntrusiveListHook
+{
+	Instance &instance;
+	Listener &listener;
+
+	/**
+	 * The address of the load balancer.
+	 */
+	const StaticSocketAddress peer_address;
+
+	SocketEvent socket;
+	CoarseTimerEvent timeout;
+
+	std::array<std::byte, MAX_PROXY_HEADER_SIZE + Connection::INITIAL_PACKETS_SIZE> buffer;
+	std::size_t fill = 0;
+
+public:
+	ProxyConnection(Instance &_instance, Listener &_listener,
+			UniqueSocketDescriptor fd,
+			SocketAddress _peer_address) noexcept;
+	~ProxyConnection() noexcept;
+
+private:
+	void Destroy() noexcept {
+		delete this;
+	}
+
+	void OnSocketReady(unsigned events) noexcept;
+	void OnTimeout() noexcept;
+};
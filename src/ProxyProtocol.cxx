@@ -0,0 +1,242 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+// author: Max Kellermann <max.kellermann@gmail.com>
+
+#include "ProxyProtocol.hxx"
+#include "net/IPv4Address.hxx"
+#include "net/IPv6Address.hxx"
+#include "net/StaticSocketAddress.hxx"
+#include "util/PackedBigEndian.hxx"
+
+#include <algorithm> // for std::equal(), std::min(), std::fill_n()
+#include <array>
+#include <cstdint>
+#include <cstring> // for memcpy()
+#include <stdexcept>
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+static constexpr std::array<std::byte, 12> proxy_signature{
+	std::byte{0x0d}, std::byte{0x0a}, std::byte{0x0d}, std::byte{0x0a},
+	std::byte{0x00}, std::byte{0x0d}, std::byte{0x0a}, std::byte{0x51},
+	std::byte{0x55}, std::byte{0x49}, std::byte{0x54}, std::byte{0x0a},
+};
+
+static constexpr uint8_t PROXY_VERSION_MASK = 0xf0;
+static constexpr uint8_t PROXY_VERSION_2 = 0x20;
+static constexpr uint8_t PROXY_COMMAND_MASK = 0x0f;
+static constexpr uint8_t PROXY_COMMAND_LOCAL = 0x00;
+static constexpr uint8_t PROXY_COMMAND_PROXY = 0x01;
+
+static constexpr uint8_t PROXY_FAMILY_UNSPEC = 0x00;
+static constexpr uint8_t PROXY_FAMILY_TCP4 = 0x11;
+static constexpr uint8_t PROXY_FAMILY_TCP6 = 0x21;
+
+struct ProxyHeader {
+	std::array<std::byte, 12> signature;
+	uint8_t version_command;
+	uint8_t family;
+
+	/**
+	 * The number of bytes following this header.
+	 */
+	PackedBE16 length;
+};
+
+static_assert(sizeof(ProxyHeader) == 16);
+static_assert(alignof(ProxyHeader) == 1);
+
+struct ProxyAddressIPv4 {
+	std::array<std::byte, 4> source, destination;
+	PackedBE16 source_port, destination_port;
+};
+
+static_assert(sizeof(ProxyAddressIPv4) == 12);
+
+struct ProxyAddressIPv6 {
+	std::array<std::byte, 16> source, destination;
+	PackedBE16 source_port, destination_port;
+};
+
+static_assert(sizeof(ProxyAddressIPv6) == 36);
+static_assert(MAX_FORMATTED_PROXY_HEADER_SIZE == sizeof(ProxyHeader) + sizeof(ProxyAddressIPv6));
+
+std::size_t
+ParseProxyHeader(std::span<const std::byte> src, StaticSocketAddress &source)
+{
+	/* check the signature as soon as we have it, to reject
+	   non-PROXY clients early */
+	const std::size_t n = std::min(src.size(), proxy_signature.size());
+	if (!std::equal(src.begin(), std::next(src.begin(), n),
+			proxy_signature.begin()))
+		throw std::runtime_error{"Bad PROXY protocol signature"};
+
+	if (src.size() < sizeof(ProxyHeader))
+		return 0;
+
+	const auto &header = *reinterpret_cast<const ProxyHeader *>(src.data());
+	if ((header.version_command & PROXY_VERSION_MASK) != PROXY_VERSION_2)
+		throw std::runtime_error{"Unsupported PROXY protocol version"};
+
+	const std::size_t total_size = sizeof(header) + header.length;
+	if (total_size > MAX_PROXY_HEADER_SIZE)
+		throw std::runtime_error{"PROXY protocol header is too large"};
+
+	if (src.size() < total_size)
+		return 0;
+
+	const auto payload = src.subspan(sizeof(header), header.length);
+
+	source.Clear();
+
+	switch (header.version_command & PROXY_COMMAND_MASK) {
+	case PROXY_COMMAND_LOCAL:
+		return total_size;
+
+	case PROXY_COMMAND_PROXY:
+		break;
+
+	default:
+		throw std::runtime_error{"Unsupported PROXY protocol command"};
+	}
+
+	switch (header.family) {
+	case PROXY_FAMILY_UNSPEC:
+		/* unknown protocol: use the load balancer's
+		   address */
+		break;
+
+	case PROXY_FAMILY_TCP4:
+		if (payload.size() < sizeof(ProxyAddressIPv4))
+			throw std::runtime_error{"Malformed PROXY protocol IPv4 address"};
+
+		{
+			const auto &a = *reinterpret_cast<const ProxyAddressIPv4 *>(payload.data());
+			struct in_addr addr;
+			memcpy(&addr, a.source.data(), sizeof(addr));
+			source = IPv4Address{addr, a.source_port};
+		}
+
+		break;
+
+	case PROXY_FAMILY_TCP6:
+		if (payload.size() < sizeof(ProxyAddressIPv6))
+			throw std::runtime_error{"Malformed PROXY protocol IPv6 address"};
+
+		{
+			const auto &a = *reinterpret_cast<const ProxyAddressIPv6 *>(payload.data());
+			struct in6_addr addr;
+			memcpy(&addr, a.source.data(), sizeof(addr));
+			source = IPv6Address{addr, a.source_port};
+		}
+
+		break;
+
+	default:
+		throw std::runtime_error{"Unsupported PROXY protocol address family"};
+	}
+
+	return total_size;
+}
+
+/**
+ * Convert an IPv4 or IPv4-mapped IPv6 address to IPv4.
+ *
+ * @return false if this is not an IPv4 address
+ */
+static bool
+ToIPv4(SocketAddress src, IPv4Address &dest) noexcept
+{
+	switch (src.GetFamily()) {
+	case AF_INET:
+		dest = IPv4Address::Cast(src);
+		return true;
+
+	case AF_INET6:
+		if (const auto &v6 = IPv6Address::Cast(src); v6.IsV4Mapped()) {
+			dest = v6.UnmapV4();
+			return true;
+		}
+
+		return false;
+
+	default:
+		return false;
+	}
+}
+
+/**
+ * Write an IPv6 address (or an IPv4 address as IPv4-mapped IPv6
+ * address) in the PROXY protocol format.
+ *
+ * @return false if this is neither IPv4 nor IPv6
+ */
+static bool
+WriteIPv6(std::array<std::byte, 16> &address, PackedBE16 &port,
+	  SocketAddress src) noexcept
+{
+	switch (src.GetFamily()) {
+	case AF_INET6:
+		{
+			const auto &v6 = IPv6Address::Cast(src);
+			memcpy(address.data(), &v6.GetAddress(), address.size());
+			port = v6.GetPort();
+		}
+
+		return true;
+
+	case AF_INET:
+		{
+			/* ::ffff:a.b.c.d */
+			const auto &v4 = IPv4Address::Cast(src);
+			std::fill_n(address.begin(), 10, std::byte{0});
+			address[10] = address[11] = std::byte{0xff};
+			memcpy(address.data() + 12, &v4.GetAddress(), 4);
+			port = v4.GetPort();
+		}
+
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+std::size_t
+FormatProxyHeader(std::span<std::byte, MAX_FORMATTED_PROXY_HEADER_SIZE> dest,
+		  SocketAddress source, SocketAddress destination) noexcept
+{
+	auto &header = *reinterpret_cast<ProxyHeader *>(dest.data());
+	header.signature = proxy_signature;
+	header.version_command = PROXY_VERSION_2 | PROXY_COMMAND_PROXY;
+
+	/* an IPv6 listener sees IPv4 clients as IPv4-mapped
+	   addresses, and the source may come from an inbound PROXY
+	   header with a different family; prefer IPv4 if both are
+	   IPv4, else map both to IPv6 */
+	IPv4Address s4, d4;
+	if (ToIPv4(source, s4) && ToIPv4(destination, d4)) {
+		auto &a = *reinterpret_cast<ProxyAddressIPv4 *>(dest.data() + sizeof(header));
+		memcpy(a.source.data(), &s4.GetAddress(), a.source.size());
+		memcpy(a.destination.data(), &d4.GetAddress(), a.destination.size());
+		a.source_port = s4.GetPort();
+		a.destination_port = d4.GetPort();
+
+		header.family = PROXY_FAMILY_TCP4;
+		header.length = sizeof(a);
+		return sizeof(header) + sizeof(a);
+	}
+
+	auto &a = *reinterpret_cast<ProxyAddressIPv6 *>(dest.data() + sizeof(header));
+	if (WriteIPv6(a.source, a.source_port, source) &&
+	    WriteIPv6(a.destination, a.destination_port, destination)) {
+		header.family = PROXY_FAMILY_TCP6;
+		header.length = sizeof(a);
+		return sizeof(header) + sizeof(a);
+	}
+
+	header.version_command = PROXY_VERSION_2 | PROXY_COMMAND_LOCAL;
+	header.family = PROXY_FAMILY_UNSPEC;
+	header.length = 0;
+	return sizeof(header);
+}
@@ -0,0 +1,49 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+// author: Max Kellermann <max.kellermann@gmail.com>
+
+#pragma once
+
+#include <cstddef>
+#include <span>
+
+class SocketAddress;
+class StaticSocketAddress;
+
+/**
+ * The maximum size of a PROXY protocol v2 header we accept
+ * (including addresses and TLVs).  Larger headers are rejected.
+ */
+static constexpr std::size_t MAX_PROXY_HEADER_SIZE = 256;
+
+/**
+ * The maximum size of a header generated by FormatProxyHeader().
+ */
+static constexpr std::size_t MAX_FORMATTED_PROXY_HEADER_SIZE = 16 + 36;
+
+/**
+ * Parse a PROXY protocol v2 header (as sent by a load balancer) at
+ * the beginning of the given buffer.  TLVs are ignored.
+ *
+ * Throws std::runtime_error if the header is malformed.
+ *
+ * @param source receives the original source address of the
+ * client; it is cleared if the header does not contain one (i.e. a
+ * "LOCAL" command, e.g. a health check of the load balancer)
+ * @return the size of the header (i.e. the number of bytes to be
+ * skipped) or 0 if the buffer does not yet contain the whole header
+ */
+std::size_t
+ParseProxyHeader(std::span<const std::byte> src, StaticSocketAddress &source);
+
+/**
+ * Generate a binary PROXY protocol v2 header.  If both addresses are
+ * IPv4 (or IPv4-mapped IPv6), an IPv4 header is generated; if one of
+ * them is IPv6, an IPv6 header with IPv4-mapped addresses.  If one
+ * is neither (e.g. a local socket), a "LOCAL" header without
+ * addresses is generated.
+ *
+ * @return the number of bytes written to the buffer
+ */
+std::size_t
+FormatProxyHeader(std::span<std::byte, MAX_FORMATTED_PROXY_HEADER_SIZE> dest,
+		  SocketAddress source, SocketAddress destination) noexcept;
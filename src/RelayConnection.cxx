@@ -0,0 +1,439 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+// author: Max Kellermann <max.kellermann@gmail.com>
+
+#include "RelayConnection.hxx"
+#include "Handover.hxx"
+#include "Instance.hxx"
+#include "JsonString.hxx"
+#include "LoopStats.hxx"
+#include "net/ClientAccounting.hxx"
+#include "net/StaticSocketAddress.hxx"
+#include "net/ToString.hxx"
+#include "net/UniqueSocketDescriptor.hxx"
+#include "time/Cast.hxx"
+
+#include <fmt/format.h>
+
+#include <array>
+#include <cassert>
+#include <iterator> // for std::back_inserter()
+
+#include <sys/epoll.h> // for EPOLLET
+
+/**
+ * Not (yet) defined by #SocketEvent; it is passed through to
+ * epoll_ctl() like the other flags.
+ */
+static constexpr unsigned EDGE_TRIGGERED = EPOLLET;
+
+/**
+ * The maximum number of bytes received per direction in one Pump()
+ * call.  A busy session yields to others after this and continues
+ * from a #DeferEvent.
+ */
+static constexpr std::size_t PUMP_BUDGET = 256 * 1024;
+
+RelayConnection::RelayConnection(Instance &_instance,
+				 PerClientAccounting *per_client,
+				 UniqueSocketDescriptor &&incoming_fd,
+				 UniqueSocketDescriptor &&outgoing_fd) noexcept
+	:instance(_instance),
+	 start_time(instance.GetEventLoop().SteadyNow()),
+	 incoming(instance.GetEventLoop(), BIND_THIS_METHOD(OnIncomingReady),
+		  incoming_fd.Release()),
+	 outgoing(instance.GetEventLoop(), BIND_THIS_METHOD(OnOutgoingReady),
+		  outgoing_fd.Release()),
+	 defer_pump(instance.GetEventLoop(), BIND_THIS_METHOD(OnDeferredPump)),
+	 edge_triggered(instance.GetConfig().relay_edge_triggered)
+{
+	++instance.metrics.client_connections;
+	++instance.metrics.server_connections;
+	++instance.metrics.relay_connections;
+
+	instance.metrics.relay_epoll_ctl += 2;
+
+	if (edge_triggered) {
+		/* the first events report the initial readiness */
+		incoming.Schedule(incoming.READ | incoming.WRITE |
+				  incoming.READ_HANGUP | EDGE_TRIGGERED);
+		outgoing.Schedule(outgoing.READ | outgoing.WRITE |
+				  outgoing.READ_HANGUP | EDGE_TRIGGERED);
+	} else {
+		incoming.Schedule(incoming.READ | incoming.READ_HANGUP);
+		outgoing.ScheduleRead();
+	}
+
+	if (per_client != nullptr)
+		per_client->AddConnection(accounting);
+}
+
+RelayConnection::~RelayConnection() noexcept
+{
+	instance.OnRelayDestroyed(*this);
+
+	outgoing.Close();
+	incoming.Close();
+
+	--instance.metrics.relay_connections;
+	--instance.metrics.server_connections;
+	--instance.metrics.client_connections;
+}
+
+bool
+RelayConnection::Handover(SocketDescriptor s)
+{
+	if (!splice_in_out.IsEmpty() || !splice_out_in.IsEmpty())
+		return false;
+
+	HandoverRecord record{
+		.type = HandoverRecordType::CONNECTION,
+	};
+
+	/* the address is only informational; with
+	   "proxy_protocol", this is the load balancer's address,
+	   but the accounting key identifies the client */
+	record.SetAddress(incoming.GetSocket().GetPeerAddress());
+
+	if (const auto *per_client = accounting.GetPerClient())
+		record.accounting_key = per_client->GetAddressKey();
+
+	const std::array<SocketDescriptor, 2> fds{
+		incoming.GetSocket(),
+		outgoing.GetSocket(),
+	};
+
+	SendHandoverRecord(s, record, fds);
+	return true;
+}
+
+void
+RelayConnection::DumpJson(std::string &out, Event::TimePoint now) const noexcept
+{
+	fmt::format_to(std::back_inserter(out),
+		       R"({{"type":"relay","age":{:.3f},"client":)",
+		       ToFloatSeconds(now - start_time));
+
+	/* with "proxy_protocol", the peer is the load balancer; the
+	   address of a local socket may contain anything */
+	AppendJsonString(out, ToString(incoming.GetSocket().GetPeerAddress()));
+
+	fmt::format_to(std::back_inserter(out),
+		       R"(,"client_to_server_bytes":{},"server_to_client_bytes":{},"buffered":{}}})" "\n",
+		       splice_in_out.sent_bytes, splice_out_in.sent_bytes,
+		       !splice_in_out.IsEmpty() || !splice_out_in.IsEmpty());
+}
+
+inline void
+RelayConnection::AddClientBytes(uint_least64_t n) noexcept
+{
+	if (const auto *per_client = accounting.GetPerClient())
+		instance.GetHeavyHitters().AddBytes(per_client->GetAddressKey(), n);
+}
+
+/**
+ * Change the registered events of a #SocketEvent, counting the
+ * resulting epoll_ctl() calls.
+ */
+static void
+Reschedule(SocketEvent &event, unsigned flags,
+	   uint_least64_t &n_epoll_ctl) noexcept
+{
+	if (flags == event.GetScheduledFlags())
+		return;
+
+	++n_epoll_ctl;
+	event.Schedule(flags);
+}
+
+static bool
+DoSpliceSend(SocketEvent &from, SocketEvent &to, Splice &s,
+	     uint_least64_t &n_epoll_ctl)
+{
+	switch (s.SendTo(to.GetSocket())) {
+	case Splice::SendResult::OK:
+		Reschedule(to, to.GetScheduledFlags() & ~to.WRITE, n_epoll_ctl);
+
+		/* the pipe is empty again; resume reading if a
+		   previous PARTIAL/SOCKET_BLOCKING or PIPE_FULL has
+		   disabled it, or this direction would stall */
+		Reschedule(from, from.GetScheduledFlags() | from.READ, n_epoll_ctl);
+		break;
+
+	case Splice::SendResult::PARTIAL:
+	case Splice::SendResult::SOCKET_BLOCKING:
+		Reschedule(from, from.GetScheduledFlags() & ~from.READ, n_epoll_ctl);
+		Reschedule(to, to.GetScheduledFlags() | to.WRITE, n_epoll_ctl);
+		break;
+
+	case Splice::SendResult::ERROR:
+		// TODO errno
+		return false;
+	}
+
+	return true;
+}
+
+enum class ForwardResult {
+	OK,
+	CLOSED,
+	ERROR,
+};
+
+/**
+ * Forward data from one socket to the other until either the source
+ * has no more data, the destination blocks or #PUMP_BUDGET bytes
+ * have been received (edge-triggered mode).  Data is only received
+ * into an empty pipe, so EAGAIN from Splice::ReceiveFrom() always
+ * means the source is drained.
+ *
+ * The caller resets Splice::received_bytes before.
+ */
+static ForwardResult
+Forward(PipeStock &pipe_stock, SocketDescriptor from, SocketDescriptor to,
+	Splice &s, bool &from_readable, bool &to_writable) noexcept
+{
+	while (true) {
+		if (!s.IsEmpty()) {
+			if (!to_writable)
+				return ForwardResult::OK;
+
+			switch (s.SendTo(to)) {
+			case Splice::SendResult::OK:
+			case Splice::SendResult::PARTIAL:
+				/* try again until EAGAIN */
+				continue;
+
+			case Splice::SendResult::SOCKET_BLOCKING:
+				to_writable = false;
+				return ForwardResult::OK;
+
+			case Splice::SendResult::ERROR:
+				return ForwardResult::ERROR;
+			}
+		}
+
+		if (!from_readable || s.received_bytes >= PUMP_BUDGET)
+			return ForwardResult::OK;
+
+		switch (s.ReceiveFrom(pipe_stock, from)) {
+		case Splice::ReceiveResult::OK:
+		case Splice::ReceiveResult::PIPE_FULL:
+			break;
+
+		case Splice::ReceiveResult::SOCKET_BLOCKING:
+			from_readable = false;
+			return ForwardResult::OK;
+
+		case Splice::ReceiveResult::SOCKET_CLOSED:
+			return ForwardResult::CLOSED;
+
+		case Splice::ReceiveResult::ERROR:
+			return ForwardResult::ERROR;
+		}
+	}
+}
+
+void
+RelayConnection::Pump() noexcept
+{
+	assert(edge_triggered);
+
+	splice_in_out.received_bytes = 0;
+	const auto in_out = Forward(instance.GetPipeStock(),
+				    incoming.GetSocket(), outgoing.GetSocket(),
+				    splice_in_out,
+				    incoming_readable, outgoing_writable);
+	instance.metrics.client_bytes += splice_in_out.received_bytes;
+	AddClientBytes(splice_in_out.received_bytes);
+
+	switch (in_out) {
+	case ForwardResult::OK:
+		break;
+
+	case ForwardResult::CLOSED:
+		/* close connection with FIN, not RST */
+		outgoing.GetSocket().ShutdownWrite();
+		Destroy();
+		return;
+
+	case ForwardResult::ERROR:
+		Destroy();
+		return;
+	}
+
+	splice_out_in.received_bytes = 0;
+	const auto out_in = Forward(instance.GetPipeStock(),
+				    outgoing.GetSocket(), incoming.GetSocket(),
+				    splice_out_in,
+				    outgoing_readable, incoming_writable);
+	instance.metrics.server_bytes += splice_out_in.received_bytes;
+	AddClientBytes(splice_out_in.received_bytes);
+
+	switch (out_in) {
+	case ForwardResult::OK:
+		break;
+
+	case ForwardResult::CLOSED:
+		incoming.GetSocket().ShutdownWrite();
+		Destroy();
+		return;
+
+	case ForwardResult::ERROR:
+		Destroy();
+		return;
+	}
+
+	/* a source which is still readable has exhausted its
+	   budget; give other connections a turn and continue in the
+	   next iteration (edge-triggered events will not be
+	   reported again) */
+	if ((incoming_readable && splice_in_out.received_bytes >= PUMP_BUDGET) ||
+	    (outgoing_readable && splice_out_in.received_bytes >= PUMP_BUDGET))
+		defer_pump.Schedule();
+}
+
+void
+RelayConnection::OnDeferredPump() noexcept
+{
+	const LoopStats::Scope loop_scope{instance.GetLoopStats(),
+					  LoopCategory::RELAY};
+
+	Pump();
+}
+
+void
+RelayConnection::OnIncomingReady(unsigned events) noexcept
+{
+	const LoopStats::Scope loop_scope{instance.GetLoopStats(),
+					  LoopCategory::RELAY};
+
+	if (events & incoming.DEAD_MASK) {
+		Destroy();
+		return;
+	}
+
+	if (edge_triggered) {
+		if (events & (incoming.READ | incoming.READ_HANGUP))
+			incoming_readable = true;
+		if (events & incoming.WRITE)
+			incoming_writable = true;
+
+		Pump();
+		return;
+	}
+
+	auto &n_epoll_ctl = instance.metrics.relay_epoll_ctl;
+
+	if (events & incoming.WRITE) {
+		if (!DoSpliceSend(outgoing, incoming, splice_out_in, n_epoll_ctl)) {
+			Destroy();
+			return;
+		}
+	}
+
+	if (events & incoming.READ) {
+		splice_in_out.received_bytes = 0;
+		switch (splice_in_out.ReceiveFrom(instance.GetPipeStock(), incoming.GetSocket())) {
+		case Splice::ReceiveResult::OK:
+			instance.metrics.client_bytes += splice_in_out.received_bytes;
+			AddClientBytes(splice_in_out.received_bytes);
+
+			if (!DoSpliceSend(incoming, outgoing, splice_in_out, n_epoll_ctl)) {
+				Destroy();
+				return;
+			}
+
+			break;
+
+		case Splice::ReceiveResult::SOCKET_BLOCKING:
+			break;
+
+		case Splice::ReceiveResult::SOCKET_CLOSED:
+			/* close connection with FIN, not RST */
+			outgoing.GetSocket().ShutdownWrite();
+
+			Destroy();
+			return;
+
+		case Splice::ReceiveResult::PIPE_FULL:
+			assert(outgoing.IsWritePending());
+			Reschedule(incoming, incoming.GetScheduledFlags() & ~incoming.READ,
+				   n_epoll_ctl);
+			return;
+
+		case Splice::ReceiveResult::ERROR:
+			// TODO errno
+			Destroy();
+			return;
+		}
+	}
+}
+
+void
+RelayConnection::OnOutgoingReady(unsigned events) noexcept
+{
+	const LoopStats::Scope loop_scope{instance.GetLoopStats(),
+					  LoopCategory::RELAY};
+
+	if (events & outgoing.DEAD_MASK) {
+		accounting.UpdateTokenBucket(5);
+		Destroy();
+		return;
+	}
+
+	if (edge_triggered) {
+		if (events & (outgoing.READ | outgoing.READ_HANGUP))
+			outgoing_readable = true;
+		if (events & outgoing.WRITE)
+			outgoing_writable = true;
+
+		Pump();
+		return;
+	}
+
+	auto &n_epoll_ctl = instance.metrics.relay_epoll_ctl;
+
+	if (events & outgoing.WRITE) {
+		if (!DoSpliceSend(incoming, outgoing, splice_in_out, n_epoll_ctl)) {
+			Destroy();
+			return;
+		}
+	}
+
+	if (events & outgoing.READ) {
+		splice_out_in.received_bytes = 0;
+		switch (splice_out_in.ReceiveFrom(instance.GetPipeStock(), outgoing.GetSocket())) {
+		case Splice::ReceiveResult::OK:
+			instance.metrics.server_bytes += splice_out_in.received_bytes;
+			AddClientBytes(splice_out_in.received_bytes);
+
+			if (!DoSpliceSend(outgoing, incoming, splice_out_in, n_epoll_ctl)) {
+				Destroy();
+				return;
+			}
+
+			break;
+
+		case Splice::ReceiveResult::SOCKET_BLOCKING:
+			break;
+
+		case Splice::ReceiveResult::SOCKET_CLOSED:
+			/* close connection with FIN, not RST */
+			incoming.GetSocket().ShutdownWrite();
+
+			Destroy();
+			return;
+
+		case Splice::ReceiveResult::PIPE_FULL:
+			assert(incoming.IsWritePending());
+			Reschedule(outgoing, outgoing.GetScheduledFlags() & ~outgoing.READ,
+				   n_epoll_ctl);
+			return;
+
+		case Splice::ReceiveResult::ERROR:
+			// TODO errno
+			Destroy();
+			return;
+		}
+	}
+}
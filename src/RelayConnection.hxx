@@ -0,0 +1,150 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+// author: Max Kellermann <max.kellermann@gmail.com>
+
+#pragma once
+
+#include "Splice.hxx"
+#include "event/Chrono.hxx"
+#include "event/DeferEvent.hxx"
+#include "event/SocketEvent.hxx"
+#include "net/SocketDescriptor.hxx"
+#include "net/AccountedClientConnection.hxx"
+#include "util/IntrusiveList.hxx"
+
+#include <cstdint>
+#include <string>
+
+class Instance;
+class PerClientAccounting;
+class UniqueSocketDescriptor;
+struct TcpInfoBackend;
+
+/**
+ * A session between a client and a game server after the login
+ * handshake (see #Connection) has completed: it only forwards data
+ * in both directions.  It keeps no handshake state, because there
+ * may be very many of these.
+ */
+class RelayConnection final
+	: public AutoUnlinkIntrusiveListHook
+{
+	Instance &instance;
+
+	/**
+	 * When the relay was started.
+	 */
+	const Event::TimePoint start_time;
+
+	AccountedClientConnection accounting;
+
+	SocketEvent incoming, outgoing;
+
+	Splice splice_in_out, splice_out_in;
+
+	/**
+	 * Calls Pump() again after it has stopped because its budget
+	 * was exhausted (edge-triggered mode only).
+	 */
+	DeferEvent defer_pump;
+
+	/**
+	 * Are both sockets registered edge-triggered for all events
+	 * (option "relay_edge_triggered")?  Then readiness is tracked
+	 * in the following flags, and each socket is drained until
+	 * EAGAIN, so the registration never needs to be changed.
+	 */
+	const bool edge_triggered;
+
+	bool incoming_readable = false, incoming_writable = false;
+	bool outgoing_readable = false, outgoing_writable = false;
+
+public:
+	/**
+	 * Per-relay state of #TcpInfoSampler.
+	 */
+	struct TcpInfoState {
+		/**
+		 * The histograms of this relay's game server or
+		 * nullptr if it was not sampled yet.
+		 */
+		TcpInfoBackend *backend = nullptr;
+
+		/**
+		 * Is the game server connected over AF_LOCAL (i.e. no
+		 * TCP_INFO on the server leg)?  Only valid if
+		 * #backend is set.
+		 */
+		bool local;
+
+		/**
+		 * The tcpi_total_retrans values of the previous
+		 * sample.
+		 */
+		uint_least32_t client_retrans = 0, server_retrans = 0;
+	};
+
+private:
+	mutable TcpInfoState tcp_info_state;
+
+public:
+	RelayConnection(Instance &_instance,
+			PerClientAccounting *per_client,
+			UniqueSocketDescriptor &&incoming_fd,
+			UniqueSocketDescriptor &&outgoing_fd) noexcept;
+
+	~RelayConnection() noexcept;
+
+	/**
+	 * Pass this connection's sockets to the new process.  This
+	 * is only possible while no data is buffered in the pipes.
+	 * The caller is responsible for destroying this object
+	 * afterwards.
+	 *
+	 * Throws on error.
+	 *
+	 * @return true on success, false if this connection cannot
+	 * be handed over
+	 */
+	bool Handover(SocketDescriptor s);
+
+	SocketDescriptor GetIncomingSocket() const noexcept {
+		return incoming.GetSocket();
+	}
+
+	SocketDescriptor GetOutgoingSocket() const noexcept {
+		return outgoing.GetSocket();
+	}
+
+	TcpInfoState &GetTcpInfoState() const noexcept {
+		return tcp_info_state;
+	}
+
+	/**
+	 * Append a JSON line describing this relay (for the
+	 * control socket).
+	 */
+	void DumpJson(std::string &out, Event::TimePoint now) const noexcept;
+
+private:
+	void Destroy() noexcept {
+		delete this;
+	}
+
+	/**
+	 * Account relayed bytes (either direction) to the client in
+	 * #HeavyHitters.
+	 */
+	void AddClientBytes(uint_least64_t n) noexcept;
+
+	/**
+	 * Forward data in both directions as far as the readiness
+	 * flags and the per-wakeup budget allow (edge-triggered mode
+	 * only).
+	 */
+	void Pump() noexcept;
+
+	void OnDeferredPump() noexcept;
+
+	void OnIncomingReady(unsigned events) noexcept;
+	void OnOutgoingReady(unsigned events) noexcept;
+};
@@ -0,0 +1,181 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+// author: Max Kellermann <max.kellermann@gmail.com>
+
+#include "Reresolver.hxx"
+#include "Config.hxx"
+#include "GameServerAddress.hxx"
+#include "thread/Job.hxx"
+#include "thread/Queue.hxx"
+#include "thread/Pool.hxx"
+#include "lib/fmt/ExceptionFormatter.hxx"
+#include "time/Cast.hxx"
+
+#include <fmt/format.h>
+
+#include <chrono>
+#include <iterator> // for std::back_inserter()
+
+class Reresolver::Job final : public ThreadJob, Cancellable {
+	ThreadQueue &queue;
+
+	Reresolver &parent;
+
+	const std::shared_ptr<const Config> old_config;
+
+	std::shared_ptr<const Config> new_config;
+
+	unsigned n_resolves = 0, n_errors = 0;
+
+	double duration;
+
+	bool canceled = false;
+
+public:
+	Job(ThreadQueue &_queue, Reresolver &_parent,
+	    std::shared_ptr<const Config> _old_config,
+	    CancellablePointer &cancel_ptr) noexcept
+		:queue(_queue), parent(_parent),
+		 old_config(std::move(_old_config)) {
+		cancel_ptr = *this;
+	}
+
+private:
+	/**
+	 * Resolve the host name again and replace the addresses if
+	 * they have changed.
+	 *
+	 * @return true if the addresses have changed
+	 */
+	bool Update(const std::string &host,
+		    std::vector<AllocatedSocketAddress> &addresses) noexcept {
+		++n_resolves;
+
+		try {
+			auto new_addresses = ResolveGameServer(host.c_str());
+			if (IsSameAddressList(new_addresses, addresses))
+				return false;
+
+			addresses = std::move(new_addresses);
+			return true;
+		} catch (...) {
+			++n_errors;
+			fmt::print(stderr, "Failed to resolve {:?}: {}\n",
+				   host, std::current_exception());
+			return false;
+		}
+	}
+
+	// virtual methods from ThreadJob
+
+	void Run() noexcept override {
+		const auto start_time = std::chrono::steady_clock::now();
+
+		auto c = std::make_shared<Config>(*old_config);
+
+		bool modified = Update(c->game_server_host, c->game_server);
+
+		for (auto &i : c->server_list)
+			modified |= Update(i.host, i.addresses);
+
+		if (modified)
+			new_config = std::move(c);
+
+		duration = ToFloatSeconds(std::chrono::steady_clock::now() - start_time);
+	}
+
+	void Done() noexcept override {
+		if (!canceled)
+			parent.OnJobDone(old_config, std::move(new_config),
+					 n_resolves, n_errors, duration);
+		delete this;
+	}
+
+	void Cancel() noexcept override {
+		canceled = true;
+
+		if (queue.Cancel(*this))
+			delete this;
+	}
+};
+
+Reresolver::Reresolver(EventLoop &event_loop,
+		       const std::shared_ptr<const Config> &_config,
+		       Callback _callback) noexcept
+	:config(_config), callback(_callback),
+	 timer(event_loop, BIND_THIS_METHOD(OnTimer))
+{
+}
+
+void
+Reresolver::Start() noexcept
+{
+	if (timer.IsPending() || cancel_ptr ||
+	    config->resolve_interval <= std::chrono::seconds{})
+		return;
+
+	timer.Schedule(config->resolve_interval);
+}
+
+void
+Reresolver::Stop() noexcept
+{
+	timer.Cancel();
+
+	if (cancel_ptr) {
+		cancel_ptr.Cancel();
+		cancel_ptr = {};
+	}
+}
+
+void
+Reresolver::OnTimer() noexcept
+{
+	auto &queue = thread_pool_get_queue(timer.GetEventLoop());
+	auto *job = new Job(queue, *this, config, cancel_ptr);
+	queue.Add(*job);
+}
+
+inline void
+Reresolver::OnJobDone(std::shared_ptr<const Config> old_config,
+		      std::shared_ptr<const Config> new_config,
+		      unsigned n_resolves, unsigned n_errors,
+		      double duration) noexcept
+{
+	cancel_ptr = {};
+
+	stats.resolves += n_resolves;
+	stats.errors += n_errors;
+	stats.duration = duration;
+
+	if (new_config) {
+		++stats.changes;
+		callback(old_config, std::move(new_config));
+	}
+
+	Start();
+}
+
+void
+Reresolver::ExportMetrics(std::string &out) const noexcept
+{
+	fmt::format_to(std::back_inserter(out), R"(
+# HELP uologin_resolves Counter for periodic game server host name resolutions
+# TYPE uologin_resolves counter
+
+# HELP uologin_resolve_errors Counter for failed periodic game server host name resolutions
+# TYPE uologin_resolve_errors counter
+
+# HELP uologin_resolve_changes Counter for configuration snapshots published due to changed game server addresses
+# TYPE uologin_resolve_changes counter
+
+# HELP uologin_resolve_seconds Duration of the last periodic game server host name resolution
+# TYPE uologin_resolve_seconds gauge
+
+uologin_resolves {}
+uologin_resolve_errors {}
+uologin_resolve_changes {}
+uologin_resolve_seconds {}
+)",
+		       stats.resolves, stats.errors, stats.changes,
+		       stats.duration);
+}
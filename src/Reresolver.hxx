@@ -0,0 +1,84 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+// author: Max Kellermann <max.kellermann@gmail.com>
+
+#pragma once
+
+#include "event/FarTimerEvent.hxx"
+#include "util/BindMethod.hxx"
+#include "util/Cancellable.hxx"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+struct Config;
+
+/**
+ * Periodically resolves the "game_server" host names again in a
+ * worker thread.  If any address has changed, a copy of the
+ * configuration snapshot with the new addresses is passed to the
+ * callback.  Resolver errors keep the old addresses.
+ */
+class Reresolver {
+public:
+	/**
+	 * @param old_config the snapshot the new one was derived
+	 * from; if it is not current anymore (because the
+	 * configuration was reloaded meanwhile), the new snapshot
+	 * should be discarded
+	 */
+	using Callback = BoundMethod<void(const std::shared_ptr<const Config> &old_config,
+					  std::shared_ptr<const Config> new_config) noexcept>;
+
+private:
+	/**
+	 * The current configuration snapshot (owned by #Instance).
+	 */
+	const std::shared_ptr<const Config> &config;
+
+	const Callback callback;
+
+	FarTimerEvent timer;
+
+	CancellablePointer cancel_ptr;
+
+	class Job;
+
+public:
+	struct {
+		uint_least64_t resolves, errors, changes;
+
+		/**
+		 * Duration of the last run in seconds.
+		 */
+		double duration;
+	} stats{};
+
+	Reresolver(EventLoop &event_loop,
+		   const std::shared_ptr<const Config> &_config,
+		   Callback _callback) noexcept;
+
+	~Reresolver() noexcept {
+		Stop();
+	}
+
+	/**
+	 * Schedule the next run according to the current
+	 * "resolve_interval" (unless already scheduled or running).
+	 */
+	void Start() noexcept;
+
+	void Stop() noexcept;
+
+	/**
+	 * Append Prometheus metrics to the given string.
+	 */
+	void ExportMetrics(std::string &out) const noexcept;
+
+private:
+	void OnTimer() noexcept;
+	void OnJobDone(std::shared_ptr<const Config> old_config,
+		       std::shared_ptr<const Config> new_config,
+		       unsigned n_resolves, unsigned n_errors,
+		       double duration) noexcept;
+};
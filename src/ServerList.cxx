@@ -0,0 +1,39 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+// author: Max Kellermann <max.kellermann@gmail.com>
+
+#include "ServerList.hxx"
+#include "Config.hxx"
+#include "uo/Command.hxx"
+
+#include <cassert>
+#include <cstdio> // for snprintf()
+#include <cstring> // for memset()
+
+std::span<const std::byte>
+FormatServerList(std::span<std::byte> dest,
+		 std::span<const GameServerConfig> servers) noexcept
+{
+	assert(!servers.empty());
+
+	const std::size_t size = GetServerListPacketSize(servers.size());
+	assert(dest.size() >= size);
+
+	auto &packet = *reinterpret_cast<struct uo_packet_server_list *>(dest.data());
+	memset(&packet, 0, size);
+
+	packet.cmd = UO::Command::ServerList;
+	packet.length = size;
+	packet.unknown_0x5d = 0x5d;
+	packet.num_game_servers = servers.size();
+
+	for (unsigned i = 0; i < servers.size(); ++i) {
+		const auto &src = servers[i];
+		auto &dst = packet.game_servers[i];
+
+		dst.index = i;
+		snprintf(dst.name, sizeof(dst.name), "%s", src.name.c_str());
+		dst.address = 0xdeadbeef;
+	}
+
+	return dest.first(size);
+}
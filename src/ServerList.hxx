@@ -0,0 +1,32 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+// author: Max Kellermann <max.kellermann@gmail.com>
+
+#pragma once
+
+#include "uo/Packets.hxx"
+
+#include <cstddef>
+#include <span>
+
+struct GameServerConfig;
+
+/**
+ * @return the size of a ServerList packet with the given number of
+ * game servers
+ */
+constexpr std::size_t
+GetServerListPacketSize(std::size_t n_servers) noexcept
+{
+	return sizeof(struct uo_packet_server_list) +
+		(n_servers - 1) * sizeof(struct uo_fragment_server_info);
+}
+
+/**
+ * Serialize a ServerList packet which lists the given game servers.
+ *
+ * @param dest a buffer of at least GetServerListPacketSize() bytes
+ * @return the packet (pointing into #dest)
+ */
+std::span<const std::byte>
+FormatServerList(std::span<std::byte> dest,
+		 std::span<const GameServerConfig> servers) noexcept;
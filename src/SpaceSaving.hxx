@@ -0,0 +1,214 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+// author: Max Kellermann <max.kellermann@gmail.com>
+
+#pragma once
+
+#include <algorithm> // for std::partial_sort_copy()
+#include <array>
+#include <bit> // for std::bit_ceil()
+#include <cstddef>
+#include <cstdint>
+#include <functional> // for std::hash, std::equal_to
+#include <iterator> // for std::distance()
+#include <span>
+#include <utility> // for std::swap()
+
+/**
+ * A fixed-size "Space-Saving" sketch (Metwally et al.) which tracks
+ * the approximate top K keys of a weighted stream.  A key which is
+ * not tracked replaces the key with the smallest count and inherits
+ * its count as the error bound; every key whose true count exceeds
+ * the total weight divided by K is guaranteed to be tracked.
+ *
+ * The counters are organized as a min-heap with an open addressing
+ * hash table for lookups, so Add() costs O(log K) with no
+ * allocation.
+ */
+template<typename Key, std::size_t K,
+	 typename Hash=std::hash<Key>, typename Equal=std::equal_to<Key>>
+class SpaceSaving {
+	static_assert(K > 0 && K < 0x8000);
+
+	using Index = uint_least16_t;
+
+public:
+	struct Counter {
+		Key key;
+
+		/**
+		 * The estimated count; it may exceed the true count
+		 * by up to #error.
+		 */
+		uint_least64_t count;
+
+		uint_least64_t error;
+	};
+
+private:
+	std::array<Counter, K> counters;
+
+	/**
+	 * Indices into #counters, ordered as a min-heap by count.
+	 */
+	std::array<Index, K> heap;
+
+	/**
+	 * The position of each counter in #heap.
+	 */
+	std::array<Index, K> heap_position;
+
+	static constexpr std::size_t TABLE_SIZE = std::bit_ceil(K * 2);
+
+	/**
+	 * Maps keys to counter indices plus one; zero means the
+	 * slot is empty (linear probing).
+	 */
+	std::array<Index, TABLE_SIZE> table{};
+
+	std::size_t n = 0;
+
+	[[no_unique_address]] Hash hash;
+	[[no_unique_address]] Equal equal;
+
+public:
+	std::size_t size() const noexcept {
+		return n;
+	}
+
+	void Add(const Key &key, uint_least64_t weight) noexcept {
+		std::size_t slot = FindSlot(key);
+		if (table[slot] != 0) {
+			const std::size_t i = table[slot] - 1;
+			counters[i].count += weight;
+			SiftDown(heap_position[i]);
+			return;
+		}
+
+		if (n < K) {
+			const std::size_t i = n++;
+			counters[i] = {key, weight, 0};
+			table[slot] = i + 1;
+			heap[n - 1] = i;
+			heap_position[i] = n - 1;
+			SiftUp(n - 1);
+			return;
+		}
+
+		/* replace the counter with the smallest count */
+		const std::size_t i = heap.front();
+		Counter &c = counters[i];
+		Erase(FindSlot(c.key));
+
+		c.key = key;
+		c.error = c.count;
+		c.count += weight;
+
+		/* the slot may have moved due to Erase() */
+		table[FindSlot(key)] = i + 1;
+		SiftDown(0);
+	}
+
+	/**
+	 * Halve all counts.  This keeps the heap order and lets old
+	 * heavy hitters fade away.
+	 */
+	void Decay() noexcept {
+		for (std::size_t i = 0; i < n; ++i) {
+			counters[i].count /= 2;
+			counters[i].error /= 2;
+		}
+	}
+
+	/**
+	 * Copy the counters with the largest counts (in descending
+	 * order) to the given buffer.
+	 *
+	 * @return the number of counters which were copied
+	 */
+	std::size_t Top(std::span<Counter> dest) const noexcept {
+		const auto end = std::partial_sort_copy(counters.begin(),
+							counters.begin() + n,
+							dest.begin(), dest.end(),
+							[](const Counter &a, const Counter &b){
+								return a.count > b.count;
+							});
+		return std::distance(dest.begin(), end);
+	}
+
+private:
+	/**
+	 * Find the slot of the given key, or the empty slot where it
+	 * would be inserted.
+	 */
+	std::size_t FindSlot(const Key &key) const noexcept {
+		std::size_t slot = hash(key) & (TABLE_SIZE - 1);
+		while (table[slot] != 0 &&
+		       !equal(counters[table[slot] - 1].key, key))
+			slot = (slot + 1) & (TABLE_SIZE - 1);
+		return slot;
+	}
+
+	/**
+	 * Clear a slot with backward shift deletion, which keeps all
+	 * probe sequences intact without tombstones.
+	 */
+	void Erase(std::size_t slot) noexcept {
+		std::size_t next = slot;
+		while (true) {
+			next = (next + 1) & (TABLE_SIZE - 1);
+			if (table[next] == 0)
+				break;
+
+			const std::size_t home = hash(counters[table[next] - 1].key) & (TABLE_SIZE - 1);
+
+			/* can the entry at "next" move to "slot"?  Only
+			   if its home is not within (slot, next] */
+			if (((next - home) & (TABLE_SIZE - 1)) >=
+			    ((next - slot) & (TABLE_SIZE - 1))) {
+				table[slot] = table[next];
+				slot = next;
+			}
+		}
+
+		table[slot] = 0;
+	}
+
+	void Swap(std::size_t a, std::size_t b) noexcept {
+		std::swap(heap[a], heap[b]);
+		heap_position[heap[a]] = a;
+		heap_position[heap[b]] = b;
+	}
+
+	uint_least64_t CountAt(std::size_t position) const noexcept {
+		return counters[heap[position]].count;
+	}
+
+	void SiftUp(std::size_t position) noexcept {
+		while (position > 0) {
+			const std::size_t parent = (position - 1) / 2;
+			if (CountAt(parent) <= CountAt(position))
+				break;
+
+			Swap(parent, position);
+			position = parent;
+		}
+	}
+
+	void SiftDown(std::size_t position) noexcept {
+		while (true) {
+			std::size_t smallest = position;
+			const std::size_t left = position * 2 + 1, right = left + 1;
+
+			if (left < n && CountAt(left) < CountAt(smallest))
+				smallest = left;
+			if (right < n && CountAt(right) < CountAt(smallest))
+				smallest = right;
+
+			if (smallest == position)
+				break;
+
+			Swap(position, smallest);
+			position = smallest;
+		}
+	}
+};
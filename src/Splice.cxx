@@ -3,6 +3,7 @@
 
 #include "Splice.hxx"
 #include "PipeStock.hxx"
+#include "Probes.hxx"
 #include "stock/Item.hxx"
 #include "net/SocketDescriptor.hxx"
 
@@ -29,6 +30,8 @@ Splice::ReceiveFrom(PipeStock &stock, SocketDescriptor s)
 				   pipe_stock_item_get(pipe).second.Get(), nullptr,
 				   1ULL << 30,
 				   SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+	UOLOGIN_PROBE(splice_receive, s.Get(), nbytes, nbytes < 0 ? errno : 0);
+
 	if (nbytes > 0) {
 		size += static_cast<std::size_t>(nbytes);
 		received_bytes += static_cast<std::size_t>(nbytes);
@@ -61,6 +64,8 @@ Splice::SendTo(SocketDescriptor s)
 				   s.Get(), nullptr,
 				   size,
 				   SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+	UOLOGIN_PROBE(splice_send, s.Get(), nbytes, nbytes < 0 ? errno : 0);
+
 	if (nbytes > 0) {
 		size -= static_cast<std::size_t>(nbytes);
 		sent_bytes += static_cast<std::size_t>(nbytes);
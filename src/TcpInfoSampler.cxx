@@ -0,0 +1,250 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+// author: Max Kellermann <max.kellermann@gmail.com>
+
+#include "TcpInfoSampler.hxx"
+#include "Instance.hxx"
+#include "Listener.hxx"
+#include "RelayConnection.hxx"
+#include "net/SocketDescriptor.hxx"
+#include "net/StaticSocketAddress.hxx"
+#include "net/ToString.hxx"
+
+#include <fmt/format.h>
+
+#include <iterator> // for std::back_inserter()
+
+#include <linux/sockios.h> // for SIOCOUTQNSD
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h> // for AF_LOCAL
+
+using std::string_view_literals::operator""sv;
+
+static constexpr Event::Duration TICK_INTERVAL = std::chrono::seconds{1};
+
+/**
+ * Limits the number of label values (and memory usage) if relays
+ * are spread over many game server addresses.
+ */
+static constexpr std::size_t MAX_BACKENDS = 64;
+
+TcpInfoSampler::TcpInfoSampler(Instance &_instance,
+			       std::size_t _budget) noexcept
+	:instance(_instance), budget(_budget),
+	 timer(instance.GetEventLoop(), BIND_THIS_METHOD(OnTimer))
+{
+}
+
+void
+TcpInfoSampler::Start() noexcept
+{
+	timer.Schedule(TICK_INTERVAL);
+}
+
+void
+TcpInfoSampler::OnRelayDestroyed(const RelayConnection &r) noexcept
+{
+	if (next_relay != &r)
+		return;
+
+	if (!r.is_linked()) {
+		/* the whole list is being cleared */
+		next_relay = nullptr;
+		return;
+	}
+
+	const auto &list = listener->GetRelays();
+	auto i = list.iterator_to(r);
+	++i;
+	next_relay = i != list.end() ? &*i : nullptr;
+}
+
+inline void
+TcpInfoBackend::Leg::Add(const struct tcp_info &info,
+			 uint_least32_t retransmits_delta,
+			 std::size_t notsent_bytes) noexcept
+{
+	rtt.Add(info.tcpi_rtt);
+	rttvar.Add(info.tcpi_rttvar);
+	retransmits.Add(retransmits_delta);
+	cwnd.Add(info.tcpi_snd_cwnd);
+	unacked.Add(info.tcpi_unacked);
+	notsent.Add(notsent_bytes);
+}
+
+TcpInfoSampler::Backend &
+TcpInfoSampler::GetBackend(const RelayConnection &r) noexcept
+{
+	auto &state = r.GetTcpInfoState();
+	if (state.backend != nullptr)
+		return *state.backend;
+
+	const auto address = r.GetOutgoingSocket().GetPeerAddress();
+	state.local = address.GetFamily() == AF_LOCAL;
+
+	std::string key = ToString(address);
+	if (key.empty())
+		key = "unknown"sv;
+
+	if (auto i = backends.find(key); i != backends.end()) {
+		state.backend = &i->second;
+		return i->second;
+	}
+
+	if (backends.size() >= MAX_BACKENDS)
+		key = "other"sv;
+
+	state.backend = &backends[std::move(key)];
+	return *state.backend;
+}
+
+bool
+TcpInfoSampler::Sample(LegHistograms &h, SocketDescriptor s,
+		       uint_least32_t &previous_retrans) noexcept
+{
+	struct tcp_info info;
+	socklen_t size = sizeof(info);
+	if (getsockopt(s.Get(), IPPROTO_TCP, TCP_INFO, &info, &size) < 0)
+		return false;
+
+	int notsent = 0;
+	if (ioctl(s.Get(), SIOCOUTQNSD, &notsent) < 0)
+		notsent = 0;
+
+	/* tcpi_total_retrans counts since the connection was
+	   established; only the increase since the previous sample
+	   says something about the current link quality */
+	const uint_least32_t delta = info.tcpi_total_retrans - previous_retrans;
+	previous_retrans = info.tcpi_total_retrans;
+
+	h.Add(info, delta, notsent);
+	return true;
+}
+
+inline void
+TcpInfoSampler::Sample(const RelayConnection &r) noexcept
+{
+	auto &backend = GetBackend(r);
+	auto &state = r.GetTcpInfoState();
+
+	++n_samples;
+
+	if (!Sample(backend.client, r.GetIncomingSocket(),
+		    state.client_retrans))
+		++n_errors;
+
+	if (!state.local &&
+	    !Sample(backend.server, r.GetOutgoingSocket(),
+		    state.server_retrans))
+		++n_errors;
+}
+
+void
+TcpInfoSampler::NextListener() noexcept
+{
+	const auto &listeners = instance.GetListeners();
+
+	++listener_index;
+
+	auto i = listeners.begin();
+	for (std::size_t n = 0; n < listener_index && i != listeners.end(); ++n)
+		++i;
+
+	if (i == listeners.end()) {
+		/* wrap around */
+		listener_index = 0;
+		i = listeners.begin();
+		if (i == listeners.end())
+			return;
+	}
+
+	listener = &*i;
+
+	const auto &relays = listener->GetRelays();
+	next_relay = relays.empty() ? nullptr : &relays.front();
+}
+
+void
+TcpInfoSampler::OnTimer() noexcept
+{
+	const auto &listeners = instance.GetListeners();
+	const std::size_t n_listeners = std::distance(listeners.begin(),
+						      listeners.end());
+
+	/* visit each listener at most once per tick, or an idle
+	   process would spin here */
+	std::size_t remaining = budget;
+	for (std::size_t visited = 0;
+	     remaining > 0 && visited <= n_listeners;) {
+		if (next_relay == nullptr) {
+			NextListener();
+			++visited;
+			continue;
+		}
+
+		const auto &relays = listener->GetRelays();
+		auto i = relays.iterator_to(*next_relay);
+		for (; remaining > 0 && i != relays.end(); ++i, --remaining)
+			Sample(*i);
+
+		next_relay = i != relays.end() ? &*i : nullptr;
+	}
+
+	timer.Schedule(TICK_INTERVAL);
+}
+
+static void
+ExportHistogram(std::string &out, std::string_view name,
+		std::string_view help, double scale,
+		const auto &backends, auto member) noexcept
+{
+	fmt::format_to(std::back_inserter(out), R"(
+# HELP {0} {1}
+# TYPE {0} histogram
+)", name, help);
+
+	for (const auto &[address, backend] : backends) {
+		(backend.client.*member).Export(out, name,
+						fmt::format(R"(leg="client",backend="{}")", address),
+						scale);
+		(backend.server.*member).Export(out, name,
+						fmt::format(R"(leg="server",backend="{}")", address),
+						scale);
+	}
+}
+
+void
+TcpInfoSampler::ExportMetrics(std::string &out) const noexcept
+{
+	fmt::format_to(std::back_inserter(out), R"(
+# HELP uologin_tcp_info_samples Counter for relays whose TCP_INFO was sampled
+# TYPE uologin_tcp_info_samples counter
+
+# HELP uologin_tcp_info_errors Counter for sockets whose TCP_INFO could not be sampled
+# TYPE uologin_tcp_info_errors counter
+
+uologin_tcp_info_samples {}
+uologin_tcp_info_errors {}
+)",
+		       n_samples, n_errors);
+
+	ExportHistogram(out, "uologin_tcp_rtt_seconds"sv,
+			"Smoothed round trip time of sampled relay sockets"sv,
+			1e-6, backends, &LegHistograms::rtt);
+	ExportHistogram(out, "uologin_tcp_rttvar_seconds"sv,
+			"Round trip time variance of sampled relay sockets"sv,
+			1e-6, backends, &LegHistograms::rttvar);
+	ExportHistogram(out, "uologin_tcp_retransmits"sv,
+			"Segments retransmitted since the previous sample of the same relay socket"sv,
+			1, backends, &LegHistograms::retransmits);
+	ExportHistogram(out, "uologin_tcp_cwnd_segments"sv,
+			"Congestion window of sampled relay sockets"sv,
+			1, backends, &LegHistograms::cwnd);
+	ExportHistogram(out, "uologin_tcp_unacked_segments"sv,
+			"Unacknowledged segments of sampled relay sockets"sv,
+			1, backends, &LegHistograms::unacked);
+	ExportHistogram(out, "uologin_tcp_notsent_bytes"sv,
+			"Bytes not yet sent of sampled relay sockets"sv,
+			1, backends, &LegHistograms::notsent);
+}
@@ -0,0 +1,157 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+// author: Max Kellermann <max.kellermann@gmail.com>
+
+#pragma once
+
+#include "Histogram.hxx"
+#include "event/CoarseTimerEvent.hxx"
+
+#include <cstddef>
+#include <cstdint>
+#include <functional> // for std::less
+#include <map>
+#include <string>
+
+struct tcp_info;
+class Instance;
+class Listener;
+class RelayConnection;
+class SocketDescriptor;
+
+/**
+ * Histograms of one game server address; see #TcpInfoSampler.
+ */
+struct TcpInfoBackend {
+	struct Leg {
+		/**
+		 * Smoothed round trip time and its variance [us].
+		 */
+		Log2Histogram<24> rtt, rttvar;
+
+		/**
+		 * Segments retransmitted since the previous sample
+		 * of the same socket.
+		 */
+		Log2Histogram<16> retransmits;
+
+		/**
+		 * Congestion window [segments].
+		 */
+		Log2Histogram<16> cwnd;
+
+		/**
+		 * Sent but unacknowledged segments.
+		 */
+		Log2Histogram<16> unacked;
+
+		/**
+		 * Bytes in the send queue which have not been sent
+		 * yet.
+		 */
+		Log2Histogram<24> notsent;
+
+		void Add(const struct tcp_info &info,
+			 uint_least32_t retransmits_delta,
+			 std::size_t notsent_bytes) noexcept;
+	};
+
+	Leg client, server;
+};
+
+/**
+ * Periodically samples TCP_INFO of both sockets of a few
+ * #RelayConnection objects and aggregates the values into histograms
+ * per leg (client or server) and per game server address.  This
+ * helps to find out where lag comes from.  Local (AF_UNIX) game
+ * server connections have no server leg.
+ *
+ * Each tick continues where the previous one stopped, so all relays
+ * are visited in turn, and the number of samples per tick is
+ * bounded, no matter how many relays there are.
+ */
+class TcpInfoSampler {
+	Instance &instance;
+
+	/**
+	 * The maximum number of relays sampled per tick.
+	 */
+	const std::size_t budget;
+
+	CoarseTimerEvent timer;
+
+	/**
+	 * The index of the #Listener whose relays are currently being
+	 * sampled.
+	 */
+	std::size_t listener_index = 0;
+
+	/**
+	 * The #Listener at #listener_index; only valid while
+	 * #next_relay is set.
+	 */
+	const Listener *listener;
+
+	/**
+	 * The next relay to be sampled or nullptr to continue with the
+	 * next #Listener.  If it gets destroyed, OnRelayDestroyed()
+	 * advances this pointer.
+	 */
+	const RelayConnection *next_relay = nullptr;
+
+	using LegHistograms = TcpInfoBackend::Leg;
+	using Backend = TcpInfoBackend;
+
+	/**
+	 * Histograms by game server address.  Items are never
+	 * erased, so #RelayConnection may keep pointers to them.
+	 */
+	std::map<std::string, Backend, std::less<>> backends;
+
+	uint_least64_t n_samples = 0, n_errors = 0;
+
+public:
+	TcpInfoSampler(Instance &_instance, std::size_t _budget) noexcept;
+
+	void Start() noexcept;
+
+	void Stop() noexcept {
+		timer.Cancel();
+	}
+
+	/**
+	 * Called by the #RelayConnection destructor.
+	 */
+	void OnRelayDestroyed(const RelayConnection &r) noexcept;
+
+	/**
+	 * Append Prometheus metrics to the given string.
+	 */
+	void ExportMetrics(std::string &out) const noexcept;
+
+private:
+	/**
+	 * Look up the #Backend of the given relay's game server.  The
+	 * result is cached in the relay, so getpeername() and the
+	 * address formatter run only on its first sample.
+	 */
+	Backend &GetBackend(const RelayConnection &r) noexcept;
+
+	/**
+	 * @param previous_retrans the tcpi_total_retrans value of the
+	 * previous sample of this socket; it is updated
+	 *
+	 * @return false if the socket could not be sampled (e.g.
+	 * because it is not TCP)
+	 */
+	static bool Sample(LegHistograms &h, SocketDescriptor s,
+			   uint_least32_t &previous_retrans) noexcept;
+
+	void Sample(const RelayConnection &r) noexcept;
+
+	/**
+	 * Advance to the first relay of the next #Listener.
+	 */
+	void NextListener() noexcept;
+
+	void OnTimer() noexcept;
+};
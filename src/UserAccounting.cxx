@@ -0,0 +1,127 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+// author: Max Kellermann <max.kellermann@gmail.com>
+
+#include "UserAccounting.hxx"
+#include "event/Loop.hxx"
+#include "time/Cast.hxx"
+#include "util/DeleteDisposer.hxx"
+
+#include <algorithm> // for std::copy()
+#include <cassert>
+
+/**
+ * Each username may fail 10 times in a row, and then once per
+ * minute.
+ */
+static constexpr TokenBucketConfig token_bucket_config{
+	.rate = 1.0 / 60,
+	.burst = 10,
+};
+
+static constexpr Event::Duration MIN_LOCKOUT = std::chrono::seconds{30};
+static constexpr unsigned MAX_LOCKOUT_SHIFT = 7; // 64 minutes
+
+UserAccounting::Item::Item(std::string_view _name) noexcept
+	:name_length(_name.size())
+{
+	assert(_name.size() <= name_buffer.size());
+
+	std::copy(_name.begin(), _name.end(), name_buffer.begin());
+}
+
+UserAccounting::~UserAccounting() noexcept
+{
+	map.clear();
+	lru.clear_and_dispose(DeleteDisposer{});
+}
+
+std::size_t
+UserAccounting::CountLockedOut() const noexcept
+{
+	const auto now = event_loop.SteadyNow();
+
+	std::size_t n = 0;
+	for (const auto &i : lru)
+		if (now < i.locked_until)
+			++n;
+
+	return n;
+}
+
+bool
+UserAccounting::Check(std::string_view upper_username) noexcept
+{
+	const auto i = map.find(upper_username);
+	if (i == map.end() || event_loop.SteadyNow() >= i->locked_until)
+		return true;
+
+	++stats.rejected_verifications;
+	return false;
+}
+
+UserAccounting::Item &
+UserAccounting::Make(std::string_view upper_username) noexcept
+{
+	auto [i, inserted] = map.insert_check(upper_username);
+	if (!inserted) {
+		/* move to the end of the LRU list */
+		lru.erase(lru.iterator_to(*i));
+		lru.push_back(*i);
+		return *i;
+	}
+
+	if (n_items >= max_items) {
+		/* evict the least recently used item */
+		auto &oldest = lru.front();
+		lru.pop_front();
+		map.erase(map.iterator_to(oldest));
+		delete &oldest;
+		--n_items;
+		++stats.evictions;
+
+		/* the eviction may have invalidated the insert
+		   position */
+		i = map.insert_check(upper_username).first;
+	}
+
+	auto *item = new Item(upper_username);
+	map.insert_commit(i, *item);
+	lru.push_back(*item);
+	++n_items;
+	return *item;
+}
+
+void
+UserAccounting::Update(std::string_view upper_username, bool result) noexcept
+{
+	if (upper_username.data() == nullptr)
+		return;
+
+	if (result) {
+		/* successful login: forget all previous failures */
+		if (auto i = map.find(upper_username); i != map.end()) {
+			auto &item = *i;
+			map.erase(i);
+			lru.erase(lru.iterator_to(item));
+			delete &item;
+			--n_items;
+		}
+
+		return;
+	}
+
+	auto &item = Make(upper_username);
+
+	const auto now = event_loop.SteadyNow();
+	if (item.token_bucket.Update(token_bucket_config,
+				     ToFloatSeconds(now.time_since_epoch()),
+				     1) >= 0)
+		return;
+
+	/* exponential backoff */
+	item.locked_until = now + MIN_LOCKOUT * (1U << item.n_lockouts);
+	if (item.n_lockouts < MAX_LOCKOUT_SHIFT)
+		++item.n_lockouts;
+
+	++stats.lockouts;
+}
@@ -0,0 +1,119 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+// author: Max Kellermann <max.kellermann@gmail.com>
+
+#pragma once
+
+#include "Username.hxx"
+#include "event/Chrono.hxx"
+#include "util/IntrusiveHashSet.hxx"
+#include "util/IntrusiveList.hxx"
+#include "util/TokenBucket.hxx"
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+class EventLoop;
+
+/**
+ * Keeps track of failed password verifications per (upper case)
+ * username, independent of the client address, to stop distributed
+ * brute force attacks on one account before they reach the
+ * (expensive) password hash verification.
+ *
+ * The number of items is bounded; if the table is full, the least
+ * recently used item is evicted.
+ */
+class UserAccounting final {
+	struct Item final
+		: IntrusiveHashSetHook<IntrusiveHookMode::NORMAL>
+	{
+		IntrusiveListHook<IntrusiveHookMode::NORMAL> lru_siblings;
+
+		UpperUsernameBuffer name_buffer;
+		uint_least8_t name_length;
+
+		/**
+		 * The number of lockouts in a row; the lockout
+		 * duration doubles each time.
+		 */
+		uint_least8_t n_lockouts = 0;
+
+		TokenBucket token_bucket;
+
+		Event::TimePoint locked_until{};
+
+		explicit Item(std::string_view _name) noexcept;
+
+		std::string_view GetName() const noexcept {
+			return {name_buffer.data(), name_length};
+		}
+
+		struct GetKey {
+			constexpr std::string_view operator()(const Item &item) const noexcept {
+				return item.GetName();
+			}
+		};
+	};
+
+	EventLoop &event_loop;
+
+	const std::size_t max_items;
+
+	using Map = IntrusiveHashSet<Item, 16384,
+				     IntrusiveHashSetOperators<Item, Item::GetKey,
+							       std::hash<std::string_view>,
+							       std::equal_to<std::string_view>>>;
+	Map map;
+
+	/**
+	 * All items; the most recently used one is at the end.
+	 */
+	IntrusiveList<Item,
+		      IntrusiveListMemberHookTraits<&Item::lru_siblings>> lru;
+
+	std::size_t n_items = 0;
+
+public:
+	struct {
+		uint_least64_t lockouts;
+		uint_least64_t rejected_verifications;
+		uint_least64_t evictions;
+	} stats{};
+
+	UserAccounting(EventLoop &_event_loop, std::size_t _max_items) noexcept
+		:event_loop(_event_loop), max_items(_max_items) {}
+
+	~UserAccounting() noexcept;
+
+	UserAccounting(const UserAccounting &) = delete;
+	UserAccounting &operator=(const UserAccounting &) = delete;
+
+	std::size_t size() const noexcept {
+		return n_items;
+	}
+
+	/**
+	 * Returns the number of usernames which are currently locked
+	 * out.
+	 */
+	[[gnu::pure]]
+	std::size_t CountLockedOut() const noexcept;
+
+	/**
+	 * Check whether a verification for this username shall be
+	 * performed.  If not, the rejection is counted.
+	 *
+	 * @param upper_username the return value of ToUpperUsername()
+	 */
+	bool Check(std::string_view upper_username) noexcept;
+
+	/**
+	 * Update the table after a password verification has
+	 * finished.
+	 */
+	void Update(std::string_view upper_username, bool result) noexcept;
+
+private:
+	Item &Make(std::string_view upper_username) noexcept;
+};
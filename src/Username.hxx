@@ -0,0 +1,34 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+// author: Max Kellermann <max.kellermann@gmail.com>
+
+#pragma once
+
+#include "util/CharUtil.hxx"
+
+#include <algorithm> // for std::transform()
+#include <array>
+#include <string_view>
+
+/**
+ * A buffer for ToUpperUsername().  Its size is the size of the
+ * username field in the UO protocol.
+ */
+using UpperUsernameBuffer = std::array<char, 30>;
+
+/**
+ * Convert a username to upper case; this is the key in the user
+ * database.
+ *
+ * @return the upper case username (pointing into the given buffer)
+ * or a nullptr string_view if the username is too long
+ */
+constexpr std::string_view
+ToUpperUsername(UpperUsernameBuffer &buffer, std::string_view username) noexcept
+{
+	if (username.size() > buffer.size())
+		return {};
+
+	std::transform(username.begin(), username.end(),
+		       buffer.begin(), ToUpperASCII);
+	return {buffer.data(), username.size()};
+}
@@ -6,6 +6,9 @@
 #include "util/CharUtil.hxx"
 #include "util/StringVerify.hxx"
 
+#include <cstddef>
+#include <cstdint>
+
 constexpr bool
 IsValidUsername(std::string_view s) noexcept
 {
@@ -13,3 +16,31 @@ IsValidUsername(std::string_view s) noexcept
 		return IsPrintableASCII(ch);
 	});
 }
+
+/**
+ * Check a null-padded string field from a UO packet: all characters
+ * up to the first null byte must be printable ASCII.
+ *
+ * Unlike IsValidUsername(), this function has no data-dependent
+ * branches; it builds bit masks over the whole field, which allows
+ * the compiler to vectorize the loop.
+ */
+template<std::size_t N>
+constexpr bool
+IsValidStringField(const char (&field)[N], bool allow_empty) noexcept
+{
+	static_assert(N <= 32);
+
+	uint_least32_t nul_mask = 0, bad_mask = 0;
+	for (std::size_t i = 0; i < N; ++i) {
+		nul_mask |= uint_least32_t(field[i] == '\0') << i;
+		bad_mask |= uint_least32_t(!IsPrintableASCII(field[i])) << i;
+	}
+
+	/* all bits below the first null byte (or all bits if there
+	   is none) */
+	const uint_least32_t before_nul = (nul_mask & -nul_mask) - 1;
+
+	return (bad_mask & before_nul) == 0 &&
+		(allow_empty || (nul_mask & 1) == 0);
+}
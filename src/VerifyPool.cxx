@@ -0,0 +1,372 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+// author: Max Kellermann <max.kellermann@gmail.com>
+
+#include "VerifyPool.hxx"
+#include "time/Cast.hxx"
+
+#include <fmt/core.h>
+
+#include <algorithm> // for std::max()
+#include <cassert>
+#include <functional> // for std::ref()
+#include <iterator> // for std::back_inserter()
+
+#include <pthread.h>
+#include <sched.h>
+
+/**
+ * Start another thread if a job had to wait in the queue for longer
+ * than this.
+ */
+static constexpr std::chrono::steady_clock::duration GROW_WAIT = std::chrono::milliseconds{20};
+
+/**
+ * Threads above the minimum exit after being idle for this long.
+ */
+static constexpr std::chrono::steady_clock::duration IDLE_TIMEOUT = std::chrono::seconds{30};
+
+VerifyPool::VerifyPool(EventLoop &event_loop,
+		       unsigned _min_threads, unsigned _max_threads,
+		       std::span<const unsigned> _cpus,
+		       std::size_t _memory_budget) noexcept
+	:min_threads(_min_threads),
+	 max_threads(std::max(_max_threads, 1U)),
+	 cpus(_cpus.begin(), _cpus.end()),
+	 inject_event(event_loop, BIND_THIS_METHOD(OnInject)),
+	 workers(std::make_unique<Worker[]>(max_threads)),
+	 memory_budget(_memory_budget)
+{
+	/* threads are started on demand, after the main thread has
+	   blocked all signals handled by signalfd */
+}
+
+VerifyPool::~VerifyPool() noexcept
+{
+	Stop();
+}
+
+void
+VerifyPool::Add(VerifyJob &job, std::size_t memory_cost) noexcept
+{
+	assert(job.state == VerifyJob::State::INITIAL);
+
+	++n_pending;
+	job.memory_cost = memory_cost;
+
+	/* don't let a cheap job overtake blocked ones, or an
+	   expensive job may starve */
+	if (!blocked.empty() || !CanAdmit(memory_cost)) {
+		job.state = VerifyJob::State::BLOCKED;
+		blocked.push_back(job);
+		++n_blocked_total;
+		return;
+	}
+
+	Submit(job);
+}
+
+inline void
+VerifyPool::Submit(VerifyJob &job) noexcept
+{
+	memory_in_use += job.memory_cost;
+
+	const std::scoped_lock lock{mutex};
+
+	job.state = VerifyJob::State::QUEUED;
+	job.enqueue_time = std::chrono::steady_clock::now();
+
+	if (!queue.empty())
+		MaybeGrow(job.enqueue_time - queue.front().enqueue_time);
+
+	queue.push_back(job);
+
+	if (n_idle > 0)
+		cond.notify_one();
+	else if (n_threads < min_threads || n_threads == 0)
+		StartThread();
+}
+
+void
+VerifyPool::AdmitBlocked() noexcept
+{
+	while (!blocked.empty() && CanAdmit(blocked.front().memory_cost)) {
+		auto &job = blocked.front();
+		blocked.pop_front();
+		Submit(job);
+	}
+}
+
+bool
+VerifyPool::Cancel(VerifyJob &job) noexcept
+{
+	if (job.state == VerifyJob::State::BLOCKED) {
+		/* this list is not protected by the mutex */
+		blocked.erase(blocked.iterator_to(job));
+		job.state = VerifyJob::State::INITIAL;
+
+		assert(n_pending > 0);
+		--n_pending;
+
+		/* the next blocked job may fit now */
+		AdmitBlocked();
+		return true;
+	}
+
+	{
+		const std::scoped_lock lock{mutex};
+
+		if (job.state != VerifyJob::State::QUEUED)
+			return false;
+
+		queue.erase(queue.iterator_to(job));
+		job.state = VerifyJob::State::INITIAL;
+	}
+
+	assert(n_pending > 0);
+	--n_pending;
+
+	assert(memory_in_use >= job.memory_cost);
+	memory_in_use -= job.memory_cost;
+
+	AdmitBlocked();
+	return true;
+}
+
+void
+VerifyPool::Stop() noexcept
+{
+	{
+		const std::scoped_lock lock{mutex};
+		stop = true;
+		cond.notify_all();
+	}
+
+	for (unsigned i = 0; i < max_threads; ++i)
+		if (workers[i].thread.joinable())
+			workers[i].thread.join();
+
+	inject_event.Cancel();
+}
+
+inline void
+VerifyPool::StartThread() noexcept
+{
+	assert(n_threads < max_threads);
+
+	for (unsigned i = 0; i < max_threads; ++i) {
+		auto &worker = workers[i];
+		if (worker.running)
+			continue;
+
+		/* this thread may still be exiting; it does not need
+		   the mutex anymore */
+		if (worker.thread.joinable())
+			worker.thread.join();
+
+		try {
+			worker.thread = std::thread{&VerifyPool::WorkerThread, this, std::ref(worker)};
+		} catch (...) {
+			/* out of resources; try again with the next
+			   job */
+			return;
+		}
+
+		worker.running = true;
+		++n_threads;
+		++threads_started;
+		return;
+	}
+}
+
+inline void
+VerifyPool::MaybeGrow(std::chrono::steady_clock::duration wait) noexcept
+{
+	if (wait >= GROW_WAIT && n_idle == 0 && n_threads < max_threads)
+		StartThread();
+}
+
+static void
+PinCurrentThread(std::span<const unsigned> cpus) noexcept
+{
+	if (cpus.empty())
+		return;
+
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (const unsigned cpu : cpus)
+		CPU_SET(cpu, &set);
+
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+void
+VerifyPool::WorkerThread(Worker &worker) noexcept
+{
+	pthread_setname_np(pthread_self(), "verify");
+	PinCurrentThread(cpus);
+
+	std::unique_lock lock{mutex};
+
+	while (!stop) {
+		if (queue.empty()) {
+			++n_idle;
+			const bool woken = cond.wait_for(lock, IDLE_TIMEOUT, [this]{
+				return stop || !queue.empty();
+			});
+			--n_idle;
+
+			if (!woken && n_threads > min_threads)
+				/* shrink */
+				break;
+
+			continue;
+		}
+
+		auto &job = queue.front();
+		queue.pop_front();
+		job.state = VerifyJob::State::RUNNING;
+
+		const auto start_time = std::chrono::steady_clock::now();
+		const auto wait = start_time - job.enqueue_time;
+		total_wait_ns.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(wait).count(),
+					std::memory_order_relaxed);
+		total_jobs.fetch_add(1, std::memory_order_relaxed);
+
+		if (!queue.empty())
+			MaybeGrow(wait);
+
+		lock.unlock();
+
+		job.Run();
+
+		const auto busy = std::chrono::steady_clock::now() - start_time;
+		worker.busy_ns.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(busy).count(),
+					 std::memory_order_relaxed);
+		worker.n_jobs.fetch_add(1, std::memory_order_relaxed);
+
+		lock.lock();
+
+		job.state = VerifyJob::State::DONE;
+
+		const bool was_empty = done.empty();
+		done.push_back(job);
+		if (was_empty)
+			inject_event.Schedule();
+	}
+
+	--n_threads;
+	worker.running = false;
+}
+
+void
+VerifyPool::OnInject() noexcept
+{
+	IntrusiveList<VerifyJob> jobs;
+
+	{
+		const std::scoped_lock lock{mutex};
+		while (!done.empty()) {
+			auto &job = done.front();
+			done.pop_front();
+			jobs.push_back(job);
+		}
+	}
+
+	while (!jobs.empty()) {
+		auto &job = jobs.front();
+		jobs.pop_front();
+
+		assert(job.state == VerifyJob::State::DONE);
+		job.state = VerifyJob::State::INITIAL;
+
+		assert(n_pending > 0);
+		--n_pending;
+
+		assert(memory_in_use >= job.memory_cost);
+		memory_in_use -= job.memory_cost;
+
+		job.Done();
+	}
+
+	AdmitBlocked();
+}
+
+void
+VerifyPool::ExportMetrics(std::string &out) noexcept
+{
+	unsigned _n_threads, _n_idle;
+	std::size_t queue_length;
+
+	{
+		const std::scoped_lock lock{mutex};
+		_n_threads = n_threads;
+		_n_idle = n_idle;
+		queue_length = queue.size();
+	}
+
+	auto o = std::back_inserter(out);
+
+	fmt::format_to(o, R"(
+# HELP uologin_verify_threads Current number of password verification threads
+# TYPE uologin_verify_threads gauge
+
+# HELP uologin_verify_idle_threads Current number of idle password verification threads
+# TYPE uologin_verify_idle_threads gauge
+
+# HELP uologin_verify_threads_started Counter for password verification threads started
+# TYPE uologin_verify_threads_started counter
+
+# HELP uologin_verify_queue_length Current number of password verifications waiting for a thread
+# TYPE uologin_verify_queue_length gauge
+
+# HELP uologin_verify_queue_wait_seconds Total time password verifications have waited for a thread
+# TYPE uologin_verify_queue_wait_seconds counter
+
+# HELP uologin_verify_jobs Counter for password verifications started
+# TYPE uologin_verify_jobs counter
+
+# HELP uologin_verify_memory_bytes Current memory cost of all queued and running password verifications
+# TYPE uologin_verify_memory_bytes gauge
+
+# HELP uologin_verify_memory_budget_bytes Maximum memory cost of all queued and running password verifications (0 is unlimited)
+# TYPE uologin_verify_memory_budget_bytes gauge
+
+# HELP uologin_verify_memory_blocked Current number of password verifications waiting for memory
+# TYPE uologin_verify_memory_blocked gauge
+
+# HELP uologin_verify_memory_blocked_total Counter for password verifications which had to wait for memory
+# TYPE uologin_verify_memory_blocked_total counter
+
+# HELP uologin_verify_thread_busy_seconds Time each password verification thread has spent verifying
+# TYPE uologin_verify_thread_busy_seconds counter
+
+# HELP uologin_verify_thread_jobs Counter for password verifications completed by each thread
+# TYPE uologin_verify_thread_jobs counter
+
+uologin_verify_threads {}
+uologin_verify_idle_threads {}
+uologin_verify_threads_started {}
+uologin_verify_queue_length {}
+uologin_verify_queue_wait_seconds {}
+uologin_verify_jobs {}
+uologin_verify_memory_bytes {}
+uologin_verify_memory_budget_bytes {}
+uologin_verify_memory_blocked {}
+uologin_verify_memory_blocked_total {}
+)",
+		       _n_threads, _n_idle,
+		       threads_started.load(std::memory_order_relaxed),
+		       queue_length,
+		       total_wait_ns.load(std::memory_order_relaxed) * 1e-9,
+		       total_jobs.load(std::memory_order_relaxed),
+		       memory_in_use, memory_budget,
+		       blocked.size(), n_blocked_total);
+
+	for (unsigned i = 0; i < max_threads; ++i) {
+		const auto &worker = workers[i];
+		fmt::format_to(o, "uologin_verify_thread_busy_seconds{{thread=\"{}\"}} {}\n"
+			       "uologin_verify_thread_jobs{{thread=\"{}\"}} {}\n",
+			       i, worker.busy_ns.load(std::memory_order_relaxed) * 1e-9,
+			       i, worker.n_jobs.load(std::memory_order_relaxed));
+	}
+}
@@ -0,0 +1,247 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+// author: Max Kellermann <max.kellermann@gmail.com>
+
+#pragma once
+
+#include "event/InjectEvent.hxx"
+#include "util/IntrusiveList.hxx"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string>
+#include <thread>
+#include <vector>
+
+class VerifyPool;
+
+/**
+ * A job for #VerifyPool.
+ */
+class VerifyJob : public IntrusiveListHook<IntrusiveHookMode::NORMAL> {
+	friend class VerifyPool;
+
+	std::chrono::steady_clock::time_point enqueue_time;
+
+	/**
+	 * The memory this job allocates while running [bytes]; see
+	 * VerifyPool::Add().
+	 */
+	std::size_t memory_cost;
+
+	enum class State : uint_least8_t {
+		INITIAL,
+
+		/**
+		 * Waiting in VerifyPool::blocked for memory.
+		 */
+		BLOCKED,
+
+		QUEUED,
+		RUNNING,
+		DONE,
+	} state = State::INITIAL;
+
+public:
+	VerifyJob() noexcept = default;
+
+	VerifyJob(const VerifyJob &) = delete;
+	VerifyJob &operator=(const VerifyJob &) = delete;
+
+protected:
+	~VerifyJob() noexcept = default;
+
+public:
+	/**
+	 * Invoked in a worker thread.
+	 */
+	virtual void Run() noexcept = 0;
+
+	/**
+	 * Invoked in the #EventLoop thread after Run() has finished.
+	 */
+	virtual void Done() noexcept = 0;
+};
+
+/**
+ * A dedicated thread pool for password verification (i.e. Argon2).
+ * The number of threads grows between the configured minimum and
+ * maximum when jobs have to wait in the queue for too long, and idle
+ * threads exit after a while.  All worker threads can be pinned to
+ * a set of CPUs (which should not include the CPU which runs the
+ * #EventLoop).
+ *
+ * Jobs are only passed to the worker threads while the sum of their
+ * memory costs fits into the configured budget; the others wait in
+ * the #EventLoop thread (in submission order).
+ */
+class VerifyPool final {
+	const unsigned min_threads, max_threads;
+
+	/**
+	 * The CPUs the worker threads are pinned to; empty means no
+	 * pinning.
+	 */
+	const std::vector<unsigned> cpus;
+
+	InjectEvent inject_event;
+
+	struct Worker {
+		std::thread thread;
+
+		/**
+		 * Is #thread running?  Protected by #mutex.
+		 */
+		bool running = false;
+
+		std::atomic<uint_least64_t> busy_ns{0}, n_jobs{0};
+	};
+
+	const std::unique_ptr<Worker[]> workers;
+
+	std::mutex mutex;
+	std::condition_variable cond;
+
+	/**
+	 * Jobs waiting for a worker thread.  Protected by #mutex.
+	 */
+	IntrusiveList<VerifyJob> queue;
+
+	/**
+	 * Jobs which have finished and wait for their Done() call.
+	 * Protected by #mutex.
+	 */
+	IntrusiveList<VerifyJob> done;
+
+	/**
+	 * Protected by #mutex.
+	 */
+	unsigned n_threads = 0, n_idle = 0;
+
+	/**
+	 * Protected by #mutex.
+	 */
+	bool stop = false;
+
+	std::atomic<uint_least64_t> total_wait_ns{0}, total_jobs{0};
+	std::atomic<uint_least64_t> threads_started{0};
+
+	/**
+	 * The number of jobs which were submitted but whose Done()
+	 * has not been called yet.  Only accessed by the
+	 * #EventLoop thread.
+	 */
+	std::size_t n_pending = 0;
+
+	/**
+	 * The maximum sum of memory costs of all queued and running
+	 * jobs [bytes]; 0 means unlimited.
+	 */
+	const std::size_t memory_budget;
+
+	/**
+	 * The sum of memory costs of all queued and running jobs.
+	 * Only accessed by the #EventLoop thread.
+	 */
+	std::size_t memory_in_use = 0;
+
+	/**
+	 * Jobs waiting for #memory_in_use to drop.  Only accessed by
+	 * the #EventLoop thread.
+	 */
+	IntrusiveList<VerifyJob> blocked;
+
+	uint_least64_t n_blocked_total = 0;
+
+public:
+	VerifyPool(EventLoop &event_loop,
+		   unsigned _min_threads, unsigned _max_threads,
+		   std::span<const unsigned> _cpus,
+		   std::size_t _memory_budget) noexcept;
+	~VerifyPool() noexcept;
+
+	VerifyPool(const VerifyPool &) = delete;
+	VerifyPool &operator=(const VerifyPool &) = delete;
+
+	/**
+	 * Submit a job.  Threads are started on demand.
+	 *
+	 * @param memory_cost the memory the job allocates while
+	 * running [bytes]; if it does not fit into the remaining
+	 * budget, the job waits until other jobs have finished (a job
+	 * which exceeds the whole budget runs alone)
+	 */
+	void Add(VerifyJob &job, std::size_t memory_cost=0) noexcept;
+
+	/**
+	 * Remove a job from the queue.
+	 *
+	 * @return true if the job was removed, false if it is already
+	 * running (and Done() will be called later)
+	 */
+	bool Cancel(VerifyJob &job) noexcept;
+
+	/**
+	 * Stop and join all worker threads.  Jobs which are still
+	 * queued will never be finished.
+	 */
+	void Stop() noexcept;
+
+	unsigned GetMaxThreads() const noexcept {
+		return max_threads;
+	}
+
+	/**
+	 * Returns the number of jobs which are queued or running (or
+	 * finished but not yet reported).  This does not lock the
+	 * mutex.
+	 */
+	std::size_t GetPendingJobs() const noexcept {
+		return n_pending;
+	}
+
+	/**
+	 * Append Prometheus metrics to the given string.
+	 */
+	void ExportMetrics(std::string &out) noexcept;
+
+private:
+	/**
+	 * Can a job with the given memory cost be submitted now?
+	 */
+	[[gnu::pure]]
+	bool CanAdmit(std::size_t memory_cost) const noexcept {
+		return memory_budget == 0 || memory_in_use == 0 ||
+			memory_in_use + memory_cost <= memory_budget;
+	}
+
+	/**
+	 * Pass a job to the worker threads.
+	 */
+	void Submit(VerifyJob &job) noexcept;
+
+	/**
+	 * Submit blocked jobs as long as they fit into the budget.
+	 */
+	void AdmitBlocked() noexcept;
+
+	/**
+	 * Caller must hold the mutex.
+	 */
+	void StartThread() noexcept;
+
+	/**
+	 * Start another thread if the given queue wait is too long.
+	 * Caller must hold the mutex.
+	 */
+	void MaybeGrow(std::chrono::steady_clock::duration wait) noexcept;
+
+	void WorkerThread(Worker &worker) noexcept;
+
+	void OnInject() noexcept;
+};
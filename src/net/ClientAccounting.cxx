@@ -10,6 +10,19 @@
 #include "time/Cast.hxx"
 #include "util/DeleteDisposer.hxx"
 
+#include <algorithm> // for std::min(), std::max()
+#include <iterator> // for std::next()
+
+static constexpr TokenBucketConfig token_bucket_config{
+	.rate = 1,
+	.burst = 10,
+};
+
+/**
+ * How long to keep an item after its last connection was closed.
+ */
+static constexpr Event::Duration EXPIRES_AFTER = std::chrono::minutes{5};
+
 static constexpr uint_least64_t
 Read64(const uint8_t *src) noexcept
 {
@@ -50,6 +63,15 @@ PerClientAccounting::PerClientAccounting(ClientAccountingMap &_map,
 					 uint_least64_t _address) noexcept
 	:map(_map), address(_address)
 {
+	map.all.push_back(*this);
+}
+
+PerClientAccounting::~PerClientAccounting() noexcept
+{
+	if (changes != 0)
+		map.changes.erase(map.changes.iterator_to(*this));
+
+	map.OnItemDestroyed(*this);
 }
 
 inline Event::TimePoint
@@ -82,23 +104,60 @@ PerClientAccounting::RemoveConnection(AccountedClientConnection &c) noexcept
 	connections.erase(connections.iterator_to(c));
 	c.per_client = nullptr;
 
-	expires = Now() + std::chrono::minutes{5};
+	expires = Now() + EXPIRES_AFTER;
 
 	if (connections.empty())
 		map.ScheduleCleanup();
 }
 
+inline void
+PerClientAccounting::AddChange(uint_least8_t flags) noexcept
+{
+	if (map.max_changes == 0)
+		/* change tracking is disabled */
+		return;
+
+	if (changes == 0) {
+		if (map.changes.size() >= map.max_changes) {
+			++map.dropped_changes;
+			return;
+		}
+
+		map.changes.push_back(*this);
+	}
+
+	changes |= flags;
+}
+
+inline void
+PerClientAccounting::KeepAlive(Event::TimePoint now) noexcept
+{
+	expires = std::max(expires, now + EXPIRES_AFTER);
+
+	if (connections.empty())
+		map.ScheduleCleanup();
+}
+
+void
+PerClientAccounting::SetKnocked() noexcept
+{
+	knocked = true;
+	AddChange(CLIENT_ACCOUNTING_KNOCKED);
+
+	/* an item without connections would otherwise have no
+	   expiry; it would be purged by the next cleanup and be
+	   skipped by the snapshot */
+	KeepAlive(Now());
+}
+
 void
 PerClientAccounting::UpdateTokenBucket(double size) noexcept
 {
+	map.ReportPenalty(address, size);
+
 	if (!map.HasTarpit())
 		return;
 
-	constexpr TokenBucketConfig token_bucket_config{
-		.rate = 1,
-		.burst = 10,
-	};
-
 	constexpr Event::Duration TARPIT_FOR = std::chrono::minutes{1};
 	constexpr Event::Duration MAX_DELAY = std::chrono::minutes{1};
 	constexpr Event::Duration DELAY_STEP = std::chrono::milliseconds{100};
@@ -114,11 +173,15 @@ PerClientAccounting::UpdateTokenBucket(double size) noexcept
 		/* reset the "knocked" flag for clients that are over
                    the limit */
 		knocked = false;
+
+		AddChange(CLIENT_ACCOUNTING_TARPIT);
 	} else if (now < tarpit_until) {
 		if (delay > DELAY_STEP)
 			delay -= DELAY_STEP;
 	} else
 		delay = {};
+
+	KeepAlive(now);
 }
 
 ClientAccountingMap::~ClientAccountingMap() noexcept
@@ -126,10 +189,21 @@ ClientAccountingMap::~ClientAccountingMap() noexcept
 	map.clear_and_dispose(DeleteDisposer{});
 }
 
+uint_least64_t
+ClientAccountingMap::GetKey(SocketAddress address) noexcept
+{
+	return ToInteger(address);
+}
+
 PerClientAccounting *
-ClientAccountingMap::Get(SocketAddress _address) noexcept
+ClientAccountingMap::Get(SocketAddress address) noexcept
+{
+	return Get(ToInteger(address));
+}
+
+PerClientAccounting *
+ClientAccountingMap::Get(uint_least64_t address) noexcept
 {
-	const uint_least64_t address = ToInteger(_address);
 	if (address == 0)
 		return nullptr;
 
@@ -140,7 +214,16 @@ ClientAccountingMap::Get(SocketAddress _address) noexcept
 		return per_client;
 	} else
 		return &*i;
+}
+
+PerClientAccounting *
+ClientAccountingMap::Find(uint_least64_t address) noexcept
+{
+	if (address == 0)
+		return nullptr;
 
+	auto i = map.find(address);
+	return i != map.end() ? &*i : nullptr;
 }
 
 void
@@ -172,3 +255,156 @@ ClientAccountingMap::OnCleanupTimer() noexcept
 	if (reschedule)
 		ScheduleCleanup();
 }
+
+bool
+ClientAccountingMap::ApplyRemoteChange(uint_least64_t address,
+				       uint_least8_t flags,
+				       Event::Duration tarpit_for,
+				       Event::Duration delay) noexcept
+{
+	auto *per_client = Get(address);
+	if (per_client == nullptr)
+		return false;
+
+	const bool was_knocked = per_client->knocked;
+	const auto now = GetEventLoop().SteadyNow();
+
+	/* the tarpit is applied first because it resets the
+	   "knocked" flag; if both flags are set, the knock was
+	   last */
+
+	if ((flags & CLIENT_ACCOUNTING_TARPIT) && tarpit) {
+		per_client->tarpit_until = std::max(per_client->tarpit_until,
+						    now + tarpit_for);
+		per_client->delay = std::max(per_client->delay, delay);
+		per_client->knocked = false;
+	}
+
+	if (flags & CLIENT_ACCOUNTING_KNOCKED)
+		per_client->knocked = true;
+
+	per_client->KeepAlive(now);
+
+	return per_client->knocked && !was_knocked;
+}
+
+static constexpr uint32_t
+ToMilliseconds(Event::Duration d) noexcept
+{
+	if (d <= Event::Duration::zero())
+		return 0;
+
+	const auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(d).count();
+	return ms < UINT32_MAX ? ms : UINT32_MAX;
+}
+
+inline ClientAccountingSnapshotItem
+ClientAccountingMap::MakeSnapshotItem(PerClientAccounting &i,
+				      Event::TimePoint now,
+				      double now_s) const noexcept
+{
+	return {
+		.address = i.address,
+		.expires_ms = i.connections.empty()
+			? ToMilliseconds(i.expires - now)
+			: ToMilliseconds(EXPIRES_AFTER),
+		.tarpit_ms = ToMilliseconds(i.tarpit_until - now),
+		.delay_ms = ToMilliseconds(i.delay),
+		.tokens = tarpit
+			? static_cast<float>(i.token_bucket.Update(token_bucket_config, now_s, 0))
+			: static_cast<float>(token_bucket_config.burst),
+		.knocked = i.knocked,
+	};
+}
+
+std::vector<ClientAccountingSnapshotItem>
+ClientAccountingMap::Snapshot() noexcept
+{
+	std::vector<ClientAccountingSnapshotItem> items;
+	items.reserve(map.size());
+
+	const auto now = GetEventLoop().SteadyNow();
+	const double now_s = ToFloatSeconds(now.time_since_epoch());
+
+	for (auto &i : all)
+		items.push_back(MakeSnapshotItem(i, now, now_s));
+
+	return items;
+}
+
+inline void
+ClientAccountingMap::OnItemDestroyed(PerClientAccounting &item) noexcept
+{
+	const auto i = all.iterator_to(item);
+
+	for (auto &cursor : cursors) {
+		if (cursor.next == &item) {
+			const auto n = std::next(i);
+			cursor.next = n != all.end() ? &*n : nullptr;
+		}
+	}
+
+	all.erase(i);
+}
+
+ClientAccountingMap::SnapshotCursor::SnapshotCursor(ClientAccountingMap &_map) noexcept
+	:map(_map),
+	 next(map.all.empty() ? nullptr : &map.all.front())
+{
+	map.cursors.push_back(*this);
+}
+
+std::size_t
+ClientAccountingMap::SnapshotCursor::Read(std::span<ClientAccountingSnapshotItem> dest) noexcept
+{
+	const auto now = map.GetEventLoop().SteadyNow();
+	const double now_s = ToFloatSeconds(now.time_since_epoch());
+
+	std::size_t n = 0;
+	auto i = next != nullptr ? map.all.iterator_to(*next) : map.all.end();
+	for (; n < dest.size() && i != map.all.end(); ++i)
+		dest[n++] = map.MakeSnapshotItem(*i, now, now_s);
+
+	next = i != map.all.end() ? &*i : nullptr;
+	return n;
+}
+
+void
+ClientAccountingMap::Restore(std::span<const ClientAccountingSnapshotItem> items,
+			     Event::Duration age) noexcept
+{
+	const auto now = GetEventLoop().SteadyNow();
+	const double now_s = ToFloatSeconds(now.time_since_epoch());
+
+	const auto Rebase = [now, age](uint32_t ms){
+		return now + std::chrono::milliseconds{ms} - age;
+	};
+
+	for (const auto &src : items) {
+		const auto expires = Rebase(src.expires_ms);
+		if (expires <= now)
+			continue;
+
+		auto *per_client = Get(static_cast<uint_least64_t>(src.address));
+		if (per_client == nullptr || !per_client->connections.empty())
+			continue;
+
+		per_client->expires = expires;
+		per_client->tarpit_until = Rebase(src.tarpit_ms);
+		per_client->delay = std::chrono::milliseconds{src.delay_ms};
+		per_client->knocked = src.knocked != 0;
+
+		if (tarpit) {
+			/* the bucket has been refilled while we were
+			   down; consume the difference from a new
+			   (full) bucket */
+			const double tokens = std::min<double>(src.tokens + token_bucket_config.rate * ToFloatSeconds(age),
+							       token_bucket_config.burst);
+			per_client->token_bucket = {};
+			per_client->token_bucket.Update(token_bucket_config, now_s,
+							token_bucket_config.burst - tokens);
+		}
+	}
+
+	ScheduleCleanup();
+}
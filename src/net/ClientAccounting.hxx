@@ -6,15 +6,61 @@
 
 #include "AccountedClientConnection.hxx"
 #include "event/FarTimerEvent.hxx"
+#include "util/BindMethod.hxx"
 #include "util/IntrusiveHashSet.hxx"
+#include "util/IntrusiveList.hxx"
 #include "util/TokenBucket.hxx"
 
 #include <cstdint>
+#include <span>
+#include <utility> // for std::exchange(), std::as_const()
+#include <vector>
 
 class SocketAddress;
 class PerClientAccounting;
 class ClientAccountingMap;
 
+/**
+ * The persistent state of one #PerClientAccounting.  This is also
+ * the on-disk format of a snapshot file, therefore it has a fixed
+ * size and layout.  All durations are relative to the time the
+ * snapshot was made.
+ */
+struct ClientAccountingSnapshotItem {
+	uint64_t address;
+
+	uint32_t expires_ms;
+	uint32_t tarpit_ms;
+	uint32_t delay_ms;
+
+	/**
+	 * The number of tokens available in the token bucket.
+	 */
+	float tokens;
+
+	uint8_t knocked;
+
+	uint8_t reserved[7];
+};
+
+static_assert(sizeof(ClientAccountingSnapshotItem) == 32);
+
+/**
+ * Flags for ClientAccountingMap::ConsumeChanges().
+ */
+enum ClientAccountingChange : uint_least8_t {
+	/**
+	 * The client has knocked.
+	 */
+	CLIENT_ACCOUNTING_KNOCKED = 0x1,
+
+	/**
+	 * The client has exceeded its token bucket and was put into
+	 * the tarpit (which also resets the "knocked" flag).
+	 */
+	CLIENT_ACCOUNTING_TARPIT = 0x2,
+};
+
 class PerClientAccounting final
 	: public IntrusiveHashSetHook<IntrusiveHookMode::AUTO_UNLINK>
 {
@@ -49,10 +95,36 @@ class PerClientAccounting final
 
 	TokenBucket token_bucket;
 
+	/**
+	 * Hook for ClientAccountingMap::changes.
+	 */
+	IntrusiveListHook<IntrusiveHookMode::NORMAL> change_siblings;
+
+	/**
+	 * Hook for ClientAccountingMap::all.
+	 */
+	IntrusiveListHook<IntrusiveHookMode::NORMAL> all_siblings;
+
+	/**
+	 * #ClientAccountingChange flags which have not yet been
+	 * consumed by ClientAccountingMap::ConsumeChanges().  If this
+	 * is non-zero, then this item is linked in
+	 * ClientAccountingMap::changes.
+	 */
+	uint_least8_t changes = 0;
+
 	bool knocked = false;
 
 public:
 	PerClientAccounting(ClientAccountingMap &_map, uint_least64_t _address) noexcept;
+	~PerClientAccounting() noexcept;
+
+	/**
+	 * Returns the key of this object in #ClientAccountingMap.
+	 */
+	uint_least64_t GetAddressKey() const noexcept {
+		return address;
+	}
 
 	[[gnu::pure]]
 	bool Check() const noexcept;
@@ -66,17 +138,28 @@ public:
 		return delay;
 	}
 
-	void SetKnocked() noexcept {
-		knocked = true;
-	}
+	void SetKnocked() noexcept;
 
 	bool HasKnocked() const noexcept {
 		return knocked;
 	}
 
+	Event::TimePoint GetTarpitUntil() const noexcept {
+		return tarpit_until;
+	}
+
 private:
 	[[gnu::pure]]
 	Event::TimePoint Now() const noexcept;
+
+	void AddChange(uint_least8_t flags) noexcept;
+
+	/**
+	 * Keep this item (and its knock/tarpit state) for at least
+	 * five minutes after the given time, even if it never had
+	 * a connection.
+	 */
+	void KeepAlive(Event::TimePoint now) noexcept;
 };
 
 class ClientAccountingMap {
@@ -91,8 +174,61 @@ class ClientAccountingMap {
 							       std::equal_to<uint_least64_t>>>;
 	Map map;
 
+	using AllList =
+		IntrusiveList<PerClientAccounting,
+			      IntrusiveListMemberHookTraits<&PerClientAccounting::all_siblings>>;
+
+	/**
+	 * All items in creation order.  Unlike #map, this can be
+	 * walked in steps by a #SnapshotCursor.
+	 */
+	AllList all;
+
 	FarTimerEvent cleanup_timer;
 
+	using ChangeList =
+		IntrusiveList<PerClientAccounting,
+			      IntrusiveListMemberHookTraits<&PerClientAccounting::change_siblings>,
+			      IntrusiveListOptions{.constant_time_size = true}>;
+
+	/**
+	 * Items with local changes which have not yet been consumed
+	 * by ConsumeChanges().  Only used if change tracking was
+	 * enabled.
+	 */
+	ChangeList changes;
+
+	/**
+	 * The maximum number of items in #changes; zero means change
+	 * tracking is disabled.
+	 */
+	std::size_t max_changes = 0;
+
+	/**
+	 * The number of changes which were discarded because
+	 * #changes was full.
+	 */
+	uint_least64_t dropped_changes = 0;
+
+public:
+	class SnapshotCursor;
+
+private:
+	/**
+	 * All cursors which are currently walking #all.
+	 */
+	IntrusiveList<SnapshotCursor> cursors;
+
+public:
+	/**
+	 * Invoked by PerClientAccounting::UpdateTokenBucket() with
+	 * the client's key and the cost.
+	 */
+	using PenaltyHandler = BoundMethod<void(uint_least64_t address, double size) noexcept>;
+
+private:
+	PenaltyHandler penalty_handler = nullptr;
+
 public:
 	ClientAccountingMap(EventLoop &event_loop, std::size_t _max_connections,
 			    bool _tarpit) noexcept
@@ -117,10 +253,152 @@ public:
 		return tarpit;
 	}
 
+	void SetPenaltyHandler(PenaltyHandler _handler) noexcept {
+		penalty_handler = _handler;
+	}
+
+	void ReportPenalty(uint_least64_t address, double size) noexcept {
+		if (penalty_handler)
+			penalty_handler(address, size);
+	}
+
+	/**
+	 * Returns the key of the given address (see
+	 * PerClientAccounting::GetAddressKey()); 0 means the address
+	 * cannot be accounted.
+	 */
+	[[gnu::pure]]
+	static uint_least64_t GetKey(SocketAddress address) noexcept;
+
 	PerClientAccounting *Get(SocketAddress address) noexcept;
 
+	/**
+	 * Look up (or create) an item by the key returned by
+	 * PerClientAccounting::GetAddressKey().
+	 */
+	PerClientAccounting *Get(uint_least64_t address) noexcept;
+
+	/**
+	 * Look up an item without creating it.
+	 */
+	[[gnu::pure]]
+	PerClientAccounting *Find(uint_least64_t address) noexcept;
+
 	void ScheduleCleanup() noexcept;
 
+	/**
+	 * Start recording local changes (knocks and tarpit events)
+	 * for ConsumeChanges().
+	 *
+	 * @param _max_changes the maximum number of items with
+	 * unconsumed changes; more changes are discarded
+	 */
+	void EnableChangeTracking(std::size_t _max_changes) noexcept {
+		max_changes = _max_changes;
+	}
+
+	std::size_t GetPendingChanges() const noexcept {
+		return changes.size();
+	}
+
+	uint_least64_t GetDroppedChanges() const noexcept {
+		return dropped_changes;
+	}
+
+	/**
+	 * Remove up to the given number of changed items (oldest
+	 * first) and pass them to the given function, which gets
+	 * the #PerClientAccounting and its #ClientAccountingChange
+	 * flags.
+	 *
+	 * @return the number of items passed to the function
+	 */
+	template<typename F>
+	std::size_t ConsumeChanges(std::size_t max, F &&f) noexcept {
+		std::size_t n = 0;
+		for (; n < max && !changes.empty(); ++n) {
+			auto &i = changes.front();
+			changes.pop_front();
+			const auto flags = std::exchange(i.changes, 0);
+			f(std::as_const(i), flags);
+		}
+
+		return n;
+	}
+
+	/**
+	 * Apply a change which was made by another node.  This does
+	 * not record a local change.
+	 *
+	 * @param tarpit_for if #CLIENT_ACCOUNTING_TARPIT is set: the
+	 * remaining tarpit duration
+	 * @return true if the client was not marked as "knocked"
+	 * before and is now
+	 */
+	bool ApplyRemoteChange(uint_least64_t address, uint_least8_t flags,
+			       Event::Duration tarpit_for,
+			       Event::Duration delay) noexcept;
+
+	/**
+	 * Export the state of all items.
+	 */
+	std::vector<ClientAccountingSnapshotItem> Snapshot() noexcept;
+
+	/**
+	 * Exports all items in several steps (e.g. one per event
+	 * loop iteration) instead of copying the whole map at once.
+	 * Items which are destroyed meanwhile are skipped; items
+	 * which are created meanwhile may or may not be visited.
+	 */
+	class SnapshotCursor final : public AutoUnlinkIntrusiveListHook {
+		friend class ClientAccountingMap;
+
+		ClientAccountingMap &map;
+
+		/**
+		 * The next item to be exported; nullptr at the end.
+		 */
+		PerClientAccounting *next;
+
+	public:
+		explicit SnapshotCursor(ClientAccountingMap &_map) noexcept;
+
+		SnapshotCursor(const SnapshotCursor &) = delete;
+		SnapshotCursor &operator=(const SnapshotCursor &) = delete;
+
+		bool IsEnd() const noexcept {
+			return next == nullptr;
+		}
+
+		/**
+		 * Export the next items.
+		 *
+		 * @return the number of items written to the
+		 * buffer (less than its size only at the end)
+		 */
+		std::size_t Read(std::span<ClientAccountingSnapshotItem> dest) noexcept;
+	};
+
+	/**
+	 * Import items created by Snapshot(), possibly by a previous
+	 * process.
+	 *
+	 * @param age the time which has passed since the snapshot
+	 * was made; all timestamps are rebased to the current time
+	 * minus this duration
+	 */
+	void Restore(std::span<const ClientAccountingSnapshotItem> items,
+		     Event::Duration age) noexcept;
+
 private:
+	/**
+	 * Called by the #PerClientAccounting destructor.
+	 */
+	void OnItemDestroyed(PerClientAccounting &item) noexcept;
+
+	ClientAccountingSnapshotItem MakeSnapshotItem(PerClientAccounting &i,
+						      Event::TimePoint now,
+						      double now_s) const noexcept;
+
 	void OnCleanupTimer() noexcept;
 };
@@ -39,6 +39,27 @@ struct uo_packet_account_login_reject {
 
 static_assert(alignof(struct uo_packet_account_login_reject) == 1);
 
+/* 0x8c Relay */
+struct uo_packet_relay {
+	UO::Command cmd;
+
+	/**
+	 * The IPv4 address of the game server.
+	 */
+	PackedBE32 ip;
+
+	PackedBE16 port;
+
+	/**
+	 * The client sends this value back to the game server (as
+	 * seed and in #uo_packet_game_login).
+	 */
+	PackedBE32 auth_id;
+};
+
+static_assert(alignof(struct uo_packet_relay) == 1);
+static_assert(sizeof(struct uo_packet_relay) == 11);
+
 /* 0x91 GameLogin */
 struct uo_packet_game_login {
 	UO::Command cmd;
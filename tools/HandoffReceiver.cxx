@@ -0,0 +1,75 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+// author: Max Kellermann <max.kellermann@gmail.com>
+
+#include "GameServerHandoff.hxx"
+#include "lib/fmt/SocketAddressFormatter.hxx"
+#include "net/AllocatedSocketAddress.hxx"
+#include "net/SocketError.hxx"
+#include "net/UniqueSocketDescriptor.hxx"
+#include "util/PrintException.hxx"
+
+#include <fmt/format.h>
+
+#include <array>
+#include <cstdlib>
+
+#include <sys/socket.h>
+#include <unistd.h> // for unlink()
+
+/*
+ * A stand-in for a game server which receives clients from uologin
+ * (option "game_server_handoff").  It prints each handoff datagram
+ * (see GameServerHandoff.hxx) and then closes the client socket.
+ *
+ * Usage: uologin-handoff-receiver PATH
+ */
+int
+main(int argc, char **argv) noexcept
+try {
+	if (argc != 2) {
+		fmt::print(stderr, "Usage: {} PATH\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	const char *path = argv[1];
+	if (path[0] != '/') {
+		fmt::print(stderr, "Absolute socket path expected\n");
+		return EXIT_FAILURE;
+	}
+
+	AllocatedSocketAddress address;
+	address.SetLocal(path);
+
+	unlink(path);
+
+	UniqueSocketDescriptor s;
+	if (!s.Create(AF_LOCAL, SOCK_DGRAM, 0))
+		throw MakeSocketError("Failed to create socket");
+
+	if (!s.Bind(address))
+		throw MakeSocketError("Failed to bind socket");
+
+	while (true) {
+		GameServerHandoffHeader header;
+		std::array<std::byte, MAX_GAME_SERVER_HANDOFF_DATA> data;
+		UniqueSocketDescriptor client;
+
+		std::size_t data_size;
+
+		try {
+			data_size = ReceiveGameServerHandoff(s, header, data,
+							     client);
+		} catch (...) {
+			PrintException(std::current_exception());
+			continue;
+		}
+
+		fmt::print("client={} local={} data={} bytes, first packet 0x{:02x}\n",
+			   header.GetAddress(), client.GetLocalAddress(),
+			   data_size,
+			   data_size > 0 ? static_cast<unsigned>(data[0]) : 0U);
+	}
+} catch (...) {
+	PrintException(std::current_exception());
+	return EXIT_FAILURE;
+}